@@ -0,0 +1,219 @@
+/* INCLUDE LIBRARIES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include "parser.h"
+
+/* DEFINE CONSTANTS */
+#define DEFAULT_BUDGET_MS 200
+#define MIN_ITERATIONS 3
+#define MAX_CORPUS_ENTRIES 256
+#define MAX_LINE_LENGTH (1 << 20)
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+struct corpus_entry {
+    char *name;
+    char *line;
+    size_t length;
+};
+
+/* FUNCTION HEADERS */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+static uint64_t now_ns(void);
+static char *repeat_pattern(const char *prefix, const char *pattern, int times, const char *suffix);
+static int build_builtin_corpus(struct corpus_entry *corpus);
+static int load_corpus_file(const char *path, struct corpus_entry *corpus, int count);
+static void run_entry(const struct corpus_entry *entry, uint64_t budget_ns);
+
+/* ALLOCATION COUNTING */
+
+// The parser is linked statically, so these definitions replace libc's for
+// it (and for strdup, which calls malloc through the PLT)
+static bool counting = false;
+static uint64_t allocation_count = 0;
+
+void *malloc(size_t size) {
+    if (counting) allocation_count++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (counting) allocation_count++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (counting) allocation_count++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+/* MAIN FUNCTION */
+
+int main(int argc, char **argv) {
+    uint64_t budget_ms = DEFAULT_BUDGET_MS;
+    struct corpus_entry corpus[MAX_CORPUS_ENTRIES];
+    int count = 0;
+    bool builtin_corpus = true;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            budget_ms = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            count = load_corpus_file(argv[++i], corpus, count);
+            builtin_corpus = false;
+        } else {
+            fprintf(stderr, "usage: %s [-t ms_per_entry] [-f corpus_file]...\n", argv[0]);
+            return 1;
+        }
+    }
+    
+    if (builtin_corpus) {
+        count = build_builtin_corpus(corpus);
+    }
+    
+    printf("%-16s %10s %12s %10s %14s\n", "entry", "bytes", "iterations", "ns/byte", "allocs/line");
+    for (int i = 0; i < count; i++) {
+        run_entry(&corpus[i], budget_ms * 1000000ULL);
+        free(corpus[i].name);
+        free(corpus[i].line);
+    }
+    
+    return 0;
+}
+
+/* FUNCTION FUNCTIONS */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static char *repeat_pattern(const char *prefix, const char *pattern, int times, const char *suffix) {
+    size_t prefix_len = strlen(prefix);
+    size_t pattern_len = strlen(pattern);
+    size_t suffix_len = strlen(suffix);
+    char *line = malloc(prefix_len + pattern_len * times + suffix_len + 1);
+    
+    char *p = line;
+    memcpy(p, prefix, prefix_len);
+    p += prefix_len;
+    for (int i = 0; i < times; i++) {
+        memcpy(p, pattern, pattern_len);
+        p += pattern_len;
+    }
+    memcpy(p, suffix, suffix_len);
+    p += suffix_len;
+    *p = '\0';
+    
+    return line;
+}
+
+// Realistic interactive lines first, then the pathological shapes that
+// generated command lines produce (huge tokens, long quoted runs, escapes)
+static int build_builtin_corpus(struct corpus_entry *corpus) {
+    int count = 0;
+    
+    corpus[count++] = (struct corpus_entry){ strdup("simple"), strdup("ls -la /tmp"), 0 };
+    corpus[count++] = (struct corpus_entry){ strdup("quoted"),
+        strdup("echo \"hello world\" 'single quoted' mixed\\ escape \"with \\\"escapes\\\" and \\\\ backslash\""), 0 };
+    corpus[count++] = (struct corpus_entry){ strdup("pipeline"),
+        strdup("cat /var/log/syslog | grep -i error | sort | uniq -c | sort -rn | head -20"), 0 };
+    corpus[count++] = (struct corpus_entry){ strdup("redirects"),
+        strdup("find . -name '*.c' -newer Makefile > out.txt 2>> err.log"), 0 };
+    corpus[count++] = (struct corpus_entry){ strdup("many_args"),
+        repeat_pattern("rm -f", " build/obj/module_0001.o", 4000, ""), 0 };
+    corpus[count++] = (struct corpus_entry){ strdup("long_token"),
+        repeat_pattern("echo ", "abcdefghijklmnop", 4096, ""), 0 };
+    corpus[count++] = (struct corpus_entry){ strdup("long_double_q"),
+        repeat_pattern("echo \"", "some text inside ", 4096, "\""), 0 };
+    corpus[count++] = (struct corpus_entry){ strdup("long_single_q"),
+        repeat_pattern("echo '", "some text inside ", 4096, "'"), 0 };
+    corpus[count++] = (struct corpus_entry){ strdup("escapes"),
+        repeat_pattern("echo ", "\\ a\\\\", 8192, ""), 0 };
+    corpus[count++] = (struct corpus_entry){ strdup("many_pipes"),
+        repeat_pattern("cat file", " | tr a-z A-Z", 512, ""), 0 };
+    corpus[count++] = (struct corpus_entry){ strdup("whitespace"),
+        repeat_pattern("echo", "    ", 16384, "end"), 0 };
+    
+    for (int i = 0; i < count; i++) {
+        corpus[i].length = strlen(corpus[i].line);
+    }
+    return count;
+}
+
+// One entry per line; the entry name is its line number in the file
+static int load_corpus_file(const char *path, struct corpus_entry *corpus, int count) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "parser_bench: %s: cannot open file\n", path);
+        exit(1);
+    }
+    
+    char *line = malloc(MAX_LINE_LENGTH);
+    int line_number = 0;
+    while (count < MAX_CORPUS_ENTRIES && fgets(line, MAX_LINE_LENGTH, file)) {
+        line_number++;
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        
+        char name[64];
+        snprintf(name, sizeof(name), "line_%d", line_number);
+        corpus[count++] = (struct corpus_entry){ strdup(name), strdup(line), len };
+    }
+    
+    free(line);
+    fclose(file);
+    return count;
+}
+
+static void run_entry(const struct corpus_entry *entry, uint64_t budget_ns) {
+    // parse_command_line tokenizes in place only through its own buffers, but
+    // takes a non-const line, so give each iteration a fresh copy
+    char *scratch = malloc(entry->length + 1);
+    uint64_t iterations = 0;
+    uint64_t parse_ns = 0;
+    
+    allocation_count = 0;
+    uint64_t deadline = now_ns() + budget_ns;
+    
+    while (iterations < MIN_ITERATIONS || now_ns() < deadline) {
+        memcpy(scratch, entry->line, entry->length + 1);
+        struct command_context ctx = {
+            .out_mode = O_TRUNC,
+            .err_mode = O_TRUNC,
+        };
+        
+        uint64_t start = now_ns();
+        counting = true;
+        parse_command_line(scratch, &ctx);
+        counting = false;
+        parse_ns += now_ns() - start;
+        
+        free_command_context(&ctx);
+        iterations++;
+    }
+    
+    double ns_per_byte = (double)parse_ns / ((double)iterations * (double)entry->length);
+    double allocs_per_line = (double)allocation_count / (double)iterations;
+    printf("%-16s %10zu %12llu %10.2f %14.1f\n", entry->name, entry->length, 
+           (unsigned long long)iterations, ns_per_byte, allocs_per_line);
+    
+    free(scratch);
+}
@@ -0,0 +1,379 @@
+/* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* DEFINE CONSTANTS */
+#ifndef SHELL_BINARY_PATH
+#define SHELL_BINARY_PATH "./shell"
+#endif
+#define DEFAULT_PATH_ENTRIES 2000
+#define DEFAULT_HISTORY_LINES 10000
+#define DEFAULT_ITERATIONS 200
+#define DEFAULT_STARTS 5
+#define WAIT_TIMEOUT_MS 5000
+#define OUTPUT_BUFFER_SIZE 65536
+#define TOOL_NAME_FORMAT "tool_%05d"
+#define TOOL_SUFFIX "_bin"
+#define PROMPT "$ "
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// Latencies for one kind of interaction, in nanoseconds
+struct samples {
+    const char *name;
+    uint64_t *ns;
+    int count;
+    int capacity;
+};
+
+// A shell running on the master side of a pseudo-terminal. `output` holds
+// what it has written since the last keystroke
+struct session {
+    int master_fd;
+    pid_t pid;
+    char output[OUTPUT_BUFFER_SIZE];
+    size_t output_length;
+};
+
+struct bench_options {
+    const char *shell_path;
+    int path_entries;
+    int history_lines;
+    int iterations;
+    int starts;
+};
+
+/* FUNCTION HEADERS */
+static uint64_t now_ns(void);
+static void make_fixture(const struct bench_options *options, char *dir, char *bin_dir, char *histfile);
+static void remove_fixture(const char *dir, const char *bin_dir, const char *histfile, int path_entries);
+static bool start_session(struct session *session, const struct bench_options *options,
+                          const char *bin_dir, const char *histfile);
+static void stop_session(struct session *session);
+static bool wait_for(struct session *session, const char *expected);
+static uint64_t press(struct session *session, const char *keys, const char *expected);
+static void record(struct samples *samples, uint64_t ns);
+static int compare_ns(const void *a, const void *b);
+static void report(struct samples *samples);
+
+/* MAIN FUNCTION */
+
+int main(int argc, char **argv) {
+    struct bench_options options = {
+        .shell_path = SHELL_BINARY_PATH,
+        .path_entries = DEFAULT_PATH_ENTRIES,
+        .history_lines = DEFAULT_HISTORY_LINES,
+        .iterations = DEFAULT_ITERATIONS,
+        .starts = DEFAULT_STARTS,
+    };
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            options.shell_path = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            options.path_entries = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) {
+            options.history_lines = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            options.iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            options.starts = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [-s shell] [-p path_entries] [-H history_lines] "
+                            "[-n iterations] [-r starts]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (options.path_entries < 1 || options.iterations < 1 || options.starts < 1) {
+        fprintf(stderr, "pty_bench: counts must be positive\n");
+        return 1;
+    }
+    
+    char dir[4096], bin_dir[4096], histfile[4096];
+    make_fixture(&options, dir, bin_dir, histfile);
+    
+    struct samples startup = { .name = "startup" };
+    struct samples keystroke = { .name = "keystroke" };
+    struct samples tab = { .name = "tab" };
+    struct samples up_arrow = { .name = "up_arrow" };
+    struct samples enter = { .name = "enter" };
+    int failures = 0;
+    
+    // Start-to-prompt includes loading HISTFILE, so it's measured on fresh shells
+    for (int i = 0; i < options.starts; i++) {
+        struct session session;
+        uint64_t start = now_ns();
+        if (!start_session(&session, &options, bin_dir, histfile)) {
+            failures++;
+            continue;
+        }
+        bool ready = wait_for(&session, PROMPT);
+        record(&startup, now_ns() - start);
+        stop_session(&session);
+        if (!ready) {
+            failures++;
+        }
+    }
+    
+    struct session session;
+    if (!start_session(&session, &options, bin_dir, histfile) || !wait_for(&session, PROMPT)) {
+        fprintf(stderr, "pty_bench: %s: no prompt\n", options.shell_path);
+        remove_fixture(dir, bin_dir, histfile, options.path_entries);
+        return 1;
+    }
+    
+    // Each round types a unique prefix, completes it with TAB, runs it,
+    // then recalls it with up-arrow and runs it again
+    for (int i = 0; i < options.iterations; i++) {
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), TOOL_NAME_FORMAT, (i * 7919) % options.path_entries);
+    
+        for (const char *c = prefix; *c; c++) {
+            char key[2] = { *c, '\0' };
+            uint64_t ns = press(&session, key, key);
+            if (ns == 0) {
+                failures++;
+                break;
+            }
+            record(&keystroke, ns);
+        }
+    
+        uint64_t steps[] = {
+            press(&session, "\t", TOOL_SUFFIX),
+            press(&session, "\r", PROMPT),
+            press(&session, "\x1b[A", prefix),
+            press(&session, "\r", PROMPT),
+        };
+        struct samples *targets[] = { &tab, &enter, &up_arrow, &enter };
+        for (int j = 0; j < 4; j++) {
+            if (steps[j] == 0) {
+                failures++;
+            } else {
+                record(targets[j], steps[j]);
+            }
+        }
+    }
+    stop_session(&session);
+    
+    printf("PATH entries: %d, history lines: %d\n", options.path_entries, options.history_lines);
+    printf("%-12s %8s %10s %10s %10s %10s\n", "event", "samples", "p50_us", "p90_us", "p99_us", "max_us");
+    report(&startup);
+    report(&keystroke);
+    report(&tab);
+    report(&up_arrow);
+    report(&enter);
+    if (failures > 0) {
+        printf("timeouts: %d\n", failures);
+    }
+    
+    remove_fixture(dir, bin_dir, histfile, options.path_entries);
+    return failures > 0 ? 1 : 0;
+}
+
+/* FUNCTION FUNCTIONS */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// A temporary directory with `path_entries` trivial executables (the whole
+// PATH completion has to search) and a HISTFILE of `history_lines` entries
+static void make_fixture(const struct bench_options *options, char *dir, char *bin_dir, char *histfile) {
+    const char *tmp = getenv("TMPDIR");
+    snprintf(dir, 4096, "%s/pty_bench.XXXXXX", tmp ? tmp : "/tmp");
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "pty_bench: %s: %s\n", dir, strerror(errno));
+        exit(1);
+    }
+    snprintf(bin_dir, 4096, "%s/bin", dir);
+    snprintf(histfile, 4096, "%s/history", dir);
+    mkdir(bin_dir, 0755);
+    
+    for (int i = 0; i < options->path_entries; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/" TOOL_NAME_FORMAT TOOL_SUFFIX, bin_dir, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+        if (fd < 0) {
+            fprintf(stderr, "pty_bench: %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        write(fd, "#!/bin/sh\n", 10);
+        close(fd);
+    }
+    
+    FILE *file = fopen(histfile, "w");
+    for (int i = 0; file && i < options->history_lines; i++) {
+        fprintf(file, "echo history entry %d | grep -v nothing\n", i);
+    }
+    if (file) {
+        fclose(file);
+    }
+}
+
+static void remove_fixture(const char *dir, const char *bin_dir, const char *histfile, int path_entries) {
+    for (int i = 0; i < path_entries; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/" TOOL_NAME_FORMAT TOOL_SUFFIX, bin_dir, i);
+        unlink(path);
+    }
+    char index_path[4096];
+    snprintf(index_path, sizeof(index_path), "%s.idx", histfile);
+    unlink(index_path);
+    unlink(histfile);
+    rmdir(bin_dir);
+    rmdir(dir);
+}
+
+// Runs the shell on a new pty. TERM=dumb keeps readline's redraws to plain
+// text, so the expected output can be matched literally
+static bool start_session(struct session *session, const struct bench_options *options,
+                          const char *bin_dir, const char *histfile) {
+    session->output_length = 0;
+    session->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (session->master_fd < 0 || grantpt(session->master_fd) < 0 || unlockpt(session->master_fd) < 0) {
+        fprintf(stderr, "pty_bench: pty: %s\n", strerror(errno));
+        return false;
+    }
+
+    // Wide enough that no line wraps or scrolls horizontally
+    struct winsize size = { .ws_row = 50, .ws_col = 250 };
+    ioctl(session->master_fd, TIOCSWINSZ, &size);
+
+    char *slave_path = ptsname(session->master_fd);
+    session->pid = fork();
+    if (session->pid == 0) {
+        setsid();
+        int slave_fd = open(slave_path, O_RDWR);
+        if (slave_fd < 0) {
+            _exit(127);
+        }
+        ioctl(slave_fd, TIOCSCTTY, 0);
+        dup2(slave_fd, STDIN_FILENO);
+        dup2(slave_fd, STDOUT_FILENO);
+        dup2(slave_fd, STDERR_FILENO);
+        if (slave_fd > STDERR_FILENO) {
+            close(slave_fd);
+        }
+
+        char path[8192];
+        snprintf(path, sizeof(path), "%s:/usr/bin:/bin", bin_dir);
+        setenv("PATH", path, 1);
+        setenv("HISTFILE", histfile, 1);
+        setenv("TERM", "dumb", 1);
+        setenv("INPUTRC", "/dev/null", 1);
+        execl(options->shell_path, options->shell_path, (char *)NULL);
+        _exit(127);
+    }
+    if (session->pid < 0) {
+        close(session->master_fd);
+        return false;
+    }
+    return true;
+}
+
+static void stop_session(struct session *session) {
+    write(session->master_fd, "exit\r", 5);
+    close(session->master_fd);
+    
+    // Closing the master hangs the shell up if `exit` wasn't read
+    int status;
+    waitpid(session->pid, &status, 0);
+}
+
+// Reads the shell's output until `expected` appears in what it wrote since
+// the last keystroke
+static bool wait_for(struct session *session, const char *expected) {
+    uint64_t deadline = now_ns() + (uint64_t)WAIT_TIMEOUT_MS * 1000000ULL;
+    
+    while (true) {
+        session->output[session->output_length] = '\0';
+        if (strstr(session->output, expected)) {
+            return true;
+        }
+    
+        uint64_t now = now_ns();
+        if (now >= deadline) {
+            return false;
+        }
+        struct pollfd pfd = { .fd = session->master_fd, .events = POLLIN };
+        if (poll(&pfd, 1, (int)((deadline - now) / 1000000ULL) + 1) <= 0) {
+            continue;
+        }
+    
+        // Keep the tail when full; the match is always near the end
+        if (session->output_length + 1 >= OUTPUT_BUFFER_SIZE) {
+            size_t keep = OUTPUT_BUFFER_SIZE / 2;
+            memmove(session->output, session->output + session->output_length - keep, keep);
+            session->output_length = keep;
+        }
+        ssize_t got = read(session->master_fd, session->output + session->output_length,
+                           OUTPUT_BUFFER_SIZE - 1 - session->output_length);
+        if (got <= 0) {
+            return false;
+        }
+        session->output_length += got;
+    }
+}
+
+// Sends `keys` and returns how long the shell took to write `expected`
+// back; 0 on timeout
+static uint64_t press(struct session *session, const char *keys, const char *expected) {
+    session->output_length = 0;
+    uint64_t start = now_ns();
+    write(session->master_fd, keys, strlen(keys));
+    if (!wait_for(session, expected)) {
+        return 0;
+    }
+    uint64_t elapsed = now_ns() - start;
+    return elapsed ? elapsed : 1;
+}
+
+static void record(struct samples *samples, uint64_t ns) {
+    if (samples->count >= samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 256;
+        samples->ns = realloc(samples->ns, samples->capacity * sizeof(uint64_t));
+    }
+    samples->ns[samples->count++] = ns;
+}
+
+static int compare_ns(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentiles
+static void report(struct samples *samples) {
+    if (samples->count == 0) {
+        printf("%-12s %8d\n", samples->name, 0);
+        return;
+    }
+    qsort(samples->ns, samples->count, sizeof(uint64_t), compare_ns);
+    
+    double percentiles[] = { 0.50, 0.90, 0.99 };
+    double values[3];
+    for (int i = 0; i < 3; i++) {
+        int rank = (int)(percentiles[i] * samples->count + 0.999999);
+        values[i] = samples->ns[(rank > 0 ? rank : 1) - 1] / 1000.0;
+    }
+    printf("%-12s %8d %10.1f %10.1f %10.1f %10.1f\n", samples->name, samples->count,
+           values[0], values[1], values[2], samples->ns[samples->count - 1] / 1000.0);
+    
+    free(samples->ns);
+    samples->ns = NULL;
+}
@@ -0,0 +1,194 @@
+/* INCLUDE LIBRARIES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "parser.h"
+
+/* DEFINE CONSTANTS */
+#define STANDALONE_READ_CHUNK 4096
+
+/* FUNCTION HEADERS */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+static void check_context(const struct command_context *ctx);
+static void check_node(const struct command_node *node);
+
+/* FUNCTION FUNCTIONS */
+
+// Entry point for libFuzzer; the standalone main() below calls it too
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    // The shell only ever hands the parser NUL-terminated readline output
+    char *line = malloc(size + 1);
+    if (line == NULL) {
+        return 0;
+    }
+    memcpy(line, data, size);
+    line[size] = '\0';
+    
+    struct command_context ctx = {
+        .out_mode = O_TRUNC,
+        .err_mode = O_TRUNC,
+    };
+    
+    parse_command_line(line, &ctx);
+    check_context(&ctx);
+    free_command_context(&ctx);
+    
+    // Same input through the full script grammar
+    enum parse_status status;
+    struct command_node *root = parse_script(line, &status);
+    if ((root == NULL) != (status != PARSE_OK)) {
+        abort();
+    }
+    check_node(root);
+    free_command_node(root);
+    
+    free(line);
+    return 0;
+}
+
+// Structural invariants the executor relies on; abort() so the fuzzer
+// records a crash instead of silently accepting a malformed context
+static void check_context(const struct command_context *ctx) {
+    if (ctx->argv == NULL) {
+        abort();
+    }
+    
+    if (ctx->num_commands > 0) {
+        for (int i = 0; i < ctx->num_commands; i++) {
+            if (ctx->all_commands[i][ctx->all_argc[i]] != NULL) {
+                abort();
+            }
+            for (int j = 0; j < ctx->all_argc[i]; j++) {
+                if (ctx->all_commands[i][j] == NULL) {
+                    abort();
+                }
+            }
+        }
+        return;
+    }
+    
+    if (ctx->argc < 0 || ctx->argv[ctx->argc] != NULL) {
+        abort();
+    }
+    for (int i = 0; i < ctx->argc; i++) {
+        if (ctx->argv[i] == NULL) {
+            abort();
+        }
+    }
+}
+
+static void check_node(const struct command_node *node) {
+    if (node == NULL) {
+        return;
+    }
+    if (node->refs != 1) {
+        abort();
+    }
+    
+    if (node->type == NODE_COMMAND) {
+        check_context(&node->command);
+    }
+    for (int i = 0; i < node->num_children; i++) {
+        if (node->children[i] == NULL) {
+            abort();
+        }
+        check_node(node->children[i]);
+    }
+    for (int i = 0; i < node->num_words; i++) {
+        if (node->words[i] == NULL) {
+            abort();
+        }
+    }
+    
+    // Shape of each node type
+    int min_children = 0;
+    int max_children = INT_MAX;
+    switch (node->type) {
+    case NODE_COMMAND:
+        max_children = 0;
+        break;
+    case NODE_LIST:
+    case NODE_CASE:
+        break;
+    case NODE_FUNCTION:
+    case NODE_FOR:
+        min_children = max_children = 1;
+        if (node->name == NULL) {
+            abort();
+        }
+        break;
+    case NODE_NOT:
+    case NODE_CASE_ARM:
+    case NODE_BACKGROUND:
+        min_children = max_children = 1;
+        break;
+    case NODE_AND:
+    case NODE_OR:
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        min_children = max_children = 2;
+        break;
+    case NODE_PIPELINE:
+        min_children = 2;
+        break;
+    case NODE_IF:
+        min_children = 2;
+        max_children = 3;
+        break;
+    }
+    if (node->num_children < min_children || node->num_children > max_children) {
+        abort();
+    }
+}
+
+#ifdef PARSER_FUZZ_STANDALONE
+// AFL-style driver: run each file argument, or stdin when there are none
+static int run_stream(FILE *input) {
+    size_t capacity = STANDALONE_READ_CHUNK;
+    size_t size = 0;
+    uint8_t *data = malloc(capacity);
+    if (data == NULL) {
+        return 1;
+    }
+    
+    size_t got;
+    while ((got = fread(data + size, 1, capacity - size, input)) > 0) {
+        size += got;
+        if (size == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+            if (data == NULL) {
+                return 1;
+            }
+        }
+    }
+    
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        return run_stream(stdin);
+    }
+    
+    for (int i = 1; i < argc; i++) {
+        FILE *input = fopen(argv[i], "rb");
+        if (!input) {
+            fprintf(stderr, "parser_fuzz: %s: cannot open file\n", argv[i]);
+            return 1;
+        }
+        int res = run_stream(input);
+        fclose(input);
+        if (res != 0) {
+            return res;
+        }
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,374 @@
+/* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "audit.h"
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// Bounded text buffer for building one record
+struct record_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool overflow;
+};
+
+// Single-producer single-consumer byte ring. The shell thread only moves
+// `head`, the writer thread only moves `tail`; both only ever increase
+struct audit_ring {
+    char *data;
+    _Atomic size_t head;
+    _Atomic size_t tail;
+};
+
+/* FUNCTION HEADERS */
+static void record_job(const struct job *job, const struct audit_stage *stages, const char *line, bool background);
+static void push_record(struct record_buffer *buf);
+static void *writer_main(void *arg);
+static size_t drain_ring(void);
+static bool ring_push(const char *data, size_t length);
+static void wake_writer(void);
+static void append_raw(struct record_buffer *buf, const char *text, size_t length);
+static void append_format(struct record_buffer *buf, const char *format, ...);
+static void append_json_string(struct record_buffer *buf, const char *text, size_t max_length);
+static long elapsed_us(const struct timespec *start, const struct timespec *end);
+static long timeval_us(const struct timeval *tv);
+
+/* AUDIT STATE */
+static bool enabled = false;
+static int log_fd = -1;
+static int wake_fd = -1;
+static pthread_t writer_thread;
+static struct audit_ring ring;
+static const char *current_line = NULL;
+static struct timespec line_started;
+static bool line_recorded = false;      // A job of the current line got a record
+static struct audit_stats stats = { 0 };
+static pid_t owner_pid = 0;
+
+// Writer is about to block (or blocked) on wake_fd and needs a nudge
+static atomic_bool writer_idle = false;
+static atomic_bool stopping = false;
+
+/* FUNCTION FUNCTIONS */
+void audit_init(void) {
+    const char *path = getenv(AUDIT_ENV_VAR);
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+    
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (log_fd < 0) {
+        fprintf(stderr, "audit: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    ring.data = malloc(AUDIT_RING_SIZE);
+    if (wake_fd < 0 || ring.data == NULL) {
+        fprintf(stderr, "audit: cannot set up the log writer\n");
+        close(log_fd);
+        log_fd = -1;
+        return;
+    }
+    atomic_init(&ring.head, 0);
+    atomic_init(&ring.tail, 0);
+    
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        fprintf(stderr, "audit: cannot start the log writer\n");
+        close(log_fd);
+        log_fd = -1;
+        return;
+    }
+    
+    enabled = true;
+    owner_pid = getpid();
+    atexit(audit_shutdown);
+}
+
+void audit_shutdown(void) {
+    // A child that failed to exec runs atexit handlers too, without the thread
+    if (!enabled || getpid() != owner_pid) {
+        return;
+    }
+    enabled = false;
+    
+    atomic_store(&stopping, true);
+    uint64_t one = 1;
+    ssize_t ignored = write(wake_fd, &one, sizeof(one));
+    (void) ignored;
+    pthread_join(writer_thread, NULL);
+    
+    close(wake_fd);
+    close(log_fd);
+    free(ring.data);
+}
+
+void audit_after_fork(void) {
+    // Only the forking thread exists here; leave the parent's fds alone
+    enabled = false;
+}
+
+bool audit_enabled(void) {
+    return enabled;
+}
+
+void audit_set_line(const char *line) {
+    current_line = line;
+    line_recorded = false;
+    clock_gettime(CLOCK_MONOTONIC, &line_started);
+}
+
+void audit_finish_line(int status) {
+    if (!enabled || current_line == NULL || line_recorded) {
+        return;
+    }
+    
+    char data[AUDIT_RECORD_MAX];
+    struct record_buffer buf = {
+        .data = data,
+        .capacity = sizeof(data),
+    };
+    
+    struct timespec now, finished;
+    clock_gettime(CLOCK_REALTIME, &now);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    
+    append_format(&buf, "{\"ts\":%ld.%03ld,\"line\":", (long)now.tv_sec, now.tv_nsec / 1000000);
+    append_json_string(&buf, current_line, AUDIT_LINE_MAX);
+    append_format(&buf, ",\"stages\":[],\"wall_us\":%ld,\"cpu_us\":0,\"max_rss_kb\":0,\"status\":%d}\n",
+                  elapsed_us(&line_started, &finished), status);
+    push_record(&buf);
+}
+
+void audit_record_job(const struct job *job, const struct audit_stage *stages) {
+    if (!enabled) {
+        return;
+    }
+    record_job(job, stages, current_line, false);
+    line_recorded = true;
+}
+
+void audit_record_background_job(const struct job *job) {
+    if (!enabled) {
+        return;
+    }
+    
+    // The line that started it is long gone; the job's own text stands in
+    struct audit_stage *stages = malloc(job->num_procs * sizeof(struct audit_stage));
+    for (int i = 0; i < job->num_procs; i++) {
+        stages[i] = (struct audit_stage) { job->text, NULL };
+    }
+    record_job(job, stages, job->text, true);
+    free(stages);
+}
+
+void audit_get_stats(struct audit_stats *out) {
+    *out = stats;
+}
+
+static void record_job(const struct job *job, const struct audit_stage *stages, const char *line, bool background) {
+    char data[AUDIT_RECORD_MAX];
+    struct record_buffer buf = {
+        .data = data,
+        .capacity = sizeof(data),
+    };
+    
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    
+    long cpu_us = 0;
+    long max_rss_kb = 0;
+    for (int i = 0; i < job->num_procs; i++) {
+        const struct rusage *usage = &job->procs[i].usage;
+        cpu_us += timeval_us(&usage->ru_utime) + timeval_us(&usage->ru_stime);
+        if (usage->ru_maxrss > max_rss_kb) {
+            max_rss_kb = usage->ru_maxrss;
+        }
+    }
+    
+    append_format(&buf, "{\"ts\":%ld.%03ld,\"line\":", (long)now.tv_sec, now.tv_nsec / 1000000);
+    append_json_string(&buf, line, AUDIT_LINE_MAX);
+    if (background) {
+        append_format(&buf, ",\"background\":true");
+    }
+    append_format(&buf, ",\"stages\":[");
+    
+    for (int i = 0; i < job->num_procs; i++) {
+        const struct job_process *proc = &job->procs[i];
+        append_raw(&buf, (i > 0) ? ",{\"command\":" : "{\"command\":", (i > 0) ? 12 : 11);
+        append_json_string(&buf, stages[i].command, AUDIT_LINE_MAX);
+        append_raw(&buf, ",\"path\":", 8);
+        append_json_string(&buf, stages[i].path, AUDIT_LINE_MAX);
+        append_format(&buf, ",\"pid\":%d,\"status\":%d,\"user_us\":%ld,\"sys_us\":%ld,\"max_rss_kb\":%ld}",
+                      (int)proc->pid, proc->status, timeval_us(&proc->usage.ru_utime),
+                      timeval_us(&proc->usage.ru_stime), (long)proc->usage.ru_maxrss);
+    }
+    
+    append_format(&buf, "],\"wall_us\":%ld,\"cpu_us\":%ld,\"max_rss_kb\":%ld,\"status\":%d}\n",
+                  elapsed_us(&job->started, &job->finished), cpu_us, max_rss_kb,
+                  job->procs[job->num_procs - 1].status);
+    push_record(&buf);
+}
+
+static void push_record(struct record_buffer *buf) {
+    if (buf->overflow || !ring_push(buf->data, buf->length)) {
+        stats.dropped++;
+        return;
+    }
+    stats.records++;
+    wake_writer();
+}
+
+// Sleeps on the eventfd whenever the ring is empty
+static void *writer_main(void *arg) {
+    (void) arg;
+    
+    while (true) {
+        drain_ring();
+    
+        // Announce the sleep first, then look again: a record pushed in
+        // between either shows up here or sees writer_idle and wakes us
+        atomic_store(&writer_idle, true);
+        if (atomic_load(&ring.head) != atomic_load(&ring.tail)) {
+            atomic_store(&writer_idle, false);
+            continue;
+        }
+        if (atomic_load(&stopping)) {
+            break;
+        }
+    
+        uint64_t count;
+        if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            break;
+        }
+        atomic_store(&writer_idle, false);
+    }
+    
+    drain_ring();
+    return NULL;
+}
+
+// Writes everything queued so far. Returns the number of bytes consumed
+static size_t drain_ring(void) {
+    size_t tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring.head, memory_order_acquire);
+    size_t total = head - tail;
+    
+    while (tail != head) {
+        size_t offset = tail & (AUDIT_RING_SIZE - 1);
+        size_t chunk = head - tail;
+        if (chunk > AUDIT_RING_SIZE - offset) {
+            chunk = AUDIT_RING_SIZE - offset;
+        }
+    
+        ssize_t written = write(log_fd, ring.data + offset, chunk);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Disk full or similar: discard rather than stall the shell
+            written = (ssize_t)chunk;
+        }
+    
+        tail += (size_t)written;
+        atomic_store_explicit(&ring.tail, tail, memory_order_release);
+    }
+    return total;
+}
+
+// Copies a whole record in, or nothing if it doesn't fit
+static bool ring_push(const char *data, size_t length) {
+    size_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+    if (length > AUDIT_RING_SIZE - (head - tail)) {
+        return false;
+    }
+    
+    size_t offset = head & (AUDIT_RING_SIZE - 1);
+    size_t first = AUDIT_RING_SIZE - offset;
+    if (first > length) {
+        first = length;
+    }
+    memcpy(ring.data + offset, data, first);
+    memcpy(ring.data, data + first, length - first);
+    
+    atomic_store_explicit(&ring.head, head + length, memory_order_release);
+    return true;
+}
+
+// One eventfd write per sleep, not per record
+static void wake_writer(void) {
+    if (atomic_exchange(&writer_idle, false)) {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void) ignored;
+    }
+}
+
+static void append_raw(struct record_buffer *buf, const char *text, size_t length) {
+    if (buf->length + length >= buf->capacity) {
+        buf->overflow = true;
+        return;
+    }
+    memcpy(buf->data + buf->length, text, length);
+    buf->length += length;
+}
+
+static void append_format(struct record_buffer *buf, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buf->data + buf->length, buf->capacity - buf->length, format, args);
+    va_end(args);
+    
+    if (written < 0 || (size_t)written >= buf->capacity - buf->length) {
+        buf->overflow = true;
+        return;
+    }
+    buf->length += (size_t)written;
+}
+
+// JSON string (or null), cut off after `max_length` input bytes
+static void append_json_string(struct record_buffer *buf, const char *text, size_t max_length) {
+    if (text == NULL) {
+        append_raw(buf, "null", 4);
+        return;
+    }
+    
+    append_raw(buf, "\"", 1);
+    for (size_t i = 0; text[i] && i < max_length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            char escaped[2] = { '\\', (char)c };
+            append_raw(buf, escaped, 2);
+        } else if (c == '\n') {
+            append_raw(buf, "\\n", 2);
+        } else if (c == '\t') {
+            append_raw(buf, "\\t", 2);
+        } else if (c < 0x20) {
+            append_format(buf, "\\u%04x", c);
+        } else {
+            append_raw(buf, (const char *)&c, 1);
+        }
+    }
+    append_raw(buf, "\"", 1);
+}
+
+static long elapsed_us(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static long timeval_us(const struct timeval *tv) {
+    return tv->tv_sec * 1000000L + tv->tv_usec;
+}
@@ -0,0 +1,60 @@
+#ifndef AUDIT_H
+#define AUDIT_H
+
+/* INCLUDE LIBRARIES */
+#include <stdbool.h>
+
+#include "jobs.h"
+
+/* DEFINE CONSTANTS */
+#define AUDIT_ENV_VAR "SHELL_AUDIT_LOG"
+#define AUDIT_RING_SIZE (1 << 20)      // Bytes; must be a power of two
+#define AUDIT_RECORD_MAX 8192
+#define AUDIT_LINE_MAX 2048
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// What the shell knows about one stage of a job
+struct audit_stage {
+    const char *command;    // argv[0], or a description of a compound stage
+    const char *path;       // Resolved executable; NULL for builtins and functions
+};
+
+struct audit_stats {
+    unsigned long records;
+    unsigned long dropped;  // Ring was full, or the record didn't fit
+};
+
+/* FUNCTION HEADERS */
+
+// Opens the log named by $SHELL_AUDIT_LOG and starts the writer thread.
+// Does nothing when the variable is unset
+void audit_init(void);
+
+// Flushes what is queued and stops the writer. Registered with atexit
+void audit_shutdown(void);
+
+// In a forked child: the writer thread didn't come along, so stop logging
+void audit_after_fork(void);
+
+bool audit_enabled(void);
+
+// The command line being run, quoted in every record until the next call.
+// The string must stay valid until then
+void audit_set_line(const char *line);
+
+// Queues one JSON line for a finished foreground job. Never blocks: if the
+// ring is full the record is dropped and counted
+void audit_record_job(const struct job *job, const struct audit_stage *stages);
+
+// The same for a background job, once its last process is reaped; marked
+// "background" and quoting the job's text as its line
+void audit_record_background_job(const struct job *job);
+
+// Ends the line set by audit_set_line. A line that ran only builtins (or
+// functions and assignments) gets a record with no stages here
+void audit_finish_line(int status);
+
+void audit_get_stats(struct audit_stats *stats);
+
+#endif
@@ -0,0 +1,507 @@
+/* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "parser.h"
+#include "brace.h"
+
+/* DEFINE CONSTANTS */
+#define BRACE_NUMBER_LENGTH 32
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+enum brace_part_type {
+    BRACE_LITERAL,
+    BRACE_SEQUENCE,         // {first..last} or {first..last..step}
+    BRACE_ALTERNATION,      // {a,b,...}
+};
+
+struct brace_pattern;
+
+// One piece of a pattern. Sequences and alternations remember where they
+// are, so a pattern works like an odometer: the rightmost part turns fastest
+struct brace_part {
+    enum brace_part_type type;
+
+    // BRACE_LITERAL
+    char *text;
+    size_t length;
+
+    // BRACE_SEQUENCE
+    long long first;
+    long long last;
+    long long step;         // Negative when counting down
+    int width;              // Zero-padded to this many characters
+    bool letters;
+    long long current;
+
+    // BRACE_ALTERNATION
+    struct brace_pattern *alternatives;
+    int num_alternatives;
+    int current_alternative;
+};
+
+struct brace_pattern {
+    struct brace_part *parts;
+    int num_parts;
+    int capacity;
+};
+
+struct brace_expansion {
+    struct brace_pattern pattern;
+    bool started;
+    bool done;
+    char *buffer;           // The word brace_next last returned
+    size_t length;
+    size_t capacity;
+};
+
+/* FUNCTION HEADERS */
+static bool is_mark(const char *word, size_t i, size_t to, char c);
+static int *match_braces(const char *word, size_t length);
+static void parse_range(const char *word, size_t from, size_t to, const int *match, struct brace_pattern *pattern);
+static void parse_brace(const char *word, size_t open, size_t close, const int *match, struct brace_pattern *pattern);
+static bool parse_sequence(const char *text, size_t length, struct brace_part *part);
+static bool parse_bound(const char *text, size_t length, long long *value, bool *letter, bool *padded);
+static struct brace_part *add_part(struct brace_pattern *pattern);
+static void add_literal(struct brace_pattern *pattern, const char *text, size_t length);
+static void move_parts(struct brace_pattern *to, struct brace_pattern *from);
+static bool pattern_expands(const struct brace_pattern *pattern);
+static size_t pattern_count(const struct brace_pattern *pattern);
+static size_t part_count(const struct brace_part *part);
+static void pattern_reset(struct brace_pattern *pattern);
+static void part_reset(struct brace_part *part);
+static bool pattern_advance(struct brace_pattern *pattern);
+static bool part_advance(struct brace_part *part);
+static void pattern_render(const struct brace_pattern *pattern, struct brace_expansion *brace);
+static void append_text(struct brace_expansion *brace, const char *text, size_t length);
+static void free_pattern(struct brace_pattern *pattern);
+
+/* FUNCTION FUNCTIONS */
+struct brace_expansion *brace_parse(const char *word) {
+    size_t length = strlen(word);
+    int *match = match_braces(word, length);
+    
+    struct brace_pattern pattern = { 0 };
+    parse_range(word, 0, length, match, &pattern);
+    free(match);
+    
+    if (!pattern_expands(&pattern)) {
+        free_pattern(&pattern);
+        return NULL;
+    }
+    
+    struct brace_expansion *brace = calloc(1, sizeof(struct brace_expansion));
+    brace->pattern = pattern;
+    return brace;
+}
+
+size_t brace_count(const struct brace_expansion *brace) {
+    return pattern_count(&brace->pattern);
+}
+
+const char *brace_next(struct brace_expansion *brace) {
+    if (brace->done) {
+        return NULL;
+    }
+    if (!brace->started) {
+        pattern_reset(&brace->pattern);
+        brace->started = true;
+    } else if (!pattern_advance(&brace->pattern)) {
+        brace->done = true;
+        return NULL;
+    }
+    
+    brace->length = 0;
+    pattern_render(&brace->pattern, brace);
+    append_text(brace, "", 0);
+    brace->buffer[brace->length] = '\0';
+    return brace->buffer;
+}
+
+void brace_free(struct brace_expansion *brace) {
+    if (brace == NULL) {
+        return;
+    }
+    free_pattern(&brace->pattern);
+    free(brace->buffer);
+    free(brace);
+}
+
+size_t brace_strip_marks(char *word, size_t length) {
+    size_t kept = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (word[i] != BRACE_MARK) {
+            word[kept++] = word[i];
+        }
+    }
+    word[kept] = '\0';
+    return kept;
+}
+
+// BRACE_MARK followed by `c`, within [.., to)
+static bool is_mark(const char *word, size_t i, size_t to, char c) {
+    return i + 1 < to && word[i] == BRACE_MARK && word[i + 1] == c;
+}
+
+// For each marked '{', the position of its marked '}' (and the reverse);
+// -1 for braces that are never closed. Pairing everything up front keeps
+// parsing linear: an unclosed '{' is known to be literal before it is reached
+static int *match_braces(const char *word, size_t length) {
+    int *match = malloc((length + 1) * sizeof(int));
+    int *open = malloc((length + 1) * sizeof(int));
+    int num_open = 0;
+    
+    for (size_t i = 0; i < length; i++) {
+        match[i] = -1;
+    }
+    for (size_t i = 0; i + 1 < length; i++) {
+        if (is_mark(word, i, length, '{')) {
+            open[num_open++] = (int)i;
+            i++;
+        } else if (is_mark(word, i, length, '}') && num_open > 0) {
+            int j = open[--num_open];
+            match[j] = (int)i;
+            match[i] = j;
+            i++;
+        }
+    }
+    
+    free(open);
+    return match;
+}
+
+// Appends the parts of word[from, to) to `pattern`. Marks that don't belong
+// to a brace expression here leave their character as plain text
+static void parse_range(const char *word, size_t from, size_t to, const int *match, struct brace_pattern *pattern) {
+    size_t i = from;
+    while (i < to) {
+        if (word[i] != BRACE_MARK) {
+            size_t run = i;
+            while (run < to && word[run] != BRACE_MARK) {
+                run++;
+            }
+            add_literal(pattern, word + i, run - i);
+            i = run;
+            continue;
+        }
+    
+        if (i + 1 >= to) {
+            i++;
+            continue;
+        }
+        if (word[i + 1] == '{' && match[i] >= 0 && (size_t)match[i] < to) {
+            parse_brace(word, i, (size_t)match[i], match, pattern);
+            i = (size_t)match[i] + 2;
+            continue;
+        }
+        add_literal(pattern, word + i + 1, 1);
+        i += 2;
+    }
+}
+
+// The expression between the marked braces at `open` and `close`: a list
+// split on its own marked commas, a sequence, or (neither) literal braces
+// around whatever is inside, as in {a{b,c}}
+static void parse_brace(const char *word, size_t open, size_t close, const int *match, struct brace_pattern *pattern) {
+    struct brace_pattern *alternatives = NULL;
+    int count = 0;
+    
+    size_t start = open + 2;
+    size_t i = start;
+    while (true) {
+        if (i >= close || is_mark(word, i, close, ',')) {
+            alternatives = realloc(alternatives, (count + 1) * sizeof(struct brace_pattern));
+            alternatives[count] = (struct brace_pattern) { 0 };
+            parse_range(word, start, i, match, &alternatives[count]);
+            count++;
+            if (i >= close) {
+                break;
+            }
+            start = i + 2;
+            i = start;
+        } else if (is_mark(word, i, close, '{') && match[i] >= 0) {
+            i = (size_t)match[i] + 2;
+        } else {
+            i += (word[i] == BRACE_MARK) ? 2 : 1;
+        }
+    }
+    
+    if (count > 1) {
+        struct brace_part *part = add_part(pattern);
+        part->type = BRACE_ALTERNATION;
+        part->alternatives = alternatives;
+        part->num_alternatives = count;
+        return;
+    }
+    
+    struct brace_part sequence = { .type = BRACE_SEQUENCE };
+    if (memchr(word + open + 2, BRACE_MARK, close - open - 2) == NULL &&
+        parse_sequence(word + open + 2, close - open - 2, &sequence)) {
+        *add_part(pattern) = sequence;
+    } else {
+        add_literal(pattern, "{", 1);
+        move_parts(pattern, &alternatives[0]);
+        add_literal(pattern, "}", 1);
+    }
+    free_pattern(&alternatives[0]);
+    free(alternatives);
+}
+
+// first..last or first..last..step, with both ends integers or both single
+// letters. A leading zero on either end pads every number to the same width
+static bool parse_sequence(const char *text, size_t length, struct brace_part *part) {
+    const char *dots = memmem(text, length, "..", 2);
+    if (dots == NULL) {
+        return false;
+    }
+    const char *right = dots + 2;
+    const char *end = text + length;
+    const char *step_dots = memmem(right, end - right, "..", 2);
+    const char *right_end = step_dots ? step_dots : end;
+    
+    bool left_letter, right_letter, left_padded, right_padded;
+    if (!parse_bound(text, dots - text, &part->first, &left_letter, &left_padded) ||
+        !parse_bound(right, right_end - right, &part->last, &right_letter, &right_padded) ||
+        left_letter != right_letter) {
+        return false;
+    }
+    
+    long long step = 1;
+    if (step_dots) {
+        bool step_letter, step_padded;
+        if (!parse_bound(step_dots + 2, end - step_dots - 2, &step, &step_letter, &step_padded) || step_letter) {
+            return false;
+        }
+        if (step == 0 || step == LLONG_MIN) {
+            step = 1;
+        }
+    }
+    step = (step < 0) ? -step : step;
+    
+    part->letters = left_letter;
+    part->step = (part->first <= part->last) ? step : -step;
+    part->width = 0;
+    if (left_padded || right_padded) {
+        size_t left_length = dots - text;
+        size_t right_length = right_end - right;
+        part->width = (int)((left_length > right_length) ? left_length : right_length);
+    }
+    return true;
+}
+
+static bool parse_bound(const char *text, size_t length, long long *value, bool *letter, bool *padded) {
+    *letter = false;
+    *padded = false;
+    if (length == 1 && ((*text >= 'a' && *text <= 'z') || (*text >= 'A' && *text <= 'Z'))) {
+        *letter = true;
+        *value = (unsigned char)*text;
+        return true;
+    }
+    
+    size_t digits_start = (length > 0 && (*text == '-' || *text == '+')) ? 1 : 0;
+    if (length == digits_start || length >= BRACE_NUMBER_LENGTH) {
+        return false;
+    }
+    for (size_t i = digits_start; i < length; i++) {
+        if (text[i] < '0' || text[i] > '9') {
+            return false;
+        }
+    }
+    
+    char number[BRACE_NUMBER_LENGTH];
+    memcpy(number, text, length);
+    number[length] = '\0';
+    errno = 0;
+    *value = strtoll(number, NULL, 10);
+    *padded = text[digits_start] == '0' && length - digits_start > 1;
+    return errno == 0;
+}
+
+static struct brace_part *add_part(struct brace_pattern *pattern) {
+    if (pattern->num_parts >= pattern->capacity) {
+        pattern->capacity = pattern->capacity ? pattern->capacity * 2 : 4;
+        pattern->parts = realloc(pattern->parts, pattern->capacity * sizeof(struct brace_part));
+    }
+    struct brace_part *part = &pattern->parts[pattern->num_parts++];
+    *part = (struct brace_part) { 0 };
+    return part;
+}
+
+// Adjacent literal text shares one part
+static void add_literal(struct brace_pattern *pattern, const char *text, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    struct brace_part *part = NULL;
+    if (pattern->num_parts > 0 && pattern->parts[pattern->num_parts - 1].type == BRACE_LITERAL) {
+        part = &pattern->parts[pattern->num_parts - 1];
+    } else {
+        part = add_part(pattern);
+        part->type = BRACE_LITERAL;
+    }
+    
+    part->text = realloc(part->text, part->length + length);
+    memcpy(part->text + part->length, text, length);
+    part->length += length;
+}
+
+// Moves every part of `from` onto the end of `to`, leaving `from` empty
+static void move_parts(struct brace_pattern *to, struct brace_pattern *from) {
+    for (int i = 0; i < from->num_parts; i++) {
+        struct brace_part *part = &from->parts[i];
+        if (part->type == BRACE_LITERAL) {
+            add_literal(to, part->text, part->length);
+            free(part->text);
+        } else {
+            *add_part(to) = *part;
+        }
+    }
+    from->num_parts = 0;
+}
+
+static bool pattern_expands(const struct brace_pattern *pattern) {
+    for (int i = 0; i < pattern->num_parts; i++) {
+        if (pattern->parts[i].type != BRACE_LITERAL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t pattern_count(const struct brace_pattern *pattern) {
+    size_t count = 1;
+    for (int i = 0; i < pattern->num_parts; i++) {
+        size_t n = part_count(&pattern->parts[i]);
+        if (n != 0 && count > SIZE_MAX / n) {
+            return SIZE_MAX;
+        }
+        count *= n;
+    }
+    return count;
+}
+
+static size_t part_count(const struct brace_part *part) {
+    switch (part->type) {
+    case BRACE_SEQUENCE: {
+        unsigned long long span = (part->step > 0)
+            ? (unsigned long long)part->last - (unsigned long long)part->first
+            : (unsigned long long)part->first - (unsigned long long)part->last;
+        unsigned long long step = (part->step > 0) ? (unsigned long long)part->step : -(unsigned long long)part->step;
+        unsigned long long count = span / step;
+        return (count >= SIZE_MAX) ? SIZE_MAX : (size_t)count + 1;
+    }
+    case BRACE_ALTERNATION: {
+        size_t count = 0;
+        for (int i = 0; i < part->num_alternatives; i++) {
+            size_t n = pattern_count(&part->alternatives[i]);
+            count = (n > SIZE_MAX - count) ? SIZE_MAX : count + n;
+        }
+        return count;
+    }
+    default:
+        return 1;
+    }
+}
+
+static void pattern_reset(struct brace_pattern *pattern) {
+    for (int i = 0; i < pattern->num_parts; i++) {
+        part_reset(&pattern->parts[i]);
+    }
+}
+
+static void part_reset(struct brace_part *part) {
+    if (part->type == BRACE_SEQUENCE) {
+        part->current = part->first;
+    } else if (part->type == BRACE_ALTERNATION) {
+        part->current_alternative = 0;
+        pattern_reset(&part->alternatives[0]);
+    }
+}
+
+// Moves to the next combination; false (with every part back at its start)
+// once they are all used up
+static bool pattern_advance(struct brace_pattern *pattern) {
+    for (int i = pattern->num_parts - 1; i >= 0; i--) {
+        if (part_advance(&pattern->parts[i])) {
+            return true;
+        }
+        part_reset(&pattern->parts[i]);
+    }
+    return false;
+}
+
+static bool part_advance(struct brace_part *part) {
+    if (part->type == BRACE_SEQUENCE) {
+        // Compared as a distance so the last step can't overflow
+        unsigned long long left = (part->step > 0)
+            ? (unsigned long long)part->last - (unsigned long long)part->current
+            : (unsigned long long)part->current - (unsigned long long)part->last;
+        unsigned long long step = (part->step > 0) ? (unsigned long long)part->step : -(unsigned long long)part->step;
+        if (left < step) {
+            return false;
+        }
+        part->current += part->step;
+        return true;
+    }
+    
+    if (part->type == BRACE_ALTERNATION) {
+        if (pattern_advance(&part->alternatives[part->current_alternative])) {
+            return true;
+        }
+        if (part->current_alternative + 1 < part->num_alternatives) {
+            part->current_alternative++;
+            pattern_reset(&part->alternatives[part->current_alternative]);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void pattern_render(const struct brace_pattern *pattern, struct brace_expansion *brace) {
+    for (int i = 0; i < pattern->num_parts; i++) {
+        const struct brace_part *part = &pattern->parts[i];
+        if (part->type == BRACE_LITERAL) {
+            append_text(brace, part->text, part->length);
+        } else if (part->type == BRACE_ALTERNATION) {
+            pattern_render(&part->alternatives[part->current_alternative], brace);
+        } else if (part->letters) {
+            char letter = (char)part->current;
+            append_text(brace, &letter, 1);
+        } else {
+            char number[BRACE_NUMBER_LENGTH * 2];
+            int length = snprintf(number, sizeof(number), "%0*lld", part->width, part->current);
+            append_text(brace, number, (size_t)length);
+        }
+    }
+}
+
+// Always leaves room for the terminating NUL
+static void append_text(struct brace_expansion *brace, const char *text, size_t length) {
+    if (brace->length + length + 1 > brace->capacity) {
+        brace->capacity = (brace->length + length + 1) * 2;
+        brace->buffer = realloc(brace->buffer, brace->capacity);
+    }
+    memcpy(brace->buffer + brace->length, text, length);
+    brace->length += length;
+}
+
+static void free_pattern(struct brace_pattern *pattern) {
+    for (int i = 0; i < pattern->num_parts; i++) {
+        struct brace_part *part = &pattern->parts[i];
+        free(part->text);
+        for (int j = 0; j < part->num_alternatives; j++) {
+            free_pattern(&part->alternatives[j]);
+        }
+        free(part->alternatives);
+    }
+    free(pattern->parts);
+    pattern->parts = NULL;
+    pattern->num_parts = 0;
+    pattern->capacity = 0;
+}
@@ -0,0 +1,37 @@
+#ifndef BRACE_H
+#define BRACE_H
+
+/* INCLUDE LIBRARIES */
+#include <stddef.h>
+#include <stdbool.h>
+
+/* DEFINE CONSTANTS */
+
+// Words brace expansion may add to one argv; `for` loops stream any number
+#define BRACE_MAX_WORDS (1 << 24)
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// Generator for the words of one brace expression, like file{a,b}.log or
+// {1..1000000}. Words are produced one at a time; the whole list never exists
+struct brace_expansion;
+
+/* FUNCTION HEADERS */
+
+// Parses a word the tokenizer marked with BRACE_MARK. NULL if it holds
+// nothing that expands (unmatched braces, {}, {x} ...)
+struct brace_expansion *brace_parse(const char *word);
+
+// How many words the expression generates; saturates at SIZE_MAX
+size_t brace_count(const struct brace_expansion *brace);
+
+// The next word, without brace marks, or NULL after the last one. The
+// string is reused by the next call
+const char *brace_next(struct brace_expansion *brace);
+
+void brace_free(struct brace_expansion *brace);
+
+// Drops the brace marks from `word` in place; returns its new length
+size_t brace_strip_marks(char *word, size_t length);
+
+#endif
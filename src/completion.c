@@ -0,0 +1,385 @@
+/* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "completion.h"
+
+/* DEFINE CONSTANTS */
+#define LISTING_INITIAL_NAMES 256
+#define LISTING_INITIAL_BYTES 4096
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// Sorted snapshot of one directory. Names live back to back in `names`,
+// each preceded by its d_type byte; `offsets` points at the names in order
+struct dir_listing {
+    char *path;             // Absolute
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    bool racy;              // Read in the same second it last changed
+    char *names;
+    size_t names_size;
+    uint32_t *offsets;
+    int count;
+    size_t bytes;
+    unsigned long last_used;
+};
+
+struct provider_entry {
+    char *command;
+    completion_provider provider;
+};
+
+struct path_visit {
+    const char *typed_dir;  // Directory part of the word, as typed
+    bool dirs_only;
+    bool show_hidden;
+    struct completion_list *out;
+};
+
+/* FUNCTION HEADERS */
+static bool absolute_dir(const char *dir, char *buf, size_t size);
+static struct dir_listing *get_listing(const char *dir);
+static struct dir_listing *load_listing(const char *path, const struct stat *st);
+static bool listing_is_current(const struct dir_listing *listing, const struct stat *st);
+static int compare_offsets(const void *a, const void *b, void *names);
+static int lower_bound(const struct dir_listing *listing, const char *prefix);
+static void evict_listing(int index);
+static void free_listing(struct dir_listing *listing);
+static bool visit_path(const char *dir, const char *name, int type, void *data);
+
+/* CACHE STATE */
+static struct dir_listing *listings[DIR_CACHE_MAX_DIRS];
+static int num_listings = 0;
+static unsigned long use_clock = 0;
+static struct dir_cache_stats stats = { 0 };
+
+static struct provider_entry providers[COMPLETION_MAX_PROVIDERS];
+static int num_providers = 0;
+
+/* FUNCTION FUNCTIONS */
+void completion_add(struct completion_list *list, const char *word) {
+    if (list->count >= list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->items = realloc(list->items, list->capacity * sizeof(char *));
+    }
+    list->items[list->count++] = strdup(word);
+}
+
+void completion_add_joined(struct completion_list *list, const char *prefix, const char *name) {
+    size_t prefix_length = strlen(prefix);
+    size_t name_length = strlen(name);
+    char *word = malloc(prefix_length + name_length + 1);
+    memcpy(word, prefix, prefix_length);
+    memcpy(word + prefix_length, name, name_length + 1);
+    
+    if (list->count >= list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->items = realloc(list->items, list->capacity * sizeof(char *));
+    }
+    list->items[list->count++] = word;
+}
+
+void completion_clear(struct completion_list *list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+    list->items = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+void complete_paths(const char *text, bool dirs_only, struct completion_list *out) {
+    const char *slash = strrchr(text, '/');
+    const char *prefix = slash ? slash + 1 : text;
+    
+    // "dir/" as typed goes back into every match; the lookup needs "dir"
+    char typed_dir[PATH_MAX];
+    size_t typed_length = slash ? (size_t)(slash - text) + 1 : 0;
+    if (typed_length >= sizeof(typed_dir)) {
+        return;
+    }
+    memcpy(typed_dir, text, typed_length);
+    typed_dir[typed_length] = '\0';
+    
+    char lookup[PATH_MAX];
+    if (typed_length == 0) {
+        snprintf(lookup, sizeof(lookup), ".");
+    } else if (strncmp(typed_dir, "~/", 2) == 0 && getenv("HOME")) {
+        snprintf(lookup, sizeof(lookup), "%s/%s", getenv("HOME"), typed_dir + 2);
+    } else {
+        snprintf(lookup, sizeof(lookup), "%s", typed_dir);
+    }
+    
+    struct path_visit visit = {
+        .typed_dir = typed_dir,
+        .dirs_only = dirs_only,
+        .show_hidden = (prefix[0] == '.'),
+        .out = out,
+    };
+    dir_cache_each(lookup, prefix, visit_path, &visit);
+}
+
+bool dir_cache_each(const char *dir, const char *prefix,
+                    bool (*visit)(const char *dir, const char *name, int type, void *data),
+                    void *data) {
+    struct dir_listing *listing = get_listing(dir);
+    if (listing == NULL) {
+        return false;
+    }
+    
+    // Matches for a prefix are one contiguous run of the sorted names
+    size_t prefix_length = strlen(prefix);
+    for (int i = lower_bound(listing, prefix); i < listing->count; i++) {
+        const char *name = listing->names + listing->offsets[i];
+        if (strncmp(name, prefix, prefix_length) != 0) {
+            break;
+        }
+        if (!visit(dir, name, (unsigned char)name[-1], data)) {
+            break;
+        }
+    }
+    return true;
+}
+
+bool dir_entry_is_dir(const char *dir, const char *name, int type) {
+    if (type == DT_DIR) {
+        return true;
+    }
+    if (type != DT_LNK && type != DT_UNKNOWN) {
+        return false;
+    }
+    
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+void completion_register(const char *command, completion_provider provider) {
+    for (int i = 0; i < num_providers; i++) {
+        if (strcmp(providers[i].command, command) == 0) {
+            providers[i].provider = provider;
+            return;
+        }
+    }
+    
+    if (num_providers >= COMPLETION_MAX_PROVIDERS) {
+        fprintf(stderr, "[completion] too many providers, ignoring %s\n", command);
+        return;
+    }
+    providers[num_providers].command = strdup(command);
+    providers[num_providers].provider = provider;
+    num_providers++;
+}
+
+completion_provider completion_find(const char *command) {
+    for (int i = 0; i < num_providers; i++) {
+        if (strcmp(providers[i].command, command) == 0) {
+            return providers[i].provider;
+        }
+    }
+    return NULL;
+}
+
+void dir_cache_clear(void) {
+    while (num_listings > 0) {
+        evict_listing(num_listings - 1);
+    }
+}
+
+void dir_cache_get_stats(struct dir_cache_stats *out) {
+    *out = stats;
+}
+
+// Cache keys are absolute so `cd` can't make a stale entry look current
+static bool absolute_dir(const char *dir, char *buf, size_t size) {
+    if (dir[0] == '/') {
+        return (size_t)snprintf(buf, size, "%s", dir) < size;
+    }
+    
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return false;
+    }
+    if (strcmp(dir, ".") == 0) {
+        return (size_t)snprintf(buf, size, "%s", cwd) < size;
+    }
+    return (size_t)snprintf(buf, size, "%s/%s", cwd, dir) < size;
+}
+
+// One stat per lookup; the directory is only read again when it changed
+static struct dir_listing *get_listing(const char *dir) {
+    char path[PATH_MAX];
+    if (!absolute_dir(dir, path, sizeof(path))) {
+        return NULL;
+    }
+    
+    // Trailing slashes would give one directory several keys
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') {
+        path[--length] = '\0';
+    }
+    
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    
+    for (int i = 0; i < num_listings; i++) {
+        if (strcmp(listings[i]->path, path) == 0) {
+            if (listing_is_current(listings[i], &st)) {
+                listings[i]->last_used = ++use_clock;
+                stats.hits++;
+                return listings[i];
+            }
+            evict_listing(i);
+            break;
+        }
+    }
+    
+    struct dir_listing *listing = load_listing(path, &st);
+    if (listing == NULL) {
+        return NULL;
+    }
+    
+    while (num_listings > 0 && (num_listings >= DIR_CACHE_MAX_DIRS ||
+                                stats.bytes + listing->bytes > DIR_CACHE_MAX_BYTES)) {
+        int oldest = 0;
+        for (int i = 1; i < num_listings; i++) {
+            if (listings[i]->last_used < listings[oldest]->last_used) {
+                oldest = i;
+            }
+        }
+        evict_listing(oldest);
+        stats.evictions++;
+    }
+    
+    listing->last_used = ++use_clock;
+    listings[num_listings++] = listing;
+    stats.dirs++;
+    stats.names += listing->count;
+    stats.bytes += listing->bytes;
+    return listing;
+}
+
+static struct dir_listing *load_listing(const char *path, const struct stat *st) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return NULL;
+    }
+    
+    struct dir_listing *listing = calloc(1, sizeof(struct dir_listing));
+    size_t names_capacity = LISTING_INITIAL_BYTES;
+    int offsets_capacity = LISTING_INITIAL_NAMES;
+    listing->names = malloc(names_capacity);
+    listing->offsets = malloc(offsets_capacity * sizeof(uint32_t));
+    
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        stats.dirents++;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+    
+        size_t name_length = strlen(entry->d_name);
+        while (listing->names_size + name_length + 2 > names_capacity) {
+            names_capacity *= 2;
+            listing->names = realloc(listing->names, names_capacity);
+        }
+        if (listing->count >= offsets_capacity) {
+            offsets_capacity *= 2;
+            listing->offsets = realloc(listing->offsets, offsets_capacity * sizeof(uint32_t));
+        }
+    
+        listing->names[listing->names_size++] = (char)entry->d_type;
+        listing->offsets[listing->count++] = (uint32_t)listing->names_size;
+        memcpy(listing->names + listing->names_size, entry->d_name, name_length + 1);
+        listing->names_size += name_length + 1;
+    }
+    closedir(dir);
+    
+    qsort_r(listing->offsets, listing->count, sizeof(uint32_t), compare_offsets, listing->names);
+    
+    listing->path = strdup(path);
+    listing->dev = st->st_dev;
+    listing->ino = st->st_ino;
+    listing->mtime = st->st_mtim;
+    
+    // A file created later in the same second may leave mtime unchanged on
+    // filesystems with coarse timestamps, so don't trust this read for long
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    listing->racy = (now.tv_sec <= st->st_mtim.tv_sec + 1);
+    
+    listing->bytes = sizeof(struct dir_listing) + strlen(path) + 1 +
+                     names_capacity + offsets_capacity * sizeof(uint32_t);
+    stats.loads++;
+    return listing;
+}
+
+static bool listing_is_current(const struct dir_listing *listing, const struct stat *st) {
+    return !listing->racy &&
+           listing->dev == st->st_dev && listing->ino == st->st_ino &&
+           listing->mtime.tv_sec == st->st_mtim.tv_sec &&
+           listing->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static int compare_offsets(const void *a, const void *b, void *names) {
+    const char *base = names;
+    return strcmp(base + *(const uint32_t *)a, base + *(const uint32_t *)b);
+}
+
+// First index whose name is >= `prefix`
+static int lower_bound(const struct dir_listing *listing, const char *prefix) {
+    int low = 0;
+    int high = listing->count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (strcmp(listing->names + listing->offsets[mid], prefix) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static void evict_listing(int index) {
+    struct dir_listing *listing = listings[index];
+    stats.dirs--;
+    stats.names -= listing->count;
+    stats.bytes -= listing->bytes;
+    
+    listings[index] = listings[--num_listings];
+    free_listing(listing);
+}
+
+static void free_listing(struct dir_listing *listing) {
+    free(listing->path);
+    free(listing->names);
+    free(listing->offsets);
+    free(listing);
+}
+
+static bool visit_path(const char *dir, const char *name, int type, void *data) {
+    struct path_visit *visit = data;
+    if (name[0] == '.' && !visit->show_hidden) {
+        return true;
+    }
+    if (visit->dirs_only && !dir_entry_is_dir(dir, name, type)) {
+        return true;
+    }
+    completion_add_joined(visit->out, visit->typed_dir, name);
+    return true;
+}
@@ -0,0 +1,70 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+/* INCLUDE LIBRARIES */
+#include <stddef.h>
+#include <stdbool.h>
+
+/* DEFINE CONSTANTS */
+#define DIR_CACHE_MAX_DIRS 64
+#define DIR_CACHE_MAX_BYTES (64 * 1024 * 1024)
+#define COMPLETION_MAX_PROVIDERS 32
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// Growable list of candidate words, each one a new string
+struct completion_list {
+    char **items;
+    int count;
+    int capacity;
+};
+
+// Adds candidates for an argument of one command
+typedef void (*completion_provider)(const char *text, struct completion_list *out);
+
+struct dir_cache_stats {
+    unsigned long hits;
+    unsigned long loads;        // Directories read because they were new or changed
+    unsigned long dirents;      // Entries readdir() returned across those reads
+    unsigned long evictions;
+    size_t dirs;
+    size_t names;
+    size_t bytes;
+};
+
+/* FUNCTION HEADERS */
+
+void completion_add(struct completion_list *list, const char *word);
+
+// Appends `prefix` + `name`
+void completion_add_joined(struct completion_list *list, const char *prefix, const char *name);
+
+void completion_clear(struct completion_list *list);
+
+// Completes `text` as a path: "dir/pre" becomes every entry of dir starting
+// with "pre", returned with the "dir/" part as typed. Dotfiles only show up
+// when the prefix starts with '.'
+void complete_paths(const char *text, bool dirs_only, struct completion_list *out);
+
+// Calls `visit` with each name in `dir` starting with `prefix`, in sorted
+// order, until it returns false. `type` is the DT_* value readdir gave.
+// Returns false if the directory can't be read
+bool dir_cache_each(const char *dir, const char *prefix,
+                    bool (*visit)(const char *dir, const char *name, int type, void *data),
+                    void *data);
+
+// True when `name` in `dir` is a directory, stat'ing only when `type` is
+// DT_LNK or DT_UNKNOWN
+bool dir_entry_is_dir(const char *dir, const char *name, int type);
+
+// Uses `provider` for arguments of `command` instead of plain paths
+void completion_register(const char *command, completion_provider provider);
+
+// NULL when `command` has no provider
+completion_provider completion_find(const char *command);
+
+void dir_cache_clear(void);
+
+void dir_cache_get_stats(struct dir_cache_stats *stats);
+
+#endif
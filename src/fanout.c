@@ -0,0 +1,271 @@
+/* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "fanout.h"
+
+/* FUNCTION HEADERS */
+static void *fanout_main(void *arg);
+static ssize_t stage_copies(struct fanout *fanout);
+static void drain_sink(struct fanout *fanout, struct fanout_sink *sink, size_t length);
+static bool forward_output(struct fanout *fanout, size_t length);
+static size_t move_bytes(struct fanout *fanout, int from, int to, size_t length);
+static bool has_outputs(const struct fanout *fanout);
+static bool has_sinks(const struct fanout *fanout);
+static void close_fanout(struct fanout *fanout);
+
+/* FUNCTION FUNCTIONS */
+bool fanout_start(struct fanout *fanout, int in_fd, int out_fd, const int *sink_fds, int num_sinks) {
+    *fanout = (struct fanout) {
+        .in_fd = in_fd,
+        .out_fd = out_fd,
+        .sinks = malloc(num_sinks * sizeof(struct fanout_sink)),
+        .num_sinks = num_sinks,
+        .null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC),
+    };
+    
+    // A staging pipe as big as the input one always has room for
+    // everything a tee from it can return
+    int size = fcntl(in_fd, F_GETPIPE_SZ);
+    bool ok = fanout->null_fd >= 0;
+    for (int i = 0; i < num_sinks; i++) {
+        struct fanout_sink *sink = &fanout->sinks[i];
+        sink->fd = sink_fds[i];
+        if (pipe2(sink->staged, O_CLOEXEC) == -1) {
+            sink->staged[0] = -1;
+            sink->staged[1] = -1;
+            ok = false;
+        } else if (size > 0) {
+            fcntl(sink->staged[1], F_SETPIPE_SZ, size);
+        }
+    }
+    
+    int error = ok ? 0 : errno;
+    if (ok) {
+        // SIGPIPE goes to the thread that wrote; the fanout sees EPIPE instead
+        sigset_t block, saved;
+        sigemptyset(&block);
+        sigaddset(&block, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &block, &saved);
+        error = pthread_create(&fanout->thread, NULL, fanout_main, fanout);
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    }
+    
+    if (error != 0) {
+        fprintf(stderr, "fanout: can't start: %s\n", strerror(error));
+        close_fanout(fanout);
+        return false;
+    }
+    fanout->running = true;
+    return true;
+}
+
+void fanout_join(struct fanout *fanout) {
+    if (fanout->running) {
+        pthread_join(fanout->thread, NULL);
+        fanout->running = false;
+    }
+}
+
+void fanout_after_fork(struct fanout *fanout) {
+    if (!fanout->running) {
+        return;
+    }
+    
+    close(fanout->in_fd);
+    if (fanout->out_fd >= 0) {
+        close(fanout->out_fd);
+    }
+    if (fanout->null_fd >= 0) {
+        close(fanout->null_fd);
+    }
+    for (int i = 0; i < fanout->num_sinks; i++) {
+        struct fanout_sink *sink = &fanout->sinks[i];
+        if (sink->fd >= 0) {
+            close(sink->fd);
+        }
+        if (sink->staged[0] >= 0) {
+            close(sink->staged[0]);
+            close(sink->staged[1]);
+        }
+    }
+}
+
+static void *fanout_main(void *arg) {
+    struct fanout *fanout = arg;
+    
+    while (has_outputs(fanout)) {
+        if (!has_sinks(fanout)) {
+            // Only the output is left: pass the rest straight through
+            if (move_bytes(fanout, fanout->in_fd, fanout->out_fd, FANOUT_CHUNK) == 0) {
+                break;
+            }
+            continue;
+        }
+        
+        ssize_t length = stage_copies(fanout);
+        if (length <= 0) {
+            break;      // The command closed its end (or the pipe broke)
+        }
+        
+        // The pages now sit in every staging pipe, so they can leave the input
+        for (int i = 0; i < fanout->num_sinks; i++) {
+            drain_sink(fanout, &fanout->sinks[i], length);
+        }
+        if (!forward_output(fanout, length)) {
+            break;
+        }
+    }
+    
+    // Nobody wants the rest: the command gets EPIPE on its next write
+    close_fanout(fanout);
+    return NULL;
+}
+
+// tee()s the next chunk of input into every live sink's staging pipe and
+// returns its length; 0 at EOF
+static ssize_t stage_copies(struct fanout *fanout) {
+    ssize_t length = -1;
+    for (int i = 0; i < fanout->num_sinks; i++) {
+        struct fanout_sink *sink = &fanout->sinks[i];
+        if (sink->fd < 0) {
+            continue;
+        }
+        
+        ssize_t copied;
+        do {
+            // The first tee waits for data; the rest copy that much again
+            copied = tee(fanout->in_fd, sink->staged[1], (length < 0) ? FANOUT_CHUNK : (size_t)length, 0);
+        } while (copied < 0 && errno == EINTR);
+        if (copied <= 0) {
+            return copied;
+        }
+        if (length < 0) {
+            length = copied;
+        }
+    }
+    return length;
+}
+
+// Writes out what was staged for `sink`. A sink that fails is dropped so
+// the others keep going
+static void drain_sink(struct fanout *fanout, struct fanout_sink *sink, size_t length) {
+    if (sink->fd < 0) {
+        return;
+    }
+    
+    size_t moved = move_bytes(fanout, sink->staged[0], sink->fd, length);
+    if (moved < length) {
+        if (errno != EPIPE) {
+            fprintf(stderr, "fanout: write error: %s\n", strerror(errno));
+        }
+        close(sink->fd);
+        sink->fd = -1;
+    }
+}
+
+// Moves `length` bytes of input to the output, or drops them if the output
+// failed. False once the reader of the output has gone away: like tee, the
+// fanout then stops, so the command gets SIGPIPE instead of running on
+// for the files alone
+static bool forward_output(struct fanout *fanout, size_t length) {
+    if (fanout->out_fd >= 0) {
+        size_t moved = move_bytes(fanout, fanout->in_fd, fanout->out_fd, length);
+        if (moved == length) {
+            return true;
+        }
+        if (errno == EPIPE) {
+            return false;
+        }
+        close(fanout->out_fd);
+        fanout->out_fd = -1;
+        length -= moved;
+    }
+    move_bytes(fanout, fanout->in_fd, fanout->null_fd, length);
+    return true;
+}
+
+// splice()s `length` bytes from the pipe `from` to `to`, through a buffer
+// if `to` doesn't take splices. Returns how much went before an error;
+// less than `length` only on error (or EOF)
+static size_t move_bytes(struct fanout *fanout, int from, int to, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t moved = splice(from, NULL, to, NULL, length - done, SPLICE_F_MOVE);
+        if (moved > 0) {
+            done += moved;
+            continue;
+        }
+        if (moved == 0) {
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EINVAL) {
+            break;
+        }
+        
+        // The bytes are already in `from`, so the read never waits
+        if (fanout->buffer == NULL) {
+            fanout->buffer = malloc(FANOUT_CHUNK);
+        }
+        size_t want = (length - done < FANOUT_CHUNK) ? length - done : FANOUT_CHUNK;
+        ssize_t got = read(from, fanout->buffer, want);
+        if (got <= 0) {
+            break;
+        }
+        for (ssize_t written = 0; written < got; ) {
+            ssize_t n = write(to, fanout->buffer + written, got - written);
+            if (n < 0 && errno != EINTR) {
+                return done + written;
+            }
+            written += (n > 0) ? n : 0;
+        }
+        done += got;
+    }
+    return done;
+}
+
+static bool has_outputs(const struct fanout *fanout) {
+    return fanout->out_fd >= 0 || has_sinks(fanout);
+}
+
+static bool has_sinks(const struct fanout *fanout) {
+    for (int i = 0; i < fanout->num_sinks; i++) {
+        if (fanout->sinks[i].fd >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void close_fanout(struct fanout *fanout) {
+    close(fanout->in_fd);
+    if (fanout->out_fd >= 0) {
+        close(fanout->out_fd);
+    }
+    if (fanout->null_fd >= 0) {
+        close(fanout->null_fd);
+    }
+    for (int i = 0; i < fanout->num_sinks; i++) {
+        struct fanout_sink *sink = &fanout->sinks[i];
+        if (sink->fd >= 0) {
+            close(sink->fd);
+        }
+        if (sink->staged[0] >= 0) {
+            close(sink->staged[0]);
+            close(sink->staged[1]);
+        }
+    }
+    free(fanout->sinks);
+    free(fanout->buffer);
+    fanout->sinks = NULL;
+    fanout->buffer = NULL;
+}
@@ -0,0 +1,52 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+/* INCLUDE LIBRARIES */
+#include <stdbool.h>
+#include <pthread.h>
+
+/* DEFINE CONSTANTS */
+#define FANOUT_CHUNK (64 * 1024)
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// One `>| FILE` target
+struct fanout_sink {
+    int fd;             // -1 once writing to it failed
+    int staged[2];      // Pipe holding this sink's copy until it is written
+};
+
+// Copies what a command writes into a pipe to every `>|` target as well as
+// to where its output goes anyway. tee(2) duplicates the pipe's pages into
+// one staging pipe per target and splice(2) moves them on, so no byte is
+// copied through user space. Outputs splice can't write to (some terminals)
+// fall back to read/write
+struct fanout {
+    int in_fd;              // Read end of the pipe the command writes to
+    int out_fd;             // The command's own stdout; -1 once it fails
+    struct fanout_sink *sinks;
+    int num_sinks;
+    int null_fd;            // Discards what only the targets still want
+    char *buffer;           // For the read/write fallback
+    pthread_t thread;
+    bool running;
+};
+
+/* FUNCTION HEADERS */
+
+// Starts copying on its own thread. The fanout owns `in_fd`, `out_fd` and
+// the sink descriptors and closes them at EOF; `out_fd` may be -1. On
+// failure everything is closed right away
+bool fanout_start(struct fanout *fanout, int in_fd, int out_fd, const int *sink_fds, int num_sinks);
+
+// Waits until everything written before the pipe was closed has gone out
+void fanout_join(struct fanout *fanout);
+
+// In a child forked while the fanout runs, and that won't exec: closes the
+// child's copies of the fanout's descriptors, so its pipes still see EOF
+// once the parent and the fanout are done with them. The parent mustn't
+// open anything between fanout_start and the fork, or a number the fanout
+// already closed could name something else by then
+void fanout_after_fork(struct fanout *fanout);
+
+#endif
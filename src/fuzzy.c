@@ -0,0 +1,334 @@
+/* INCLUDE LIBRARIES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+
+#include "fuzzy.h"
+
+/* DEFINE CONSTANTS */
+#define FUZZY_INITIAL_BUCKETS 1024
+#define FUZZY_CHECK_INTERVAL 256    // Candidates between clock reads
+#define FUZZY_NO_ENTRY UINT32_MAX
+
+// Scoring, loosely after fzf: every matched character earns points, more
+// at word starts and right after the previous match; gaps and extra length
+// cost a little. Usage adds FUZZY_FREQUENCY_WEIGHT per doubling
+#define FUZZY_MATCH 16
+#define FUZZY_BOUNDARY 8
+#define FUZZY_CONSECUTIVE 8
+#define FUZZY_PREFIX 16
+#define FUZZY_MAX_GAP_PENALTY 6
+#define FUZZY_LENGTH_DIVISOR 8
+#define FUZZY_FREQUENCY_WEIGHT 6
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// A recorded line or command word. Entries are never removed, so their
+// index in `entries` is the order they were first seen in
+struct fuzzy_entry {
+    char *text;
+    uint32_t length;
+    uint32_t line_count;    // Times recorded as a whole line
+    uint32_t command_count; // Times it was the command word of a line
+    uint32_t next;          // Hash chain, as an index into `entries`
+    uint64_t hash;
+    uint64_t mask;
+};
+
+/* FUNCTION HEADERS */
+static uint64_t hash_text(const char *text, size_t length);
+static uint64_t char_mask(const char *text, size_t length);
+static struct fuzzy_entry *get_entry(const char *text, size_t length);
+static void grow_buckets(void);
+static bool out_of_time(struct fuzzy_search *search);
+static int score_candidate(const struct fuzzy_search *search, const char *text, size_t length);
+static int frequency_bonus(unsigned count);
+static void keep_result(struct fuzzy_search *search, const char *text, int score);
+static void remove_result(struct fuzzy_search *search, int index);
+
+/* TABLE STATE */
+static struct fuzzy_entry *entries = NULL;
+static uint32_t num_entries = 0;
+static uint32_t entries_capacity = 0;
+static uint32_t *buckets = NULL;
+static uint32_t num_buckets = 0;
+static struct fuzzy_stats stats = { 0 };
+
+/* FUNCTION FUNCTIONS */
+void fuzzy_record(const char *line) {
+    size_t length = strlen(line);
+    if (length == 0 || length > FUZZY_MAX_LINE) {
+        return;
+    }
+    get_entry(line, length)->line_count++;
+    
+    const char *word = line;
+    while (*word == ' ' || *word == '\t') {
+        word++;
+    }
+    size_t word_length = strcspn(word, " \t;|&<>()");
+    if (word_length > 0) {
+        get_entry(word, word_length)->command_count++;
+    }
+}
+
+unsigned fuzzy_command_count(const char *command) {
+    if (num_buckets == 0) {
+        return 0;
+    }
+    
+    size_t length = strlen(command);
+    uint64_t hash = hash_text(command, length);
+    for (uint32_t i = buckets[hash & (num_buckets - 1)]; i != FUZZY_NO_ENTRY; i = entries[i].next) {
+        if (entries[i].hash == hash && entries[i].length == length &&
+            memcmp(entries[i].text, command, length) == 0) {
+            return entries[i].command_count;
+        }
+    }
+    return 0;
+}
+
+void fuzzy_begin(struct fuzzy_search *search, const char *query, int budget_ms) {
+    memset(search, 0, sizeof(*search));
+    search->query = query;
+    search->query_length = strlen(query);
+    search->query_mask = char_mask(query, search->query_length);
+    
+    clock_gettime(CLOCK_MONOTONIC, &search->deadline);
+    search->deadline.tv_sec += budget_ms / 1000;
+    search->deadline.tv_nsec += (long)(budget_ms % 1000) * 1000000L;
+    if (search->deadline.tv_nsec >= 1000000000L) {
+        search->deadline.tv_sec++;
+        search->deadline.tv_nsec -= 1000000000L;
+    }
+    stats.searches++;
+}
+
+bool fuzzy_offer(struct fuzzy_search *search, const char *candidate, unsigned count) {
+    if (out_of_time(search)) {
+        return false;
+    }
+    
+    int score = score_candidate(search, candidate, strlen(candidate));
+    if (score >= 0) {
+        keep_result(search, candidate, score + frequency_bonus(count));
+    }
+    return true;
+}
+
+void fuzzy_offer_history(struct fuzzy_search *search) {
+    // Newest first, so a search cut short still covers recent commands
+    for (uint32_t i = num_entries; i-- > 0;) {
+        if (out_of_time(search)) {
+            return;
+        }
+    
+        const struct fuzzy_entry *entry = &entries[i];
+        // Cheap reject: some query character appears nowhere in the entry
+        if (entry->line_count == 0 || (search->query_mask & ~entry->mask) != 0) {
+            continue;
+        }
+    
+        int score = score_candidate(search, entry->text, entry->length);
+        if (score >= 0) {
+            keep_result(search, entry->text, score + frequency_bonus(entry->line_count));
+        }
+    }
+}
+
+void fuzzy_end(struct fuzzy_search *search) {
+    if (search->timed_out) {
+        stats.timeouts++;
+    }
+    for (int i = 0; i < search->num_results; i++) {
+        free(search->results[i].text);
+    }
+    search->num_results = 0;
+}
+
+void fuzzy_get_stats(struct fuzzy_stats *out) {
+    *out = stats;
+}
+
+static uint64_t hash_text(const char *text, size_t length) {
+    // FNV-1a, 64-bit
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// One bit per letter and digit (case folded), the rest share the others
+static uint64_t char_mask(const char *text, size_t length) {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)tolower((unsigned char)text[i]);
+        if (c >= 'a' && c <= 'z') {
+            mask |= 1ULL << (c - 'a');
+        } else if (c >= '0' && c <= '9') {
+            mask |= 1ULL << (26 + c - '0');
+        } else {
+            mask |= 1ULL << (36 + c % 28);
+        }
+    }
+    return mask;
+}
+
+static struct fuzzy_entry *get_entry(const char *text, size_t length) {
+    uint64_t hash = hash_text(text, length);
+    if (num_buckets > 0) {
+        for (uint32_t i = buckets[hash & (num_buckets - 1)]; i != FUZZY_NO_ENTRY; i = entries[i].next) {
+            if (entries[i].hash == hash && entries[i].length == length &&
+                memcmp(entries[i].text, text, length) == 0) {
+                return &entries[i];
+            }
+        }
+    }
+    
+    if (num_entries >= entries_capacity) {
+        entries_capacity = entries_capacity ? entries_capacity * 2 : FUZZY_INITIAL_BUCKETS;
+        entries = realloc(entries, entries_capacity * sizeof(struct fuzzy_entry));
+    }
+    if (num_entries >= num_buckets) {
+        grow_buckets();
+    }
+    
+    struct fuzzy_entry *entry = &entries[num_entries];
+    entry->text = strndup(text, length);
+    entry->length = (uint32_t)length;
+    entry->line_count = 0;
+    entry->command_count = 0;
+    entry->hash = hash;
+    entry->mask = char_mask(text, length);
+    
+    uint32_t bucket = hash & (num_buckets - 1);
+    entry->next = buckets[bucket];
+    buckets[bucket] = num_entries++;
+    
+    stats.entries++;
+    stats.bytes += sizeof(struct fuzzy_entry) + sizeof(uint32_t) + length + 1;
+    return entry;
+}
+
+// Keeps the load factor at or below one
+static void grow_buckets(void) {
+    uint32_t new_buckets = num_buckets ? num_buckets * 2 : FUZZY_INITIAL_BUCKETS;
+    free(buckets);
+    buckets = malloc(new_buckets * sizeof(uint32_t));
+    memset(buckets, 0xff, new_buckets * sizeof(uint32_t));
+    num_buckets = new_buckets;
+    
+    for (uint32_t i = 0; i < num_entries; i++) {
+        uint32_t bucket = entries[i].hash & (num_buckets - 1);
+        entries[i].next = buckets[bucket];
+        buckets[bucket] = i;
+    }
+}
+
+static bool out_of_time(struct fuzzy_search *search) {
+    if (search->timed_out) {
+        return true;
+    }
+    if (++search->offered % FUZZY_CHECK_INTERVAL != 0) {
+        return false;
+    }
+    
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > search->deadline.tv_sec ||
+        (now.tv_sec == search->deadline.tv_sec && now.tv_nsec >= search->deadline.tv_nsec)) {
+        search->timed_out = true;
+    }
+    return search->timed_out;
+}
+
+// -1 unless the query is a (case-insensitive) subsequence of `text`
+static int score_candidate(const struct fuzzy_search *search, const char *text, size_t length) {
+    if (search->query_length == 0 || search->query_length > length) {
+        return -1;
+    }
+    
+    int score = 0;
+    size_t previous = 0;
+    size_t pos = 0;
+    for (size_t q = 0; q < search->query_length; q++) {
+        int wanted = tolower((unsigned char)search->query[q]);
+        while (pos < length && tolower((unsigned char)text[pos]) != wanted) {
+            pos++;
+        }
+        if (pos == length) {
+            return -1;
+        }
+    
+        score += FUZZY_MATCH;
+        if (pos == 0 || strchr(" /-_.", text[pos - 1])) {
+            score += FUZZY_BOUNDARY;
+        }
+        if (q > 0) {
+            size_t gap = pos - previous - 1;
+            if (gap == 0) {
+                score += FUZZY_CONSECUTIVE;
+            } else {
+                score -= (gap < FUZZY_MAX_GAP_PENALTY) ? (int)gap : FUZZY_MAX_GAP_PENALTY;
+            }
+        }
+        previous = pos++;
+    }
+    
+    if (strncasecmp(text, search->query, search->query_length) == 0) {
+        score += FUZZY_PREFIX;
+    }
+    score -= (int)((length - search->query_length) / FUZZY_LENGTH_DIVISOR);
+    return (score > 0) ? score : 0;
+}
+
+static int frequency_bonus(unsigned count) {
+    int bonus = 0;
+    while (count) {
+        bonus += FUZZY_FREQUENCY_WEIGHT;
+        count >>= 1;
+    }
+    return bonus;
+}
+
+// Inserts into the sorted result list; one copy of each text
+static void keep_result(struct fuzzy_search *search, const char *text, int score) {
+    if (search->num_results == FUZZY_MAX_RESULTS &&
+        score <= search->results[FUZZY_MAX_RESULTS - 1].score) {
+        return;
+    }
+    
+    for (int i = 0; i < search->num_results; i++) {
+        if (strcmp(search->results[i].text, text) == 0) {
+            if (search->results[i].score >= score) {
+                return;
+            }
+            remove_result(search, i);
+            break;
+        }
+    }
+    
+    if (search->num_results == FUZZY_MAX_RESULTS) {
+        remove_result(search, FUZZY_MAX_RESULTS - 1);
+    }
+    
+    int pos = search->num_results;
+    while (pos > 0 && search->results[pos - 1].score < score) {
+        search->results[pos] = search->results[pos - 1];
+        pos--;
+    }
+    search->results[pos].text = strdup(text);
+    search->results[pos].score = score;
+    search->num_results++;
+}
+
+static void remove_result(struct fuzzy_search *search, int index) {
+    free(search->results[index].text);
+    memmove(&search->results[index], &search->results[index + 1],
+            (search->num_results - index - 1) * sizeof(struct fuzzy_result));
+    search->num_results--;
+}
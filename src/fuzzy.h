@@ -0,0 +1,63 @@
+#ifndef FUZZY_H
+#define FUZZY_H
+
+/* INCLUDE LIBRARIES */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* DEFINE CONSTANTS */
+#define FUZZY_MAX_RESULTS 64
+#define FUZZY_BUDGET_MS 20
+#define FUZZY_MAX_LINE 1024     // Longer history lines are not indexed
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+struct fuzzy_result {
+    char *text;
+    int score;
+};
+
+// One query in progress. Candidates are offered one at a time; the best
+// FUZZY_MAX_RESULTS are kept, best first
+struct fuzzy_search {
+    const char *query;
+    size_t query_length;
+    uint64_t query_mask;
+    struct timespec deadline;   // CLOCK_MONOTONIC
+    unsigned long offered;
+    bool timed_out;
+    struct fuzzy_result results[FUZZY_MAX_RESULTS];
+    int num_results;
+};
+
+struct fuzzy_stats {
+    size_t entries;
+    size_t bytes;
+    unsigned long searches;
+    unsigned long timeouts;     // Searches cut short by the latency budget
+};
+
+/* FUNCTION HEADERS */
+
+// Counts one run of `line` and of its command word
+void fuzzy_record(const char *line);
+
+// How often `command` started a recorded line
+unsigned fuzzy_command_count(const char *command);
+
+void fuzzy_begin(struct fuzzy_search *search, const char *query, int budget_ms);
+
+// Scores `candidate` (used `count` times) against the query. False once the
+// budget is spent; the caller should stop offering candidates then
+bool fuzzy_offer(struct fuzzy_search *search, const char *candidate, unsigned count);
+
+// Offers every recorded line, most recently first seen first, until done or
+// out of time
+void fuzzy_offer_history(struct fuzzy_search *search);
+
+void fuzzy_end(struct fuzzy_search *search);
+
+void fuzzy_get_stats(struct fuzzy_stats *stats);
+
+#endif
@@ -0,0 +1,332 @@
+/* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "history_file.h"
+
+/* DEFINE CONSTANTS */
+#define HISTFILE_READ_CHUNK 65536
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// Start of the .idx file. After it come `count` native-endian uint64_t
+// offsets, one per non-empty line of the history file. The index is only a
+// cache: anything that doesn't match the history file gets it rebuilt
+struct index_header {
+    char magic[8];
+    uint64_t inode;         // History file the offsets describe
+    uint64_t covered;       // Bytes of it indexed so far (whole lines only)
+    uint64_t count;
+};
+
+/* FUNCTION HEADERS */
+static bool lock_file(int operation);
+static void sync_index(void);
+static bool index_is_valid(const struct stat *st);
+static void reset_index(const struct stat *st);
+static void index_tail(uint64_t size);
+static uint64_t entry_offset(uint64_t n);
+static void read_entries(uint64_t from, uint64_t to, uint64_t first_entry, histfile_visitor add);
+static bool is_own_entry(uint64_t n);
+
+/* HISTORY FILE STATE */
+static int hist_fd = -1;
+static int index_fd = -1;       // -1 when the .idx can't be created
+static struct index_header header;
+
+// Entries [0, seen_count) are in this session's history already; they end
+// at byte `seen_covered`
+static uint64_t seen_count = 0;
+static uint64_t seen_covered = 0;
+
+// Entries this session appended after some it hasn't seen yet
+static uint64_t *own_entries = NULL;
+static int num_own_entries = 0;
+static int own_entries_capacity = 0;
+
+/* FUNCTION FUNCTIONS */
+bool histfile_open(const char *path) {
+    hist_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (hist_fd < 0) {
+        fprintf(stderr, "history: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    
+    char index_path[4096];
+    snprintf(index_path, sizeof(index_path), "%s%s", path, HISTFILE_INDEX_SUFFIX);
+    index_fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    
+    memset(&header, 0, sizeof(header));
+    if (lock_file(LOCK_EX)) {
+        sync_index();
+        lock_file(LOCK_UN);
+    }
+    return true;
+}
+
+void histfile_load(histfile_visitor add) {
+    if (hist_fd < 0) {
+        return;
+    }
+    
+    // Bytes below `covered` never change, so they can be read unlocked
+    if (lock_file(LOCK_EX)) {
+        sync_index();
+        lock_file(LOCK_UN);
+    }
+    read_entries(0, header.covered, 0, add);
+    seen_count = header.count;
+    seen_covered = header.covered;
+}
+
+void histfile_append(const char *line) {
+    if (hist_fd < 0 || line[0] == '\0' || strchr(line, '\n')) {
+        return;
+    }
+    if (!lock_file(LOCK_EX)) {
+        return;
+    }
+    
+    // One write, so the line lands whole even if another shell ignores the lock
+    size_t length = strlen(line);
+    char *record = malloc(length + 1);
+    memcpy(record, line, length);
+    record[length] = '\n';
+    ssize_t written = write(hist_fd, record, length + 1);
+    free(record);
+    
+    if (written == (ssize_t)(length + 1)) {
+        // Index it like any other appended line; ours is now the last one
+        sync_index();
+        uint64_t entry = header.count - 1;
+    
+        if (entry == seen_count) {
+            // Nothing foreign in between: this session has seen up to here
+            seen_count = header.count;
+            seen_covered = header.covered;
+        } else {
+            if (num_own_entries >= own_entries_capacity) {
+                own_entries_capacity = own_entries_capacity ? own_entries_capacity * 2 : 16;
+                own_entries = realloc(own_entries, own_entries_capacity * sizeof(uint64_t));
+            }
+            own_entries[num_own_entries++] = entry;
+        }
+    }
+    
+    lock_file(LOCK_UN);
+}
+
+int histfile_read_new(histfile_visitor add) {
+    if (hist_fd < 0 || !lock_file(LOCK_EX)) {
+        return 0;
+    }
+    sync_index();
+    uint64_t count = header.count;
+    uint64_t covered = header.covered;
+    uint64_t from = (index_fd >= 0 && seen_count < count) ? entry_offset(seen_count) : seen_covered;
+    lock_file(LOCK_UN);
+    
+    if (seen_count >= count) {
+        return 0;
+    }
+    
+    uint64_t before = seen_count;
+    read_entries(from, covered, seen_count, add);
+    int added = (int)(count - before) - num_own_entries;
+    
+    seen_count = count;
+    seen_covered = covered;
+    num_own_entries = 0;
+    return added;
+}
+
+void histfile_close(void) {
+    if (index_fd >= 0) {
+        close(index_fd);
+        index_fd = -1;
+    }
+    if (hist_fd >= 0) {
+        close(hist_fd);
+        hist_fd = -1;
+    }
+    free(own_entries);
+    own_entries = NULL;
+    num_own_entries = 0;
+    own_entries_capacity = 0;
+}
+
+static bool lock_file(int operation) {
+    while (flock(hist_fd, operation) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Brings `header` (and the .idx) up to date with the history file. Lines
+// other programs appended are indexed from where the last sync stopped.
+// Caller holds the exclusive lock
+static void sync_index(void) {
+    struct stat st;
+    if (fstat(hist_fd, &st) < 0) {
+        return;
+    }
+    
+    if (index_fd >= 0) {
+        if (pread(index_fd, &header, sizeof(header), 0) != sizeof(header) || !index_is_valid(&st)) {
+            reset_index(&st);
+        }
+    } else if (header.inode != (uint64_t)st.st_ino || header.covered > (uint64_t)st.st_size) {
+        reset_index(&st);
+    }
+    
+    if (header.covered < (uint64_t)st.st_size) {
+        index_tail((uint64_t)st.st_size);
+    }
+}
+
+// The file can have been replaced, truncated or rewritten since
+static bool index_is_valid(const struct stat *st) {
+    if (memcmp(header.magic, HISTFILE_INDEX_MAGIC, sizeof(HISTFILE_INDEX_MAGIC)) != 0 ||
+        header.inode != (uint64_t)st->st_ino || header.covered > (uint64_t)st->st_size) {
+        return false;
+    }
+    
+    struct stat index_st;
+    if (fstat(index_fd, &index_st) < 0 ||
+        (uint64_t)index_st.st_size < sizeof(header) + header.count * sizeof(uint64_t)) {
+        return false;
+    }
+    
+    char last = '\n';
+    if (header.covered > 0 && pread(hist_fd, &last, 1, header.covered - 1) != 1) {
+        return false;
+    }
+    return last == '\n';
+}
+
+static void reset_index(const struct stat *st) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HISTFILE_INDEX_MAGIC, sizeof(HISTFILE_INDEX_MAGIC));
+    header.inode = (uint64_t)st->st_ino;
+    
+    if (index_fd >= 0) {
+        ftruncate(index_fd, 0);
+        pwrite(index_fd, &header, sizeof(header), 0);
+    }
+}
+
+// Indexes whole lines from `covered` up to `size`; a partial last line is
+// left for the next sync
+static void index_tail(uint64_t size) {
+    char *buf = malloc(HISTFILE_READ_CHUNK);
+    uint64_t *offsets = NULL;
+    size_t num_offsets = 0;
+    size_t offsets_capacity = 0;
+    
+    uint64_t pos = header.covered;
+    uint64_t line_start = header.covered;
+    while (pos < size) {
+        size_t want = (size - pos < HISTFILE_READ_CHUNK) ? (size_t)(size - pos) : HISTFILE_READ_CHUNK;
+        ssize_t got = pread(hist_fd, buf, want, pos);
+        if (got <= 0) {
+            break;
+        }
+    
+        for (ssize_t i = 0; i < got; i++) {
+            if (buf[i] != '\n') {
+                continue;
+            }
+            // Empty lines aren't entries
+            if (pos + i > line_start) {
+                if (num_offsets >= offsets_capacity) {
+                    offsets_capacity = offsets_capacity ? offsets_capacity * 2 : 1024;
+                    offsets = realloc(offsets, offsets_capacity * sizeof(uint64_t));
+                }
+                offsets[num_offsets++] = line_start;
+            }
+            line_start = pos + i + 1;
+        }
+        pos += got;
+    }
+    
+    if (index_fd >= 0 && num_offsets > 0) {
+        pwrite(index_fd, offsets, num_offsets * sizeof(uint64_t),
+               sizeof(header) + header.count * sizeof(uint64_t));
+    }
+    header.count += num_offsets;
+    header.covered = line_start;
+    if (index_fd >= 0) {
+        pwrite(index_fd, &header, sizeof(header), 0);
+    }
+    
+    free(offsets);
+    free(buf);
+}
+
+static uint64_t entry_offset(uint64_t n) {
+    uint64_t offset;
+    if (pread(index_fd, &offset, sizeof(offset), sizeof(header) + n * sizeof(uint64_t)) != sizeof(offset)) {
+        return seen_covered;
+    }
+    return offset;
+}
+
+// Passes the non-empty lines in [from, to) to `add`; `first_entry` is the
+// number of the first one
+static void read_entries(uint64_t from, uint64_t to, uint64_t first_entry, histfile_visitor add) {
+    char *buf = malloc(HISTFILE_READ_CHUNK);
+    char *line = NULL;
+    size_t line_length = 0;
+    size_t line_capacity = 0;
+    uint64_t entry = first_entry;
+    
+    uint64_t pos = from;
+    while (pos < to) {
+        size_t want = (to - pos < HISTFILE_READ_CHUNK) ? (size_t)(to - pos) : HISTFILE_READ_CHUNK;
+        ssize_t got = pread(hist_fd, buf, want, pos);
+        if (got <= 0) {
+            break;
+        }
+    
+        for (ssize_t i = 0; i < got; i++) {
+            if (buf[i] != '\n') {
+                if (line_length + 1 >= line_capacity) {
+                    line_capacity = line_capacity ? line_capacity * 2 : 256;
+                    line = realloc(line, line_capacity);
+                }
+                line[line_length++] = buf[i];
+                continue;
+            }
+            if (line_length > 0) {
+                line[line_length] = '\0';
+                if (!is_own_entry(entry)) {
+                    add(line);
+                }
+                entry++;
+                line_length = 0;
+            }
+        }
+        pos += got;
+    }
+    
+    free(line);
+    free(buf);
+}
+
+static bool is_own_entry(uint64_t n) {
+    for (int i = 0; i < num_own_entries; i++) {
+        if (own_entries[i] == n) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,36 @@
+#ifndef HISTORY_FILE_H
+#define HISTORY_FILE_H
+
+/* INCLUDE LIBRARIES */
+#include <stdint.h>
+#include <stdbool.h>
+
+/* DEFINE CONSTANTS */
+#define HISTFILE_INDEX_SUFFIX ".idx"
+#define HISTFILE_INDEX_MAGIC "SHHIDX1"
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+typedef void (*histfile_visitor)(const char *line);
+
+/* FUNCTION HEADERS */
+
+// Opens (or creates) the shared history file and its offset index, bringing
+// the index up to date. False if the history file can't be opened
+bool histfile_open(const char *path);
+
+// Passes every entry to `add`, oldest first, and marks them as seen
+void histfile_load(histfile_visitor add);
+
+// Appends one entry under an exclusive lock, so concurrent sessions
+// interleave whole lines instead of overwriting each other
+void histfile_append(const char *line);
+
+// Passes entries other sessions appended since the last load or call to
+// `add`; own appends are skipped. The index gives the offset of the first
+// unseen entry directly, so only the new tail of the file is read. Returns
+// how many were passed
+int histfile_read_new(histfile_visitor add);
+
+void histfile_close(void);
+
+#endif
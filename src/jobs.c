@@ -0,0 +1,439 @@
+/* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include "jobs.h"
+
+/* DEFINE CONSTANTS */
+#define EVLOOP_INITIAL_SLOTS 64
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// Handler registered for one fd; the slot index is the fd
+struct evloop_slot {
+    event_handler handler;
+    void *data;
+};
+
+/* FUNCTION HEADERS */
+static void free_job_table(void);
+static int open_pidfd(pid_t pid);
+static void on_child_exit(int fd, void *data);
+static bool reap_process(struct job *job, struct job_process *proc, int flags);
+static void poll_job(struct job *job);
+static void unlink_job(struct job *job);
+static char job_marker(const struct job *job);
+static void print_job(FILE *output, const struct job *job);
+
+/* EVENT LOOP STATE */
+static int epoll_fd = -1;
+static struct evloop_slot *slots = NULL;
+static int num_slots = 0;
+
+// Cleared the first time pidfd_open says ENOSYS
+static bool pidfds_available = true;
+
+// Background jobs in the order they were started
+static struct job *job_table = NULL;
+static job_handler background_finished = NULL;
+
+/* FUNCTION FUNCTIONS */
+void jobs_init(void) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        fprintf(stderr, "[jobs] epoll_create1 failed: %s\n", strerror(errno));
+    }
+}
+
+void jobs_after_fork(void) {
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    free(slots);
+    slots = NULL;
+    num_slots = 0;
+    free_job_table();
+    
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+bool evloop_add(int fd, event_handler handler, void *data) {
+    if (epoll_fd < 0 || fd < 0) {
+        return false;
+    }
+    
+    if (fd >= num_slots) {
+        int new_slots = num_slots ? num_slots : EVLOOP_INITIAL_SLOTS;
+        while (new_slots <= fd) {
+            new_slots *= 2;
+        }
+        slots = realloc(slots, new_slots * sizeof(struct evloop_slot));
+        memset(slots + num_slots, 0, (new_slots - num_slots) * sizeof(struct evloop_slot));
+        num_slots = new_slots;
+    }
+    
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.fd = fd,
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        return false;
+    }
+    
+    slots[fd].handler = handler;
+    slots[fd].data = data;
+    return true;
+}
+
+void evloop_remove(int fd) {
+    if (epoll_fd < 0 || fd < 0 || fd >= num_slots || slots[fd].handler == NULL) {
+        return;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    slots[fd].handler = NULL;
+    slots[fd].data = NULL;
+}
+
+int evloop_run_once(int timeout_ms) {
+    if (epoll_fd < 0) {
+        return -1;
+    }
+    
+    struct epoll_event events[EVLOOP_MAX_EVENTS];
+    int ready = epoll_wait(epoll_fd, events, EVLOOP_MAX_EVENTS, timeout_ms);
+    if (ready < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+    
+    int handled = 0;
+    for (int i = 0; i < ready; i++) {
+        // A handler earlier in this batch may have removed this fd
+        int fd = events[i].data.fd;
+        if (fd < num_slots && slots[fd].handler) {
+            slots[fd].handler(fd, slots[fd].data);
+            handled++;
+        }
+    }
+    return handled;
+}
+
+struct job *job_create(const pid_t *pids, int count, const char *text, const struct timespec *started) {
+    struct job *job = calloc(1, sizeof(struct job));
+    job->text = text ? strdup(text) : NULL;
+    job->procs = calloc(count, sizeof(struct job_process));
+    job->num_procs = count;
+    job->remaining = count;
+    if (started) {
+        job->started = *started;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &job->started);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        job->procs[i].pid = pids[i];
+        job->procs[i].pidfd = open_pidfd(pids[i]);
+        if (job->procs[i].pidfd >= 0 && !evloop_add(job->procs[i].pidfd, on_child_exit, job)) {
+            close(job->procs[i].pidfd);
+            job->procs[i].pidfd = -1;
+        }
+    }
+    return job;
+}
+
+int job_wait(struct job *job) {
+    while (job->remaining > 0) {
+        // Processes without a pidfd can only be waited for directly
+        bool waited = false;
+        for (int i = 0; i < job->num_procs; i++) {
+            if (!job->procs[i].done && job->procs[i].pidfd < 0) {
+                reap_process(job, &job->procs[i], 0);
+                waited = true;
+            }
+        }
+    
+        if (job->remaining > 0 && !waited) {
+            evloop_run_once(-1);
+        }
+    }
+    
+    return job->procs[job->num_procs - 1].status;
+}
+
+int job_wait_any(struct job *const *jobs, int count) {
+    while (true) {
+        for (int i = 0; i < count; i++) {
+            if (jobs[i]->remaining == 0) {
+                return i;
+            }
+        }
+        
+        // Processes without a pidfd never show up in the event loop
+        for (int i = 0; i < count; i++) {
+            for (int j = 0; j < jobs[i]->num_procs; j++) {
+                if (!jobs[i]->procs[j].done && jobs[i]->procs[j].pidfd < 0) {
+                    job_wait(jobs[i]);
+                    return i;
+                }
+            }
+        }
+        evloop_run_once(-1);
+    }
+}
+
+void job_signal(struct job *job, int sig) {
+    for (int i = 0; i < job->num_procs; i++) {
+        struct job_process *proc = &job->procs[i];
+        if (proc->done) {
+            continue;
+        }
+#ifdef SYS_pidfd_send_signal
+        if (proc->pidfd >= 0 && syscall(SYS_pidfd_send_signal, proc->pidfd, sig, NULL, 0) == 0) {
+            continue;
+        }
+#endif
+        kill(proc->pid, sig);   // Still unreaped, so the pid is still this process
+    }
+}
+
+void job_free(struct job *job) {
+    for (int i = 0; i < job->num_procs; i++) {
+        if (job->procs[i].pidfd >= 0) {
+            evloop_remove(job->procs[i].pidfd);
+            close(job->procs[i].pidfd);
+        }
+    }
+    free(job->procs);
+    free(job->text);
+    free(job);
+}
+
+void jobs_on_background_finished(job_handler handler) {
+    background_finished = handler;
+}
+
+void job_background(struct job *job) {
+    struct job **link = &job_table;
+    int id = 1;
+    while (*link) {
+        id = (*link)->id + 1;
+        link = &(*link)->next;
+    }
+    
+    job->id = id;
+    job->background = true;
+    job->next = NULL;
+    *link = job;
+    
+    fprintf(stderr, "[%d] %d\n", job->id, (int)job->procs[job->num_procs - 1].pid);
+}
+
+struct job *job_find(const char *spec) {
+    if (spec[0] == '%') {
+        struct job *last = NULL;
+        for (struct job *job = job_table; job; job = job->next) {
+            last = job;
+        }
+        if (strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 || spec[1] == '\0') {
+            return last;
+        }
+    
+        int id = atoi(spec + 1);
+        for (struct job *job = job_table; job; job = job->next) {
+            if (job->id == id) {
+                return job;
+            }
+        }
+        return NULL;
+    }
+    
+    pid_t pid = (pid_t)atoi(spec);
+    for (struct job *job = job_table; job; job = job->next) {
+        for (int i = 0; i < job->num_procs; i++) {
+            if (job->procs[i].pid == pid) {
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+int job_wait_background(struct job *job) {
+    int status = job_wait(job);
+    unlink_job(job);
+    job_free(job);
+    return status;
+}
+
+void jobs_notify(FILE *output) {
+    struct job *job = job_table;
+    while (job) {
+        struct job *next = job->next;
+        poll_job(job);
+        if (job->remaining == 0) {
+            print_job(output, job);
+            unlink_job(job);
+            job_free(job);
+        }
+        job = next;
+    }
+}
+
+void jobs_print(FILE *output) {
+    struct job *job = job_table;
+    while (job) {
+        struct job *next = job->next;
+        poll_job(job);
+        print_job(output, job);
+    
+        // Finished jobs are reported once, here or by jobs_notify
+        if (job->remaining == 0) {
+            unlink_job(job);
+            job_free(job);
+        }
+        job = next;
+    }
+}
+
+int jobs_count(void) {
+    int count = 0;
+    for (struct job *job = job_table; job; job = job->next) {
+        count++;
+    }
+    return count;
+}
+
+int job_status_value(int wait_status) {
+    if (WIFSIGNALED(wait_status)) {
+        return STATUS_SIGNAL_BASE + WTERMSIG(wait_status);
+    }
+    return WEXITSTATUS(wait_status);
+}
+
+static void free_job_table(void) {
+    while (job_table) {
+        struct job *next = job_table->next;
+        job_free(job_table);
+        job_table = next;
+    }
+}
+
+static int open_pidfd(pid_t pid) {
+    if (!pidfds_available || epoll_fd < 0) {
+        return -1;
+    }
+    
+#ifdef SYS_pidfd_open
+    int fd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (fd < 0) {
+        if (errno == ENOSYS) {
+            pidfds_available = false;
+        }
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+#else
+    (void) pid;
+    pidfds_available = false;
+    return -1;
+#endif
+}
+
+// A pidfd turns readable once its process has exited
+static void on_child_exit(int fd, void *data) {
+    struct job *job = data;
+    for (int i = 0; i < job->num_procs; i++) {
+        if (job->procs[i].pidfd == fd) {
+            reap_process(job, &job->procs[i], WNOHANG);
+            return;
+        }
+    }
+}
+
+// wait4 rather than waitpid so the resource usage comes back with the status
+static bool reap_process(struct job *job, struct job_process *proc, int flags) {
+    int wait_status;
+    pid_t result;
+    do {
+        result = wait4(proc->pid, &wait_status, flags, &proc->usage);
+    } while (result < 0 && errno == EINTR);
+    
+    if (result == 0) {
+        return false;
+    }
+    
+    // ECHILD: already reaped elsewhere, nothing more to learn
+    proc->status = (result < 0) ? 1 : job_status_value(wait_status);
+    proc->done = true;
+    job->remaining--;
+    if (job->remaining == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &job->finished);
+        if (job->background && background_finished) {
+            background_finished(job);
+        }
+    }
+    
+    if (proc->pidfd >= 0) {
+        evloop_remove(proc->pidfd);
+        close(proc->pidfd);
+        proc->pidfd = -1;
+    }
+    return true;
+}
+
+// Reaps whatever in `job` has exited, without blocking
+static void poll_job(struct job *job) {
+    for (int i = 0; i < job->num_procs && job->remaining > 0; i++) {
+        if (!job->procs[i].done) {
+            reap_process(job, &job->procs[i], WNOHANG);
+        }
+    }
+}
+
+static void unlink_job(struct job *job) {
+    struct job **link = &job_table;
+    while (*link && *link != job) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = job->next;
+    }
+}
+
+// '+' for the most recent job, '-' for the one before it
+static char job_marker(const struct job *job) {
+    const struct job *last = NULL;
+    const struct job *previous = NULL;
+    for (const struct job *j = job_table; j; j = j->next) {
+        previous = last;
+        last = j;
+    }
+    if (job == last) {
+        return '+';
+    }
+    return (job == previous) ? '-' : ' ';
+}
+
+static void print_job(FILE *output, const struct job *job) {
+    char state[32];
+    int status = job->procs[job->num_procs - 1].status;
+    if (job->remaining > 0) {
+        snprintf(state, sizeof(state), "Running");
+    } else if (status == 0) {
+        snprintf(state, sizeof(state), "Done");
+    } else {
+        snprintf(state, sizeof(state), "Exit %d", status);
+    }
+    
+    fprintf(output, "[%d]%c  %-24s%s%s\n", job->id, job_marker(job), state, 
+            job->text ? job->text : "", (job->remaining > 0) ? " &" : "");
+}
@@ -0,0 +1,106 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+/* INCLUDE LIBRARIES */
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/* DEFINE CONSTANTS */
+#define EVLOOP_MAX_EVENTS 64
+#define STATUS_SIGNAL_BASE 128
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+typedef void (*event_handler)(int fd, void *data);
+
+struct job;
+typedef void (*job_handler)(const struct job *job);
+
+struct job_process {
+    pid_t pid;
+    int pidfd;              // -1 once reaped, or when pidfds aren't available
+    bool done;
+    int status;             // $?-style: exit code, or 128 + signal
+    struct rusage usage;
+};
+
+// One foreground pipeline or background command
+struct job {
+    int id;                 // %N for background jobs, 0 in the foreground
+    bool background;
+    char *text;             // What `jobs` prints; may be NULL
+    struct job_process *procs;
+    int num_procs;
+    int remaining;          // Processes not reaped yet
+    struct timespec started;    // CLOCK_MONOTONIC
+    struct timespec finished;   // Set when the last process is reaped
+    struct job *next;
+};
+
+/* FUNCTION HEADERS */
+
+// Creates the shell's epoll instance. Without it (or without pidfd_open)
+// everything still works through blocking waits
+void jobs_init(void);
+
+// In a forked child that keeps running shell code: drop the parent's epoll
+// instance and job table so the two processes don't share them
+void jobs_after_fork(void);
+
+// Calls `handler` whenever `fd` is readable. False if `fd` can't be watched
+// (regular files, or no epoll)
+bool evloop_add(int fd, event_handler handler, void *data);
+
+void evloop_remove(int fd);
+
+// Waits up to `timeout_ms` (-1 = forever) and dispatches what is ready.
+// Returns the number of handlers run, or -1 if there is no event loop
+int evloop_run_once(int timeout_ms);
+
+// Starts tracking already forked processes. `started` is when the first
+// one was forked (CLOCK_MONOTONIC), or NULL for now
+struct job *job_create(const pid_t *pids, int count, const char *text, const struct timespec *started);
+
+// Runs the event loop until every process in `job` has exited. Returns the
+// status of the last one
+int job_wait(struct job *job);
+
+// Runs the event loop until one of `jobs` has finished and returns its
+// index, for callers that keep several jobs going at once
+int job_wait_any(struct job *const *jobs, int count);
+
+// Sends `sig` to every process of `job` not reaped yet, through its pidfd
+// when there is one, so a recycled pid never gets it
+void job_signal(struct job *job, int sig);
+
+// Releases a foreground job after job_wait
+void job_free(struct job *job);
+
+// Hands `job` to the job table and prints "[N] pid"
+void job_background(struct job *job);
+
+// Calls `handler` as soon as the last process of a background job has been
+// reaped, by the event loop or by polling
+void jobs_on_background_finished(job_handler handler);
+
+// Finds a background job by "%N", "%%", "%+" or a pid
+struct job *job_find(const char *spec);
+
+// Waits for a background job and removes it from the table
+int job_wait_background(struct job *job);
+
+// Prints and drops background jobs that have finished since the last call
+void jobs_notify(FILE *output);
+
+// `jobs` output
+void jobs_print(FILE *output);
+
+// Background jobs in the table, finished ones not yet reported included
+int jobs_count(void);
+
+// Converts a wait() status to the $? convention
+int job_status_value(int wait_status);
+
+#endif
@@ -0,0 +1,211 @@
+/* INCLUDE LIBRARIES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "line_cache.h"
+
+/* DEFINE CONSTANTS */
+#define LINE_CACHE_BUCKETS 1024
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// One cached line. Entries sit in a hash chain (by line hash) and in a
+// doubly linked recency list, most recently used at the head
+struct line_cache_entry {
+    uint64_t hash;
+    char *line;
+    size_t length;
+    size_t bytes;
+    struct command_node *root;
+    struct line_cache_entry *chain_next;
+    struct line_cache_entry *lru_prev;
+    struct line_cache_entry *lru_next;
+};
+
+/* FUNCTION HEADERS */
+static uint64_t hash_line(const char *line, size_t length);
+static size_t context_bytes(const struct command_context *ctx);
+static size_t node_bytes(const struct command_node *node);
+static void lru_unlink(struct line_cache_entry *entry);
+static void lru_push_front(struct line_cache_entry *entry);
+static void remove_entry(struct line_cache_entry *entry);
+
+/* CACHE STATE */
+static struct line_cache_entry *buckets[LINE_CACHE_BUCKETS];
+static struct line_cache_entry *lru_head = NULL;
+static struct line_cache_entry *lru_tail = NULL;
+static struct line_cache_stats stats = { 0 };
+
+/* FUNCTION FUNCTIONS */
+struct command_node *line_cache_lookup(const char *line) {
+    size_t length = strlen(line);
+    uint64_t hash = hash_line(line, length);
+    
+    struct line_cache_entry *entry = buckets[hash % LINE_CACHE_BUCKETS];
+    while (entry) {
+        // Compare the text too; a hash match alone could run the wrong line
+        if (entry->hash == hash && entry->length == length && 
+            memcmp(entry->line, line, length) == 0) {
+            lru_unlink(entry);
+            lru_push_front(entry);
+            stats.hits++;
+            return retain_command_node(entry->root);
+        }
+        entry = entry->chain_next;
+    }
+    
+    stats.misses++;
+    return NULL;
+}
+
+void line_cache_insert(const char *line, struct command_node *root) {
+    if (root->has_expansions) {
+        stats.bypasses++;
+        return;
+    }
+    
+    size_t length = strlen(line);
+    size_t bytes = sizeof(struct line_cache_entry) + length + 1 + node_bytes(root);
+    if (bytes > LINE_CACHE_MAX_BYTES / 4) {
+        // One huge generated line shouldn't flush everything else
+        stats.bypasses++;
+        return;
+    }
+    
+    while (lru_tail && (stats.entries >= LINE_CACHE_MAX_ENTRIES || 
+                        stats.bytes + bytes > LINE_CACHE_MAX_BYTES)) {
+        remove_entry(lru_tail);
+        stats.evictions++;
+    }
+    
+    struct line_cache_entry *entry = calloc(1, sizeof(struct line_cache_entry));
+    if (entry == NULL) {
+        fprintf(stderr, "[line cache] failed to malloc for cache entry\n");
+        return;
+    }
+    entry->hash = hash_line(line, length);
+    entry->line = strdup(line);
+    entry->length = length;
+    entry->bytes = bytes;
+    entry->root = retain_command_node(root);
+    
+    size_t bucket = entry->hash % LINE_CACHE_BUCKETS;
+    entry->chain_next = buckets[bucket];
+    buckets[bucket] = entry;
+    lru_push_front(entry);
+    
+    stats.entries++;
+    stats.bytes += bytes;
+}
+
+void line_cache_clear(void) {
+    while (lru_head) {
+        remove_entry(lru_head);
+    }
+}
+
+void line_cache_get_stats(struct line_cache_stats *out) {
+    *out = stats;
+}
+
+static uint64_t hash_line(const char *line, size_t length) {
+    // FNV-1a, 64-bit
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)line[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Rough heap footprint of a parsed tree, used for the memory bound
+static size_t context_bytes(const struct command_context *ctx) {
+    size_t bytes = 0;
+    
+    if (ctx->num_commands > 0) {
+        for (int i = 0; i < ctx->num_commands; i++) {
+            bytes += (ctx->all_argc[i] + 1) * sizeof(char *);
+            for (int j = 0; j < ctx->all_argc[i]; j++) {
+                bytes += strlen(ctx->all_commands[i][j]) + 1;
+            }
+        }
+        bytes += ctx->num_commands * (sizeof(char **) + sizeof(int) + sizeof(char *));
+    } else {
+        bytes += (ctx->argc + 1) * sizeof(char *);
+        for (int i = 0; i < ctx->argc; i++) {
+            bytes += strlen(ctx->argv[i]) + 1;
+        }
+    }
+    
+    if (ctx->out_file) bytes += strlen(ctx->out_file) + 1;
+    if (ctx->error_file) bytes += strlen(ctx->error_file) + 1;
+    for (int i = 0; i < ctx->num_fanouts; i++) {
+        bytes += sizeof(char *) + sizeof(int) + strlen(ctx->fanout_files[i]) + 1;
+    }
+    return bytes;
+}
+
+static size_t node_bytes(const struct command_node *node) {
+    size_t bytes = sizeof(struct command_node);
+    
+    // Compound commands keep their redirects in `command` too
+    bytes += context_bytes(&node->command);
+    
+    bytes += node->num_children * sizeof(struct command_node *);
+    for (int i = 0; i < node->num_children; i++) {
+        bytes += node_bytes(node->children[i]);
+    }
+    
+    if (node->name) bytes += strlen(node->name) + 1;
+    bytes += node->num_words * sizeof(char *);
+    for (int i = 0; i < node->num_words; i++) {
+        bytes += strlen(node->words[i]) + 1;
+    }
+    return bytes;
+}
+
+static void lru_unlink(struct line_cache_entry *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct line_cache_entry *entry) {
+    entry->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = entry;
+    }
+    lru_head = entry;
+    if (lru_tail == NULL) {
+        lru_tail = entry;
+    }
+}
+
+// Trees still being executed keep their own reference, so dropping the
+// cache's reference here is safe even mid-execution
+static void remove_entry(struct line_cache_entry *entry) {
+    struct line_cache_entry **link = &buckets[entry->hash % LINE_CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->chain_next;
+    }
+    *link = entry->chain_next;
+    
+    lru_unlink(entry);
+    stats.entries--;
+    stats.bytes -= entry->bytes;
+    
+    free_command_node(entry->root);
+    free(entry->line);
+    free(entry);
+}
@@ -0,0 +1,38 @@
+#ifndef LINE_CACHE_H
+#define LINE_CACHE_H
+
+/* INCLUDE LIBRARIES */
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "parser.h"
+
+/* DEFINE CONSTANTS */
+#define LINE_CACHE_MAX_ENTRIES 512
+#define LINE_CACHE_MAX_BYTES (4 * 1024 * 1024)
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+struct line_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long bypasses;     // Lines never cached because they use expansions
+    unsigned long evictions;
+    size_t entries;
+    size_t bytes;
+};
+
+/* FUNCTION HEADERS */
+
+// Returns the cached tree for `line` with an extra reference (release it
+// with free_command_node), or NULL on a miss
+struct command_node *line_cache_lookup(const char *line);
+
+// Remembers `root` as the parse of `line` unless the parse depends on run-time
+// state. The cache takes its own reference; the caller keeps theirs
+void line_cache_insert(const char *line, struct command_node *root);
+
+void line_cache_clear(void);
+
+void line_cache_get_stats(struct line_cache_stats *stats);
+
+#endif
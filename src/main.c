@@ -1,4 +1,5 @@
 /* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,44 +9,231 @@
 #include <dirent.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
+#include "parser.h"
+#include "line_cache.h"
+#include "variables.h"
+#include "jobs.h"
+#include "audit.h"
+#include "completion.h"
+#include "fuzzy.h"
+#include "history_file.h"
+#include "script_cache.h"
+#include "pipestats.h"
+#include "memo.h"
+#include "server.h"
+#include "fanout.h"
+#include "shellstats.h"
+
 /* DEFINE CONSTANTS */
 #define MAX_COMMAND_LENGTH 1024
 #define DEFAULT_EXIT_STATUS 0
 #define EXIT_LENGTH 4
 #define ECHO_LENGTH 4
 #define MAX_PATH_LENGTH 1024
-#define ARGV_MAX_CAPACITY 1024
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_MAX 3
+#define IOPRIO_LEVEL_MAX 7
+#define DEFINITION_BUCKETS 256
+#define MAX_FUNCTION_DEPTH 1000
+#define MAX_SOURCE_DEPTH 100
+#define STATUS_NOT_FOUND 127
+#define JOB_TEXT_LENGTH 256
+#define XARGS_HEADROOM 2048         // Bytes of ARG_MAX left unused, as POSIX asks
+#define XARGS_READ_CHUNK 65536
+#define XARGS_MAX_ARG_LENGTH (32 * 4096)    // Linux's limit on one argument
+#define XARGS_STATUS_FAILED 123
+#define COPROC_BUFFER_SIZE 4096
+#define TIMEOUT_STATUS 124              // GNU timeout's: the command ran out of time
+#define TIMEOUT_FAILED 125              // timeout itself couldn't run it
+#define TIMEOUT_DEFAULT_GRACE_MS 5000   // From the signal to SIGKILL
+#define READ_CHUNK 4096
+#define MAX_SHELL_STATS 48
+#define WATCH_DEFAULT_INTERVAL_MS 2000
+#define WATCH_MIN_INTERVAL_MS 100
+#define WATCH_SETTLE_MS 100             // Quiet time after the last change before re-running
+#define WATCH_EVENT_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                          IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
 
 /* DEFINE STRUCTS AND TYPEDEFS */
-struct command_context {
-	bool redirect;
-	char *out_file;
-    int out_mode;
-    bool redirect_err;
-    char *error_file;
-    int err_mode;
-	char *command_name;
-    int argc;
-    char **argv;
-    int num_commands;
-    char ***all_commands;
-    int *all_argc;
-    char **all_command_names;
-};
-
 typedef void (*command_function)(struct command_context *);
 
+// Scheduling policy applied in a forked child right before it runs its command
+struct stage_sched {
+    bool has_cpus;
+    cpu_set_t cpus;
+    bool has_nice;
+    int nice;
+    bool has_ioprio;
+    int ioprio_class;
+    int ioprio_level;
+    bool colocate;
+};
+
 struct command {
 	const char *name;
 	command_function func;
 };
 
+// An alias and/or function, both kept in pre-parsed form
+struct definition {
+    char *name;
+    char *alias_text;
+    struct command_node *alias;
+    struct command_node *function;
+    bool expanding;     // Alias is being expanded: don't expand it again
+    struct definition *next;
+};
+
+// A running <(cmd) or >(cmd). The shell keeps its end of the pipe open
+// until the command that was handed /dev/fd/N has finished
+struct process_substitution {
+    int fd;
+    pid_t pid;
+};
+
+// The `>|` copies of one pipeline stage's output
+struct stage_fanout {
+    int pipe[2];        // The stage writes to pipe[1]; both -1 without `>|`
+    int *sinks;
+    int num_sinks;
+    struct fanout fanout;
+};
+
+// One number reported by `shellstats`
+struct shell_stat {
+    const char *group;
+    const char *name;
+    unsigned long long value;
+};
+
+// Looking a name up in one cached PATH directory
+struct path_lookup {
+    const char *name;
+    bool found;
+};
+
+// `xargs` flags
+struct xargs_options {
+    bool null_separated;    // -0
+    bool no_run_if_empty;   // -r
+    bool trace;             // -t
+    int max_args;           // -n; 0 = as many as fit
+    int max_procs;          // -P; 0 = no limit
+};
+
+// Buffered stdin for `xargs`. The shell's own input can't go through stdio
+struct xargs_input {
+    char buf[XARGS_READ_CHUNK];
+    size_t pos;
+    size_t length;
+    bool eof;
+};
+
+// One run of `xargs`: the batch being filled and the ones still running
+struct xargs_run {
+    struct xargs_options options;
+    char *path;             // Resolved once for every batch
+    char **argv;            // Command words, then this batch's items
+    int fixed_argc;
+    int argc;
+    int capacity;
+    size_t fixed_size;      // Environment plus command words, as execve counts them
+    size_t size;            // fixed_size plus this batch's items
+    size_t limit;
+    struct job **running;
+    int num_running;
+    int running_capacity;
+    int launched;
+    int status;
+};
+
+// A path given to `watch -f`
+struct watch_path {
+    const char *path;
+    int wd;                 // -1 after the path went away, until it is watched again
+};
+
+// One run of `watch`. The handlers only set flags; the loop does the work
+struct watch_state {
+    char *text;             // The command as shown in the header
+    struct command_node *command;
+    long interval_ms;       // 0: only on changes
+    struct watch_path *paths;
+    int num_paths;
+    int interval_fd;
+    int inotify_fd;
+    int settle_fd;          // One-shot timer re-armed by every change
+    bool due;
+    bool stop;
+};
+
+// A request a forked worker is running for `shell --server`; the status
+// goes back on `conn_fd` once the job finishes
+struct server_worker {
+    int conn_fd;
+    struct job *job;
+};
+
+// State a streamed `for` loop carries between values
+struct for_iteration {
+    struct command_node *node;
+    int status;
+};
+
+// A `set -o` option
+struct shell_option {
+    const char *name;
+    bool *value;
+};
+
+// A `coproc NAME` child and the shell's ends of its two pipes. Output the
+// shell reads is buffered here; nothing else reads that pipe
+struct coprocess {
+    char *name;
+    pid_t pid;
+    int read_fd;            // The coprocess's stdout
+    int write_fd;           // Its stdin; -1 after `coproc -c NAME`
+    char *buffer;
+    size_t buffer_start;
+    size_t buffer_end;
+};
+
+// One `timeout` run. The timer fires twice at most: first to send
+// `signal`, then SIGKILL if the command is still there after the grace
+struct timeout_run {
+    struct job *job;
+    pid_t group;            // The command's own process group
+    int signal;
+    long grace_ms;          // 0: never escalate to SIGKILL
+    bool timed_out;
+    bool killed;
+};
+
+// Prefix search over variable names for complete_variables
+struct variable_prefix {
+    const char *text;
+    size_t length;
+    struct completion_list *out;
+};
+
 /* FUNCTION HEADERS */
 static void trim_newline(char *s);
-static void parse_command_line(char *line, struct command_context *ctx);
 static void debug_print_context(struct command_context *ctx);
 static void shell_exit(struct command_context *ctx);
 static void shell_echo(struct command_context *ctx);
@@ -53,19 +241,148 @@ static void shell_type(struct command_context *ctx);
 static void shell_exec(struct command_context *ctx);
 static void shell_pwd(struct command_context *ctx);
 static void shell_cd(struct command_context *ctx);
-static char *command_generator(const char *text, int state);
 static char **command_completion(const char *text, int start, int end);
+static char *completion_generator(const char *text, int state);
+static bool find_completion_command(int start, char *buf, size_t size);
+static void complete_commands(const char *text, struct completion_list *out);
+static bool visit_executable(const char *dir, const char *name, int type, void *data);
+static char **fuzzy_completion_matches(const char *text);
+static bool visit_fuzzy_command(const char *dir, const char *name, int type, void *data);
+static void complete_directories(const char *text, struct completion_list *out);
+static void complete_aliases(const char *text, struct completion_list *out);
+static void complete_variables(const char *text, struct completion_list *out);
+static void visit_variable(const char *name, void *data);
+static void register_completions(void);
 static bool is_executable(const char *path);
-static char *path_executable_generator(const char *text, int state);
 static void shell_exec_pipeline(struct command_context *ctx);
+static bool can_fuse_stage(struct command_context *ctx, char ***stage_argv, int i);
+static void run_fused_stages(char ***stage_argv, int *stage_argc, int first, int last, int *statuses);
+static void set_fused_pipestatus(const struct job *job, const bool *fused, const int *statuses, int n);
 static char *find_executable_in_path(const char *command_name);
+static bool visit_exact_name(const char *dir, const char *name, int type, void *data);
 static bool is_builtin(const char *command_name);
 static command_function get_builtin_function(const char *command_name);
 static void execute_builtin_in_fork(const char *command_name, char **argv, int argc, 
                                    int stdin_fd, int stdout_fd);
 static void shell_history(struct command_context *ctx);
+static void remember_line(const char *line);
 static void load_history_histfile(void);
-static void write_history_histfile(void);
+static void shell_sched(struct command_context *ctx);
+static void execute_node(struct command_node *node);
+static void execute_command(struct command_context *ctx);
+static unsigned long hash_string(const char *s);
+static struct definition *find_definition(const char *name);
+static struct definition *get_definition(const char *name);
+static void run_alias(struct definition *def, struct command_context *ctx);
+static void run_function(struct definition *def, struct command_context *ctx);
+static void shell_alias(struct command_context *ctx);
+static void shell_unalias(struct command_context *ctx);
+static void merge_alias_call(const struct command_context *base, const struct command_context *call, 
+                             struct command_context *out);
+static void free_merged_call(const struct command_context *base, struct command_context *merged);
+static int parse_sched_options(char **argv, int argc, struct stage_sched *policy);
+static bool parse_cpu_list(const char *list, cpu_set_t *set);
+static void format_cpu_list(const cpu_set_t *set, char *buf, size_t size);
+static int sched_sibling_groups(const struct stage_sched *policy, cpu_set_t **groups_out);
+static void apply_stage_sched(const struct stage_sched *policy, const cpu_set_t *group);
+static void on_stdin_ready(int fd, void *data);
+static void handle_line(char *line);
+static void run_command(struct command_context *ctx);
+static void run_with_fanout(struct command_context *ctx);
+static int open_fanout_sinks(const struct command_context *ctx, int stage, int *fds);
+static struct stage_fanout *open_stage_fanouts(const struct command_context *ctx, bool *failed);
+static void close_stage_fanouts(struct stage_fanout *fanouts, int n);
+static void expand_context(const struct command_context *ctx, struct command_context *out);
+static int expand_arguments(char **words, int count, char ***out);
+static char *expand_target(const char *word);
+static char *start_process_substitution(const char *word);
+static void finish_process_substitutions(int mark);
+static int count_assignments(const struct command_context *ctx);
+static void run_with_assignments(struct command_context *ctx, int assignments);
+static bool push_redirects(const struct command_context *ctx, int saved[2]);
+static void pop_redirects(int saved[2]);
+static pid_t fork_shell(void);
+static void set_pipestatus(const struct job *job);
+static void describe_node(const struct command_node *node, char *buf, size_t size);
+static void describe_words(char **words, int count, char *buf, size_t size);
+static void execute_background(struct command_node *node);
+static bool control_pending(void);
+static bool loop_should_stop(void);
+static void execute_loop(struct command_node *node);
+static void execute_for(struct command_node *node);
+static bool run_for_iteration(const char *value, void *data);
+static bool words_use_parameters(char *const *words, int count);
+static void execute_case(struct command_node *node);
+static void execute_pipeline_node(struct command_node *node);
+static bool parse_number_argument(struct command_context *ctx, int *value);
+static void shell_true(struct command_context *ctx);
+static void shell_false(struct command_context *ctx);
+static void shell_break(struct command_context *ctx);
+static void shell_continue(struct command_context *ctx);
+static void shell_return(struct command_context *ctx);
+static void shell_export(struct command_context *ctx);
+static void shell_unset(struct command_context *ctx);
+static void shell_set(struct command_context *ctx);
+static bool *find_shell_option(const char *name);
+static void print_shell_options(FILE *output, bool as_commands);
+static void shell_jobs(struct command_context *ctx);
+static void shell_wait(struct command_context *ctx);
+static void shell_source(struct command_context *ctx);
+static bool find_source_file(const char *name, char *buf);
+static struct command_node *load_script(const char *path, const char *builtin);
+static void shell_xargs(struct command_context *ctx);
+static void shell_watch(struct command_context *ctx);
+static int parse_watch_options(struct command_context *ctx, struct watch_state *state);
+static bool open_watch_fds(struct watch_state *state);
+static void close_watch_fds(struct watch_state *state);
+static void set_timer(int fd, long first_ms, long interval_ms);
+static void watch_paths(struct watch_state *state);
+static void run_watched(struct watch_state *state);
+static void drain_watch_events(struct watch_state *state);
+static void on_watch_interval(int fd, void *data);
+static void on_watch_change(int fd, void *data);
+static void on_watch_settled(int fd, void *data);
+static void on_watch_interrupt(int fd, void *data);
+static void watch_sigint_handler(int sig);
+static void shell_memo(struct command_context *ctx);
+static void run_memoized(char **argv, int argc, const char *key, size_t key_length);
+static void run_words(char **argv, int argc);
+static void shell_coproc(struct command_context *ctx);
+static struct coprocess *find_coprocess(const char *name);
+static void release_coprocess(struct coprocess *coproc);
+static void close_coprocess_fds(void);
+static void shell_read(struct command_context *ctx);
+static char *read_input_line(int fd, bool *complete);
+static void assign_read_fields(char **names, int count, const char *line, const bool *escaped);
+static bool is_field_separator(const char *line, const bool *escaped, size_t i, const char *ifs, bool space_only);
+static void shell_shellstats(struct command_context *ctx);
+static int collect_shell_stats(struct shell_stat *stats);
+static void print_shell_stats(FILE *output, const struct shell_stat *stats, int count);
+static void print_shell_stats_json(FILE *output, const struct shell_stat *stats, int count);
+static void shell_timeout(struct command_context *ctx);
+static int parse_timeout_options(struct command_context *ctx, struct timeout_run *run);
+static long parse_duration_ms(const char *text);
+static int parse_signal_name(const char *text);
+static void on_timeout_expired(int fd, void *data);
+static void signal_timed_group(struct timeout_run *run, int sig);
+static void timeout_sigint_handler(int sig);
+static int run_server(const char *path);
+static int run_client(int argc, char **argv);
+static void warm_path_cache(void);
+static bool visit_nothing(const char *dir, const char *name, int type, void *data);
+static void on_server_connection(int fd, void *data);
+static void on_server_request(int fd, void *data);
+static void on_server_signal(int fd, void *data);
+static void start_server_worker(int conn_fd, struct server_request *request);
+static void run_request_words(struct server_request *request);
+static void reap_server_workers(void);
+static int parse_xargs_options(struct command_context *ctx, struct xargs_options *options);
+static size_t xargs_size_limit(void);
+static char *read_xargs_item(struct xargs_input *in, bool null_separated, bool *error);
+static int xargs_getc(struct xargs_input *in);
+static bool add_xargs_item(struct xargs_run *run, char *item);
+static void launch_xargs_batch(struct xargs_run *run);
+static void reap_xargs_batch(struct xargs_run *run, int index);
 
 /* OTHER HELPERS TO MAKE LIFE EASIER */
 struct command commands[] = {
@@ -75,6 +392,29 @@ struct command commands[] = {
     { "pwd", shell_pwd }, 
     { "cd", shell_cd },
     { "history", shell_history },
+    { "sched", shell_sched },
+    { "alias", shell_alias },
+    { "unalias", shell_unalias },
+    { "true", shell_true },
+    { "false", shell_false },
+    { ":", shell_true },
+    { "break", shell_break },
+    { "continue", shell_continue },
+    { "return", shell_return },
+    { "export", shell_export },
+    { "unset", shell_unset },
+    { "set", shell_set },
+    { "jobs", shell_jobs },
+    { "wait", shell_wait },
+    { "source", shell_source },
+    { ".", shell_source },
+    { "xargs", shell_xargs },
+    { "watch", shell_watch },
+    { "memo", shell_memo },
+    { "coproc", shell_coproc },
+    { "read", shell_read },
+    { "shellstats", shell_shellstats },
+    { "timeout", shell_timeout },
 };
 
 #define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
@@ -86,325 +426,240 @@ char *command_names[] = {
     "pwd",
     "cd",
     "history",
+    "sched",
+    "alias",
+    "unalias",
+    "true",
+    "false",
+    "break",
+    "continue",
+    "return",
+    "export",
+    "unset",
+    "set",
+    "jobs",
+    "wait",
+    "source",
+    "xargs",
+    "watch",
+    "memo",
+    "coproc",
+    "read",
+    "shellstats",
+    "timeout",
     NULL,
 };
 
 static int last_history_written = 0;
 
-/* MAIN FUNCTION */
+// Session-wide policy for pipeline stages, set by `sched` without a command
+static struct stage_sched pipeline_sched = { 0 };
 
-int main(void) {
-    // Set up readline completion
-    rl_attempted_completion_function = command_completion;
+// Policy for the next shell_exec child, set by `sched ... command`
+static const struct stage_sched *exec_sched = NULL;
 
-    load_history_histfile();
+// Aliases and functions, consulted before builtins and PATH
+static struct definition *definitions[DEFINITION_BUCKETS];
 
-    char *line;
+static int function_depth = 0;
 
-    while (1) {
-        // Use readline instead of fgets - this is what enables TAB completion
-        line = readline("$ ");
-        
-        // Check if we got EOF (Ctrl+D)
-        if (!line) {
-            break;
-        }
-        
-        // Skip empty lines
-        if (strlen(line) == 0) {
-            free(line);
-            continue;
-        }
-        
-        // Add to history (optional but nice - lets us use up arrow)
-        add_history(line);
-        
-        struct command_context ctx = {
-            .redirect = false,
-            .out_file = NULL,
-            .out_mode = O_TRUNC,
-            .redirect_err = false,
-            .error_file = NULL,
-            .err_mode = O_TRUNC,
-            .command_name = NULL,
-            .argc = 0,
-            .argv = NULL,
-            .num_commands = 0,
-            .all_argc = NULL,
-            .all_commands = NULL,
-            .all_command_names = NULL,
-        };
+// Nested `source` calls; `return` also ends a sourced script
+static int source_depth = 0;
 
-        parse_command_line(line, &ctx);
+// `shell --server`: requests still running, and how to stop
+static const char *server_path = NULL;
+static int server_listen_fd = -1;
+static int server_signal_fd = -1;
+static bool server_stopping = false;
+static sigset_t server_saved_mask;
+static struct server_worker *server_workers = NULL;
+static int num_server_workers = 0;
+static int server_workers_capacity = 0;
 
-        // Skip empty commands
-        if (ctx.command_name == NULL || ctx.argc == 0) {
-            free(line);
-            continue;
-        }
+// Running `coproc` children, by name
+static struct coprocess *coprocs = NULL;
+static int num_coprocs = 0;
+static int coprocs_capacity = 0;
 
-        // debug_print_context(&ctx);
+// Self-pipe that turns ^C into an event while `watch` is running
+static int watch_interrupt_pipe[2] = { -1, -1 };
 
-        if (ctx.num_commands == 0 && (ctx.command_name == NULL || ctx.argc == 0)) {
-            free(line);
-            continue;
-        }
+// Group a `timeout` command runs in; ^C is passed on to it
+static volatile pid_t timeout_group = 0;
 
-        // Check if it's a pipeline
-        if (ctx.num_commands > 0) {
-            // Execute pipeline (works for 2, 3, 4... any number)
-            shell_exec_pipeline(&ctx);
-        } else {
-            // Single command execution
-            bool found = false;
-            for (size_t i = 0; i < NUM_COMMANDS; i++) {
-                if (strcmp(ctx.command_name, commands[i].name) == 0) {
-                    commands[i].func(&ctx);
-                    found = true;
-                    break;
-                }
-            }
-            
-            if (!found) {
-                shell_exec(&ctx);
-            }
-        }
+// Substitutions started for commands that are still running, oldest first
+static struct process_substitution *procsubs = NULL;
+static int num_procsubs = 0;
+static int procsubs_capacity = 0;
 
-        // Free allocated memory
-        if (ctx.num_commands > 0) {
-            // Pipeline
-            for (int i = 0; i < ctx.num_commands; i++) {
-                for (int j = 0; j < ctx.all_argc[i]; j++) {
-                    free(ctx.all_commands[i][j]);
-                }
-                free(ctx.all_commands[i]);
-            }
-            free(ctx.all_commands);
-            free(ctx.all_argc);
-            free(ctx.all_command_names);
-        } else {
-            // Single command
-            for (int i = 0; i < ctx.argc; i++) {
-                if (ctx.argv[i]) free(ctx.argv[i]);
-            }
-        }
-        free(ctx.argv);
+// Enclosing for/while/until loops at the point of execution
+static int loop_depth = 0;
+
+// Pending `break N` / `continue N`: loops still to leave or skip
+static int break_count = 0;
+static int continue_count = 0;
+
+// Set by `return` until the function call unwinds
+static bool returning = false;
+
+// $? from before the running builtin started, for `return` and `exit`
+static int previous_status = 0;
+
+// Script so far while a construct is still open
+static char *pending = NULL;
+
+// stdin is in the event loop (false for regular files, which epoll refuses)
+static bool stdin_watched = false;
+
+static bool input_done = false;
+
+// Candidates for the word being completed, handed out by completion_generator
+static struct completion_list completions = { 0 };
 
-        if (ctx.out_file) {
-            free(ctx.out_file);
+// `set -o fuzzy`: rank command-position completions by fuzzy score and usage
+static bool fuzzy_completion = false;
+
+// `set -o pipestats` (or $SHELL_PIPESTATS): relay every pipeline link
+// through the shell and report per-stage throughput when it finishes
+static bool pipeline_stats = false;
+
+static struct shell_option shell_options[] = {
+    { "fuzzy", &fuzzy_completion },
+    { "pipestats", &pipeline_stats },
+};
+
+#define NUM_SHELL_OPTIONS (sizeof(shell_options) / sizeof(shell_options[0]))
+
+/* MAIN FUNCTION */
+
+int main(int argc, char **argv) {
+    shellstats_init();
+    if (argc >= 2 && strcmp(argv[1], "--client") == 0) {
+        return run_client(argc, argv);
+    }
+    
+    // A builtin writing to a coprocess that has exited, or the server writing
+    // to a client that went away, gets EPIPE instead of killing the shell.
+    // Every child puts the default back
+    signal(SIGPIPE, SIG_IGN);
+    
+    if (argc >= 2 && strcmp(argv[1], "--server") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "usage: shell --server SOCKET\n");
+            return 2;
         }
+        jobs_init();
+        return run_server(argv[2]);
+    }
+    
+    // Set up readline completion
+    rl_attempted_completion_function = command_completion;
+    register_completions();
+
+    load_history_histfile();
+    jobs_init();
+    audit_init();
+    jobs_on_background_finished(audit_record_background_job);
 
-        if (ctx.error_file) {
-            free(ctx.error_file);
+    // Readline's callback interface lets input share the event loop with
+    // child exits; handle_line runs once per complete line
+    rl_callback_handler_install("$ ", handle_line);
+    stdin_watched = evloop_add(STDIN_FILENO, on_stdin_ready, NULL);
+
+    while (!input_done) {
+        if (!stdin_watched || evloop_run_once(-1) < 0) {
+            rl_callback_read_char();
         }
-        
-        free(line);
     }
 
+    rl_callback_handler_remove();
+    free(pending);
 
-    return 0;
+    return var_status();
 }
 
-/* FUNCTION FUNCTIONS, LIKE THE REAL THINGS THAT DO THE WORK */
-static void trim_newline(char *s) {
-    size_t len = strlen(s);
-    if (len > 0 && s[len - 1] == '\n') {
-        s[len - 1] = '\0';
-    }
+static void on_stdin_ready(int fd, void *data) {
+    (void) fd;
+    (void) data;
+    rl_callback_read_char();
 }
 
-static void parse_command_line(char *line, struct command_context *ctx) {
-    int count = 0;
-    int capacity = ARGV_MAX_CAPACITY;
-    ctx->argv = malloc(capacity * sizeof(char *));
-    
-    if (strlen(line) == 0) {
-        ctx->command_name = NULL;
-        ctx->argv[0] = NULL;
-        ctx->argc = 0;
-        ctx->num_commands = 0;
+static void handle_line(char *line) {
+    // Check if we got EOF (Ctrl+D)
+    if (!line) {
+        input_done = true;
         return;
     }
     
-    char token_buffer[MAX_COMMAND_LENGTH] = {0};
-    int buffer_pos = 0;
-    
-    char *p = line;
-    char quote_type = '\0';
-    
-    // === TOKENIZATION LOOP (THIS WAS MISSING!) ===
-    while (*p != '\0') {
-        // Handle backslash OUTSIDE quotes
-        if (*p == '\\' && quote_type == '\0') {
-            p++;
-            if (*p != '\0') {
-                token_buffer[buffer_pos++] = *p;
-                p++;
-            }
-            continue;
-        }
-        
-        // Handle backslash INSIDE DOUBLE QUOTES
-        if (*p == '\\' && quote_type == '"') {
-            if (*(p + 1) == '"' || *(p + 1) == '\\' || 
-                *(p + 1) == '$' || *(p + 1) == '`') {
-                p++;
-                token_buffer[buffer_pos++] = *p;
-                p++;
-                continue;
-            }
-        }
-        
-        // Handle quote characters
-        if ((*p == '\'' || *p == '"') && quote_type == '\0') {
-            quote_type = *p;
-            p++;
-            continue;
-        }
-        else if (*p == quote_type && quote_type != '\0') {
-            quote_type = '\0';
-            p++;
-            continue;
-        }
-        
-        // Handle spaces
-        if (*p == ' ' && quote_type == '\0') {
-            if (buffer_pos > 0) {
-                token_buffer[buffer_pos] = '\0';
-                if (count >= capacity) {
-                    capacity *= 2;
-                    ctx->argv = realloc(ctx->argv, capacity * sizeof(char *));
-                }
-                ctx->argv[count++] = strdup(token_buffer);
-                buffer_pos = 0;
-            }
-            p++;
-            continue;
-        }
-        
-        // Regular character - accumulate it
-        token_buffer[buffer_pos++] = *p;
-        p++;
+    // Skip empty lines
+    if (strlen(line) == 0 && !pending) {
+        free(line);
+        jobs_notify(stderr);
+        return;
     }
     
-    // Save last token if exists
-    if (buffer_pos > 0) {
-        token_buffer[buffer_pos] = '\0';
-        if (count >= capacity) {
-            capacity *= 2;
-            ctx->argv = realloc(ctx->argv, capacity * sizeof(char *));
-        }
-        ctx->argv[count++] = strdup(token_buffer);
+    // Add to history (optional but nice - lets us use up arrow)
+    if (strlen(line) > 0) {
+        remember_line(line);
+        histfile_append(line);
     }
     
-    // === CHECK FOR PIPES ===
-    int num_pipes = 0;
-    for (int i = 0; i < count; i++) {
-        if (strcmp(ctx->argv[i], "|") == 0) {
-            num_pipes++;
-        }
+    // Continuation lines join the open construct, newline-separated
+    char *script = line;
+    if (pending) {
+        size_t pending_len = strlen(pending);
+        script = malloc(pending_len + strlen(line) + 2);
+        memcpy(script, pending, pending_len);
+        script[pending_len] = '\n';
+        strcpy(script + pending_len + 1, line);
+        free(pending);
+        free(line);
+        pending = NULL;
     }
     
-    if (num_pipes > 0) {
-        // Pipeline detected
-        ctx->num_commands = num_pipes + 1;
-        
-        // Allocate arrays
-        ctx->all_commands = malloc(ctx->num_commands * sizeof(char **));
-        ctx->all_argc = malloc(ctx->num_commands * sizeof(int));
-        ctx->all_command_names = malloc(ctx->num_commands * sizeof(char *));
+    // Repeated lines (up-arrow re-runs, polling loops) skip the parser
+    struct command_node *root = line_cache_lookup(script);
+    if (root == NULL) {
+        enum parse_status status;
+        root = parse_script(script, &status);
         
-        // Split into commands
-        int cmd_idx = 0;
-        int cmd_start = 0;
-        
-        for (int i = 0; i <= count; i++) {
-            if (i == count || strcmp(ctx->argv[i], "|") == 0) {
-                // End of a command
-                int cmd_argc = i - cmd_start;
-                
-                ctx->all_commands[cmd_idx] = malloc((cmd_argc + 1) * sizeof(char *));
-                for (int j = 0; j < cmd_argc; j++) {
-                    ctx->all_commands[cmd_idx][j] = ctx->argv[cmd_start + j];
-                }
-                ctx->all_commands[cmd_idx][cmd_argc] = NULL;
-                
-                ctx->all_argc[cmd_idx] = cmd_argc;
-                ctx->all_command_names[cmd_idx] = ctx->all_commands[cmd_idx][0];
-                
-                cmd_idx++;
-                
-                if (i < count) {
-                    free(ctx->argv[i]); // Free pipe symbol
-                }
-                
-                cmd_start = i + 1;
-            }
+        if (status == PARSE_INCOMPLETE) {
+            pending = script;
+            rl_set_prompt("> ");
+            return;
+        }
+        if (root) {
+            line_cache_insert(script, root);
         }
-        
-        // Set legacy single-command fields (for debug or compatibility)
-        ctx->command_name = ctx->all_command_names[0];
-        ctx->argc = ctx->all_argc[0];
-        
-        return;
     }
     
-    // === NO PIPES - SINGLE COMMAND ===
-    ctx->num_commands = 0;
-    
-    // Process redirect operators
-    int final_argc = 0;
-    for (int i = 0; i < count; i++) {
-        if (strcmp(ctx->argv[i], ">") == 0 || strcmp(ctx->argv[i], "1>") == 0) {
-            if (i + 1 < count) {
-                ctx->redirect = true;
-                ctx->out_file = strdup(ctx->argv[i + 1]);
-                ctx->out_mode = O_TRUNC;
-                free(ctx->argv[i]);
-                free(ctx->argv[i + 1]);
-                i++;
-            }
-        } else if (strcmp(ctx->argv[i], ">>") == 0 || strcmp(ctx->argv[i], "1>>") == 0) {
-            if (i + 1 < count) {
-                ctx->redirect = true;
-                ctx->out_file = strdup(ctx->argv[i + 1]);
-                ctx->out_mode = O_APPEND;
-                free(ctx->argv[i]);
-                free(ctx->argv[i + 1]);
-                i++;
-            }
-        } else if (strcmp(ctx->argv[i], "2>") == 0) {
-            if (i + 1 < count) {
-                ctx->redirect_err = true;
-                ctx->error_file = strdup(ctx->argv[i + 1]);
-                ctx->err_mode = O_TRUNC;
-                free(ctx->argv[i]);
-                free(ctx->argv[i + 1]);
-                i++;
-            }
-        } else if (strcmp(ctx->argv[i], "2>>") == 0) {
-            if (i + 1 < count) {
-                ctx->redirect_err = true;
-                ctx->error_file = strdup(ctx->argv[i + 1]);
-                ctx->err_mode = O_APPEND;
-                free(ctx->argv[i]);
-                free(ctx->argv[i + 1]);
-                i++;
-            }
-        } else {
-            ctx->argv[final_argc++] = ctx->argv[i];
+    // debug_print_context(&ctx);
+
+    if (root) {
+        // Children own the terminal while they run; only their exits matter
+        if (stdin_watched) {
+            evloop_remove(STDIN_FILENO);
+        }
+        audit_set_line(script);
+        execute_node(root);
+        audit_finish_line(var_status());
+        audit_set_line(NULL);
+        free_command_node(root);
+        if (stdin_watched) {
+            evloop_add(STDIN_FILENO, on_stdin_ready, NULL);
         }
     }
     
-    // Set command info
-    if (final_argc > 0) {
-        ctx->command_name = ctx->argv[0];
-        ctx->argc = final_argc;
-        ctx->argv[final_argc] = NULL;
-    } else {
-        ctx->command_name = NULL;
-        ctx->argc = 0;
-        ctx->argv[0] = NULL;
+    free(script);
+    jobs_notify(stderr);
+    rl_set_prompt("$ ");
+}
+
+/* FUNCTION FUNCTIONS, LIKE THE REAL THINGS THAT DO THE WORK */
+static void trim_newline(char *s) {
+    size_t len = strlen(s);
+    if (len > 0 && s[len - 1] == '\n') {
+        s[len - 1] = '\0';
     }
 }
 
@@ -430,11 +685,12 @@ static void debug_print_context(struct command_context *ctx) {
 }
 
 static void shell_exit(struct command_context *ctx) {
-	(void) ctx;
+    // Plain `exit` keeps the status of the last command
+    int status = (ctx->argc > 1) ? atoi(ctx->argv[1]) : previous_status;
 
-    write_history_histfile();
+    histfile_close();
 
-    exit(DEFAULT_EXIT_STATUS);
+    exit(status & 0xff);
 }
 
 static void shell_echo(struct command_context *ctx) {
@@ -481,6 +737,16 @@ static void shell_type(struct command_context *ctx) {
     
     char *target = ctx->argv[1]; 
     
+    struct definition *def = find_definition(target);
+    if (def && def->alias) {
+        fprintf(stdout, "%s is aliased to `%s'\n", target, def->alias_text);
+        return;
+    }
+    if (def && def->function) {
+        fprintf(stdout, "%s is a function\n", target);
+        return;
+    }
+    
 	bool found = false;
 	for (size_t i = 0; i < NUM_COMMANDS; i++) {
 		if (strcmp(commands[i].name, target) == 0) {
@@ -490,100 +756,47 @@ static void shell_type(struct command_context *ctx) {
 		}
 	}
 
-	char *path_env = getenv("PATH");
-	if (path_env) {
-		char *path_copy = malloc(strlen(path_env) * sizeof(char));
-        if (path_copy == NULL) {
-            fprintf(stderr, "[shell type] failed to malloc for path copy string\n");
-        }
-        strcpy(path_copy, path_env);
-        char *token = strtok(path_copy, ":");
-        if (token == NULL) {
-            fprintf(stderr, "[shell type] token is null\n");
-        }
-        while (token) {
-            DIR *dir = opendir(token);
-            if (dir) {
-                struct dirent *entry;
-                while ((entry = readdir(dir)) != NULL) {
-                    if (strcmp(entry->d_name, target) == 0) {
-                        char full_path[1024];
-                        snprintf(full_path, sizeof(full_path), "%s/%s", token, entry->d_name);
-                        if (access(full_path, X_OK) == 0) {
-                            struct stat path_stat;
-                            stat(full_path, &path_stat);
-                            if (S_ISREG(path_stat.st_mode)) {
-                                fprintf(stdout, "%s is %s\n", entry->d_name, full_path);
-                                found = true;
-                                break;
-                            }
-                        }
-                    }
-                }
-                closedir(dir);
-            }
-            if (found) {
-                break;
-            }
-            token = strtok(NULL, ":");
-        }
-	}
+    // Same lookup as running it: cached PATH listings, not a readdir of each
+    char *path = find_executable_in_path(target);
+    if (path) {
+        fprintf(stdout, "%s is %s\n", target, path);
+        free(path);
+        found = true;
+    }
     if (!found) {
 	    fprintf(stdout, "%s: not found\n", target);
+        var_set_status(1);
     }
 }
 
 static void shell_exec(struct command_context *ctx) {
-    char *path_env = getenv("PATH");
-    char *executable_path = NULL;
-    
-    if (path_env) {
-        char *path_copy = strdup(path_env);
-        char *token = strtok(path_copy, ":");
-        
-        while (token) {
-            DIR *dir = opendir(token);
-            if (dir) {
-                struct dirent *entry;
-                while ((entry = readdir(dir)) != NULL) {
-                    if (strcmp(entry->d_name, ctx->command_name) == 0) {
-                        char full_path[1024];
-                        snprintf(full_path, sizeof(full_path), "%s/%s", 
-                                token, entry->d_name);
-                        
-                        if (access(full_path, X_OK) == 0) {
-                            struct stat path_stat;
-                            stat(full_path, &path_stat);
-                            if (S_ISREG(path_stat.st_mode)) {
-                                executable_path = strdup(full_path);
-                                break;
-                            }
-                        }
-                    }
-                }
-                closedir(dir);
-            }
-            if (executable_path) {
-                break;
-            }
-            token = strtok(NULL, ":");
-        }
-        free(path_copy);
-    }
+    char *executable_path = find_executable_in_path(ctx->command_name);
     
     if (!executable_path) {
         fprintf(stdout, "%s: command not found\n", ctx->command_name);
+        var_set_status(STATUS_NOT_FOUND);
         return;
     }
     
+    // Anything a builtin printed must come out before the child's output
+    fflush(stdout);
+    
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
     pid_t pid = fork();
     if (pid == -1) {
         fprintf(stderr, "[shell exec] failed to fork\n");
         free(executable_path);
+        var_set_status(1);
         return;
     }
 
     if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        if (exec_sched) {
+            apply_stage_sched(exec_sched, NULL);
+        }
+
         // Handle stdout redirection
         if (ctx->redirect && ctx->out_file) {
             int flags = O_WRONLY | O_CREAT | ctx->out_mode;
@@ -608,14 +821,22 @@ static void shell_exec(struct command_context *ctx) {
             close(fd);
         }
         
+        shellstats_count(COUNTER_EXECS);
         execv(executable_path, ctx->argv);
         fprintf(stderr, "[shell exec] error in execv\n");
         exit(1);
     }
 
     // PARENT PROCESS
-    int status;
-    waitpid(pid, &status, 0);
+    shellstats_count(COUNTER_FORKS);
+    struct job *job = job_create(&pid, 1, NULL, &started);
+    var_set_status(job_wait(job));
+    set_pipestatus(job);
+    if (audit_enabled()) {
+        struct audit_stage stage = { ctx->command_name, executable_path };
+        audit_record_job(job, &stage);
+    }
+    job_free(job);
     free(executable_path);
 }
 
@@ -664,6 +885,7 @@ static void shell_cd(struct command_context *ctx) {
 
     if (ctx->argc < 2 || ctx->argv[1] == NULL) {
         fprintf(stderr, "cd: missing argument\n");
+        var_set_status(1);
         return;
     }
 
@@ -673,6 +895,7 @@ static void shell_cd(struct command_context *ctx) {
         target_dir = getenv("HOME");
         if (target_dir == NULL) {
             fprintf(stderr, "cd: HOME not set\n");
+            var_set_status(1);
             return;
         }
     }
@@ -680,172 +903,349 @@ static void shell_cd(struct command_context *ctx) {
     int res = chdir(target_dir);
     if (res == -1) {
         fprintf(stderr, "cd: %s: No such file or directory\n", ctx->argv[1]);
+        var_set_status(1);
         return;
     }
 }
 
-static char *command_generator(const char *text, int state) {
-    static int list_idx;
-    static int text_len;
-    static bool checking_builtins;
-    
-    // First call - initialize
-    if (!state) {
-        list_idx = 0;
-        text_len = strlen(text);
-        checking_builtins = true;
+static char **command_completion(const char *text, int start, int end) {
+    (void) end;
+    if (text == NULL) {
+        fprintf(stderr, "[command completion] text is NULL\n");
+        return NULL;
     }
     
-    // First check builtins
-    if (checking_builtins) {
-        while (command_names[list_idx]) {
-            char *name = command_names[list_idx++];
-            if (strncmp(name, text, text_len) == 0) {
-                return strdup(name);
-            }
+    // Everything goes through the cached listings; never fall back to
+    // readline's own filename completion, which rereads the directory
+    rl_attempted_completion_over = 1;
+    completion_clear(&completions);
+    
+    // Sorting (which also drops duplicates) is only switched off for the
+    // ranked fuzzy list, and readline reads the flag after we return
+    rl_sort_completion_matches = 1;
+    
+    char command[MAX_COMMAND_LENGTH];
+    if (!find_completion_command(start, command, sizeof(command))) {
+        if (strchr(text, '/')) {
+            rl_filename_completion_desired = 1;
+            complete_paths(text, false, &completions);
+        } else if (fuzzy_completion && text[0] != '\0') {
+            return fuzzy_completion_matches(text);
+        } else {
+            complete_commands(text, &completions);
+        }
+    } else {
+        completion_provider provider = completion_find(command);
+        if (provider) {
+            provider(text, &completions);
+        } else {
+            rl_filename_completion_desired = 1;
+            complete_paths(text, false, &completions);
         }
-        // Done with builtins, now check PATH
-        checking_builtins = false;
     }
     
-    // Now check PATH executables
-    return path_executable_generator(text, state);
+    return rl_completion_matches(text, completion_generator);
 }
 
-static char **command_completion(const char *text, int start, int end) {
-    if (text == NULL) {
-        fprintf(stderr, "[command completion] text is NULL\n");
-        return NULL;
+// Hands out the words collected by command_completion; readline frees them
+static char *completion_generator(const char *text, int state) {
+    static int list_idx;
+    (void) text;
+    
+    if (!state) {
+        list_idx = 0;
     }
-
-    if (start == 0) {
-        return rl_completion_matches(text, command_generator);
+    if (list_idx >= completions.count) {
+        return NULL;
     }
-
-    return NULL;
+    
+    char *word = completions.items[list_idx];
+    completions.items[list_idx++] = NULL;
+    return word;
 }
 
-static bool is_executable(const char *path) {
-    if (path == NULL) {
-        fprintf(stderr, "path is NULL\n");
-        return false;
+// Finds the command whose argument is being completed: the first word of the
+// current simple command, after reserved words and assignments. False when
+// the word at `start` is itself in command position
+static bool find_completion_command(int start, char *buf, size_t size) {
+    static const char *leading_words[] = {
+        "if", "then", "else", "elif", "do", "while", "until", "!", "{", NULL,
+    };
+    
+    int begin = start;
+    while (begin > 0 && !strchr("|;&(){\n", rl_line_buffer[begin - 1])) {
+        begin--;
     }
-
-    struct stat st;
-    if (stat(path, &st) == -1) {
-        return false;
+    
+    int pos = begin;
+    while (true) {
+        while (pos < start && (rl_line_buffer[pos] == ' ' || rl_line_buffer[pos] == '\t')) {
+            pos++;
+        }
+        int word_start = pos;
+        while (pos < start && rl_line_buffer[pos] != ' ' && rl_line_buffer[pos] != '\t') {
+            pos++;
+        }
+        if (pos == word_start || pos == start) {
+            // No complete word before the cursor
+            return false;
+        }
+    
+        size_t length = pos - word_start;
+        if (length >= size) {
+            return false;
+        }
+        memcpy(buf, rl_line_buffer + word_start, length);
+        buf[length] = '\0';
+    
+        bool skip = strchr(buf, '=') && var_is_name(buf, strchr(buf, '=') - buf);
+        for (int i = 0; leading_words[i] && !skip; i++) {
+            skip = (strcmp(buf, leading_words[i]) == 0);
+        }
+        if (!skip) {
+            return true;
+        }
     }
-
-    return S_ISREG(st.st_mode) && (st.st_mode & S_IXUSR);
 }
 
-static char *path_executable_generator(const char *text, int state) {
-    if (text == NULL) {
-        fprintf(stderr, "[path executable generator] text is NULL\n");
-        return NULL;
+// Builtins, aliases, functions and PATH executables starting with `text`
+static void complete_commands(const char *text, struct completion_list *out) {
+    size_t text_len = strlen(text);
+    for (int i = 0; command_names[i]; i++) {
+        if (strncmp(command_names[i], text, text_len) == 0) {
+            completion_add(out, command_names[i]);
+        }
     }
-
-    static char **executable_list = NULL;
-    static int list_idx, text_len;
-
-    if (!state) {
-        list_idx = 0;
-        text_len = strlen(text);
-
-        if (executable_list) {
-            for (int i = 0; executable_list[i]; i++) {
-                free(executable_list[i]);
+    
+    for (int b = 0; b < DEFINITION_BUCKETS; b++) {
+        for (struct definition *def = definitions[b]; def; def = def->next) {
+            if ((def->alias || def->function) && strncmp(def->name, text, text_len) == 0) {
+                completion_add(out, def->name);
             }
-            free(executable_list);
-            executable_list = NULL;
-        }
-
-        char *path_env = getenv("PATH");
-        if (path_env == NULL) {
-            fprintf(stderr, "[path executable generator] path env is NULL\n");
-            return NULL;
         }
+    }
+    
+    char *path_env = getenv("PATH");
+    if (path_env == NULL) {
+        return;
+    }
+    
+    // Duplicates across PATH entries are dropped by readline
+    char *path_copy = strdup(path_env);
+    char *saveptr = NULL;
+    for (char *dir = strtok_r(path_copy, ":", &saveptr); dir; dir = strtok_r(NULL, ":", &saveptr)) {
+        dir_cache_each(dir, text, visit_executable, out);
+    }
+    free(path_copy);
+}
 
-        int capacity = 1024, count = 0;
-        executable_list = malloc(capacity * sizeof(char *));
-        if (executable_list == NULL) {
-            fprintf(stderr, "[path executable generator] failed to malloc for executable list\n");
-            return NULL;
+// Commands and whole history lines ranked by fuzzy score plus usage, best
+// first. Whatever the budget allows is searched: builtins, aliases and
+// functions, PATH, then history from the newest line back
+static char **fuzzy_completion_matches(const char *text) {
+    struct fuzzy_search search;
+    fuzzy_begin(&search, text, FUZZY_BUDGET_MS);
+    
+    for (int i = 0; command_names[i]; i++) {
+        fuzzy_offer(&search, command_names[i], fuzzy_command_count(command_names[i]));
+    }
+    for (int b = 0; b < DEFINITION_BUCKETS; b++) {
+        for (struct definition *def = definitions[b]; def; def = def->next) {
+            if (def->alias || def->function) {
+                fuzzy_offer(&search, def->name, fuzzy_command_count(def->name));
+            }
         }
-
+    }
+    
+    char *path_env = getenv("PATH");
+    if (path_env) {
         char *path_copy = strdup(path_env);
-        char *token = strtok(path_copy, ":");
-        
-        while (token) {
-            DIR *dir = opendir(token);
-            if (dir) {
-                struct dirent *entry;
-                while ((entry = readdir(dir)) != NULL) {
-                    // Skip . and ..
-                    if (strcmp(entry->d_name, ".") == 0 || 
-                        strcmp(entry->d_name, "..") == 0) {
-                        continue;
-                    }
-                    
-                    // Build full path
-                    char full_path[MAX_PATH_LENGTH];
-                    snprintf(full_path, sizeof(full_path), "%s/%s", 
-                            token, entry->d_name);
-                    
-                    // Check if executable
-                    if (is_executable(full_path)) {
-                        // Check if we need to grow the list
-                        if (count >= capacity - 1) {
-                            capacity *= 2;
-                            executable_list = realloc(executable_list, 
-                                                     capacity * sizeof(char *));
-                        }
-                        
-                        // Add to list (no duplicates check for simplicity)
-                        executable_list[count++] = strdup(entry->d_name);
-                    }
-                }
-                closedir(dir);
-            }
-            token = strtok(NULL, ":");
+        char *saveptr = NULL;
+        for (char *dir = strtok_r(path_copy, ":", &saveptr); dir && !search.timed_out; 
+             dir = strtok_r(NULL, ":", &saveptr)) {
+            dir_cache_each(dir, "", visit_fuzzy_command, &search);
         }
-        
         free(path_copy);
-        executable_list[count] = NULL;
     }
+    
+    fuzzy_offer_history(&search);
+    
+    if (search.num_results == 0) {
+        fuzzy_end(&search);
+        return NULL;
+    }
+    
+    // matches[0] is what replaces the word; readline narrows it to the
+    // common prefix of the rest. Keep the ranking for the listing
+    char **matches = malloc((search.num_results + 2) * sizeof(char *));
+    matches[0] = strdup(search.num_results == 1 ? search.results[0].text : text);
+    for (int i = 0; i < search.num_results; i++) {
+        matches[i + 1] = search.results[i].text;
+        search.results[i].text = NULL;
+    }
+    matches[search.num_results + 1] = NULL;
+    rl_sort_completion_matches = 0;
+    
+    fuzzy_end(&search);
+    return matches;
+}
+
+// Executable bits aren't checked here: a stat per PATH entry would eat the
+// budget, and PATH directories hold little else
+static bool visit_fuzzy_command(const char *dir, const char *name, int type, void *data) {
+    (void) dir;
+    if (type == DT_DIR) {
+        return true;
+    }
+    return fuzzy_offer(data, name, fuzzy_command_count(name));
+}
+
+// Only entries matching the prefix get stat'ed
+static bool visit_executable(const char *dir, const char *name, int type, void *data) {
+    if (type == DT_DIR) {
+        return true;
+    }
+    
+    char full_path[MAX_PATH_LENGTH];
+    snprintf(full_path, sizeof(full_path), "%s/%s", dir, name);
+    if (is_executable(full_path)) {
+        completion_add(data, name);
+    }
+    return true;
+}
+
+static void complete_directories(const char *text, struct completion_list *out) {
+    rl_filename_completion_desired = 1;
+    complete_paths(text, true, out);
+}
 
-    if (executable_list) {
-        while (executable_list[list_idx]) {
-            char *name = executable_list[list_idx++];
-            if (strncmp(name, text, text_len) == 0) {
-                return strdup(name);
+static void complete_aliases(const char *text, struct completion_list *out) {
+    size_t text_len = strlen(text);
+    for (int b = 0; b < DEFINITION_BUCKETS; b++) {
+        for (struct definition *def = definitions[b]; def; def = def->next) {
+            if (def->alias && strncmp(def->name, text, text_len) == 0) {
+                completion_add(out, def->name);
             }
         }
     }
+}
+
+static void complete_variables(const char *text, struct completion_list *out) {
+    struct variable_prefix search = { text, strlen(text), out };
+    var_each_name(visit_variable, &search);
+    
+    // Inherited variables the shell hasn't touched are only in environ
+    for (char **env = environ; *env; env++) {
+        const char *equals = strchr(*env, '=');
+        size_t length = equals ? (size_t)(equals - *env) : strlen(*env);
+        if (length >= search.length && strncmp(*env, text, search.length) == 0) {
+            char *name = strndup(*env, length);
+            completion_add(out, name);
+            free(name);
+        }
+    }
+}
 
-    return NULL;
+static void visit_variable(const char *name, void *data) {
+    struct variable_prefix *search = data;
+    if (strncmp(name, search->text, search->length) == 0) {
+        completion_add(search->out, name);
+    }
+}
+
+static void register_completions(void) {
+    completion_register("cd", complete_directories);
+    completion_register("type", complete_commands);
+    completion_register("alias", complete_aliases);
+    completion_register("unalias", complete_aliases);
+    completion_register("export", complete_variables);
+    completion_register("unset", complete_variables);
+}
+
+static bool is_executable(const char *path) {
+    if (path == NULL) {
+        fprintf(stderr, "path is NULL\n");
+        return false;
+    }
+    
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return false;
+    }
+    
+    return S_ISREG(st.st_mode) && (st.st_mode & S_IXUSR);
 }
 
 static void shell_exec_pipeline(struct command_context *ctx) {
     int n = ctx->num_commands;
     
+    // Per-stage view of the commands, after stripping any `sched` prefix
+    char ***stage_argv = malloc(n * sizeof(char **));
+    int *stage_argc = malloc(n * sizeof(int));
+    struct stage_sched *stage_policy = malloc(n * sizeof(struct stage_sched));
+    
+    for (int i = 0; i < n; i++) {
+        stage_argv[i] = ctx->all_commands[i];
+        stage_argc[i] = ctx->all_argc[i];
+        stage_policy[i] = pipeline_sched;
+        
+        if (stage_argc[i] > 0 && strcmp(stage_argv[i][0], "sched") == 0) {
+            int skip = parse_sched_options(stage_argv[i], stage_argc[i], &stage_policy[i]);
+            if (skip < 0 || skip >= stage_argc[i]) {
+                if (skip >= 0) {
+                    fprintf(stderr, "sched: missing command in pipeline\n");
+                }
+                free(stage_argv);
+                free(stage_argc);
+                free(stage_policy);
+                return;
+            }
+            stage_argv[i] += skip;
+            stage_argc[i] -= skip;
+        }
+        
+        if (stage_argc[i] == 0) {
+            fprintf(stderr, "syntax error near unexpected token `|'\n");
+            free(stage_argv);
+            free(stage_argc);
+            free(stage_policy);
+            return;
+        }
+    }
+    
+    // Sibling-core groups, shared by adjacent stages that ask for co-location
+    cpu_set_t *groups = NULL;
+    int num_groups = 0;
+    for (int i = 0; i < n; i++) {
+        if (stage_policy[i].colocate) {
+            num_groups = sched_sibling_groups(&stage_policy[i], &groups);
+            break;
+        }
+    }
+    
     // Check which commands are builtins and find executables
     bool *is_builtin_arr = malloc(n * sizeof(bool));
     char **exec_paths = malloc(n * sizeof(char *));
     
     for (int i = 0; i < n; i++) {
-        is_builtin_arr[i] = is_builtin(ctx->all_command_names[i]);
+        // Aliases and functions run in the child just like builtins
+        is_builtin_arr[i] = find_definition(stage_argv[i][0]) || is_builtin(stage_argv[i][0]);
         
         if (!is_builtin_arr[i]) {
-            exec_paths[i] = find_executable_in_path(ctx->all_command_names[i]);
+            exec_paths[i] = find_executable_in_path(stage_argv[i][0]);
             if (!exec_paths[i]) {
-                fprintf(stdout, "%s: command not found\n", ctx->all_command_names[i]);
+                fprintf(stdout, "%s: command not found\n", stage_argv[i][0]);
+                var_set_status(STATUS_NOT_FOUND);
                 // Cleanup what we've allocated so far
                 for (int j = 0; j < i; j++) {
                     if (exec_paths[j]) free(exec_paths[j]);
                 }
                 free(exec_paths);
                 free(is_builtin_arr);
+                free(groups);
+                free(stage_argv);
+                free(stage_argc);
+                free(stage_policy);
                 return;
             }
         } else {
@@ -853,67 +1253,178 @@ static void shell_exec_pipeline(struct command_context *ctx) {
         }
     }
     
-    // Create pipes (n-1 pipes for n commands)
+    bool fanout_failed = false;
+    struct stage_fanout *fanouts = open_stage_fanouts(ctx, &fanout_failed);
+    if (fanout_failed) {
+        var_set_status(1);
+        for (int j = 0; j < n; j++) {
+            if (exec_paths[j]) free(exec_paths[j]);
+        }
+        free(exec_paths);
+        free(is_builtin_arr);
+        free(groups);
+        free(stage_argv);
+        free(stage_argc);
+        free(stage_policy);
+        return;
+    }
+    
+    // Create pipes (n-1 pipes for n commands). With pipestats each link is
+    // two pipes, stage i -> pipes[i] -> relay -> pipes[num_pipes + i] -> stage i+1
+    bool relayed = pipeline_stats || getenv("SHELL_PIPESTATS") != NULL;
     int num_pipes = n - 1;
-    int (*pipes)[2] = malloc(num_pipes * sizeof(int[2]));
+    int num_fds = relayed ? 2 * num_pipes : num_pipes;
+    int (*pipes)[2] = malloc(num_fds * sizeof(int[2]));
+    
+    // Adjacent builtins that don't read stdin run one after another in a
+    // single child, with no pipe between them. Not with pipestats, which
+    // measures every link
+    bool *fused = calloc(n, sizeof(bool));      // Stage i feeds stage i + 1 directly
+    bool any_fused = false;
+    for (int i = 0; i + 1 < n && !relayed; i++) {
+        bool own_output = !fanouts || fanouts[i].pipe[0] < 0;
+        fused[i] = own_output && can_fuse_stage(ctx, stage_argv, i) && can_fuse_stage(ctx, stage_argv, i + 1);
+        any_fused |= fused[i];
+    }
+    
+    // Where fused stages leave their statuses for PIPESTATUS
+    int *fused_statuses = NULL;
+    if (any_fused) {
+        fused_statuses = mmap(NULL, n * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (fused_statuses == MAP_FAILED) {
+            fused_statuses = NULL;
+        } else {
+            for (int i = 0; i < n; i++) {
+                fused_statuses[i] = -1;
+            }
+        }
+    }
     
-    for (int i = 0; i < num_pipes; i++) {
+    for (int i = 0; i < num_fds; i++) {
+        if (i < num_pipes && fused[i]) {
+            pipes[i][0] = -1;
+            pipes[i][1] = -1;
+            continue;
+        }
         if (pipe(pipes[i]) == -1) {
             fprintf(stderr, "pipe: failed to create pipe\n");
             // Close pipes we've already created
             for (int j = 0; j < i; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+                if (pipes[j][0] >= 0) {
+                    close(pipes[j][0]);
+                    close(pipes[j][1]);
+                }
             }
             free(pipes);
+            free(fused);
+            if (fused_statuses) {
+                munmap(fused_statuses, n * sizeof(int));
+            }
+            if (fanouts) {
+                close_stage_fanouts(fanouts, n);
+                free(fanouts);
+            }
             for (int j = 0; j < n; j++) {
                 if (exec_paths[j]) free(exec_paths[j]);
             }
             free(exec_paths);
             free(is_builtin_arr);
+            free(groups);
+            free(stage_argv);
+            free(stage_argc);
+            free(stage_policy);
             return;
         }
     }
     
+    // Fanouts pass a stage's output on to the next pipe (or the shell's
+    // stdout) themselves. They start before the forks so that a stage whose
+    // fanout can't start writes straight to its destination instead
+    if (fanouts) {
+        for (int i = 0; i < n; i++) {
+            struct stage_fanout *stage = &fanouts[i];
+            if (stage->pipe[0] < 0) {
+                continue;
+            }
+            int out_fd = fcntl((i < n - 1) ? pipes[i][1] : STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+            if (!fanout_start(&stage->fanout, stage->pipe[0], out_fd, stage->sinks, stage->num_sinks)) {
+                close(stage->pipe[1]);
+                stage->pipe[1] = -1;
+            }
+            free(stage->sinks);
+            stage->pipe[0] = -1;
+            stage->sinks = NULL;
+            stage->num_sinks = 0;
+        }
+    }
+    
     // Fork for each command
     pid_t *pids = malloc(n * sizeof(pid_t));
+    fflush(stdout);
     
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int num_procs = 0;
     for (int i = 0; i < n; i++) {
-        pids[i] = fork();
+        // Stages i..last share this child
+        int last = i;
+        while (fused[last]) {
+            last++;
+        }
+        pids[num_procs] = fork();
         
-        if (pids[i] == -1) {
+        if (pids[num_procs] == -1) {
             fprintf(stderr, "fork: failed\n");
             exit(1);
         }
         
-        if (pids[i] == 0) {
+        if (pids[num_procs] == 0) {
             // CHILD PROCESS for command i
+            signal(SIGPIPE, SIG_DFL);
+            
+            // Pin / renice before anything else so the exec'd image starts in place
+            const cpu_set_t *group = NULL;
+            if (stage_policy[i].colocate && num_groups > 0) {
+                // Stages 0 and 1 share the first core, 2 and 3 the next, ...
+                group = &groups[(i / 2) % num_groups];
+            }
+            apply_stage_sched(&stage_policy[i], group);
             
             // Redirect stdin from previous pipe (except first command)
             if (i > 0) {
-                dup2(pipes[i-1][0], STDIN_FILENO);
+                dup2(pipes[relayed ? num_pipes + i - 1 : i - 1][0], STDIN_FILENO);
             }
             
             // Redirect stdout to next pipe (except last command)
-            if (i < n - 1) {
-                dup2(pipes[i][1], STDOUT_FILENO);
+            if (last < n - 1) {
+                dup2(pipes[last][1], STDOUT_FILENO);
+            }
+            
+            // With `>|`, to the fanout that passes it on
+            if (fanouts && fanouts[last].pipe[1] >= 0) {
+                dup2(fanouts[last].pipe[1], STDOUT_FILENO);
             }
             
             // Close ALL pipe file descriptors in child
-            for (int j = 0; j < num_pipes; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+            for (int j = 0; j < num_fds; j++) {
+                if (pipes[j][0] >= 0) {
+                    close(pipes[j][0]);
+                    close(pipes[j][1]);
+                }
+            }
+            if (fanouts) {
+                close_stage_fanouts(fanouts, n);
+                for (int j = 0; j < n; j++) {
+                    fanout_after_fork(&fanouts[j].fanout);
+                }
             }
             
             // Execute the command
             if (is_builtin_arr[i]) {
-                // Builtin command
-                command_function func = get_builtin_function(ctx->all_command_names[i]);
-                if (!func) {
-                    fprintf(stderr, "%s: builtin not found\n", ctx->all_command_names[i]);
-                    exit(1);
-                }
-                
+                // Builtin, alias or function
+                jobs_after_fork();
+                audit_after_fork();
+                close_coprocess_fds();
                 struct command_context temp_ctx = {
                     .redirect = false,
                     .out_file = NULL,
@@ -921,91 +1432,233 @@ static void shell_exec_pipeline(struct command_context *ctx) {
                     .redirect_err = false,
                     .error_file = NULL,
                     .err_mode = O_TRUNC,
-                    .command_name = ctx->all_command_names[i],
-                    .argc = ctx->all_argc[i],
-                    .argv = ctx->all_commands[i],
+                    .command_name = stage_argv[i][0],
+                    .argc = stage_argc[i],
+                    .argv = stage_argv[i],
                     .num_commands = 0,
                     .all_commands = NULL,
                     .all_argc = NULL,
                     .all_command_names = NULL,
                 };
                 
-                func(&temp_ctx);
-                exit(0);
+                if (last > i) {
+                    run_fused_stages(stage_argv, stage_argc, i, last, fused_statuses);
+                } else {
+                    execute_command(&temp_ctx);
+                }
+                fflush(stdout);
+                exit(var_status());
             } else {
                 // External command
-                execv(exec_paths[i], ctx->all_commands[i]);
-                fprintf(stderr, "execv: failed to execute %s\n", ctx->all_command_names[i]);
+                shellstats_count(COUNTER_EXECS);
+                execv(exec_paths[i], stage_argv[i]);
+                fprintf(stderr, "execv: failed to execute %s\n", stage_argv[i][0]);
                 exit(1);
             }
         }
+        shellstats_count(COUNTER_FORKS);
+        num_procs++;
+        i = last;
     }
     
     // PARENT PROCESS
-    // Close all pipes in parent
-    for (int i = 0; i < num_pipes; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+    // Each fanout sees EOF once its stage is done with the write end
+    if (fanouts) {
+        close_stage_fanouts(fanouts, n);
     }
     
-    // Wait for all children
-    for (int i = 0; i < n; i++) {
-        waitpid(pids[i], NULL, 0);
+    // Close all pipes in parent, except the ends the relays copy between
+    struct pipe_relay *relays = NULL;
+    if (relayed) {
+        relays = malloc(num_pipes * sizeof(struct pipe_relay));
+        for (int i = 0; i < num_pipes; i++) {
+            close(pipes[i][1]);
+            close(pipes[num_pipes + i][0]);
+            pipe_relay_start(&relays[i], pipes[i][0], pipes[num_pipes + i][1]);
+        }
+    } else {
+        for (int i = 0; i < num_pipes; i++) {
+            if (pipes[i][0] >= 0) {
+                close(pipes[i][0]);
+                close(pipes[i][1]);
+            }
+        }
     }
     
+    // Wait for all children; the pipeline's status is the last stage's
+    struct job *job = job_create(pids, num_procs, NULL, &started);
+    var_set_status(job_wait(job));
+    if (any_fused) {
+        set_fused_pipestatus(job, fused, fused_statuses, n);
+    } else {
+        set_pipestatus(job);
+    }
+    if (fanouts) {
+        for (int i = 0; i < n; i++) {
+            fanout_join(&fanouts[i].fanout);
+            free(fanouts[i].sinks);
+        }
+        free(fanouts);
+    }
+    if (relays) {
+        for (int i = 0; i < num_pipes; i++) {
+            pipe_relay_join(&relays[i]);
+        }
+        char **names = malloc(n * sizeof(char *));
+        for (int i = 0; i < n; i++) {
+            names[i] = stage_argv[i][0];
+        }
+        pipestats_report(stderr, job, names, relays);
+        free(names);
+        free(relays);
+    }
+    if (audit_enabled()) {
+        // A fused run is recorded under its first stage
+        struct audit_stage *stages = malloc(n * sizeof(struct audit_stage));
+        for (int i = 0, proc = 0; i < n; i++) {
+            if (i > 0 && fused[i - 1]) {
+                continue;
+            }
+            stages[proc].command = stage_argv[i][0];
+            stages[proc].path = exec_paths[i];
+            proc++;
+        }
+        audit_record_job(job, stages);
+        free(stages);
+    }
+    job_free(job);
+    
     // Cleanup
     free(pipes);
     free(pids);
+    free(fused);
+    if (fused_statuses) {
+        munmap(fused_statuses, n * sizeof(int));
+    }
     for (int i = 0; i < n; i++) {
         if (exec_paths[i]) free(exec_paths[i]);
     }
     free(exec_paths);
     free(is_builtin_arr);
+    free(groups);
+    free(stage_argv);
+    free(stage_argc);
+    free(stage_policy);
+}
+
+// Builtins that never read stdin and change nothing later stages can see,
+// so running them one after another in one process gives the same result
+// as a process each. Stages with a `sched` prefix keep their own process
+static bool can_fuse_stage(struct command_context *ctx, char ***stage_argv, int i) {
+    static const char *fusible[] = {
+        "echo", "pwd", "type", "history", "jobs", "true", "false", ":", "shellstats",
+    };
+    if (stage_argv[i] != ctx->all_commands[i] || find_definition(stage_argv[i][0])) {
+        return false;
+    }
+    for (size_t j = 0; j < sizeof(fusible) / sizeof(fusible[0]); j++) {
+        if (strcmp(stage_argv[i][0], fusible[j]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs stages first..last of a pipeline one after another in this (forked)
+// process. None of them reads stdin, so what an earlier stage writes would
+// only sit unread in its pipe: it goes to /dev/null, and only the last
+// stage's output reaches the rest of the pipeline. Stderr and statuses are
+// kept for every stage
+static void run_fused_stages(char ***stage_argv, int *stage_argc, int first, int last, int *statuses) {
+    int out_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    for (int i = first; i <= last; i++) {
+        dup2((i < last && null_fd >= 0) ? null_fd : out_fd, STDOUT_FILENO);
+        
+        struct command_context temp_ctx = {
+            .out_mode = O_TRUNC,
+            .err_mode = O_TRUNC,
+            .command_name = stage_argv[i][0],
+            .argc = stage_argc[i],
+            .argv = stage_argv[i],
+        };
+        execute_command(&temp_ctx);
+        fflush(stdout);
+        if (statuses) {
+            statuses[i] = var_status();
+        }
+    }
+    close(out_fd);
+    if (null_fd >= 0) {
+        close(null_fd);
+    }
+}
+
+// PIPESTATUS when fused stages share a process: the last stage of a run
+// gets the process's status, the others the one they left in `statuses`
+static void set_fused_pipestatus(const struct job *job, const bool *fused, const int *statuses, int n) {
+    char buf[JOB_TEXT_LENGTH];
+    size_t used = 0;
+    buf[0] = '\0';
+    
+    int proc = 0;
+    for (int i = 0; i < n && used < sizeof(buf); i++) {
+        int status = job->procs[proc].status;
+        if (fused[i] && statuses && statuses[i] >= 0) {
+            status = statuses[i];
+        }
+        if (!fused[i]) {
+            proc++;
+        }
+        used += snprintf(buf + used, sizeof(buf) - used, i ? " %d" : "%d", status);
+    }
+    var_set("PIPESTATUS", buf);
 }
 
-// Helper to find executable in PATH
+// First PATH entry for `command_name` that is an executable file. Listings
+// come from the directory cache, so a lookup costs a stat per directory and
+// a binary search rather than a readdir of each one
 static char *find_executable_in_path(const char *command_name) {
     char *path_env = getenv("PATH");
-    if (!path_env) {
+    if (!path_env || strchr(command_name, '/')) {
         return NULL;
     }
     
     char *path_copy = strdup(path_env);
-    char *token = strtok(path_copy, ":");
+    char *saveptr = NULL;
     char *executable_path = NULL;
     
-    while (token) {
-        DIR *dir = opendir(token);
-        if (dir) {
-            struct dirent *entry;
-            while ((entry = readdir(dir)) != NULL) {
-                if (strcmp(entry->d_name, command_name) == 0) {
-                    char full_path[MAX_PATH_LENGTH];
-                    snprintf(full_path, sizeof(full_path), "%s/%s", 
-                            token, entry->d_name);
-                    
-                    if (access(full_path, X_OK) == 0) {
-                        struct stat path_stat;
-                        stat(full_path, &path_stat);
-                        if (S_ISREG(path_stat.st_mode)) {
-                            executable_path = strdup(full_path);
-                            break;
-                        }
-                    }
-                }
-            }
-            closedir(dir);
+    for (char *dir = strtok_r(path_copy, ":", &saveptr); dir; dir = strtok_r(NULL, ":", &saveptr)) {
+        struct path_lookup lookup = { command_name, false };
+        dir_cache_each(dir, command_name, visit_exact_name, &lookup);
+        if (!lookup.found) {
+            continue;
         }
-        if (executable_path) {
-            break;
+        
+        char full_path[MAX_PATH_LENGTH];
+        snprintf(full_path, sizeof(full_path), "%s/%s", dir, command_name);
+        if (access(full_path, X_OK) == 0) {
+            struct stat path_stat;
+            if (stat(full_path, &path_stat) == 0 && S_ISREG(path_stat.st_mode)) {
+                executable_path = strdup(full_path);
+                break;
+            }
         }
-        token = strtok(NULL, ":");
     }
     
     free(path_copy);
     return executable_path;
 }
 
+// Names come sorted, so an exact match is the first name with the prefix
+static bool visit_exact_name(const char *dir, const char *name, int type, void *data) {
+    (void) dir;
+    (void) type;
+    struct path_lookup *lookup = data;
+    lookup->found = strcmp(name, lookup->name) == 0;
+    return false;
+}
+
 // Helper to check if a command is a builtin
 static bool is_builtin(const char *command_name) {
     for (size_t i = 0; i < NUM_COMMANDS; i++) {
@@ -1067,6 +1720,12 @@ static void execute_builtin_in_fork(const char *command_name, char **argv, int a
     exit(0);
 }
 
+// History entry plus a count in the fuzzy completion frequency table
+static void remember_line(const char *line) {
+    add_history(line);
+    fuzzy_record(line);
+}
+
 static void shell_history(struct command_context *ctx) {
     FILE *output = stdout;
     
@@ -1079,6 +1738,15 @@ static void shell_history(struct command_context *ctx) {
         }
     }
     
+    // -n: pick up what other sessions appended to HISTFILE since
+    if (ctx->argc >= 2 && strcmp(ctx->argv[1], "-n") == 0) {
+        histfile_read_new(remember_line);
+        if (output != stdout) {
+            fclose(output);
+        }
+        return;
+    }
+    
     // Check for -r flag (read from file)
     if (ctx->argc >= 3 && strcmp(ctx->argv[1], "-r") == 0) {
         const char *filepath = ctx->argv[2];
@@ -1100,7 +1768,7 @@ static void shell_history(struct command_context *ctx) {
             }
             
             if (strlen(line) > 0) {
-                add_history(line);
+                remember_line(line);
             }
         }
         
@@ -1213,47 +1881,3525 @@ static void shell_history(struct command_context *ctx) {
     }
 }
 
+// HISTFILE is shared with other sessions: it is appended to line by line
+// as commands are entered and never rewritten
 static void load_history_histfile(void) {
     char *histfile = getenv("HISTFILE");
-    if (histfile) {
-        FILE *file = fopen(histfile, "r");
-        if (file) {
-            char line[MAX_COMMAND_LENGTH];
-            while (fgets(line, sizeof(line), file)) {
-                // Remove trailing newline
-                size_t len = strlen(line);
-                if (len > 0 && line[len - 1] == '\n') {
-                    line[len - 1] = '\0';
-                }
-                
-                // Skip empty lines
-                if (strlen(line) > 0) {
-                    add_history(line);
-                }
-            }
-            fclose(file);
-        }
+    if (histfile && histfile_open(histfile)) {
+        histfile_load(remember_line);
     }
 }
 
-static void write_history_histfile(void) {
-    char *histfile = getenv("HISTFILE");
-
-    if (histfile) {
-        FILE *file = fopen(histfile, "w");
-        if (file) {
-            // Get history list
-            HIST_ENTRY **hist_list = history_list();
-            
-            if (hist_list) {
-                // Write each history entry to file
-                for (int i = 0; i < history_length; i++) {
-                    if (hist_list[i]) {
-                        fprintf(file, "%s\n", hist_list[i]->line);
-                    }
-                }
+static void shell_sched(struct command_context *ctx) {
+    struct stage_sched policy = pipeline_sched;
+    
+    if (ctx->argc >= 2 && strcmp(ctx->argv[1], "-r") == 0) {
+        memset(&pipeline_sched, 0, sizeof(pipeline_sched));
+        return;
+    }
+    
+    int skip = parse_sched_options(ctx->argv, ctx->argc, &policy);
+    if (skip < 0) {
+        return;
+    }
+    
+    // No command: show or update the default policy for pipeline stages
+    if (skip >= ctx->argc) {
+        if (skip > 1) {
+            pipeline_sched = policy;
+            return;
+        }
+        
+        FILE *output = stdout;
+        if (ctx->redirect && ctx->out_file) {
+            const char *mode = (ctx->out_mode == O_APPEND) ? "a" : "w";
+            output = fopen(ctx->out_file, mode);
+            if (!output) {
+                fprintf(stderr, "sched: %s: cannot create file\n", ctx->out_file);
+                return;
             }
-            fclose(file);
         }
+        
+        char cpus[MAX_COMMAND_LENGTH] = "all";
+        if (pipeline_sched.has_cpus) {
+            format_cpu_list(&pipeline_sched.cpus, cpus, sizeof(cpus));
+        }
+        fprintf(output, "cpus: %s\n", cpus);
+        if (pipeline_sched.has_nice) {
+            fprintf(output, "nice: %d\n", pipeline_sched.nice);
+        } else {
+            fprintf(output, "nice: inherit\n");
+        }
+        if (pipeline_sched.has_ioprio) {
+            fprintf(output, "ioprio: %d:%d\n", pipeline_sched.ioprio_class, pipeline_sched.ioprio_level);
+        } else {
+            fprintf(output, "ioprio: inherit\n");
+        }
+        fprintf(output, "colocate: %s\n", pipeline_sched.colocate ? "on" : "off");
+        
+        if (output != stdout) {
+            fclose(output);
+        }
+        return;
+    }
+    
+    // With a command: run it once under the policy
+    char *command_name = ctx->argv[skip];
+    if (is_builtin(command_name)) {
+        // Builtins run inside the shell itself; don't repin the shell
+        struct command_context sub_ctx = *ctx;
+        sub_ctx.command_name = command_name;
+        sub_ctx.argv = ctx->argv + skip;
+        sub_ctx.argc = ctx->argc - skip;
+        get_builtin_function(command_name)(&sub_ctx);
+        return;
     }
-}
\ No newline at end of file
+    
+    struct command_context sub_ctx = *ctx;
+    sub_ctx.command_name = command_name;
+    sub_ctx.argv = ctx->argv + skip;
+    sub_ctx.argc = ctx->argc - skip;
+    
+    exec_sched = &policy;
+    shell_exec(&sub_ctx);
+    exec_sched = NULL;
+}
+
+// Parses `sched` options starting at argv[1]; returns the index of the first
+// non-option word (the command, or argc if there is none), or -1 on error
+static int parse_sched_options(char **argv, int argc, struct stage_sched *policy) {
+    int i = 1;
+    
+    while (i < argc && argv[i][0] == '-') {
+        const char *opt = argv[i];
+        
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        }
+        
+        if (strcmp(opt, "-s") == 0) {
+            policy->colocate = true;
+            i++;
+            continue;
+        }
+        
+        if (i + 1 >= argc) {
+            fprintf(stderr, "sched: %s: option requires an argument\n", opt);
+            return -1;
+        }
+        const char *value = argv[i + 1];
+        
+        if (strcmp(opt, "-c") == 0) {
+            if (!parse_cpu_list(value, &policy->cpus)) {
+                fprintf(stderr, "sched: %s: invalid cpu list\n", value);
+                return -1;
+            }
+            policy->has_cpus = true;
+        } else if (strcmp(opt, "-n") == 0) {
+            char *end;
+            long nice_value = strtol(value, &end, 10);
+            if (*end != '\0' || nice_value < -20 || nice_value > 19) {
+                fprintf(stderr, "sched: %s: invalid nice value\n", value);
+                return -1;
+            }
+            policy->has_nice = true;
+            policy->nice = (int)nice_value;
+        } else if (strcmp(opt, "-i") == 0) {
+            // class[:level], e.g. 2:7 for best-effort lowest, 3 for idle
+            char *end;
+            long io_class = strtol(value, &end, 10);
+            long io_level = 0;
+            if (*end == ':') {
+                io_level = strtol(end + 1, &end, 10);
+            }
+            if (*end != '\0' || io_class < 0 || io_class > IOPRIO_CLASS_MAX || 
+                io_level < 0 || io_level > IOPRIO_LEVEL_MAX) {
+                fprintf(stderr, "sched: %s: invalid io priority\n", value);
+                return -1;
+            }
+            policy->has_ioprio = true;
+            policy->ioprio_class = (int)io_class;
+            policy->ioprio_level = (int)io_level;
+        } else {
+            fprintf(stderr, "sched: %s: invalid option\n", opt);
+            fprintf(stderr, "sched: usage: sched [-c cpus] [-n nice] [-i class[:level]] [-s] [-r] [command ...]\n");
+            return -1;
+        }
+        i += 2;
+    }
+    
+    return i;
+}
+
+// Parses the kernel's list format ("0-3,8,10-11") used by taskset and sysfs
+static bool parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    
+    const char *p = list;
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE) {
+                return false;
+            }
+            p = end;
+        }
+        
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return false;
+        } else {
+            break;
+        }
+    }
+    
+    return CPU_COUNT(set) > 0;
+}
+
+static void format_cpu_list(const cpu_set_t *set, char *buf, size_t size) {
+    size_t pos = 0;
+    buf[0] = '\0';
+    
+    for (int cpu = 0; cpu < CPU_SETSIZE && pos < size; cpu++) {
+        if (!CPU_ISSET(cpu, set)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+            last++;
+        }
+        
+        int written;
+        if (last == cpu) {
+            written = snprintf(buf + pos, size - pos, "%s%d", pos ? "," : "", cpu);
+        } else {
+            written = snprintf(buf + pos, size - pos, "%s%d-%d", pos ? "," : "", cpu, last);
+        }
+        if (written < 0) {
+            break;
+        }
+        pos += written;
+        cpu = last;
+    }
+}
+
+// Groups the allowed CPUs by physical core (hyperthread siblings share one
+// set) so adjacent pipeline stages can be placed on the same core's caches
+static int sched_sibling_groups(const struct stage_sched *policy, cpu_set_t **groups_out) {
+    cpu_set_t allowed;
+    if (policy->has_cpus) {
+        allowed = policy->cpus;
+    } else if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        *groups_out = NULL;
+        return 0;
+    }
+    
+    cpu_set_t *groups = malloc(CPU_COUNT(&allowed) * sizeof(cpu_set_t));
+    if (groups == NULL) {
+        fprintf(stderr, "[sched] failed to malloc for sibling groups\n");
+        *groups_out = NULL;
+        return 0;
+    }
+    
+    cpu_set_t seen;
+    CPU_ZERO(&seen);
+    int count = 0;
+    
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || CPU_ISSET(cpu, &seen)) {
+            continue;
+        }
+        
+        cpu_set_t siblings;
+        char sysfs_path[MAX_PATH_LENGTH];
+        snprintf(sysfs_path, sizeof(sysfs_path), 
+                 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        
+        FILE *file = fopen(sysfs_path, "r");
+        char line[MAX_COMMAND_LENGTH];
+        if (!file || !fgets(line, sizeof(line), file) || !parse_cpu_list(line, &siblings)) {
+            CPU_ZERO(&siblings);
+            CPU_SET(cpu, &siblings);
+        }
+        if (file) {
+            fclose(file);
+        }
+        
+        CPU_AND(&groups[count], &siblings, &allowed);
+        CPU_OR(&seen, &seen, &groups[count]);
+        count++;
+    }
+    
+    *groups_out = groups;
+    return count;
+}
+
+// Runs in the child between fork and exec; failures are reported but the
+// command still runs, just without the requested placement
+static void apply_stage_sched(const struct stage_sched *policy, const cpu_set_t *group) {
+    const cpu_set_t *cpus = group;
+    if (cpus == NULL && policy->has_cpus) {
+        cpus = &policy->cpus;
+    }
+    
+    if (cpus && sched_setaffinity(0, sizeof(cpu_set_t), cpus) == -1) {
+        fprintf(stderr, "sched: failed to set cpu affinity: %s\n", strerror(errno));
+    }
+    
+    if (policy->has_nice && setpriority(PRIO_PROCESS, 0, policy->nice) == -1) {
+        fprintf(stderr, "sched: failed to set nice value: %s\n", strerror(errno));
+    }
+    
+    if (policy->has_ioprio) {
+        int ioprio = (policy->ioprio_class << IOPRIO_CLASS_SHIFT) | policy->ioprio_level;
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == -1) {
+            fprintf(stderr, "sched: failed to set io priority: %s\n", strerror(errno));
+        }
+    }
+}
+
+static void execute_node(struct command_node *node) {
+    // <(cmd) and >(cmd) started while expanding this node end with it
+    int procsub_mark = num_procsubs;
+    
+    // Redirects on a compound command cover everything it runs
+    int saved[2] = { -1, -1 };
+    bool redirected = node->type != NODE_COMMAND && (node->command.redirect || node->command.redirect_err);
+    if (redirected && !push_redirects(&node->command, saved)) {
+        finish_process_substitutions(procsub_mark);
+        var_set_status(1);
+        return;
+    }
+    
+    switch (node->type) {
+    case NODE_LIST:
+        for (int i = 0; i < node->num_children && !control_pending(); i++) {
+            execute_node(node->children[i]);
+        }
+        break;
+    case NODE_FUNCTION: {
+        // Keep the already-parsed body; calls never re-tokenize it
+        struct definition *def = get_definition(node->name);
+        free_command_node(def->function);
+        def->function = retain_command_node(node->children[0]);
+        var_set_status(0);
+        break;
+    }
+    case NODE_COMMAND:
+        execute_command(&node->command);
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        execute_node(node->children[0]);
+        if (!control_pending() && (var_status() == 0) == (node->type == NODE_AND)) {
+            execute_node(node->children[1]);
+        }
+        break;
+    case NODE_NOT:
+        execute_node(node->children[0]);
+        var_set_status(var_status() == 0);
+        break;
+    case NODE_PIPELINE:
+        execute_pipeline_node(node);
+        break;
+    case NODE_IF:
+        execute_node(node->children[0]);
+        if (control_pending()) {
+            break;
+        }
+        if (var_status() == 0) {
+            execute_node(node->children[1]);
+        } else if (node->num_children > 2) {
+            execute_node(node->children[2]);
+        } else {
+            var_set_status(0);
+        }
+        break;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        execute_loop(node);
+        break;
+    case NODE_FOR:
+        execute_for(node);
+        break;
+    case NODE_CASE:
+        execute_case(node);
+        break;
+    case NODE_CASE_ARM:
+        execute_node(node->children[0]);
+        break;
+    case NODE_BACKGROUND:
+        execute_background(node);
+        break;
+    }
+    
+    if (redirected) {
+        pop_redirects(saved);
+    }
+    finish_process_substitutions(procsub_mark);
+}
+
+// Expands words at run time so the tree itself stays reusable
+static void execute_command(struct command_context *ctx) {
+    if (ctx->num_commands == 0) {
+        int assignments = count_assignments(ctx);
+        if (assignments > 0) {
+            run_with_assignments(ctx, assignments);
+            return;
+        }
+    }
+    
+    if (ctx->needs_expansion) {
+        struct command_context expanded;
+        expand_context(ctx, &expanded);
+        run_command(&expanded);
+        free_command_context(&expanded);
+        return;
+    }
+    
+    run_command(ctx);
+}
+
+// Dispatch order: alias, function, builtin, then PATH
+static void run_command(struct command_context *ctx) {
+    // Check if it's a pipeline
+    if (ctx->num_commands > 0) {
+        // Execute pipeline (works for 2, 3, 4... any number)
+        shell_exec_pipeline(ctx);
+        return;
+    }
+    
+    if (ctx->num_fanouts > 0) {
+        run_with_fanout(ctx);
+        return;
+    }
+    
+    // Nothing left to run ("> file", or words that expanded to nothing)
+    if (ctx->argc == 0) {
+        int saved[2] = { -1, -1 };
+        bool opened = push_redirects(ctx, saved);
+        pop_redirects(saved);
+        var_set_status(opened ? 0 : 1);
+        return;
+    }
+    
+    struct definition *def = find_definition(ctx->command_name);
+    if (def && def->alias && !def->expanding) {
+        run_alias(def, ctx);
+        return;
+    }
+    if (def && def->function) {
+        run_function(def, ctx);
+        return;
+    }
+    
+    // Single command execution
+    for (size_t i = 0; i < NUM_COMMANDS; i++) {
+        if (strcmp(ctx->command_name, commands[i].name) == 0) {
+            // Builtins succeed unless they say otherwise
+            previous_status = var_status();
+            var_set_status(0);
+            commands[i].func(ctx);
+            return;
+        }
+    }
+    
+    shell_exec(ctx);
+}
+
+// Runs a simple command with stdout on a pipe, which a fanout copies to the
+// `>|` targets and on to where the output would have gone. Builtins,
+// functions and external commands all just write to the pipe
+static void run_with_fanout(struct command_context *ctx) {
+    int *sinks = malloc(ctx->num_fanouts * sizeof(int));
+    int num_sinks = open_fanout_sinks(ctx, 0, sinks);
+    if (num_sinks < 0) {
+        free(sinks);
+        var_set_status(1);
+        return;
+    }
+    
+    // A `>` file still gets the command's own output
+    struct command_context inner = *ctx;
+    inner.num_fanouts = 0;
+    int out_fd;
+    if (ctx->redirect && ctx->out_file) {
+        out_fd = open(ctx->out_file, O_WRONLY | O_CREAT | O_CLOEXEC | ctx->out_mode, 0644);
+        inner.redirect = false;
+        inner.out_file = NULL;
+    } else {
+        out_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    }
+    
+    int fds[2] = { -1, -1 };
+    if (out_fd < 0 || pipe2(fds, O_CLOEXEC) == -1) {
+        if (out_fd < 0) {
+            fprintf(stderr, "%s: cannot create file\n", ctx->out_file ? ctx->out_file : "stdout");
+        } else {
+            fprintf(stderr, "pipe: failed to create pipe\n");
+        }
+        for (int i = 0; i < num_sinks; i++) {
+            close(sinks[i]);
+        }
+        if (out_fd >= 0) {
+            close(out_fd);
+        }
+        free(sinks);
+        var_set_status(1);
+        return;
+    }
+    
+    struct fanout fanout;
+    bool started = fanout_start(&fanout, fds[0], out_fd, sinks, num_sinks);
+    free(sinks);
+    if (!started) {
+        close(fds[1]);
+        var_set_status(1);
+        return;
+    }
+    
+    fflush(stdout);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+    
+    run_command(&inner);
+    
+    // The fanout sees EOF once the last copy of the pipe's write end is gone
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    fanout_join(&fanout);
+}
+
+// Opens (truncating) the `>|` targets of pipeline stage `stage` into `fds`.
+// Returns how many there are, or -1 after closing them if one fails
+static int open_fanout_sinks(const struct command_context *ctx, int stage, int *fds) {
+    int count = 0;
+    for (int i = 0; i < ctx->num_fanouts; i++) {
+        if (ctx->fanout_stages[i] != stage) {
+            continue;
+        }
+        
+        int fd = open(ctx->fanout_files[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "%s: cannot create file\n", ctx->fanout_files[i]);
+            for (int j = 0; j < count; j++) {
+                close(fds[j]);
+            }
+            return -1;
+        }
+        fds[count++] = fd;
+    }
+    return count;
+}
+
+// Opens the `>|` targets and the pipe of each pipeline stage that has some.
+// NULL if no stage does, or (with `*failed` set) if one can't be opened
+static struct stage_fanout *open_stage_fanouts(const struct command_context *ctx, bool *failed) {
+    if (ctx->num_fanouts == 0) {
+        return NULL;
+    }
+    
+    int n = ctx->num_commands;
+    struct stage_fanout *fanouts = calloc(n, sizeof(struct stage_fanout));
+    for (int i = 0; i < n; i++) {
+        fanouts[i].pipe[0] = -1;
+        fanouts[i].pipe[1] = -1;
+    }
+    
+    for (int i = 0; i < n; i++) {
+        struct stage_fanout *stage = &fanouts[i];
+        stage->sinks = malloc(ctx->num_fanouts * sizeof(int));
+        stage->num_sinks = open_fanout_sinks(ctx, i, stage->sinks);
+        if (stage->num_sinks < 0) {
+            stage->num_sinks = 0;
+            *failed = true;
+            break;
+        }
+        if (stage->num_sinks > 0 && pipe2(stage->pipe, O_CLOEXEC) == -1) {
+            fprintf(stderr, "pipe: failed to create pipe\n");
+            stage->pipe[0] = -1;
+            stage->pipe[1] = -1;
+            *failed = true;
+            break;
+        }
+    }
+    
+    if (*failed) {
+        close_stage_fanouts(fanouts, n);
+        free(fanouts);
+        return NULL;
+    }
+    return fanouts;
+}
+
+// Closes every descriptor in `fanouts` that no fanout thread has taken yet
+static void close_stage_fanouts(struct stage_fanout *fanouts, int n) {
+    for (int i = 0; i < n; i++) {
+        struct stage_fanout *stage = &fanouts[i];
+        if (stage->pipe[0] >= 0) {
+            close(stage->pipe[0]);
+            stage->pipe[0] = -1;
+        }
+        if (stage->pipe[1] >= 0) {
+            close(stage->pipe[1]);
+            stage->pipe[1] = -1;
+        }
+        for (int j = 0; j < stage->num_sinks; j++) {
+            close(stage->sinks[j]);
+        }
+        free(stage->sinks);
+        stage->sinks = NULL;
+        stage->num_sinks = 0;
+    }
+}
+
+// Copy of `ctx` with every word and redirect target expanded
+static void expand_context(const struct command_context *ctx, struct command_context *out) {
+    *out = (struct command_context) {
+        .redirect = ctx->redirect,
+        .out_mode = ctx->out_mode,
+        .redirect_err = ctx->redirect_err,
+        .err_mode = ctx->err_mode,
+    };
+    if (ctx->out_file) {
+        out->out_file = expand_target(ctx->out_file);
+    }
+    if (ctx->error_file) {
+        out->error_file = expand_target(ctx->error_file);
+    }
+    if (ctx->num_fanouts > 0) {
+        out->num_fanouts = ctx->num_fanouts;
+        out->fanout_files = malloc(ctx->num_fanouts * sizeof(char *));
+        out->fanout_stages = malloc(ctx->num_fanouts * sizeof(int));
+        memcpy(out->fanout_stages, ctx->fanout_stages, ctx->num_fanouts * sizeof(int));
+        for (int i = 0; i < ctx->num_fanouts; i++) {
+            out->fanout_files[i] = expand_target(ctx->fanout_files[i]);
+        }
+    }
+    
+    if (ctx->num_commands > 0) {
+        out->num_commands = ctx->num_commands;
+        out->all_commands = malloc(ctx->num_commands * sizeof(char **));
+        out->all_argc = malloc(ctx->num_commands * sizeof(int));
+        out->all_command_names = malloc(ctx->num_commands * sizeof(char *));
+        for (int i = 0; i < ctx->num_commands; i++) {
+            out->all_argc[i] = expand_arguments(ctx->all_commands[i], ctx->all_argc[i], &out->all_commands[i]);
+            out->all_command_names[i] = out->all_commands[i][0];
+        }
+        
+        // Pipeline words live in all_commands; argv is only a placeholder
+        out->argv = calloc(1, sizeof(char *));
+        out->command_name = out->all_command_names[0];
+        out->argc = out->all_argc[0];
+        return;
+    }
+    
+    out->argc = expand_arguments(ctx->argv, ctx->argc, &out->argv);
+    out->command_name = out->argv[0];
+}
+
+// expand_words, after starting each process substitution and putting its
+// /dev/fd path in place of the word
+static int expand_arguments(char **words, int count, char ***out) {
+    int first = 0;
+    while (first < count && words[first][0] != PROCSUB_MARK) {
+        first++;
+    }
+    if (first == count) {
+        return expand_words(words, count, out);
+    }
+    
+    char **substituted = malloc(count * sizeof(char *));
+    for (int i = 0; i < count; i++) {
+        substituted[i] = (i >= first && words[i][0] == PROCSUB_MARK) ? start_process_substitution(words[i]) : NULL;
+        if (substituted[i] == NULL) {
+            substituted[i] = words[i];
+        }
+    }
+    
+    int expanded = expand_words(substituted, count, out);
+    for (int i = first; i < count; i++) {
+        if (substituted[i] != words[i]) {
+            free(substituted[i]);
+        }
+    }
+    free(substituted);
+    return expanded;
+}
+
+// A redirect target, which may be a process substitution: `cmd > >(gzip > f)`
+static char *expand_target(const char *word) {
+    if (word[0] == PROCSUB_MARK) {
+        char *path = start_process_substitution(word);
+        return path ? path : strdup("/dev/null");
+    }
+    return expand_word(word);
+}
+
+// Runs the command in "<(cmd)" or ">(cmd)" in a child shell connected to a
+// pipe, and returns the /dev/fd path of the shell's end. The descriptor is
+// inherited by whatever runs next, so the data never touches the disk.
+// NULL if the pipe or child can't be created
+static char *start_process_substitution(const char *word) {
+    bool readable = word[1] == '<';     // <(cmd): cmd writes, the caller reads
+    int fds[2];
+    if (pipe(fds) == -1) {
+        fprintf(stderr, "pipe: failed to create pipe\n");
+        return NULL;
+    }
+    
+    pid_t pid = fork_shell();
+    if (pid == -1) {
+        fprintf(stderr, "fork: failed\n");
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+    
+    if (pid == 0) {
+        // Pipes of earlier substitutions would otherwise never see EOF
+        for (int i = 0; i < num_procsubs; i++) {
+            close(procsubs[i].fd);
+        }
+        num_procsubs = 0;
+        
+        dup2(readable ? fds[1] : fds[0], readable ? STDOUT_FILENO : STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        
+        // Strip the mark, the '<(' or '>(' and the closing ')'
+        size_t length = strlen(word);
+        char *source = strndup(word + 3, length - 4);
+        enum parse_status status;
+        struct command_node *root = parse_script(source, &status);
+        if (root == NULL) {
+            fprintf(stderr, "syntax error in process substitution\n");
+            exit(2);
+        }
+        execute_node(root);
+        fflush(stdout);
+        exit(var_status());
+    }
+    
+    int fd = readable ? fds[0] : fds[1];
+    close(readable ? fds[1] : fds[0]);
+    
+    if (num_procsubs >= procsubs_capacity) {
+        procsubs_capacity = procsubs_capacity ? procsubs_capacity * 2 : 8;
+        procsubs = realloc(procsubs, procsubs_capacity * sizeof(struct process_substitution));
+    }
+    procsubs[num_procsubs++] = (struct process_substitution) { fd, pid };
+    
+    char path[32];
+    snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+    return strdup(path);
+}
+
+// Closes the shell's ends of the substitutions started after `mark` and
+// reaps them. A writer to a reader that quit early gets SIGPIPE; a reader
+// gets EOF. Their statuses don't affect $?
+static void finish_process_substitutions(int mark) {
+    if (num_procsubs <= mark) {
+        return;
+    }
+    
+    int count = num_procsubs - mark;
+    pid_t *pids = malloc(count * sizeof(pid_t));
+    for (int i = 0; i < count; i++) {
+        close(procsubs[mark + i].fd);
+        pids[i] = procsubs[mark + i].pid;
+    }
+    num_procsubs = mark;
+    
+    struct job *job = job_create(pids, count, NULL, NULL);
+    job_wait(job);
+    job_free(job);
+    free(pids);
+}
+
+// Leading NAME=value words
+static int count_assignments(const struct command_context *ctx) {
+    int count = 0;
+    while (count < ctx->argc) {
+        const char *equals = strchr(ctx->argv[count], '=');
+        if (equals == NULL || !var_is_name(ctx->argv[count], equals - ctx->argv[count])) {
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
+// `NAME=value` alone sets a shell variable; in front of a command it only
+// applies to that command's environment
+static void run_with_assignments(struct command_context *ctx, int assignments) {
+    char **names = malloc(assignments * sizeof(char *));
+    char **values = malloc(assignments * sizeof(char *));
+    for (int i = 0; i < assignments; i++) {
+        const char *equals = strchr(ctx->argv[i], '=');
+        names[i] = strndup(ctx->argv[i], equals - ctx->argv[i]);
+        values[i] = expand_word(equals + 1);
+    }
+    
+    if (assignments == ctx->argc) {
+        for (int i = 0; i < assignments; i++) {
+            var_set(names[i], values[i]);
+        }
+        
+        // Redirects still create their files
+        struct command_context rest = *ctx;
+        rest.argc = 0;
+        rest.needs_expansion = false;
+        int saved[2] = { -1, -1 };
+        bool opened = push_redirects(&rest, saved);
+        pop_redirects(saved);
+        var_set_status(opened ? 0 : 1);
+    } else {
+        char **old_values = malloc(assignments * sizeof(char *));
+        for (int i = 0; i < assignments; i++) {
+            const char *old = getenv(names[i]);
+            old_values[i] = old ? strdup(old) : NULL;
+            setenv(names[i], values[i], 1);
+        }
+        
+        // A view of the remaining words; nothing in it is owned
+        struct command_context rest = *ctx;
+        rest.argv = ctx->argv + assignments;
+        rest.argc = ctx->argc - assignments;
+        rest.command_name = rest.argv[0];
+        
+        if (rest.needs_expansion) {
+            struct command_context expanded;
+            expand_context(&rest, &expanded);
+            run_command(&expanded);
+            free_command_context(&expanded);
+        } else {
+            run_command(&rest);
+        }
+        
+        for (int i = 0; i < assignments; i++) {
+            if (old_values[i]) {
+                setenv(names[i], old_values[i], 1);
+            } else {
+                unsetenv(names[i]);
+            }
+            free(old_values[i]);
+        }
+        free(old_values);
+    }
+    
+    for (int i = 0; i < assignments; i++) {
+        free(names[i]);
+        free(values[i]);
+    }
+    free(names);
+    free(values);
+}
+
+// Points stdout/stderr at the redirect targets of `ctx`, keeping the old
+// descriptors in `saved` for pop_redirects. False if a file can't be opened
+static bool push_redirects(const struct command_context *ctx, int saved[2]) {
+    saved[0] = -1;
+    saved[1] = -1;
+    
+    if (ctx->redirect && ctx->out_file) {
+        char *path = ctx->needs_expansion ? expand_target(ctx->out_file) : strdup(ctx->out_file);
+        int fd = open(path, O_WRONLY | O_CREAT | ctx->out_mode, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "%s: cannot create file\n", path);
+            free(path);
+            return false;
+        }
+        free(path);
+        fflush(stdout);
+        saved[0] = dup(STDOUT_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+    
+    if (ctx->redirect_err && ctx->error_file) {
+        char *path = ctx->needs_expansion ? expand_target(ctx->error_file) : strdup(ctx->error_file);
+        int fd = open(path, O_WRONLY | O_CREAT | ctx->err_mode, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "%s: cannot create file\n", path);
+            free(path);
+            pop_redirects(saved);
+            return false;
+        }
+        free(path);
+        fflush(stderr);
+        saved[1] = dup(STDERR_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+    
+    return true;
+}
+
+static void pop_redirects(int saved[2]) {
+    if (saved[0] >= 0) {
+        fflush(stdout);
+        dup2(saved[0], STDOUT_FILENO);
+        close(saved[0]);
+        saved[0] = -1;
+    }
+    if (saved[1] >= 0) {
+        fflush(stderr);
+        dup2(saved[1], STDERR_FILENO);
+        close(saved[1]);
+        saved[1] = -1;
+    }
+}
+
+// fork() for children that go on running shell code instead of exec'ing
+static pid_t fork_shell(void) {
+    fflush(stdout);
+    fflush(stderr);
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        jobs_after_fork();
+        audit_after_fork();
+        close_coprocess_fds();
+    } else if (pid > 0) {
+        shellstats_count(COUNTER_FORKS);
+    }
+    return pid;
+}
+
+// PIPESTATUS holds the status of every process of the last foreground job,
+// space separated (there are no arrays to put them in)
+static void set_pipestatus(const struct job *job) {
+    char buf[JOB_TEXT_LENGTH];
+    size_t used = 0;
+    buf[0] = '\0';
+    
+    for (int i = 0; i < job->num_procs && used < sizeof(buf); i++) {
+        used += snprintf(buf + used, sizeof(buf) - used, i ? " %d" : "%d", job->procs[i].status);
+    }
+    var_set("PIPESTATUS", buf);
+}
+
+// Short text for a node, as shown by `jobs`
+static void describe_node(const struct command_node *node, char *buf, size_t size) {
+    char left[JOB_TEXT_LENGTH];
+    char right[JOB_TEXT_LENGTH];
+    
+    switch (node->type) {
+    case NODE_COMMAND:
+        if (node->command.num_commands > 0) {
+            buf[0] = '\0';
+            for (int i = 0; i < node->command.num_commands; i++) {
+                describe_words(node->command.all_commands[i], node->command.all_argc[i], left, sizeof(left));
+                size_t used = strlen(buf);
+                snprintf(buf + used, size - used, i ? " | %s" : "%s", left);
+            }
+        } else {
+            describe_words(node->command.argv, node->command.argc, buf, size);
+        }
+        break;
+    case NODE_LIST:
+        if (node->num_children == 0) {
+            snprintf(buf, size, "{ }");
+        } else {
+            describe_node(node->children[0], left, sizeof(left));
+            snprintf(buf, size, (node->num_children > 1) ? "{ %s; ... }" : "{ %s; }", left);
+        }
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        describe_node(node->children[0], left, sizeof(left));
+        describe_node(node->children[1], right, sizeof(right));
+        snprintf(buf, size, "%s %s %s", left, (node->type == NODE_AND) ? "&&" : "||", right);
+        break;
+    case NODE_NOT:
+        describe_node(node->children[0], left, sizeof(left));
+        snprintf(buf, size, "! %s", left);
+        break;
+    case NODE_PIPELINE:
+        buf[0] = '\0';
+        for (int i = 0; i < node->num_children; i++) {
+            describe_node(node->children[i], left, sizeof(left));
+            size_t used = strlen(buf);
+            snprintf(buf + used, size - used, i ? " | %s" : "%s", left);
+        }
+        break;
+    case NODE_FOR:
+        snprintf(buf, size, "for %s in ...", node->name);
+        break;
+    case NODE_IF:
+        snprintf(buf, size, "if ...");
+        break;
+    case NODE_WHILE:
+        snprintf(buf, size, "while ...");
+        break;
+    case NODE_UNTIL:
+        snprintf(buf, size, "until ...");
+        break;
+    case NODE_CASE:
+        snprintf(buf, size, "case ...");
+        break;
+    case NODE_FUNCTION:
+        snprintf(buf, size, "%s ()", node->name);
+        break;
+    case NODE_CASE_ARM:
+    case NODE_BACKGROUND:
+        describe_node(node->children[0], buf, size);
+        break;
+    }
+}
+
+// Words joined by spaces, without the tokenizer's expansion marks
+static void describe_words(char **words, int count, char *buf, size_t size) {
+    size_t used = 0;
+    for (int i = 0; i < count && used + 1 < size; i++) {
+        if (i > 0) {
+            buf[used++] = ' ';
+        }
+        for (const char *c = words[i]; *c && used + 1 < size; c++) {
+            if (*c != EXPAND_MARK && *c != EXPAND_MARK_QUOTED && *c != PROCSUB_MARK && *c != BRACE_MARK) {
+                buf[used++] = *c;
+            }
+        }
+    }
+    buf[used] = '\0';
+}
+
+// `cmd &`: the child runs the node with stdin from /dev/null (there is no
+// job control to hand it the terminal) and the shell moves on
+static void execute_background(struct command_node *node) {
+    pid_t pid = fork_shell();
+    if (pid == -1) {
+        fprintf(stderr, "[shell exec] failed to fork\n");
+        var_set_status(1);
+        return;
+    }
+    
+    if (pid == 0) {
+        setpgid(0, 0);
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
+        }
+        
+        execute_node(node->children[0]);
+        fflush(stdout);
+        exit(var_status());
+    }
+    
+    char text[JOB_TEXT_LENGTH];
+    describe_node(node->children[0], text, sizeof(text));
+    
+    struct job *job = job_create(&pid, 1, text, NULL);
+    job_background(job);
+    var_set_last_background(pid);
+    var_set_status(0);
+}
+
+// A break, continue or return is unwinding: stop running list items
+static bool control_pending(void) {
+    return break_count > 0 || continue_count > 0 || returning;
+}
+
+// Called by a loop after each pass. Consumes a break/continue aimed at this
+// loop and returns true when the loop has to stop
+static bool loop_should_stop(void) {
+    if (returning) {
+        return true;
+    }
+    if (break_count > 0) {
+        break_count--;
+        return true;
+    }
+    if (continue_count > 0) {
+        continue_count--;
+        return continue_count > 0;  // `continue 2` continues the outer loop
+    }
+    return false;
+}
+
+// while/until: children[0] is the condition, children[1] the body
+static void execute_loop(struct command_node *node) {
+    bool until = node->type == NODE_UNTIL;
+    int status = 0;
+    
+    loop_depth++;
+    while (true) {
+        execute_node(node->children[0]);
+        if (control_pending()) {
+            if (loop_should_stop()) {
+                break;
+            }
+            continue;
+        }
+        if ((var_status() == 0) == until) {
+            break;
+        }
+        
+        execute_node(node->children[1]);
+        status = var_status();
+        if (loop_should_stop()) {
+            break;
+        }
+    }
+    loop_depth--;
+    
+    var_set_status(returning ? var_status() : status);
+}
+
+static void execute_for(struct command_node *node) {
+    // Without parameters in the list, expanding it lazily gives the same
+    // values, so brace expressions are generated as the loop asks for them
+    if (!words_use_parameters(node->words, node->num_words)) {
+        struct for_iteration iteration = { .node = node };
+        loop_depth++;
+        expand_words_each(node->words, node->num_words, run_for_iteration, &iteration);
+        loop_depth--;
+        var_set_status(returning ? var_status() : iteration.status);
+        return;
+    }
+    
+    // The word list is expanded once, when the loop starts
+    char **values;
+    int count = expand_words(node->words, node->num_words, &values);
+    int status = 0;
+    
+    loop_depth++;
+    for (int i = 0; i < count; i++) {
+        var_set(node->name, values[i]);
+        execute_node(node->children[0]);
+        status = var_status();
+        if (loop_should_stop()) {
+            break;
+        }
+    }
+    loop_depth--;
+    
+    for (int i = 0; i < count; i++) {
+        free(values[i]);
+    }
+    free(values);
+    
+    var_set_status(returning ? var_status() : status);
+}
+
+static bool run_for_iteration(const char *value, void *data) {
+    struct for_iteration *iteration = data;
+    var_set(iteration->node->name, value);
+    execute_node(iteration->node->children[0]);
+    iteration->status = var_status();
+    return !loop_should_stop();
+}
+
+static bool words_use_parameters(char *const *words, int count) {
+    for (int i = 0; i < count; i++) {
+        if (strchr(words[i], EXPAND_MARK) || strchr(words[i], EXPAND_MARK_QUOTED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs the first arm with a pattern matching the subject
+static void execute_case(struct command_node *node) {
+    char *subject = expand_word(node->name);
+    var_set_status(0);
+    
+    for (int i = 0; i < node->num_children; i++) {
+        struct command_node *arm = node->children[i];
+        bool matched = false;
+        
+        for (int j = 0; j < arm->num_words && !matched; j++) {
+            char *pattern = expand_word(arm->words[j]);
+            matched = fnmatch(pattern, subject, 0) == 0;
+            free(pattern);
+        }
+        
+        if (matched) {
+            execute_node(arm->children[0]);
+            break;
+        }
+    }
+    
+    free(subject);
+}
+
+// A pipeline with compound stages ("cmd | while ...; done"): each stage
+// runs in its own child with the same interpreter
+static void execute_pipeline_node(struct command_node *node) {
+    int n = node->num_children;
+    int (*pipes)[2] = malloc((n - 1) * sizeof(int[2]));
+    pid_t *pids = malloc(n * sizeof(pid_t));
+    
+    for (int i = 0; i < n - 1; i++) {
+        if (pipe(pipes[i]) == -1) {
+            fprintf(stderr, "pipe: failed to create pipe\n");
+            for (int j = 0; j < i; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
+            free(pipes);
+            free(pids);
+            var_set_status(1);
+            return;
+        }
+    }
+    
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (int i = 0; i < n; i++) {
+        pids[i] = fork_shell();
+        
+        if (pids[i] == -1) {
+            fprintf(stderr, "fork: failed\n");
+            exit(1);
+        }
+        
+        if (pids[i] == 0) {
+            if (i > 0) {
+                dup2(pipes[i - 1][0], STDIN_FILENO);
+            }
+            if (i < n - 1) {
+                dup2(pipes[i][1], STDOUT_FILENO);
+            }
+            for (int j = 0; j < n - 1; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
+            
+            execute_node(node->children[i]);
+            fflush(stdout);
+            exit(var_status());
+        }
+    }
+    
+    for (int i = 0; i < n - 1; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    
+    struct job *job = job_create(pids, n, NULL, &started);
+    var_set_status(job_wait(job));
+    set_pipestatus(job);
+    if (audit_enabled()) {
+        char (*texts)[JOB_TEXT_LENGTH] = malloc(n * sizeof(*texts));
+        struct audit_stage *stages = malloc(n * sizeof(struct audit_stage));
+        for (int i = 0; i < n; i++) {
+            describe_node(node->children[i], texts[i], JOB_TEXT_LENGTH);
+            stages[i].command = texts[i];
+            stages[i].path = NULL;
+        }
+        audit_record_job(job, stages);
+        free(stages);
+        free(texts);
+    }
+    job_free(job);
+    
+    free(pipes);
+    free(pids);
+}
+
+static unsigned long hash_string(const char *s) {
+    // FNV-1a
+    unsigned long hash = 14695981039346656037UL;
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static struct definition *find_definition(const char *name) {
+    struct definition *def = definitions[hash_string(name) % DEFINITION_BUCKETS];
+    while (def && strcmp(def->name, name) != 0) {
+        def = def->next;
+    }
+    return def;
+}
+
+// Like find_definition, but creates an empty entry if there is none
+static struct definition *get_definition(const char *name) {
+    struct definition *def = find_definition(name);
+    if (def) {
+        return def;
+    }
+    
+    unsigned long bucket = hash_string(name) % DEFINITION_BUCKETS;
+    def = calloc(1, sizeof(struct definition));
+    def->name = strdup(name);
+    def->next = definitions[bucket];
+    definitions[bucket] = def;
+    return def;
+}
+
+// Builds a view of `base` with the caller's extra words appended to its
+// (last) command. Strings are borrowed
+static void merge_alias_call(const struct command_context *base, const struct command_context *call, 
+                             struct command_context *out) {
+    *out = *base;
+    int extra = call->argc - 1;
+    
+    if (base->num_commands > 0) {
+        int last = base->num_commands - 1;
+        int last_argc = base->all_argc[last];
+        
+        out->all_commands = malloc(base->num_commands * sizeof(char **));
+        memcpy(out->all_commands, base->all_commands, base->num_commands * sizeof(char **));
+        out->all_argc = malloc(base->num_commands * sizeof(int));
+        memcpy(out->all_argc, base->all_argc, base->num_commands * sizeof(int));
+        
+        out->all_commands[last] = malloc((last_argc + extra + 1) * sizeof(char *));
+        memcpy(out->all_commands[last], base->all_commands[last], last_argc * sizeof(char *));
+        memcpy(out->all_commands[last] + last_argc, call->argv + 1, (extra + 1) * sizeof(char *));
+        out->all_argc[last] = last_argc + extra;
+        return;
+    }
+    
+    out->argv = malloc((base->argc + extra + 1) * sizeof(char *));
+    memcpy(out->argv, base->argv, base->argc * sizeof(char *));
+    memcpy(out->argv + base->argc, call->argv + 1, (extra + 1) * sizeof(char *));
+    out->argc = base->argc + extra;
+}
+
+static void free_merged_call(const struct command_context *base, struct command_context *merged) {
+    if (base->num_commands > 0) {
+        free(merged->all_commands[base->num_commands - 1]);
+        free(merged->all_commands);
+        free(merged->all_argc);
+    } else {
+        free(merged->argv);
+    }
+}
+
+// The alias body was parsed when it was defined; words given at the call
+// site are appended to its last command, which has to be a simple one
+static void run_alias(struct definition *def, struct command_context *ctx) {
+    struct command_node *body = retain_command_node(def->alias);
+    struct command_node *last = NULL;
+    if (body->type == NODE_LIST && body->num_children > 0) {
+        last = body->children[body->num_children - 1];
+    }
+    if (ctx->argc > 1 && (!last || last->type != NODE_COMMAND)) {
+        fprintf(stderr, "%s: alias doesn't end in a simple command; can't add arguments\n", def->name);
+        free_command_node(body);
+        var_set_status(2);
+        return;
+    }
+    
+    // Redirects on the call apply to the whole body
+    int saved[2];
+    if (!push_redirects(ctx, saved)) {
+        free_command_node(body);
+        var_set_status(1);
+        return;
+    }
+    
+    def->expanding = true;
+    if (last) {
+        for (int i = 0; i < body->num_children - 1; i++) {
+            execute_node(body->children[i]);
+        }
+    }
+    
+    if (last && last->type == NODE_COMMAND) {
+        struct command_context merged;
+        merge_alias_call(&last->command, ctx, &merged);
+        execute_command(&merged);
+        free_merged_call(&last->command, &merged);
+    } else if (last) {
+        execute_node(last);
+    }
+    def->expanding = false;
+    
+    pop_redirects(saved);
+    free_command_node(body);
+}
+
+static void run_function(struct definition *def, struct command_context *ctx) {
+    if (function_depth >= MAX_FUNCTION_DEPTH) {
+        fprintf(stderr, "%s: maximum function nesting level exceeded (%d)\n", 
+                def->name, MAX_FUNCTION_DEPTH);
+        var_set_status(1);
+        return;
+    }
+    
+    // Redirects on the call apply to the whole body
+    int saved[2];
+    if (!push_redirects(ctx, saved)) {
+        var_set_status(1);
+        return;
+    }
+    
+    // Arguments become $1... for the duration of the call
+    struct positional_params saved_params;
+    var_set_positional(ctx->argc - 1, ctx->argv + 1, &saved_params);
+    
+    // Loops outside the function can't be broken from inside it
+    int saved_loop_depth = loop_depth;
+    loop_depth = 0;
+    
+    // Hold a reference: the body may redefine this very function
+    struct command_node *body = retain_command_node(def->function);
+    function_depth++;
+    execute_node(body);
+    function_depth--;
+    free_command_node(body);
+    
+    returning = false;
+    break_count = 0;
+    continue_count = 0;
+    loop_depth = saved_loop_depth;
+    var_restore_positional(&saved_params);
+    
+    pop_redirects(saved);
+}
+
+static void shell_alias(struct command_context *ctx) {
+    FILE *output = stdout;
+    if (ctx->redirect && ctx->out_file) {
+        const char *mode = (ctx->out_mode == O_APPEND) ? "a" : "w";
+        output = fopen(ctx->out_file, mode);
+        if (!output) {
+            fprintf(stderr, "alias: %s: cannot create file\n", ctx->out_file);
+            return;
+        }
+    }
+    
+    // No arguments: list every alias
+    if (ctx->argc < 2) {
+        for (int b = 0; b < DEFINITION_BUCKETS; b++) {
+            for (struct definition *def = definitions[b]; def; def = def->next) {
+                if (def->alias) {
+                    fprintf(output, "alias %s='%s'\n", def->name, def->alias_text);
+                }
+            }
+        }
+    }
+    
+    for (int i = 1; i < ctx->argc; i++) {
+        char *equals = strchr(ctx->argv[i], '=');
+        
+        if (equals == NULL) {
+            struct definition *def = find_definition(ctx->argv[i]);
+            if (def && def->alias) {
+                fprintf(output, "alias %s='%s'\n", def->name, def->alias_text);
+            } else {
+                fprintf(stderr, "alias: %s: not found\n", ctx->argv[i]);
+            }
+            continue;
+        }
+        
+        *equals = '\0';
+        const char *name = ctx->argv[i];
+        const char *value = equals + 1;
+        
+        if (strlen(name) == 0 || strchr(name, '/')) {
+            fprintf(stderr, "alias: `%s': invalid alias name\n", name);
+            *equals = '=';
+            continue;
+        }
+        
+        // Parse once here; every use runs the stored tree
+        enum parse_status status;
+        struct command_node *body = parse_script(value, &status);
+        if (body == NULL) {
+            fprintf(stderr, "alias: %s: cannot parse alias value\n", name);
+            *equals = '=';
+            continue;
+        }
+        
+        struct definition *def = get_definition(name);
+        free_command_node(def->alias);
+        free(def->alias_text);
+        def->alias = body;
+        def->alias_text = strdup(value);
+        *equals = '=';
+    }
+    
+    if (output != stdout) {
+        fclose(output);
+    }
+}
+
+static void shell_unalias(struct command_context *ctx) {
+    if (ctx->argc < 2) {
+        fprintf(stderr, "unalias: usage: unalias [-a] name [name ...]\n");
+        return;
+    }
+    
+    if (strcmp(ctx->argv[1], "-a") == 0) {
+        for (int b = 0; b < DEFINITION_BUCKETS; b++) {
+            for (struct definition *def = definitions[b]; def; def = def->next) {
+                free_command_node(def->alias);
+                free(def->alias_text);
+                def->alias = NULL;
+                def->alias_text = NULL;
+            }
+        }
+        return;
+    }
+    
+    for (int i = 1; i < ctx->argc; i++) {
+        struct definition *def = find_definition(ctx->argv[i]);
+        if (def == NULL || def->alias == NULL) {
+            fprintf(stderr, "unalias: %s: not found\n", ctx->argv[i]);
+            continue;
+        }
+        free_command_node(def->alias);
+        free(def->alias_text);
+        def->alias = NULL;
+        def->alias_text = NULL;
+    }
+}
+
+static void shell_true(struct command_context *ctx) {
+    (void) ctx;
+    var_set_status(0);
+}
+
+static void shell_false(struct command_context *ctx) {
+    (void) ctx;
+    var_set_status(1);
+}
+
+// Optional numeric argument of break/continue/return; `*value` keeps its
+// default when there is none
+static bool parse_number_argument(struct command_context *ctx, int *value) {
+    if (ctx->argc < 2) {
+        return true;
+    }
+    
+    char *end;
+    long number = strtol(ctx->argv[1], &end, 10);
+    if (*ctx->argv[1] == '\0' || *end != '\0') {
+        fprintf(stderr, "%s: %s: numeric argument required\n", ctx->command_name, ctx->argv[1]);
+        return false;
+    }
+    *value = (int)number;
+    return true;
+}
+
+static void shell_break(struct command_context *ctx) {
+    if (loop_depth == 0) {
+        fprintf(stderr, "break: only meaningful in a `for', `while', or `until' loop\n");
+        return;
+    }
+    
+    int levels = 1;
+    if (!parse_number_argument(ctx, &levels) || levels < 1) {
+        if (levels < 1) {
+            fprintf(stderr, "break: %s: loop count out of range\n", ctx->argv[1]);
+        }
+        var_set_status(1);
+        return;
+    }
+    break_count = (levels > loop_depth) ? loop_depth : levels;
+}
+
+static void shell_continue(struct command_context *ctx) {
+    if (loop_depth == 0) {
+        fprintf(stderr, "continue: only meaningful in a `for', `while', or `until' loop\n");
+        return;
+    }
+    
+    int levels = 1;
+    if (!parse_number_argument(ctx, &levels) || levels < 1) {
+        if (levels < 1) {
+            fprintf(stderr, "continue: %s: loop count out of range\n", ctx->argv[1]);
+        }
+        var_set_status(1);
+        return;
+    }
+    
+    // Continuing past the outermost loop just continues that one
+    continue_count = (levels > loop_depth) ? loop_depth : levels;
+}
+
+static void shell_return(struct command_context *ctx) {
+    if (function_depth == 0 && source_depth == 0) {
+        fprintf(stderr, "return: can only `return' from a function or sourced script\n");
+        var_set_status(1);
+        return;
+    }
+    
+    // Without an argument the function returns the status of its last command
+    int status = previous_status;
+    if (!parse_number_argument(ctx, &status)) {
+        status = 2;
+    }
+    var_set_status(status & 0xff);
+    returning = true;
+}
+
+static void shell_export(struct command_context *ctx) {
+    FILE *output = stdout;
+    if (ctx->redirect && ctx->out_file) {
+        const char *mode = (ctx->out_mode == O_APPEND) ? "a" : "w";
+        output = fopen(ctx->out_file, mode);
+        if (!output) {
+            fprintf(stderr, "export: %s: cannot create file\n", ctx->out_file);
+            var_set_status(1);
+            return;
+        }
+    }
+    
+    // No arguments: list the environment
+    if (ctx->argc < 2) {
+        for (char **env = environ; *env; env++) {
+            fprintf(output, "declare -x %s\n", *env);
+        }
+    }
+    
+    for (int i = 1; i < ctx->argc; i++) {
+        char *equals = strchr(ctx->argv[i], '=');
+        size_t name_length = equals ? (size_t)(equals - ctx->argv[i]) : strlen(ctx->argv[i]);
+        if (!var_is_name(ctx->argv[i], name_length)) {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", ctx->argv[i]);
+            var_set_status(1);
+            continue;
+        }
+        
+        if (equals) {
+            *equals = '\0';
+            var_set(ctx->argv[i], equals + 1);
+            var_export(ctx->argv[i]);
+            *equals = '=';
+        } else {
+            var_export(ctx->argv[i]);
+        }
+    }
+    
+    if (output != stdout) {
+        fclose(output);
+    }
+}
+
+static void shell_unset(struct command_context *ctx) {
+    for (int i = 1; i < ctx->argc; i++) {
+        if (!var_is_name(ctx->argv[i], strlen(ctx->argv[i]))) {
+            fprintf(stderr, "unset: `%s': not a valid identifier\n", ctx->argv[i]);
+            var_set_status(1);
+            continue;
+        }
+        var_unset(ctx->argv[i]);
+    }
+}
+
+// `set` lists variables, `set -o`/`set +o` shows or changes options and
+// `set [--] args` replaces the positional parameters
+static void shell_set(struct command_context *ctx) {
+    bool option_word = ctx->argc >= 2 && 
+                       (strcmp(ctx->argv[1], "-o") == 0 || strcmp(ctx->argv[1], "+o") == 0);
+    
+    if (ctx->argc < 2 || (option_word && ctx->argc == 2)) {
+        FILE *output = stdout;
+        if (ctx->redirect && ctx->out_file) {
+            const char *mode = (ctx->out_mode == O_APPEND) ? "a" : "w";
+            output = fopen(ctx->out_file, mode);
+            if (!output) {
+                fprintf(stderr, "set: %s: cannot create file\n", ctx->out_file);
+                var_set_status(1);
+                return;
+            }
+        }
+        
+        if (ctx->argc < 2) {
+            var_print(output);
+        } else {
+            print_shell_options(output, ctx->argv[1][0] == '+');
+        }
+        
+        if (output != stdout) {
+            fclose(output);
+        }
+        return;
+    }
+    
+    if (option_word) {
+        for (int i = 2; i < ctx->argc; i++) {
+            bool *value = find_shell_option(ctx->argv[i]);
+            if (value == NULL) {
+                fprintf(stderr, "set: %s: invalid option name\n", ctx->argv[i]);
+                var_set_status(2);
+                return;
+            }
+            *value = (ctx->argv[1][0] == '-');
+        }
+        return;
+    }
+    
+    int first = 1;
+    if (strcmp(ctx->argv[1], "--") == 0) {
+        first = 2;
+    } else if (ctx->argv[1][0] == '-') {
+        fprintf(stderr, "set: %s: invalid option\n", ctx->argv[1]);
+        var_set_status(2);
+        return;
+    }
+    var_set_positional(ctx->argc - first, ctx->argv + first, NULL);
+}
+
+static bool *find_shell_option(const char *name) {
+    for (size_t i = 0; i < NUM_SHELL_OPTIONS; i++) {
+        if (strcmp(shell_options[i].name, name) == 0) {
+            return shell_options[i].value;
+        }
+    }
+    return NULL;
+}
+
+// `set -o` prints a table, `set +o` the commands that recreate it
+static void print_shell_options(FILE *output, bool as_commands) {
+    for (size_t i = 0; i < NUM_SHELL_OPTIONS; i++) {
+        bool on = *shell_options[i].value;
+        if (as_commands) {
+            fprintf(output, "set %co %s\n", on ? '-' : '+', shell_options[i].name);
+        } else {
+            fprintf(output, "%-15s\t%s\n", shell_options[i].name, on ? "on" : "off");
+        }
+    }
+}
+
+static void shell_jobs(struct command_context *ctx) {
+    FILE *output = stdout;
+    if (ctx->redirect && ctx->out_file) {
+        const char *mode = (ctx->out_mode == O_APPEND) ? "a" : "w";
+        output = fopen(ctx->out_file, mode);
+        if (!output) {
+            fprintf(stderr, "jobs: %s: cannot create file\n", ctx->out_file);
+            var_set_status(1);
+            return;
+        }
+    }
+    
+    jobs_print(output);
+    
+    if (output != stdout) {
+        fclose(output);
+    }
+}
+
+// `wait` waits for every background job; `wait %N|pid...` for those given
+static void shell_wait(struct command_context *ctx) {
+    if (ctx->argc < 2) {
+        struct job *job;
+        while ((job = job_find("%%")) != NULL) {
+            job_wait_background(job);
+        }
+        var_set_status(0);
+        return;
+    }
+    
+    for (int i = 1; i < ctx->argc; i++) {
+        struct job *job = job_find(ctx->argv[i]);
+        if (job == NULL) {
+            fprintf(stderr, "wait: %s: no such job\n", ctx->argv[i]);
+            var_set_status(STATUS_NOT_FOUND);
+            continue;
+        }
+        var_set_status(job_wait_background(job));
+    }
+}
+
+// `source FILE [args...]` (or `. FILE`) runs FILE in this shell. The parsed
+// tree is cached on disk, so an unchanged script is never tokenized again
+static void shell_source(struct command_context *ctx) {
+    if (ctx->argc < 2) {
+        fprintf(stderr, "%s: filename argument required\n", ctx->argv[0]);
+        var_set_status(2);
+        return;
+    }
+    if (source_depth >= MAX_SOURCE_DEPTH) {
+        fprintf(stderr, "%s: maximum source nesting level exceeded (%d)\n", ctx->argv[0], MAX_SOURCE_DEPTH);
+        var_set_status(1);
+        return;
+    }
+    
+    char path[PATH_MAX];
+    if (!find_source_file(ctx->argv[1], path)) {
+        fprintf(stderr, "%s: %s: No such file or directory\n", ctx->argv[0], ctx->argv[1]);
+        var_set_status(1);
+        return;
+    }
+    
+    struct command_node *root = load_script(path, ctx->argv[0]);
+    if (root == NULL) {
+        var_set_status(2);
+        return;
+    }
+    
+    int saved[2];
+    if (!push_redirects(ctx, saved)) {
+        free_command_node(root);
+        var_set_status(1);
+        return;
+    }
+    
+    // Extra arguments replace $1... while the script runs
+    struct positional_params saved_params;
+    bool has_args = ctx->argc > 2;
+    if (has_args) {
+        var_set_positional(ctx->argc - 2, ctx->argv + 2, &saved_params);
+    }
+    
+    source_depth++;
+    execute_node(root);
+    source_depth--;
+    free_command_node(root);
+    
+    // `return` stops at the script; break/continue don't leave it either
+    returning = false;
+    if (loop_depth == 0) {
+        break_count = 0;
+        continue_count = 0;
+    }
+    if (has_args) {
+        var_restore_positional(&saved_params);
+    }
+    pop_redirects(saved);
+}
+
+// Names without a '/' are looked up in PATH, then the current directory.
+// `buf` (PATH_MAX bytes) gets the canonical path, which is also the cache key
+static bool find_source_file(const char *name, char *buf) {
+    struct stat st;
+    if (strchr(name, '/') == NULL) {
+        char *path_env = getenv("PATH");
+        if (path_env) {
+            char *path_copy = strdup(path_env);
+            char *saveptr = NULL;
+            for (char *dir = strtok_r(path_copy, ":", &saveptr); dir; dir = strtok_r(NULL, ":", &saveptr)) {
+                char candidate[PATH_MAX];
+                snprintf(candidate, sizeof(candidate), "%s/%s", dir, name);
+                if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && realpath(candidate, buf)) {
+                    free(path_copy);
+                    return true;
+                }
+            }
+            free(path_copy);
+        }
+    }
+    
+    return stat(name, &st) == 0 && S_ISREG(st.st_mode) && realpath(name, buf) != NULL;
+}
+
+// Cached tree if the script is unchanged, else parse the file's text and
+// cache the result
+static struct command_node *load_script(const char *path, const char *builtin) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s: %s\n", builtin, path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    
+    struct command_node *root = script_cache_load(path, &st);
+    if (root) {
+        close(fd);
+        return root;
+    }
+    
+    // Read rather than mapped: a script that shrinks while it is parsed
+    // would fault, and one that grows would run past the terminator
+    size_t size = (size_t)st.st_size;
+    char *text = malloc(size + 1);
+    size_t length = 0;
+    while (length < size) {
+        ssize_t got = read(fd, text + length, size - length);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            fprintf(stderr, "%s: %s: %s\n", builtin, path, strerror(errno));
+            close(fd);
+            free(text);
+            return NULL;
+        }
+        if (got == 0) {
+            break;
+        }
+        length += (size_t)got;
+    }
+    text[length] = '\0';
+    close(fd);
+    
+    enum parse_status status;
+    root = parse_script(text, &status);
+    if (status == PARSE_INCOMPLETE) {
+        fprintf(stderr, "%s: %s: syntax error: unexpected end of file\n", builtin, path);
+    }
+    free(text);
+    
+    // A file cut short under us doesn't match `st`; don't cache what was read
+    if (root && length == size) {
+        script_cache_store(path, &st, root);
+    }
+    return root;
+}
+
+// `xargs [-0rt] [-n max-args] [-P max-procs] [command [args...]]` runs
+// command with items from stdin appended, packing as many into each argv as
+// ARG_MAX leaves room for after the environment. Other options are passed
+// on to the real xargs
+static void shell_xargs(struct command_context *ctx) {
+    struct xargs_run run = { .options = { .max_procs = 1 } };
+    int first = parse_xargs_options(ctx, &run.options);
+    if (first == -1) {
+        shell_exec(ctx);
+        return;
+    }
+    if (first == -2) {
+        var_set_status(1);
+        return;
+    }
+    
+    char *default_command[] = { "echo" };
+    char **command = (first < ctx->argc) ? ctx->argv + first : default_command;
+    run.fixed_argc = (first < ctx->argc) ? ctx->argc - first : 1;
+    
+    run.path = find_executable_in_path(command[0]);
+    if (run.path == NULL) {
+        fprintf(stderr, "xargs: %s: No such file or directory\n", command[0]);
+        var_set_status(STATUS_NOT_FOUND);
+        return;
+    }
+    
+    run.limit = xargs_size_limit();
+    run.fixed_size = sizeof(char *);    // argv's NULL
+    for (char **env = environ; *env; env++) {
+        run.fixed_size += strlen(*env) + 1 + sizeof(char *);
+    }
+    run.capacity = run.fixed_argc + 64;
+    run.argv = malloc(run.capacity * sizeof(char *));
+    for (int i = 0; i < run.fixed_argc; i++) {
+        run.argv[i] = command[i];
+        run.fixed_size += strlen(command[i]) + 1 + sizeof(char *);
+    }
+    run.argc = run.fixed_argc;
+    run.size = run.fixed_size;
+    
+    struct xargs_input *in = malloc(sizeof(struct xargs_input));
+    in->pos = 0;
+    in->length = 0;
+    in->eof = false;
+    
+    bool error = false;
+    char *item;
+    while ((item = read_xargs_item(in, run.options.null_separated, &error)) != NULL) {
+        if (!add_xargs_item(&run, item)) {
+            error = true;
+            break;
+        }
+    }
+    
+    // Like GNU xargs, run the command once even without input unless -r
+    if (!error && (run.argc > run.fixed_argc || (run.launched == 0 && !run.options.no_run_if_empty))) {
+        launch_xargs_batch(&run);
+    }
+    while (run.num_running > 0) {
+        reap_xargs_batch(&run, job_wait_any(run.running, run.num_running));
+    }
+    
+    for (int i = run.fixed_argc; i < run.argc; i++) {
+        free(run.argv[i]);
+    }
+    free(run.argv);
+    free(run.running);
+    free(run.path);
+    free(in);
+    var_set_status((error && run.status == 0) ? 1 : run.status);
+}
+
+// Index of the first command word, -1 for an option only the real xargs
+// knows, or -2 after printing a usage error
+static int parse_xargs_options(struct command_context *ctx, struct xargs_options *options) {
+    int i = 1;
+    for (; i < ctx->argc && ctx->argv[i][0] == '-' && ctx->argv[i][1] != '\0'; i++) {
+        if (strcmp(ctx->argv[i], "--") == 0) {
+            return i + 1;
+        }
+        
+        for (const char *flag = ctx->argv[i] + 1; *flag; flag++) {
+            if (*flag == '0') {
+                options->null_separated = true;
+            } else if (*flag == 'r') {
+                options->no_run_if_empty = true;
+            } else if (*flag == 't') {
+                options->trace = true;
+            } else if (*flag == 'n' || *flag == 'P') {
+                // The number is the rest of this word or the next one
+                const char *text = flag + 1;
+                if (*text == '\0') {
+                    if (i + 1 >= ctx->argc) {
+                        fprintf(stderr, "xargs: option requires an argument -- '%c'\n", *flag);
+                        return -2;
+                    }
+                    text = ctx->argv[++i];
+                }
+                
+                char *end;
+                long value = strtol(text, &end, 10);
+                if (*end != '\0' || value < (*flag == 'n' ? 1 : 0) || value > INT_MAX) {
+                    fprintf(stderr, "xargs: -%c: %s: invalid number\n", *flag, text);
+                    return -2;
+                }
+                if (*flag == 'n') {
+                    options->max_args = (int)value;
+                } else {
+                    options->max_procs = (int)value;
+                }
+                break;
+            } else {
+                return -1;
+            }
+        }
+    }
+    return i;
+}
+
+// Bytes of argv and environment strings (and their pointers) one execve
+// may take
+static size_t xargs_size_limit(void) {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0) {
+        arg_max = _POSIX_ARG_MAX;
+    }
+    return (arg_max > XARGS_HEADROOM) ? (size_t)(arg_max - XARGS_HEADROOM) : (size_t)arg_max;
+}
+
+// Next item from stdin, or NULL at the end. Blanks separate items unless
+// quoted or escaped with a backslash; with -0 only NUL does
+static char *read_xargs_item(struct xargs_input *in, bool null_separated, bool *error) {
+    char *item = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    bool started = false;
+    char quote = '\0';
+    
+    int c;
+    while ((c = xargs_getc(in)) != EOF) {
+        if (null_separated) {
+            started = true;
+            if (c == '\0') {
+                break;
+            }
+        } else if (quote != '\0') {
+            if (c == quote) {
+                quote = '\0';
+                continue;
+            }
+            if (c == '\n') {
+                break;
+            }
+        } else if (c == ' ' || c == '\t' || c == '\n') {
+            if (started) {
+                break;
+            }
+            continue;
+        } else {
+            started = true;
+            if (c == '\'' || c == '"') {
+                quote = (char)c;
+                continue;
+            }
+            if (c == '\\' && (c = xargs_getc(in)) == EOF) {
+                break;
+            }
+        }
+        
+        if (length + 1 >= capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            item = realloc(item, capacity);
+        }
+        item[length++] = (char)c;
+    }
+    
+    if (quote != '\0') {
+        fprintf(stderr, "xargs: unmatched %s quote\n", quote == '\'' ? "single" : "double");
+        *error = true;
+        free(item);
+        return NULL;
+    }
+    if (!started) {
+        free(item);
+        return NULL;
+    }
+    if (item == NULL) {
+        item = malloc(1);
+    }
+    item[length] = '\0';
+    return item;
+}
+
+static int xargs_getc(struct xargs_input *in) {
+    if (in->pos == in->length) {
+        if (in->eof) {
+            return EOF;
+        }
+        ssize_t got;
+        do {
+            got = read(STDIN_FILENO, in->buf, sizeof(in->buf));
+        } while (got < 0 && errno == EINTR);
+        if (got <= 0) {
+            in->eof = true;
+            return EOF;
+        }
+        in->pos = 0;
+        in->length = (size_t)got;
+    }
+    return (unsigned char)in->buf[in->pos++];
+}
+
+// Appends `item` to the current batch, launching the batch first when the
+// item wouldn't fit. Takes ownership of `item`; false if it can never fit
+static bool add_xargs_item(struct xargs_run *run, char *item) {
+    size_t length = strlen(item) + 1;
+    size_t cost = length + sizeof(char *);
+    if (length > XARGS_MAX_ARG_LENGTH || run->fixed_size + cost > run->limit) {
+        fprintf(stderr, "xargs: argument line too long\n");
+        free(item);
+        return false;
+    }
+    
+    int items = run->argc - run->fixed_argc;
+    if (items > 0 && (run->size + cost > run->limit ||
+                      (run->options.max_args > 0 && items >= run->options.max_args))) {
+        launch_xargs_batch(run);
+    }
+    
+    // Keep a slot for the NULL
+    if (run->argc + 1 >= run->capacity) {
+        run->capacity *= 2;
+        run->argv = realloc(run->argv, run->capacity * sizeof(char *));
+    }
+    run->argv[run->argc++] = item;
+    run->size += cost;
+    return true;
+}
+
+// Forks the current batch and empties it. With -P, first waits for a slot
+static void launch_xargs_batch(struct xargs_run *run) {
+    while (run->options.max_procs > 0 && run->num_running >= run->options.max_procs) {
+        reap_xargs_batch(run, job_wait_any(run->running, run->num_running));
+    }
+    
+    run->argv[run->argc] = NULL;
+    if (run->options.trace) {
+        for (int i = 0; i < run->argc; i++) {
+            fprintf(stderr, i ? " %s" : "%s", run->argv[i]);
+        }
+        fputc('\n', stderr);
+    }
+    
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        shellstats_count(COUNTER_EXECS);
+        execv(run->path, run->argv);
+        fprintf(stderr, "xargs: %s: %s\n", run->argv[0], strerror(errno));
+        _exit(errno == ENOENT ? STATUS_NOT_FOUND : 126);
+    }
+    
+    if (pid == -1) {
+        fprintf(stderr, "xargs: fork failed: %s\n", strerror(errno));
+        run->status = 1;
+    } else {
+        shellstats_count(COUNTER_FORKS);
+        if (run->num_running >= run->running_capacity) {
+            run->running_capacity = run->running_capacity ? run->running_capacity * 2 : 8;
+            run->running = realloc(run->running, run->running_capacity * sizeof(struct job *));
+        }
+        run->running[run->num_running++] = job_create(&pid, 1, NULL, NULL);
+    }
+    run->launched++;
+    
+    for (int i = run->fixed_argc; i < run->argc; i++) {
+        free(run->argv[i]);
+    }
+    run->argc = run->fixed_argc;
+    run->size = run->fixed_size;
+}
+
+// Collects the status of a finished batch: 123 if any batch failed, or
+// 126/127 when the command couldn't be run at all
+static void reap_xargs_batch(struct xargs_run *run, int index) {
+    struct job *job = run->running[index];
+    int status = job->procs[0].status;
+    if (status == STATUS_NOT_FOUND || status == 126) {
+        run->status = status;
+    } else if (status != 0 && run->status == 0) {
+        run->status = XARGS_STATUS_FAILED;
+    }
+    
+    job_free(job);
+    run->running[index] = run->running[--run->num_running];
+}
+
+// `watch [-n secs] [-f path]... command` re-runs command every `secs`
+// (2 by default) or, with -f, when one of the paths changes. Everything is
+// driven from the shell's event loop: a timerfd for the interval, inotify
+// for the paths, and a self-pipe for ^C, which ends the watch. Bursts of
+// changes are coalesced into one run
+static void shell_watch(struct command_context *ctx) {
+    struct watch_state state = {
+        .interval_fd = -1,
+        .inotify_fd = -1,
+        .settle_fd = -1,
+    };
+    int first = parse_watch_options(ctx, &state);
+    if (first < 0) {
+        free(state.paths);
+        var_set_status(2);
+        return;
+    }
+    if (state.num_paths == 0 && state.interval_ms == 0) {
+        state.interval_ms = WATCH_DEFAULT_INTERVAL_MS;
+    }
+    
+    // Like procps watch, the words are joined and run as one command line,
+    // so `watch 'ls | wc -l'` works. It is parsed once
+    size_t length = 0;
+    for (int i = first; i < ctx->argc; i++) {
+        length += strlen(ctx->argv[i]) + 1;
+    }
+    state.text = malloc(length + 1);
+    state.text[0] = '\0';
+    for (int i = first; i < ctx->argc; i++) {
+        strcat(state.text, ctx->argv[i]);
+        if (i + 1 < ctx->argc) {
+            strcat(state.text, " ");
+        }
+    }
+    enum parse_status status;
+    state.command = parse_script(state.text, &status);
+    if (state.command == NULL) {
+        fprintf(stderr, "watch: %s: syntax error\n", state.text);
+        free(state.text);
+        free(state.paths);
+        var_set_status(2);
+        return;
+    }
+    
+    if (!open_watch_fds(&state)) {
+        close_watch_fds(&state);
+        free_command_node(state.command);
+        free(state.text);
+        free(state.paths);
+        var_set_status(1);
+        return;
+    }
+    
+    struct sigaction interrupt = { .sa_handler = watch_sigint_handler };
+    struct sigaction saved_interrupt;
+    sigemptyset(&interrupt.sa_mask);
+    sigaction(SIGINT, &interrupt, &saved_interrupt);
+    
+    state.due = true;
+    while (!state.stop) {
+        if (state.due) {
+            state.due = false;
+            run_watched(&state);
+            continue;
+        }
+        if (evloop_run_once(-1) < 0) {
+            break;
+        }
+    }
+    
+    sigaction(SIGINT, &saved_interrupt, NULL);
+    close_watch_fds(&state);
+    free_command_node(state.command);
+    free(state.text);
+    free(state.paths);
+}
+
+// Index of the first command word, or -1 after printing a usage error
+static int parse_watch_options(struct command_context *ctx, struct watch_state *state) {
+    int i = 1;
+    for (; i < ctx->argc && ctx->argv[i][0] == '-'; i++) {
+        if (strcmp(ctx->argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if ((strcmp(ctx->argv[i], "-n") != 0 && strcmp(ctx->argv[i], "-f") != 0) || i + 1 >= ctx->argc) {
+            fprintf(stderr, "watch: usage: watch [-n secs] [-f path]... command\n");
+            return -1;
+        }
+        
+        const char *value = ctx->argv[++i];
+        if (ctx->argv[i - 1][1] == 'n') {
+            char *end;
+            double seconds = strtod(value, &end);
+            if (*end != '\0' || !(seconds > 0) || seconds > LONG_MAX / 1000) {
+                fprintf(stderr, "watch: -n: %s: invalid interval\n", value);
+                return -1;
+            }
+            state->interval_ms = (long)(seconds * 1000);
+            if (state->interval_ms < WATCH_MIN_INTERVAL_MS) {
+                state->interval_ms = WATCH_MIN_INTERVAL_MS;
+            }
+        } else {
+            state->paths = realloc(state->paths, (state->num_paths + 1) * sizeof(struct watch_path));
+            state->paths[state->num_paths++] = (struct watch_path) { value, -1 };
+        }
+    }
+    
+    if (i >= ctx->argc) {
+        fprintf(stderr, "watch: usage: watch [-n secs] [-f path]... command\n");
+        return -1;
+    }
+    return i;
+}
+
+static bool open_watch_fds(struct watch_state *state) {
+    if (pipe2(watch_interrupt_pipe, O_CLOEXEC | O_NONBLOCK) < 0 ||
+        !evloop_add(watch_interrupt_pipe[0], on_watch_interrupt, state)) {
+        fprintf(stderr, "watch: event loop unavailable\n");
+        return false;
+    }
+    
+    if (state->interval_ms > 0) {
+        state->interval_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (state->interval_fd < 0 || !evloop_add(state->interval_fd, on_watch_interval, state)) {
+            fprintf(stderr, "watch: timerfd: %s\n", strerror(errno));
+            return false;
+        }
+        set_timer(state->interval_fd, state->interval_ms, state->interval_ms);
+    }
+    
+    if (state->num_paths > 0) {
+        state->inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        state->settle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (state->inotify_fd < 0 || state->settle_fd < 0 ||
+            !evloop_add(state->inotify_fd, on_watch_change, state) ||
+            !evloop_add(state->settle_fd, on_watch_settled, state)) {
+            fprintf(stderr, "watch: inotify: %s\n", strerror(errno));
+            return false;
+        }
+        
+        for (int i = 0; i < state->num_paths; i++) {
+            state->paths[i].wd = inotify_add_watch(state->inotify_fd, state->paths[i].path, WATCH_EVENT_MASK);
+            if (state->paths[i].wd < 0) {
+                fprintf(stderr, "watch: %s: %s\n", state->paths[i].path, strerror(errno));
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void close_watch_fds(struct watch_state *state) {
+    int *fds[] = { &watch_interrupt_pipe[0], &watch_interrupt_pipe[1], &state->interval_fd,
+                   &state->inotify_fd, &state->settle_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) {
+            evloop_remove(*fds[i]);
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+// Arms `fd` to fire after `first_ms`, then every `interval_ms` (0 = once)
+static void set_timer(int fd, long first_ms, long interval_ms) {
+    struct itimerspec spec = {
+        .it_value = { first_ms / 1000, (first_ms % 1000) * 1000000 },
+        .it_interval = { interval_ms / 1000, (interval_ms % 1000) * 1000000 },
+    };
+    timerfd_settime(fd, 0, &spec, NULL);
+}
+
+// (Re)adds watches for paths that don't have one. A file replaced by an
+// editor's rename loses its watch, and gets the new file's here
+static void watch_paths(struct watch_state *state) {
+    for (int i = 0; i < state->num_paths; i++) {
+        if (state->paths[i].wd < 0) {
+            state->paths[i].wd = inotify_add_watch(state->inotify_fd, state->paths[i].path, WATCH_EVENT_MASK);
+        }
+    }
+}
+
+// Header, then the command's output, all from this process
+static void run_watched(struct watch_state *state) {
+    char stamp[64];
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%a %b %e %H:%M:%S %Y", localtime(&now));
+    
+    if (isatty(STDOUT_FILENO)) {
+        fputs("\033[H\033[2J", stdout);
+    }
+    if (state->interval_ms > 0) {
+        printf("Every %.1fs: %s    %s\n\n", state->interval_ms / 1000.0, state->text, stamp);
+    } else {
+        printf("On change: %s    %s\n\n", state->text, stamp);
+    }
+    fflush(stdout);
+    
+    execute_node(state->command);
+    fflush(stdout);
+    
+    // `return` or `break` inside the command mustn't leak out of the watch
+    returning = false;
+    if (loop_depth == 0) {
+        break_count = 0;
+        continue_count = 0;
+    }
+    
+    // Changes made while the command ran stay queued, so on_watch_change
+    // sees them next and a save during a long build still gets its rerun
+}
+
+// Reads every queued event. Paths whose watch went away are marked so
+// watch_paths picks up whatever replaced them
+static void drain_watch_events(struct watch_state *state) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t got;
+    while ((got = read(state->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + got; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            if (event->mask & IN_IGNORED) {
+                for (int i = 0; i < state->num_paths; i++) {
+                    if (state->paths[i].wd == event->wd) {
+                        state->paths[i].wd = -1;
+                    }
+                }
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+static void on_watch_interval(int fd, void *data) {
+    struct watch_state *state = data;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+        state->due = true;
+    }
+}
+
+// Each change pushes the run back, so a save that touches several files
+// (or a file many times) runs the command once
+static void on_watch_change(int fd, void *data) {
+    (void) fd;
+    struct watch_state *state = data;
+    drain_watch_events(state);
+    watch_paths(state);
+    set_timer(state->settle_fd, WATCH_SETTLE_MS, 0);
+}
+
+static void on_watch_settled(int fd, void *data) {
+    struct watch_state *state = data;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+        state->due = true;
+    }
+}
+
+static void on_watch_interrupt(int fd, void *data) {
+    struct watch_state *state = data;
+    char byte;
+    while (read(fd, &byte, 1) > 0) {
+    }
+    state->stop = true;
+}
+
+static void watch_sigint_handler(int sig) {
+    (void) sig;
+    int saved_errno = errno;
+    ssize_t ignored = write(watch_interrupt_pipe[1], "", 1);
+    (void) ignored;
+    errno = saved_errno;
+}
+
+// `memo [-e NAME]... command [args...]` runs a deterministic command, or
+// replays its output and status from an earlier run with the same words,
+// working directory, NAME variables and file arguments (by size, mtime and
+// inode). `memo -c` empties the cache
+static void shell_memo(struct command_context *ctx) {
+    char **env_names = malloc(ctx->argc * sizeof(char *));
+    int num_env = 0;
+    int first = 1;
+    for (; first < ctx->argc && ctx->argv[first][0] == '-'; first++) {
+        if (strcmp(ctx->argv[first], "--") == 0) {
+            first++;
+            break;
+        }
+        if (strcmp(ctx->argv[first], "-c") == 0) {
+            printf("memo: removed %d entries\n", memo_clear());
+            free(env_names);
+            return;
+        }
+        if (strcmp(ctx->argv[first], "-e") != 0 || first + 1 >= ctx->argc) {
+            break;
+        }
+        env_names[num_env++] = ctx->argv[++first];
+    }
+    
+    if (first >= ctx->argc || ctx->argv[first][0] == '-') {
+        fprintf(stderr, "memo: usage: memo [-e NAME]... command [args...] | memo -c\n");
+        free(env_names);
+        var_set_status(2);
+        return;
+    }
+    
+    int saved[2] = { -1, -1 };
+    if (!push_redirects(ctx, saved)) {
+        free(env_names);
+        var_set_status(1);
+        return;
+    }
+    
+    size_t key_length;
+    char *key = memo_key(ctx->argv + first, ctx->argc - first, env_names, num_env, &key_length);
+    int status;
+    fflush(stdout);
+    if (memo_replay(key, key_length, STDOUT_FILENO, &status)) {
+        var_set_status(status);
+    } else {
+        run_memoized(ctx->argv + first, ctx->argc - first, key, key_length);
+    }
+    
+    free(key);
+    free(env_names);
+    pop_redirects(saved);
+}
+
+// Runs the command with stdout through a pipe that the shell copies to the
+// real stdout and into a new cache entry
+static void run_memoized(char **argv, int argc, const char *key, size_t key_length) {
+    struct memo_writer writer;
+    int fds[2];
+    if (!memo_begin(&writer, key, key_length)) {
+        run_words(argv, argc);
+        return;
+    }
+    if (pipe(fds) == -1) {
+        memo_abort(&writer);
+        run_words(argv, argc);
+        return;
+    }
+    
+    pid_t pid = fork_shell();
+    if (pid == -1) {
+        fprintf(stderr, "memo: fork failed\n");
+        close(fds[0]);
+        close(fds[1]);
+        memo_abort(&writer);
+        var_set_status(1);
+        return;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        
+        // External commands replace the child instead of forking again
+        char *path = (find_definition(argv[0]) || is_builtin(argv[0])) ? NULL : find_executable_in_path(argv[0]);
+        if (path) {
+            shellstats_count(COUNTER_EXECS);
+            execv(path, argv);
+        }
+        run_words(argv, argc);
+        fflush(stdout);
+        exit(var_status());
+    }
+    
+    close(fds[1]);
+    memo_capture(&writer, fds[0], STDOUT_FILENO);
+    close(fds[0]);
+    
+    struct job *job = job_create(&pid, 1, NULL, NULL);
+    int status = job_wait(job);
+    job_free(job);
+    
+    // A killed command didn't produce its real output
+    if (status < STATUS_SIGNAL_BASE) {
+        memo_commit(&writer, status);
+    } else {
+        memo_abort(&writer);
+    }
+    var_set_status(status);
+}
+
+// Runs already expanded words as a simple command
+static void run_words(char **argv, int argc) {
+    struct command_context ctx = {
+        .out_mode = O_TRUNC,
+        .err_mode = O_TRUNC,
+        .command_name = argv[0],
+        .argc = argc,
+        .argv = argv,
+    };
+    run_command(&ctx);
+}
+
+// `shell --server SOCKET` keeps one shell alive so its caches stay warm:
+// PATH listings, parsed command lines, and script/memo caches on disk.
+// Each request arrives with the client's stdin/stdout/stderr and runs in a
+// forked worker, so requests can't disturb each other or the server.
+// SIGINT/SIGTERM stop accepting, wait for running requests, and remove
+// the socket
+static int run_server(const char *path) {
+    server_path = path;
+    server_listen_fd = server_listen(path);
+    if (server_listen_fd < 0) {
+        return 1;
+    }
+    
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop_signals, &server_saved_mask);
+    server_signal_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC | SFD_NONBLOCK);
+    
+    if (server_signal_fd < 0 || !evloop_add(server_listen_fd, on_server_connection, NULL) ||
+        !evloop_add(server_signal_fd, on_server_signal, NULL)) {
+        fprintf(stderr, "shell: --server needs epoll and signalfd\n");
+        unlink(path);
+        return 1;
+    }
+    
+    warm_path_cache();
+    while (!server_stopping || num_server_workers > 0) {
+        if (evloop_run_once(-1) < 0) {
+            break;
+        }
+        reap_server_workers();
+    }
+    return 0;
+}
+
+// `shell --client SOCKET command [args...]` runs the command with exactly
+// these words on the server, and `shell --client SOCKET -c LINE` has the
+// server parse LINE. Exits with the command's status
+static int run_client(int argc, char **argv) {
+    if (argc < 4 || (strcmp(argv[3], "-c") == 0 && argc != 5)) {
+        fprintf(stderr, "usage: shell --client SOCKET command [args...] | shell --client SOCKET -c line\n");
+        return 2;
+    }
+    if (strcmp(argv[3], "-c") == 0) {
+        return client_run(argv[2], REQUEST_LINE, argv[4], strlen(argv[4]));
+    }
+    
+    // The words go as they are, so the server never re-splits or re-quotes them
+    size_t length = 0;
+    for (int i = 3; i < argc; i++) {
+        length += strlen(argv[i]) + 1;
+    }
+    char *words = malloc(length);
+    size_t used = 0;
+    for (int i = 3; i < argc; i++) {
+        size_t size = strlen(argv[i]) + 1;
+        memcpy(words + used, argv[i], size);
+        used += size;
+    }
+    
+    int status = client_run(argv[2], REQUEST_WORDS, words, length);
+    free(words);
+    return status;
+}
+
+// Loads every PATH directory into the directory cache before the first
+// fork, so workers inherit the listings instead of each reading them
+static void warm_path_cache(void) {
+    char *path_env = getenv("PATH");
+    if (!path_env) {
+        return;
+    }
+    char *path_copy = strdup(path_env);
+    char *saveptr = NULL;
+    for (char *dir = strtok_r(path_copy, ":", &saveptr); dir; dir = strtok_r(NULL, ":", &saveptr)) {
+        dir_cache_each(dir, "", visit_nothing, NULL);
+    }
+    free(path_copy);
+}
+
+static bool visit_nothing(const char *dir, const char *name, int type, void *data) {
+    (void) dir;
+    (void) name;
+    (void) type;
+    (void) data;
+    return false;
+}
+
+static void on_server_connection(int fd, void *data) {
+    (void) data;
+    int conn_fd = server_accept(fd);
+    if (conn_fd >= 0 && !evloop_add(conn_fd, on_server_request, NULL)) {
+        close(conn_fd);
+    }
+}
+
+static void on_server_request(int fd, void *data) {
+    (void) data;
+    evloop_remove(fd);
+    
+    struct server_request request;
+    if (!server_receive(fd, &request)) {
+        close(fd);
+        return;
+    }
+    start_server_worker(fd, &request);
+    
+    // The worker has its own copies of the client's descriptors
+    server_free_request(&request);
+}
+
+static void on_server_signal(int fd, void *data) {
+    (void) data;
+    struct signalfd_siginfo info;
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+    
+    if (!server_stopping) {
+        server_stopping = true;
+        evloop_remove(server_listen_fd);
+        close(server_listen_fd);
+        server_listen_fd = -1;
+        unlink(server_path);
+    }
+}
+
+// Parses lines in the server, so repeated requests hit the line cache, then
+// runs the tree (or the words) in a worker with the client's descriptors
+// and directory
+static void start_server_worker(int conn_fd, struct server_request *request) {
+    struct command_node *root = NULL;
+    if (request->kind == REQUEST_LINE) {
+        root = line_cache_lookup(request->text);
+    }
+    if (request->kind == REQUEST_LINE && root == NULL) {
+        enum parse_status status;
+        root = parse_script(request->text, &status);
+        if (root == NULL) {
+            dprintf(request->fds[2], "shell: syntax error\n");
+            server_reply(conn_fd, 2);
+            close(conn_fd);
+            return;
+        }
+        line_cache_insert(request->text, root);
+    }
+    
+    pid_t pid = fork_shell();
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &server_saved_mask, NULL);
+        if (server_listen_fd >= 0) {
+            close(server_listen_fd);
+        }
+        close(server_signal_fd);
+        for (int i = 0; i < SERVER_NUM_FDS; i++) {
+            dup2(request->fds[i], i);
+        }
+        
+        if (request->cwd[0] != '\0' && chdir(request->cwd) < 0) {
+            fprintf(stderr, "shell: %s: %s\n", request->cwd, strerror(errno));
+            exit(1);
+        }
+        if (root) {
+            execute_node(root);
+        } else {
+            run_request_words(request);
+        }
+        fflush(stdout);
+        exit(var_status());
+    }
+    if (root) {
+        free_command_node(root);
+    }
+    
+    if (pid == -1) {
+        dprintf(request->fds[2], "shell: fork failed\n");
+        server_reply(conn_fd, 1);
+        close(conn_fd);
+        return;
+    }
+    
+    if (num_server_workers >= server_workers_capacity) {
+        server_workers_capacity = server_workers_capacity ? server_workers_capacity * 2 : 16;
+        server_workers = realloc(server_workers, server_workers_capacity * sizeof(struct server_worker));
+    }
+    server_workers[num_server_workers++] = (struct server_worker) {
+        .conn_fd = conn_fd,
+        .job = job_create(&pid, 1, NULL, NULL),
+    };
+}
+
+// Runs a REQUEST_WORDS request's words as one command, without parsing or
+// expanding them again
+static void run_request_words(struct server_request *request) {
+    int argc = 0;
+    for (size_t i = 0; i < request->text_length; i++) {
+        argc += request->text[i] == '\0';
+    }
+    char **argv = malloc((argc + 1) * sizeof(char *));
+    char *word = request->text;
+    for (int i = 0; i < argc; i++) {
+        argv[i] = word;
+        word += strlen(word) + 1;
+    }
+    argv[argc] = NULL;
+    
+    run_words(argv, argc);
+    free(argv);
+}
+
+// Workers are reaped by the event loop; report the finished ones
+static void reap_server_workers(void) {
+    for (int i = 0; i < num_server_workers; ) {
+        struct server_worker *worker = &server_workers[i];
+        if (worker->job->remaining > 0) {
+            i++;
+            continue;
+        }
+        server_reply(worker->conn_fd, worker->job->procs[0].status);
+        close(worker->conn_fd);
+        job_free(worker->job);
+        server_workers[i] = server_workers[--num_server_workers];
+    }
+}
+
+// `coproc NAME cmd [args...]` starts cmd in the background with its stdin
+// and stdout connected to the shell, so a loop can send it thousands of
+// requests without starting a process for each. ${NAME[1]} is the fd that
+// writes to it and ${NAME[0]} the one that reads its output:
+//     echo query >&${NAME[1]}; read -u ${NAME[0]} answer
+// It is an ordinary background job; `coproc -c NAME` closes its stdin so a
+// filter that reads to EOF can finish
+static void shell_coproc(struct command_context *ctx) {
+    if (ctx->argc == 3 && strcmp(ctx->argv[1], "-c") == 0) {
+        struct coprocess *coproc = find_coprocess(ctx->argv[2]);
+        if (coproc == NULL) {
+            fprintf(stderr, "coproc: %s: no such coprocess\n", ctx->argv[2]);
+            var_set_status(1);
+            return;
+        }
+        if (coproc->write_fd >= 0) {
+            close(coproc->write_fd);
+            coproc->write_fd = -1;
+        }
+        var_set_status(0);
+        return;
+    }
+    
+    if (ctx->argc < 3 || !var_is_name(ctx->argv[1], strlen(ctx->argv[1]))) {
+        fprintf(stderr, "coproc: usage: coproc NAME command [args...] | coproc -c NAME\n");
+        var_set_status(2);
+        return;
+    }
+    const char *name = ctx->argv[1];
+    
+    struct coprocess *existing = find_coprocess(name);
+    if (existing) {
+        char pid_spec[32];
+        snprintf(pid_spec, sizeof(pid_spec), "%d", (int)existing->pid);
+        struct job *job = job_find(pid_spec);
+        if (job && job->remaining > 0) {
+            fprintf(stderr, "coproc: %s: still running\n", name);
+            var_set_status(1);
+            return;
+        }
+        release_coprocess(existing);
+    }
+    
+    // Close-on-exec, so commands started later don't hold the pipes open
+    int to_child[2], from_child[2];
+    if (pipe2(to_child, O_CLOEXEC) == -1) {
+        fprintf(stderr, "coproc: failed to create pipe\n");
+        var_set_status(1);
+        return;
+    }
+    if (pipe2(from_child, O_CLOEXEC) == -1) {
+        fprintf(stderr, "coproc: failed to create pipe\n");
+        close(to_child[0]);
+        close(to_child[1]);
+        var_set_status(1);
+        return;
+    }
+    
+    pid_t pid = fork_shell();
+    if (pid == 0) {
+        setpgid(0, 0);
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        
+        run_words(ctx->argv + 2, ctx->argc - 2);
+        fflush(stdout);
+        exit(var_status());
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    if (pid == -1) {
+        fprintf(stderr, "coproc: failed to fork\n");
+        close(to_child[1]);
+        close(from_child[0]);
+        var_set_status(1);
+        return;
+    }
+    
+    if (num_coprocs >= coprocs_capacity) {
+        coprocs_capacity = coprocs_capacity ? coprocs_capacity * 2 : 4;
+        coprocs = realloc(coprocs, coprocs_capacity * sizeof(struct coprocess));
+    }
+    coprocs[num_coprocs++] = (struct coprocess) {
+        .name = strdup(name),
+        .pid = pid,
+        .read_fd = from_child[0],
+        .write_fd = to_child[1],
+        .buffer = malloc(COPROC_BUFFER_SIZE),
+    };
+    
+    char variable[MAX_COMMAND_LENGTH];
+    char value[32];
+    snprintf(variable, sizeof(variable), "%s[0]", name);
+    snprintf(value, sizeof(value), "%d", from_child[0]);
+    var_set(variable, value);
+    snprintf(variable, sizeof(variable), "%s[1]", name);
+    snprintf(value, sizeof(value), "%d", to_child[1]);
+    var_set(variable, value);
+    snprintf(variable, sizeof(variable), "%s_PID", name);
+    snprintf(value, sizeof(value), "%d", (int)pid);
+    var_set(variable, value);
+    
+    char text[JOB_TEXT_LENGTH];
+    describe_words(ctx->argv, ctx->argc, text, sizeof(text));
+    job_background(job_create(&pid, 1, text, NULL));
+    var_set_status(0);
+}
+
+static struct coprocess *find_coprocess(const char *name) {
+    for (int i = 0; i < num_coprocs; i++) {
+        if (strcmp(coprocs[i].name, name) == 0) {
+            return &coprocs[i];
+        }
+    }
+    return NULL;
+}
+
+// Forgets a coprocess that has exited, closing the shell's ends of its pipes
+static void release_coprocess(struct coprocess *coproc) {
+    char variable[MAX_COMMAND_LENGTH];
+    snprintf(variable, sizeof(variable), "%s[0]", coproc->name);
+    var_unset(variable);
+    snprintf(variable, sizeof(variable), "%s[1]", coproc->name);
+    var_unset(variable);
+    
+    close(coproc->read_fd);
+    if (coproc->write_fd >= 0) {
+        close(coproc->write_fd);
+    }
+    free(coproc->buffer);
+    free(coproc->name);
+    *coproc = coprocs[--num_coprocs];
+}
+
+// In a forked child: the pipes belong to the parent shell, as in other
+// shells, and a copy held here would keep a coprocess from seeing EOF
+static void close_coprocess_fds(void) {
+    for (int i = 0; i < num_coprocs; i++) {
+        close(coprocs[i].read_fd);
+        if (coprocs[i].write_fd >= 0) {
+            close(coprocs[i].write_fd);
+        }
+        free(coprocs[i].buffer);
+        free(coprocs[i].name);
+    }
+    num_coprocs = 0;
+}
+
+// `read [-r] [-u FD] [NAME...]` reads one line and splits it on IFS; the
+// last NAME gets the rest of the line, and REPLY the whole line if no NAME
+// is given. Without -r, a backslash quotes the next character and one at
+// the end of the line continues it. Status 1 at end of input
+static void shell_read(struct command_context *ctx) {
+    bool raw = false;
+    int fd = STDIN_FILENO;
+    int first_name = 1;
+    for (; first_name < ctx->argc && ctx->argv[first_name][0] == '-'; first_name++) {
+        if (strcmp(ctx->argv[first_name], "-r") == 0) {
+            raw = true;
+        } else if (strcmp(ctx->argv[first_name], "-u") == 0 && first_name + 1 < ctx->argc) {
+            char *end;
+            fd = (int)strtol(ctx->argv[++first_name], &end, 10);
+            if (*end != '\0' || fd < 0) {
+                fprintf(stderr, "read: %s: invalid file descriptor specification\n", ctx->argv[first_name]);
+                var_set_status(2);
+                return;
+            }
+        } else if (strcmp(ctx->argv[first_name], "--") == 0) {
+            first_name++;
+            break;
+        } else {
+            fprintf(stderr, "read: usage: read [-r] [-u fd] [name ...]\n");
+            var_set_status(2);
+            return;
+        }
+    }
+    for (int i = first_name; i < ctx->argc; i++) {
+        if (!var_is_name(ctx->argv[i], strlen(ctx->argv[i]))) {
+            fprintf(stderr, "read: `%s': not a valid identifier\n", ctx->argv[i]);
+            var_set_status(2);
+            return;
+        }
+    }
+    
+    // Backslash handling needs to know which characters were escaped, so
+    // the IFS split can leave them alone
+    char *text = NULL;
+    bool *escaped = NULL;
+    size_t length = 0;
+    bool complete = false;
+    bool any = false;
+    char *line;
+    while ((line = read_input_line(fd, &complete)) != NULL) {
+        any = true;
+        size_t line_length = strlen(line);
+        text = realloc(text, length + line_length + 1);
+        escaped = realloc(escaped, (length + line_length + 1) * sizeof(bool));
+    
+        bool continued = false;
+        for (size_t i = 0; i < line_length; i++) {
+            if (!raw && line[i] == '\\') {
+                if (i + 1 == line_length) {
+                    continued = complete;
+                    break;
+                }
+                i++;
+                escaped[length] = true;
+            } else {
+                escaped[length] = false;
+            }
+            text[length++] = line[i];
+        }
+        free(line);
+        if (!continued) {
+            break;
+        }
+    }
+    
+    if (!any) {
+        var_set_status(1);
+        return;
+    }
+    text[length] = '\0';
+    
+    if (first_name == ctx->argc) {
+        var_set("REPLY", text);
+    } else {
+        assign_read_fields(ctx->argv + first_name, ctx->argc - first_name, text, escaped);
+    }
+    free(text);
+    free(escaped);
+    var_set_status(complete ? 0 : 1);
+}
+
+// One line from `fd` without its newline, or NULL at end of input. Never
+// reads past the newline: coprocess output is kept in the coprocess's
+// buffer, seekable files are rewound to just after the line, and anything
+// else (a pipe other processes read too) is read one byte at a time.
+// `*complete` is false if input ended before a newline
+static char *read_input_line(int fd, bool *complete) {
+    struct coprocess *coproc = NULL;
+    for (int i = 0; i < num_coprocs && coproc == NULL; i++) {
+        if (coprocs[i].read_fd == fd) {
+            coproc = &coprocs[i];
+        }
+    }
+    bool seekable = coproc == NULL && lseek(fd, 0, SEEK_CUR) >= 0;
+    
+    char *line = NULL;
+    size_t length = 0;
+    bool any = false;
+    *complete = false;
+    
+    while (!*complete) {
+        char chunk[READ_CHUNK];
+        const char *data = chunk;
+        ssize_t got;
+        if (coproc) {
+            if (coproc->buffer_start == coproc->buffer_end) {
+                got = read(fd, coproc->buffer, COPROC_BUFFER_SIZE);
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (got <= 0) {
+                    break;
+                }
+                coproc->buffer_start = 0;
+                coproc->buffer_end = (size_t)got;
+            }
+            data = coproc->buffer + coproc->buffer_start;
+            got = (ssize_t)(coproc->buffer_end - coproc->buffer_start);
+        } else {
+            got = read(fd, chunk, seekable ? sizeof(chunk) : 1);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                break;
+            }
+        }
+        any = true;
+    
+        const char *newline = memchr(data, '\n', (size_t)got);
+        size_t take = newline ? (size_t)(newline - data) : (size_t)got;
+        line = realloc(line, length + take + 1);
+        memcpy(line + length, data, take);
+        length += take;
+        *complete = newline != NULL;
+    
+        size_t consumed = newline ? take + 1 : (size_t)got;
+        if (coproc) {
+            coproc->buffer_start += consumed;
+        } else if (seekable && consumed < (size_t)got) {
+            lseek(fd, (off_t)consumed - got, SEEK_CUR);
+        }
+    }
+    
+    if (!any) {
+        free(line);
+        return NULL;
+    }
+    line[length] = '\0';
+    return line;
+}
+
+// Splits `line` on unescaped IFS characters into `names`. Runs of IFS
+// whitespace count as one separator and are trimmed from both ends
+static void assign_read_fields(char **names, int count, const char *line, const bool *escaped) {
+    const char *ifs = var_get("IFS");
+    if (ifs == NULL) {
+        ifs = " \t\n";
+    }
+    size_t length = strlen(line);
+    
+    size_t pos = 0;
+    while (pos < length && is_field_separator(line, escaped, pos, ifs, true)) {
+        pos++;
+    }
+    
+    for (int n = 0; n < count; n++) {
+        size_t start = pos;
+        size_t end;
+        if (n == count - 1) {
+            end = length;
+            while (end > start && is_field_separator(line, escaped, end - 1, ifs, true)) {
+                end--;
+            }
+            pos = length;
+        } else {
+            while (pos < length && !is_field_separator(line, escaped, pos, ifs, false)) {
+                pos++;
+            }
+            end = pos;
+    
+            // One separator: surrounding IFS whitespace plus at most one other IFS character
+            while (pos < length && is_field_separator(line, escaped, pos, ifs, true)) {
+                pos++;
+            }
+            if (pos < length && is_field_separator(line, escaped, pos, ifs, false)) {
+                pos++;
+                while (pos < length && is_field_separator(line, escaped, pos, ifs, true)) {
+                    pos++;
+                }
+            }
+        }
+    
+        char *value = strndup(line + start, end - start);
+        var_set(names[n], value);
+        free(value);
+    }
+}
+
+// Whether line[i] separates fields; with `space_only`, only IFS whitespace
+static bool is_field_separator(const char *line, const bool *escaped, size_t i, const char *ifs, bool space_only) {
+    char c = line[i];
+    if (escaped[i] || c == '\0' || strchr(ifs, c) == NULL) {
+        return false;
+    }
+    return !space_only || c == ' ' || c == '\t' || c == '\n';
+}
+
+// `shellstats [-j]`: heap use, processes, descriptors and every cache's
+// counters for this session. -j prints one JSON object for scripts
+static void shell_shellstats(struct command_context *ctx) {
+    bool json = false;
+    for (int i = 1; i < ctx->argc; i++) {
+        if (strcmp(ctx->argv[i], "-j") == 0) {
+            json = true;
+        } else {
+            fprintf(stderr, "shellstats: usage: shellstats [-j]\n");
+            var_set_status(2);
+            return;
+        }
+    }
+    
+    FILE *output = stdout;
+    if (ctx->redirect && ctx->out_file) {
+        const char *mode = (ctx->out_mode == O_APPEND) ? "a" : "w";
+        output = fopen(ctx->out_file, mode);
+        if (!output) {
+            fprintf(stderr, "shellstats: %s: cannot create file\n", ctx->out_file);
+            var_set_status(1);
+            return;
+        }
+    }
+    
+    struct shell_stat stats[MAX_SHELL_STATS];
+    int count = collect_shell_stats(stats);
+    if (json) {
+        print_shell_stats_json(output, stats, count);
+    } else {
+        print_shell_stats(output, stats, count);
+    }
+    
+    if (output != stdout) {
+        fclose(output);
+    }
+}
+
+// Snapshot of every counter, grouped by what keeps it
+static int collect_shell_stats(struct shell_stat *stats) {
+    int count = 0;
+    
+    // Taken first, so the snapshot doesn't count its own bookkeeping
+    struct alloc_stats alloc;
+    shellstats_get_alloc_stats(&alloc);
+    int open_fds = shellstats_open_fds();
+    
+    struct dir_cache_stats dir_cache;
+    struct line_cache_stats line_cache;
+    struct script_cache_stats script_cache;
+    struct memo_stats memo;
+    struct fuzzy_stats fuzzy;
+    struct audit_stats audit;
+    dir_cache_get_stats(&dir_cache);
+    line_cache_get_stats(&line_cache);
+    script_cache_get_stats(&script_cache);
+    memo_get_stats(&memo);
+    fuzzy_get_stats(&fuzzy);
+    audit_get_stats(&audit);
+    
+    const struct shell_stat all[] = {
+        { "memory", "allocations", alloc.allocations },
+        { "memory", "reallocations", alloc.reallocations },
+        { "memory", "frees", alloc.frees },
+        { "memory", "live_blocks", alloc.live_blocks },
+        { "memory", "bytes", alloc.bytes },
+        { "memory", "peak_bytes", alloc.peak_bytes },
+        { "processes", "forks", shellstats_counter(COUNTER_FORKS) },
+        { "processes", "execs", shellstats_counter(COUNTER_EXECS) },
+        { "processes", "jobs", jobs_count() },
+        { "fds", "open", (unsigned long long)(open_fds < 0 ? 0 : open_fds) },
+        { "path_cache", "hits", dir_cache.hits },
+        { "path_cache", "loads", dir_cache.loads },
+        { "path_cache", "dirents", dir_cache.dirents },
+        { "path_cache", "evictions", dir_cache.evictions },
+        { "path_cache", "dirs", dir_cache.dirs },
+        { "path_cache", "names", dir_cache.names },
+        { "path_cache", "bytes", dir_cache.bytes },
+        { "line_cache", "hits", line_cache.hits },
+        { "line_cache", "misses", line_cache.misses },
+        { "line_cache", "bypasses", line_cache.bypasses },
+        { "line_cache", "evictions", line_cache.evictions },
+        { "line_cache", "entries", line_cache.entries },
+        { "line_cache", "bytes", line_cache.bytes },
+        { "script_cache", "hits", script_cache.hits },
+        { "script_cache", "misses", script_cache.misses },
+        { "script_cache", "stores", script_cache.stores },
+        { "script_cache", "rejected", script_cache.rejected },
+        { "memo", "hits", memo.hits },
+        { "memo", "misses", memo.misses },
+        { "memo", "stores", memo.stores },
+        { "memo", "evictions", memo.evictions },
+        { "history_index", "entries", fuzzy.entries },
+        { "history_index", "bytes", fuzzy.bytes },
+        { "history_index", "searches", fuzzy.searches },
+        { "history_index", "timeouts", fuzzy.timeouts },
+        { "audit", "records", audit.records },
+        { "audit", "dropped", audit.dropped },
+    };
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]) && count < MAX_SHELL_STATS; i++) {
+        stats[count++] = all[i];
+    }
+    return count;
+}
+
+// One line per group; caches also get their hit rate
+static void print_shell_stats(FILE *output, const struct shell_stat *stats, int count) {
+    for (int i = 0; i < count; ) {
+        const char *group = stats[i].group;
+        unsigned long long hits = 0;
+        unsigned long long lookups = 0;
+        
+        fprintf(output, "%-14s", group);
+        for (int first = i; i < count && strcmp(stats[i].group, group) == 0; i++) {
+            fprintf(output, "%s%s %llu", (i == first) ? "" : ", ", stats[i].name, stats[i].value);
+            if (strcmp(stats[i].name, "hits") == 0) {
+                hits = stats[i].value;
+                lookups += stats[i].value;
+            } else if (strcmp(stats[i].name, "misses") == 0 || strcmp(stats[i].name, "loads") == 0) {
+                lookups += stats[i].value;
+            }
+        }
+        if (lookups > 0) {
+            fprintf(output, " (%.1f%% hits)", 100.0 * hits / lookups);
+        }
+        fputc('\n', output);
+    }
+}
+
+// {"group":{"name":value,...},...} on one line; names are plain identifiers
+static void print_shell_stats_json(FILE *output, const struct shell_stat *stats, int count) {
+    fputc('{', output);
+    for (int i = 0; i < count; ) {
+        const char *group = stats[i].group;
+        fprintf(output, "%s\"%s\":{", (i == 0) ? "" : ",", group);
+        for (int first = i; i < count && strcmp(stats[i].group, group) == 0; i++) {
+            fprintf(output, "%s\"%s\":%llu", (i == first) ? "" : ",", stats[i].name, stats[i].value);
+        }
+        fputc('}', output);
+    }
+    fputs("}\n", output);
+}
+
+// `timeout [-s SIGNAL] [-k GRACE] DURATION command [args...]` runs the
+// command in its own process group and signals the whole group once
+// DURATION has passed. The shell forks once and execs external commands
+// straight from that child; a timerfd in the event loop keeps the deadline
+static void shell_timeout(struct command_context *ctx) {
+    struct timeout_run run = { .signal = SIGTERM, .grace_ms = TIMEOUT_DEFAULT_GRACE_MS };
+    int first = parse_timeout_options(ctx, &run);
+    if (first < 0) {
+        var_set_status(TIMEOUT_FAILED);
+        return;
+    }
+    long duration_ms = parse_duration_ms(ctx->argv[first]);
+    if (duration_ms < 0) {
+        fprintf(stderr, "timeout: %s: invalid time interval\n", ctx->argv[first]);
+        var_set_status(TIMEOUT_FAILED);
+        return;
+    }
+    char **argv = ctx->argv + first + 1;
+    int argc = ctx->argc - first - 1;
+    
+    int saved[2] = { -1, -1 };
+    if (!push_redirects(ctx, saved)) {
+        var_set_status(1);
+        return;
+    }
+    
+    pid_t pid = fork_shell();
+    if (pid == -1) {
+        fprintf(stderr, "timeout: fork failed\n");
+        pop_redirects(saved);
+        var_set_status(TIMEOUT_FAILED);
+        return;
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        
+        // External commands replace the child instead of forking again
+        char *path = (find_definition(argv[0]) || is_builtin(argv[0])) ? NULL : find_executable_in_path(argv[0]);
+        if (path) {
+            shellstats_count(COUNTER_EXECS);
+            execv(path, argv);
+        }
+        run_words(argv, argc);
+        fflush(stdout);
+        exit(var_status());
+    }
+    setpgid(pid, pid);      // Whichever side gets there first
+    run.group = pid;
+    run.job = job_create(&pid, 1, NULL, NULL);
+    
+    // Without a pidfd job_wait blocks in waitpid and the timer never fires
+    int timer_fd = -1;
+    if (duration_ms > 0) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (timer_fd >= 0 && evloop_add(timer_fd, on_timeout_expired, &run)) {
+            set_timer(timer_fd, duration_ms, 0);
+        } else {
+            fprintf(stderr, "timeout: can't keep a deadline without timerfd and epoll\n");
+        }
+    }
+    
+    // The group isn't the terminal's any more, so ^C has to be passed on
+    struct sigaction interrupt = { .sa_handler = timeout_sigint_handler };
+    struct sigaction saved_interrupt;
+    sigemptyset(&interrupt.sa_mask);
+    timeout_group = pid;
+    sigaction(SIGINT, &interrupt, &saved_interrupt);
+    
+    int status = job_wait(run.job);
+    
+    sigaction(SIGINT, &saved_interrupt, NULL);
+    timeout_group = 0;
+    if (timer_fd >= 0) {
+        evloop_remove(timer_fd);
+        close(timer_fd);
+    }
+    set_pipestatus(run.job);
+    job_free(run.job);
+    pop_redirects(saved);
+    
+    if (run.killed) {
+        status = STATUS_SIGNAL_BASE + SIGKILL;
+    } else if (run.timed_out) {
+        status = TIMEOUT_STATUS;
+    }
+    var_set_status(status);
+}
+
+// Index of DURATION, or -1 after printing a usage error
+static int parse_timeout_options(struct command_context *ctx, struct timeout_run *run) {
+    int i = 1;
+    for (; i < ctx->argc && ctx->argv[i][0] == '-'; i++) {
+        if (strcmp(ctx->argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if ((strcmp(ctx->argv[i], "-s") != 0 && strcmp(ctx->argv[i], "-k") != 0) || i + 1 >= ctx->argc) {
+            fprintf(stderr, "timeout: usage: timeout [-s signal] [-k duration] duration command [args...]\n");
+            return -1;
+        }
+        
+        const char *value = ctx->argv[++i];
+        if (ctx->argv[i - 1][1] == 's') {
+            run->signal = parse_signal_name(value);
+            if (run->signal <= 0) {
+                fprintf(stderr, "timeout: -s: %s: invalid signal\n", value);
+                return -1;
+            }
+        } else {
+            run->grace_ms = parse_duration_ms(value);
+            if (run->grace_ms < 0) {
+                fprintf(stderr, "timeout: -k: %s: invalid time interval\n", value);
+                return -1;
+            }
+        }
+    }
+    
+    if (i + 1 >= ctx->argc) {
+        fprintf(stderr, "timeout: usage: timeout [-s signal] [-k duration] duration command [args...]\n");
+        return -1;
+    }
+    return i;
+}
+
+// Seconds with an optional s, m, h or d suffix, in milliseconds; -1 if
+// `text` isn't one. 0 means no limit
+static long parse_duration_ms(const char *text) {
+    char *end;
+    double seconds = strtod(text, &end);
+    if (end == text || !(seconds >= 0)) {
+        return -1;
+    }
+    
+    if (*end != '\0') {
+        if (end[1] != '\0') {
+            return -1;
+        }
+        switch (*end) {
+            case 's': break;
+            case 'm': seconds *= 60; break;
+            case 'h': seconds *= 60 * 60; break;
+            case 'd': seconds *= 24 * 60 * 60; break;
+            default: return -1;
+        }
+    }
+    if (seconds > LONG_MAX / 1000) {
+        return -1;
+    }
+    
+    // Anything above zero waits at least a millisecond; 0 would disarm the timer
+    long ms = (long)(seconds * 1000);
+    return (ms == 0 && seconds > 0) ? 1 : ms;
+}
+
+// "TERM", "SIGTERM" or "15"; 0 if unknown
+static int parse_signal_name(const char *text) {
+    char *end;
+    long number = strtol(text, &end, 10);
+    if (end != text && *end == '\0') {
+        return (number > 0 && number < NSIG) ? (int)number : 0;
+    }
+    
+    if (strncasecmp(text, "SIG", 3) == 0) {
+        text += 3;
+    }
+    for (int sig = 1; sig < NSIG; sig++) {
+        const char *name = sigabbrev_np(sig);
+        if (name && strcasecmp(name, text) == 0) {
+            return sig;
+        }
+    }
+    return 0;
+}
+
+static void on_timeout_expired(int fd, void *data) {
+    struct timeout_run *run = data;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations) || run->job->remaining == 0) {
+        return;
+    }
+    
+    if (!run->timed_out) {
+        run->timed_out = true;
+        run->killed = run->signal == SIGKILL;
+        signal_timed_group(run, run->signal);
+        if (run->grace_ms > 0 && run->signal != SIGKILL) {
+            set_timer(fd, run->grace_ms, 0);
+        }
+        return;
+    }
+    run->killed = true;
+    signal_timed_group(run, SIGKILL);
+}
+
+// The leader goes through its pidfd, the rest of the pipeline through the
+// group. Until the shell reaps the leader, its pid (the group id) can't be
+// handed to anyone else
+static void signal_timed_group(struct timeout_run *run, int sig) {
+    job_signal(run->job, sig);
+    killpg(run->group, sig);
+    if (sig != SIGKILL && sig != SIGCONT) {
+        killpg(run->group, SIGCONT);    // A stopped process only acts on it once continued
+    }
+}
+
+static void timeout_sigint_handler(int sig) {
+    int saved_errno = errno;
+    if (timeout_group > 0) {
+        killpg(timeout_group, sig);
+    }
+    errno = saved_errno;
+}
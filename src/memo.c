@@ -0,0 +1,411 @@
+/* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <stdarg.h>
+#include <sys/sendfile.h>
+
+#include "memo.h"
+
+/* DEFINE CONSTANTS */
+#define MEMO_COPY_CHUNK 65536
+#define MEMO_SUFFIX ".memo"
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// Start of an entry. The key follows, then the command's output
+struct memo_header {
+    char magic[8];
+    uint32_t version;
+    int32_t status;
+    uint64_t key_length;
+    uint64_t output_length;
+};
+
+struct key_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+// An entry seen while trimming the cache
+struct memo_entry {
+    char name[64];
+    off_t size;
+    struct timespec used;   // mtime, refreshed by every hit
+};
+
+/* FUNCTION HEADERS */
+static bool cache_dir(char *buf, size_t size, bool create);
+static bool entry_path(const char *key, size_t key_length, char *buf, size_t size, bool create);
+static bool make_dirs(char *path);
+static uint64_t hash_bytes(const void *data, size_t length);
+static void key_append(struct key_buffer *key, const char *text, size_t length);
+static void key_printf(struct key_buffer *key, const char *format, ...);
+static bool write_all(int fd, const char *data, size_t length);
+static bool copy_range(int in_fd, int out_fd, off_t offset, uint64_t length);
+static void trim_cache(void);
+static int compare_entries(const void *a, const void *b);
+
+/* MEMO STATE */
+static struct memo_stats stats = { 0 };
+
+/* FUNCTION FUNCTIONS */
+char *memo_key(char *const *argv, int argc, char *const *env_names, int num_env, size_t *length) {
+    struct key_buffer key = { 0 };
+    
+    // Every part ends in a NUL, so no two different keys run together
+    for (int i = 0; i < argc; i++) {
+        key_append(&key, argv[i], strlen(argv[i]) + 1);
+    }
+    key_append(&key, "", 1);
+    
+    char cwd[PATH_MAX];
+    key_printf(&key, "cwd=%s", getcwd(cwd, sizeof(cwd)) ? cwd : "");
+    for (int i = 0; i < num_env; i++) {
+        const char *value = getenv(env_names[i]);
+        key_printf(&key, "env %s%s%s", env_names[i], value ? "=" : "", value ? value : "");
+    }
+    
+    for (int i = 0; i < argc; i++) {
+        struct stat st;
+        if (stat(argv[i], &st) == 0) {
+            key_printf(&key, "file %d %llu %llu %lld %lld.%09ld", i, (unsigned long long)st.st_dev,
+                       (unsigned long long)st.st_ino, (long long)st.st_size,
+                       (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+        }
+    }
+    
+    *length = key.length;
+    return key.data;
+}
+
+bool memo_replay(const char *key, size_t key_length, int out_fd, int *status) {
+    char path[PATH_MAX];
+    if (!entry_path(key, key_length, path, sizeof(path), false)) {
+        return false;
+    }
+    
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        stats.misses++;
+        return false;
+    }
+    
+    struct memo_header header;
+    struct stat st;
+    bool valid = read(fd, &header, sizeof(header)) == sizeof(header) &&
+                 memcmp(header.magic, MEMO_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == MEMO_CACHE_VERSION &&
+                 header.key_length == key_length &&
+                 fstat(fd, &st) == 0 &&
+                 (uint64_t)st.st_size == sizeof(header) + key_length + header.output_length;
+    
+    // Same hash isn't enough; the whole key has to match
+    if (valid) {
+        char *stored = malloc(key_length);
+        valid = read(fd, stored, key_length) == (ssize_t)key_length && memcmp(stored, key, key_length) == 0;
+        free(stored);
+    }
+    if (!valid) {
+        close(fd);
+        stats.misses++;
+        return false;
+    }
+    
+    copy_range(fd, out_fd, (off_t)(sizeof(header) + key_length), header.output_length);
+    futimens(fd, NULL);     // Recently used entries survive trimming
+    close(fd);
+    
+    stats.hits++;
+    *status = header.status;
+    return true;
+}
+
+bool memo_begin(struct memo_writer *writer, const char *key, size_t key_length) {
+    writer->fd = -1;
+    if (!entry_path(key, key_length, writer->path, sizeof(writer->path), true)) {
+        return false;
+    }
+    snprintf(writer->temp_path, sizeof(writer->temp_path), "%s.%d.tmp", writer->path, (int)getpid());
+    
+    writer->fd = open(writer->temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (writer->fd < 0) {
+        return false;
+    }
+    
+    // The header is rewritten with the real lengths at commit
+    struct memo_header header = { 0 };
+    writer->key_length = key_length;
+    writer->output_length = 0;
+    writer->too_big = !write_all(writer->fd, (const char *)&header, sizeof(header)) ||
+                      !write_all(writer->fd, key, key_length);
+    return true;
+}
+
+void memo_capture(struct memo_writer *writer, int in_fd, int out_fd) {
+    char *buf = malloc(MEMO_COPY_CHUNK);
+    ssize_t got;
+    while ((got = read(in_fd, buf, MEMO_COPY_CHUNK)) != 0) {
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        write_all(out_fd, buf, (size_t)got);
+    
+        if (!writer->too_big) {
+            writer->output_length += (uint64_t)got;
+            writer->too_big = writer->output_length > MEMO_ENTRY_MAX_BYTES ||
+                              !write_all(writer->fd, buf, (size_t)got);
+        }
+    }
+    free(buf);
+}
+
+void memo_commit(struct memo_writer *writer, int status) {
+    if (writer->too_big) {
+        memo_abort(writer);
+        return;
+    }
+    
+    struct memo_header header = {
+        .version = MEMO_CACHE_VERSION,
+        .status = status,
+        .key_length = writer->key_length,
+        .output_length = writer->output_length,
+    };
+    memcpy(header.magic, MEMO_CACHE_MAGIC, sizeof(header.magic));
+    
+    bool ok = pwrite(writer->fd, &header, sizeof(header), 0) == sizeof(header);
+    ok = close(writer->fd) == 0 && ok;
+    writer->fd = -1;
+    if (ok && rename(writer->temp_path, writer->path) == 0) {
+        stats.stores++;
+        trim_cache();
+    } else {
+        unlink(writer->temp_path);
+    }
+}
+
+void memo_abort(struct memo_writer *writer) {
+    if (writer->fd >= 0) {
+        close(writer->fd);
+        writer->fd = -1;
+        unlink(writer->temp_path);
+    }
+}
+
+int memo_clear(void) {
+    char dir_path[PATH_MAX];
+    if (!cache_dir(dir_path, sizeof(dir_path), false)) {
+        return 0;
+    }
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return 0;
+    }
+    
+    int removed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strstr(entry->d_name, MEMO_SUFFIX) && unlinkat(dirfd(dir), entry->d_name, 0) == 0) {
+            removed++;
+        }
+    }
+    closedir(dir);
+    return removed;
+}
+
+void memo_get_stats(struct memo_stats *out) {
+    *out = stats;
+}
+
+static bool cache_dir(char *buf, size_t size, bool create) {
+    const char *configured = getenv(MEMO_CACHE_ENV_VAR);
+    if (configured) {
+        if (configured[0] == '\0') {
+            return false;
+        }
+        snprintf(buf, size, "%s", configured);
+    } else if (getenv("XDG_CACHE_HOME") && getenv("XDG_CACHE_HOME")[0] == '/') {
+        snprintf(buf, size, "%s/%s", getenv("XDG_CACHE_HOME"), MEMO_CACHE_DIR_NAME);
+    } else if (getenv("HOME")) {
+        snprintf(buf, size, "%s/.cache/%s", getenv("HOME"), MEMO_CACHE_DIR_NAME);
+    } else {
+        return false;
+    }
+    return !create || make_dirs(buf);
+}
+
+// <cache dir>/<hash of the key>.memo
+static bool entry_path(const char *key, size_t key_length, char *buf, size_t size, bool create) {
+    char dir[PATH_MAX];
+    if (!cache_dir(dir, sizeof(dir), create)) {
+        return false;
+    }
+    uint64_t hash = hash_bytes(key, key_length);
+    return (size_t)snprintf(buf, size, "%s/%016llx%s", dir, (unsigned long long)hash, MEMO_SUFFIX) < size;
+}
+
+// mkdir -p
+static bool make_dirs(char *path) {
+    for (char *p = path + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            bool ok = mkdir(path, 0700) == 0 || errno == EEXIST;
+            *p = '/';
+            if (!ok) {
+                return false;
+            }
+        }
+    }
+    return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+static uint64_t hash_bytes(const void *data, size_t length) {
+    // FNV-1a, 64-bit
+    const unsigned char *bytes = data;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void key_append(struct key_buffer *key, const char *text, size_t length) {
+    if (key->length + length > key->capacity) {
+        key->capacity = (key->capacity ? key->capacity * 2 : 256) + length;
+        key->data = realloc(key->data, key->capacity);
+    }
+    memcpy(key->data + key->length, text, length);
+    key->length += length;
+}
+
+static void key_printf(struct key_buffer *key, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    char *text;
+    int length = vasprintf(&text, format, args);
+    va_end(args);
+    if (length >= 0) {
+        key_append(key, text, (size_t)length + 1);
+        free(text);
+    }
+}
+
+static bool write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return true;
+}
+
+// sendfile() straight from the page cache, or a read/write loop for
+// descriptors it doesn't support
+static bool copy_range(int in_fd, int out_fd, off_t offset, uint64_t length) {
+    while (length > 0) {
+        ssize_t sent = sendfile(out_fd, in_fd, &offset, length);
+        if (sent > 0) {
+            length -= (uint64_t)sent;
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent == 0 || (errno != EINVAL && errno != ENOSYS)) {
+            return false;
+        }
+        break;
+    }
+    
+    char *buf = malloc(MEMO_COPY_CHUNK);
+    bool ok = true;
+    while (ok && length > 0) {
+        size_t want = length < MEMO_COPY_CHUNK ? (size_t)length : MEMO_COPY_CHUNK;
+        ssize_t got = pread(in_fd, buf, want, offset);
+        ok = got > 0 && write_all(out_fd, buf, (size_t)got);
+        if (ok) {
+            offset += got;
+            length -= (uint64_t)got;
+        }
+    }
+    free(buf);
+    return ok;
+}
+
+// Deletes the least recently used entries until the cache fits
+static void trim_cache(void) {
+    char dir_path[PATH_MAX];
+    if (!cache_dir(dir_path, sizeof(dir_path), false)) {
+        return;
+    }
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
+    }
+    
+    struct memo_entry *entries = NULL;
+    int count = 0;
+    int capacity = 0;
+    off_t total = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        size_t length = strlen(entry->d_name);
+        if (length >= sizeof(entries[0].name) || length < strlen(MEMO_SUFFIX) ||
+            strcmp(entry->d_name + length - strlen(MEMO_SUFFIX), MEMO_SUFFIX) != 0 ||
+            fstatat(dirfd(dir), entry->d_name, &st, 0) < 0) {
+            continue;
+        }
+    
+        if (count >= capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = realloc(entries, capacity * sizeof(struct memo_entry));
+        }
+        memcpy(entries[count].name, entry->d_name, length + 1);
+        entries[count].size = st.st_size;
+        entries[count].used = st.st_mtim;
+        total += st.st_size;
+        count++;
+    }
+    
+    if (total > MEMO_CACHE_MAX_BYTES) {
+        qsort(entries, count, sizeof(struct memo_entry), compare_entries);
+        for (int i = 0; i < count && total > MEMO_CACHE_MAX_BYTES; i++) {
+            if (unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+                total -= entries[i].size;
+                stats.evictions++;
+            }
+        }
+    }
+    
+    closedir(dir);
+    free(entries);
+}
+
+// Oldest first
+static int compare_entries(const void *a, const void *b) {
+    const struct memo_entry *x = a;
+    const struct memo_entry *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return (x->used.tv_sec < y->used.tv_sec) ? -1 : 1;
+    }
+    return (x->used.tv_nsec < y->used.tv_nsec) ? -1 : (x->used.tv_nsec > y->used.tv_nsec);
+}
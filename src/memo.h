@@ -0,0 +1,68 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+/* INCLUDE LIBRARIES */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+
+/* DEFINE CONSTANTS */
+#define MEMO_CACHE_ENV_VAR "SHELL_MEMO_CACHE"       // Directory; empty disables
+#define MEMO_CACHE_DIR_NAME "codecrafters-shell/memo"   // Under $XDG_CACHE_HOME or ~/.cache
+#define MEMO_CACHE_MAGIC "SHMEMO\0\0"
+#define MEMO_CACHE_VERSION 1
+#define MEMO_CACHE_MAX_BYTES (256 * 1024 * 1024)    // Oldest entries go past this
+#define MEMO_ENTRY_MAX_BYTES (64 * 1024 * 1024)     // Bigger outputs aren't kept
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// An entry being recorded. Output goes to a temporary file that is renamed
+// into place once the command has finished
+struct memo_writer {
+    int fd;
+    char path[PATH_MAX];
+    char temp_path[PATH_MAX + 32];
+    size_t key_length;
+    uint64_t output_length;
+    bool too_big;
+};
+
+struct memo_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stores;
+    unsigned long evictions;
+};
+
+/* FUNCTION HEADERS */
+
+// Key for running `argv` here and now: the words, the working directory,
+// the values of the `env_names` variables, and the size, mtime and inode
+// of every word that names an existing file. Free it with free()
+char *memo_key(char *const *argv, int argc, char *const *env_names, int num_env, size_t *length);
+
+// Copies the stored output for `key` to `out_fd` with sendfile(). False on
+// a miss; otherwise `*status` is the status the command exited with
+bool memo_replay(const char *key, size_t key_length, int out_fd, int *status);
+
+// Starts recording an entry for `key`. False when the cache is disabled or
+// its directory can't be written
+bool memo_begin(struct memo_writer *writer, const char *key, size_t key_length);
+
+// Copies `in_fd` to `out_fd` until EOF, recording what passes through
+void memo_capture(struct memo_writer *writer, int in_fd, int out_fd);
+
+// Publishes the entry with the command's exit status, then trims the cache
+// back under MEMO_CACHE_MAX_BYTES
+void memo_commit(struct memo_writer *writer, int status);
+
+// Drops the entry being recorded
+void memo_abort(struct memo_writer *writer);
+
+// Removes every entry. Returns how many were removed
+int memo_clear(void);
+
+void memo_get_stats(struct memo_stats *stats);
+
+#endif
@@ -0,0 +1,1438 @@
+/* INCLUDE LIBRARIES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PARSER_HAVE_X86_SIMD 1
+#endif
+
+#include "parser.h"
+#include "brace.h"
+
+/* DEFINE CONSTANTS */
+#define SCAN_CLASS_MAX 16
+#define SCAN_SCALAR_PROBE 16
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// A set of bytes the tokenizer must stop at; everything else is copied in bulk
+struct scan_class {
+    int count;
+    char chars[SCAN_CLASS_MAX];
+    bool table[256];
+};
+
+typedef const char *(*scan_function)(const char *p, const char *end, const struct scan_class *set);
+
+// Words of a line, plus whether any part of each word was quoted or escaped
+struct token_list {
+    char **words;
+    bool *quoted;
+    bool *expands;          // Word contains an EXPAND_MARK or a brace expression
+    int count;
+    int capacity;
+    bool has_expansions;    // Saw '$' or '`' outside single quotes
+};
+
+// Recursive-descent position in a token list
+struct parse_state {
+    struct token_list *tokens;
+    int pos;
+    enum parse_status status;
+};
+
+/* FUNCTION HEADERS */
+static const char *scan_scalar(const char *p, const char *end, const struct scan_class *set);
+#ifdef PARSER_HAVE_X86_SIMD
+static const char *scan_sse2(const char *p, const char *end, const struct scan_class *set);
+static const char *scan_avx2(const char *p, const char *end, const struct scan_class *set);
+#endif
+static inline const char *scan_to_special(const char *p, const char *end, const struct scan_class *set);
+static void tokenize(const char *line, struct token_list *tokens);
+static int operator_length(const char *p, const char *word, int word_length);
+static const char *find_closing_paren(const char *p);
+static int copy_marking_braces(char *buffer, int pos, const char *p, size_t length, int *brace_depth, int *param_depth);
+static bool settle_brace_marks(char *buffer, int *length);
+static void push_token(struct token_list *tokens, const char *text, int length, bool quoted, bool expands);
+static bool is_operator(const struct token_list *tokens, int i, const char *op);
+static void build_context(struct token_list *tokens, int start, int end, struct command_context *ctx);
+static int take_fanouts(struct command_context *ctx, bool *quoted, int count);
+static struct command_node *new_node(enum node_type type);
+static void append_child(struct command_node *parent, struct command_node *child);
+static bool at_end(struct parse_state *ps);
+static bool at_operator(struct parse_state *ps, const char *op);
+static bool at_word(struct parse_state *ps, const char *word);
+static bool at_separator(struct parse_state *ps);
+static bool at_list_end(struct parse_state *ps);
+static bool at_redirect(struct parse_state *ps);
+static char *duplication_target(const char *word, bool *is_stderr);
+static void skip_newlines(struct parse_state *ps);
+static void syntax_error(struct parse_state *ps);
+static bool expect_word(struct parse_state *ps, const char *word);
+static char *take_word(struct parse_state *ps);
+static bool is_name(const char *name);
+static bool is_function_name(const char *name);
+static struct command_node *parse_list(struct parse_state *ps, const char *const *terminators);
+static struct command_node *parse_and_or(struct parse_state *ps);
+static struct command_node *parse_pipeline(struct parse_state *ps);
+static struct command_node *parse_command(struct parse_state *ps);
+static struct command_node *parse_simple_command(struct parse_state *ps, bool allow_pipes);
+static struct command_node *parse_function(struct parse_state *ps);
+static struct command_node *parse_group(struct parse_state *ps);
+static struct command_node *parse_if(struct parse_state *ps);
+static struct command_node *parse_loop(struct parse_state *ps, enum node_type type);
+static struct command_node *parse_for(struct parse_state *ps);
+static struct command_node *parse_case(struct parse_state *ps);
+static void parse_redirects(struct parse_state *ps, struct command_node *node);
+
+/* SCANNER TABLES */
+
+// Outside quotes: whitespace, quotes, escapes, separators and the operator characters
+static const struct scan_class unquoted_specials = {
+    .count = 15,
+    .chars = { ' ', '\t', '\n', ';', '\'', '"', '\\', '|', '>', '<', '&', '$', '`', '(', ')' },
+    .table = {
+        [' '] = true, ['\t'] = true, ['\n'] = true, [';'] = true, ['\''] = true, ['"'] = true,
+        ['\\'] = true, ['|'] = true, ['>'] = true, ['<'] = true, ['&'] = true, ['$'] = true,
+        ['`'] = true, ['('] = true, [')'] = true,
+    },
+};
+
+// Inside double quotes: the closing quote, backslash and expansion starts
+static const struct scan_class double_quoted_specials = {
+    .count = 4,
+    .chars = { '"', '\\', '$', '`' },
+    .table = { ['"'] = true, ['\\'] = true, ['$'] = true, ['`'] = true },
+};
+
+// Picked on first use from what the CPU supports
+static scan_function scan_impl = NULL;
+
+/* FUNCTION FUNCTIONS */
+void parse_command_line(char *line, struct command_context *ctx) {
+    struct token_list tokens;
+    tokenize(line, &tokens);
+    
+    // Operators like ';' are plain words here; parse_script splits on them
+    build_context(&tokens, 0, tokens.count, ctx);
+    
+    free(tokens.words);
+    free(tokens.quoted);
+    free(tokens.expands);
+}
+
+struct command_node *parse_script(const char *text, enum parse_status *status) {
+    struct token_list tokens;
+    tokenize(text, &tokens);
+    
+    struct parse_state ps = {
+        .tokens = &tokens,
+        .pos = 0,
+        .status = PARSE_OK,
+    };
+    struct command_node *root = parse_list(&ps, NULL);
+    root->has_expansions = tokens.has_expansions;
+    *status = ps.status;
+    
+    // Words not handed to the tree (operators, reserved words, everything
+    // after an error) are still owned by the token list
+    for (int i = 0; i < tokens.count; i++) {
+        free(tokens.words[i]);
+    }
+    free(tokens.words);
+    free(tokens.quoted);
+    free(tokens.expands);
+    
+    if (*status != PARSE_OK) {
+        free_command_node(root);
+        return NULL;
+    }
+    return root;
+}
+
+struct command_node *retain_command_node(struct command_node *node) {
+    if (node) {
+        node->refs++;
+    }
+    return node;
+}
+
+void free_command_node(struct command_node *node) {
+    if (node == NULL || --node->refs > 0) {
+        return;
+    }
+    
+    free_command_context(&node->command);
+    for (int i = 0; i < node->num_children; i++) {
+        free_command_node(node->children[i]);
+    }
+    free(node->children);
+    for (int i = 0; i < node->num_words; i++) {
+        free(node->words[i]);
+    }
+    free(node->words);
+    free(node->name);
+    free(node);
+}
+
+// Splits `line` into words. Quoting only affects how a word is built, but is
+// remembered so that a quoted "|" or ";" stays an ordinary argument
+static void tokenize(const char *line, struct token_list *tokens) {
+    tokens->count = 0;
+    tokens->has_expansions = false;
+    tokens->capacity = ARGV_MAX_CAPACITY;
+    tokens->words = malloc(tokens->capacity * sizeof(char *));
+    tokens->quoted = malloc(tokens->capacity * sizeof(bool));
+    tokens->expands = malloc(tokens->capacity * sizeof(bool));
+    
+    // A token is never longer than the line it came from, plus one marker
+    // byte per '$' or brace character
+    size_t line_length = strlen(line);
+    char *token_buffer = malloc(2 * line_length + 1);
+    int buffer_pos = 0;
+    bool token_quoted = false;
+    bool token_expands = false;
+    int paren_depth = 0;    // Inside a literal $( ... ) kept as one word
+    bool token_braces = false;
+    int brace_depth = 0;    // Unquoted '{' not yet closed in this word
+    int param_depth = 0;    // Inside ${...}, whose braces aren't brace expansion
+    
+    const char *p = line;
+    const char *end = line + line_length;
+    char quote_type = '\0';
+    
+    // === TOKENIZATION LOOP ===
+    while (*p != '\0') {
+        // '#' at the start of a word comments out the rest of the line
+        if (*p == '#' && quote_type == '\0' && paren_depth == 0 && buffer_pos == 0 && !token_quoted) {
+            while (*p != '\0' && *p != '\n') {
+                p++;
+            }
+            continue;
+        }
+        
+        // <(cmd) and >(cmd) become one word holding the command's source
+        if ((*p == '<' || *p == '>') && *(p + 1) == '(' && quote_type == '\0' &&
+            paren_depth == 0 && buffer_pos == 0 && !token_quoted) {
+            const char *close = find_closing_paren(p + 2);
+            if (close != NULL) {
+                token_buffer[0] = PROCSUB_MARK;
+                memcpy(token_buffer + 1, p, close + 1 - p);
+                push_token(tokens, token_buffer, (int)(close + 2 - p), false, true);
+                tokens->has_expansions = true;
+                p = close + 1;
+                continue;
+            }
+        }
+        
+        // Bulk-copy the run of plain bytes up to the next one the state
+        // machine below cares about
+        const char *special;
+        if (quote_type == '\'') {
+            special = memchr(p, '\'', end - p);
+            if (special == NULL) {
+                special = end;
+            }
+        } else if (quote_type == '"') {
+            special = scan_to_special(p, end, &double_quoted_specials);
+        } else {
+            special = scan_to_special(p, end, &unquoted_specials);
+        }
+        
+        if (special > p) {
+            size_t run = special - p;
+            if (quote_type == '\0' && paren_depth == 0 && (brace_depth > 0 || param_depth > 0 || memchr(p, '{', run))) {
+                buffer_pos = copy_marking_braces(token_buffer, buffer_pos, p, run, &brace_depth, &param_depth);
+                token_braces = true;
+            } else {
+                memcpy(token_buffer + buffer_pos, p, run);
+                buffer_pos += run;
+            }
+            p = special;
+            continue;
+        }
+        
+        // Handle backslash OUTSIDE quotes
+        if (*p == '\\' && quote_type == '\0') {
+            p++;
+            token_quoted = true;
+            if (*p != '\0') {
+                token_buffer[buffer_pos++] = *p;
+                p++;
+            }
+            continue;
+        }
+        
+        // Handle backslash INSIDE DOUBLE QUOTES
+        if (*p == '\\' && quote_type == '"') {
+            if (*(p + 1) == '"' || *(p + 1) == '\\' || 
+                *(p + 1) == '$' || *(p + 1) == '`') {
+                p++;
+                token_buffer[buffer_pos++] = *p;
+                p++;
+                continue;
+            }
+        }
+        
+        // Handle quote characters
+        if ((*p == '\'' || *p == '"') && quote_type == '\0') {
+            quote_type = *p;
+            token_quoted = true;
+            p++;
+            continue;
+        }
+        else if (*p == quote_type && quote_type != '\0') {
+            quote_type = '\0';
+            p++;
+            continue;
+        }
+        
+        // Handle spaces
+        if ((*p == ' ' || *p == '\t') && quote_type == '\0' && paren_depth == 0) {
+            if (buffer_pos > 0 || token_quoted) {
+                if (token_braces && settle_brace_marks(token_buffer, &buffer_pos)) {
+                    token_expands = true;
+                }
+                push_token(tokens, token_buffer, buffer_pos, token_quoted, token_expands);
+                buffer_pos = 0;
+                token_quoted = false;
+                token_expands = false;
+            }
+            token_braces = false;
+            brace_depth = 0;
+            param_depth = 0;
+            // Swallow the whole run of separators at once
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            continue;
+        }
+        
+        // Operators end the current word and are words themselves
+        int op_length = (quote_type == '\0' && paren_depth == 0) ? 
+                        operator_length(p, token_buffer, buffer_pos) : 0;
+        if (op_length > 0) {
+            if (buffer_pos > 0 || token_quoted) {
+                if (token_braces && settle_brace_marks(token_buffer, &buffer_pos)) {
+                    token_expands = true;
+                }
+                push_token(tokens, token_buffer, buffer_pos, token_quoted, token_expands);
+                buffer_pos = 0;
+                token_quoted = false;
+                token_expands = false;
+            }
+            token_braces = false;
+            brace_depth = 0;
+            param_depth = 0;
+            push_token(tokens, p, op_length, false, false);
+            p += op_length;
+            continue;
+        }
+        
+        // '$' and '`' outside single quotes make the line's meaning depend
+        // on shell state at run time. Expandable '$' gets a marker byte in
+        // front so the expander can tell it from a quoted or escaped one
+        if (*p == '$' || *p == '`') {
+            tokens->has_expansions = true;
+        }
+        if (*p == '$') {
+            token_buffer[buffer_pos++] = (quote_type == '"') ? EXPAND_MARK_QUOTED : EXPAND_MARK;
+            token_expands = true;
+            if (*(p + 1) == '(' && quote_type == '\0') {
+                // Command substitution isn't supported; keep the text whole
+                token_buffer[buffer_pos++] = *p++;
+                paren_depth++;
+            }
+        } else if (paren_depth > 0 && quote_type == '\0') {
+            if (*p == '(') {
+                paren_depth++;
+            } else if (*p == ')') {
+                paren_depth--;
+            }
+        }
+        
+        // Regular character - accumulate it
+        token_buffer[buffer_pos++] = *p;
+        p++;
+    }
+    
+    // Save last token if exists
+    if (buffer_pos > 0 || token_quoted) {
+        if (token_braces && settle_brace_marks(token_buffer, &buffer_pos)) {
+            token_expands = true;
+        }
+        push_token(tokens, token_buffer, buffer_pos, token_quoted, token_expands);
+    }
+    free(token_buffer);
+}
+
+// Length of the operator starting at `p` outside quotes, or 0. `word` is the
+// word built so far, so "2>&1" and ">&3" keep their '&' and ">|" its '|'
+static int operator_length(const char *p, const char *word, int word_length) {
+    switch (*p) {
+    case '\n':
+        return 1;
+    case ';':
+        return (*(p + 1) == ';') ? 2 : 1;
+    case '|':
+        if (word_length == 1 && word[0] == '>') {
+            return 0;   // ">|" is a redirect
+        }
+        return (*(p + 1) == '|') ? 2 : 1;
+    case '&':
+        if (word_length > 0 && (word[word_length - 1] == '>' || word[word_length - 1] == '<')) {
+            return 0;
+        }
+        return (*(p + 1) == '&') ? 2 : 1;
+    case '(':
+    case ')':
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// The ')' closing the '(' just before `p`, skipping quoted text and
+// nested parentheses. NULL if the input ends first
+static const char *find_closing_paren(const char *p) {
+    int depth = 1;
+    char quote = '\0';
+    for (; *p != '\0'; p++) {
+        if (quote != '\0') {
+            if (*p == quote) {
+                quote = '\0';
+            } else if (*p == '\\' && quote == '"' && *(p + 1) != '\0') {
+                p++;
+            }
+        } else if (*p == '\'' || *p == '"') {
+            quote = *p;
+        } else if (*p == '\\' && *(p + 1) != '\0') {
+            p++;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Copies an unquoted run, putting BRACE_MARK in front of each '{' and the
+// ',' and '}' inside one. Braces of ${NAME} are left alone. Returns the new
+// buffer position
+static int copy_marking_braces(char *buffer, int pos, const char *p, size_t length, int *brace_depth, int *param_depth) {
+    for (size_t i = 0; i < length; i++) {
+        char c = p[i];
+        bool mark = false;
+        if (c == '{') {
+            if (pos >= 2 && buffer[pos - 1] == '$' && buffer[pos - 2] == EXPAND_MARK) {
+                (*param_depth)++;
+            } else if (*param_depth == 0) {
+                (*brace_depth)++;
+                mark = true;
+            }
+        } else if (c == '}') {
+            if (*param_depth > 0) {
+                (*param_depth)--;
+            } else if (*brace_depth > 0) {
+                (*brace_depth)--;
+                mark = true;
+            }
+        } else if (c == ',') {
+            mark = *brace_depth > 0 && *param_depth == 0;
+        }
+    
+        if (mark) {
+            buffer[pos++] = BRACE_MARK;
+        }
+        buffer[pos++] = c;
+    }
+    return pos;
+}
+
+// Keeps the brace marks of a finished word only if something in it expands;
+// otherwise `{}`, `{x}` or an unclosed '{' are plain text again
+static bool settle_brace_marks(char *buffer, int *length) {
+    buffer[*length] = '\0';
+    struct brace_expansion *brace = brace_parse(buffer);
+    if (brace) {
+        brace_free(brace);
+        return true;
+    }
+    *length = (int)brace_strip_marks(buffer, (size_t)*length);
+    return false;
+}
+
+static void push_token(struct token_list *tokens, const char *text, int length, bool quoted, bool expands) {
+    // Keep one spare slot so build_context can NULL-terminate in place
+    if (tokens->count >= tokens->capacity - 1) {
+        tokens->capacity *= 2;
+        tokens->words = realloc(tokens->words, tokens->capacity * sizeof(char *));
+        tokens->quoted = realloc(tokens->quoted, tokens->capacity * sizeof(bool));
+        tokens->expands = realloc(tokens->expands, tokens->capacity * sizeof(bool));
+    }
+    
+    char *word = malloc(length + 1);
+    memcpy(word, text, length);
+    word[length] = '\0';
+    
+    tokens->words[tokens->count] = word;
+    tokens->quoted[tokens->count] = quoted;
+    tokens->expands[tokens->count] = expands;
+    tokens->count++;
+}
+
+static bool is_operator(const struct token_list *tokens, int i, const char *op) {
+    return !tokens->quoted[i] && strcmp(tokens->words[i], op) == 0;
+}
+
+// Builds a simple command or pipeline out of tokens[start, end). The words in
+// that range move into `ctx`; the token list slots are cleared
+static void build_context(struct token_list *tokens, int start, int end, struct command_context *ctx) {
+    int count = end - start;
+    ctx->argv = malloc((count + 1) * sizeof(char *));
+    for (int i = 0; i < count; i++) {
+        ctx->argv[i] = tokens->words[start + i];
+        tokens->words[start + i] = NULL;
+        if (tokens->expands[start + i]) {
+            ctx->needs_expansion = true;
+        }
+    }
+    ctx->argv[count] = NULL;
+    
+    if (count == 0) {
+        ctx->command_name = NULL;
+        ctx->argc = 0;
+        ctx->num_commands = 0;
+        return;
+    }
+    
+    bool *quoted = tokens->quoted + start;
+    count = take_fanouts(ctx, quoted, count);
+    
+    // === CHECK FOR PIPES ===
+    int num_pipes = 0;
+    for (int i = 0; i < count; i++) {
+        if (!quoted[i] && strcmp(ctx->argv[i], "|") == 0) {
+            num_pipes++;
+        }
+    }
+    
+    if (num_pipes > 0) {
+        // Pipeline detected
+        ctx->num_commands = num_pipes + 1;
+        
+        // Allocate arrays
+        ctx->all_commands = malloc(ctx->num_commands * sizeof(char **));
+        ctx->all_argc = malloc(ctx->num_commands * sizeof(int));
+        ctx->all_command_names = malloc(ctx->num_commands * sizeof(char *));
+        
+        // Split into commands
+        int cmd_idx = 0;
+        int cmd_start = 0;
+        
+        for (int i = 0; i <= count; i++) {
+            if (i == count || (!quoted[i] && strcmp(ctx->argv[i], "|") == 0)) {
+                // End of a command
+                int cmd_argc = i - cmd_start;
+                
+                ctx->all_commands[cmd_idx] = malloc((cmd_argc + 1) * sizeof(char *));
+                for (int j = 0; j < cmd_argc; j++) {
+                    ctx->all_commands[cmd_idx][j] = ctx->argv[cmd_start + j];
+                }
+                ctx->all_commands[cmd_idx][cmd_argc] = NULL;
+                
+                ctx->all_argc[cmd_idx] = cmd_argc;
+                ctx->all_command_names[cmd_idx] = ctx->all_commands[cmd_idx][0];
+                
+                cmd_idx++;
+                
+                if (i < count) {
+                    free(ctx->argv[i]); // Free pipe symbol
+                }
+                
+                cmd_start = i + 1;
+            }
+        }
+        
+        // Set legacy single-command fields (for debug or compatibility)
+        ctx->command_name = ctx->all_command_names[0];
+        ctx->argc = ctx->all_argc[0];
+        
+        return;
+    }
+    
+    // === NO PIPES - SINGLE COMMAND ===
+    ctx->num_commands = 0;
+    
+    // Process redirect operators
+    int final_argc = 0;
+    for (int i = 0; i < count; i++) {
+        bool is_stderr;
+        char *target = quoted[i] ? NULL : duplication_target(ctx->argv[i], &is_stderr);
+        if (quoted[i]) {
+            ctx->argv[final_argc++] = ctx->argv[i];
+        } else if (target && is_stderr) {
+            ctx->redirect_err = true;
+            free(ctx->error_file);
+            ctx->error_file = target;
+            ctx->err_mode = O_APPEND;
+            free(ctx->argv[i]);
+        } else if (target) {
+            ctx->redirect = true;
+            free(ctx->out_file);
+            ctx->out_file = target;
+            ctx->out_mode = O_APPEND;
+            free(ctx->argv[i]);
+        } else if (strcmp(ctx->argv[i], ">") == 0 || strcmp(ctx->argv[i], "1>") == 0) {
+            if (i + 1 < count) {
+                ctx->redirect = true;
+                free(ctx->out_file); // The last redirect wins
+                ctx->out_file = strdup(ctx->argv[i + 1]);
+                ctx->out_mode = O_TRUNC;
+                free(ctx->argv[i]);
+                free(ctx->argv[i + 1]);
+                i++;
+            } else {
+                free(ctx->argv[i]); // Dangling operator with no file
+            }
+        } else if (strcmp(ctx->argv[i], ">>") == 0 || strcmp(ctx->argv[i], "1>>") == 0) {
+            if (i + 1 < count) {
+                ctx->redirect = true;
+                free(ctx->out_file);
+                ctx->out_file = strdup(ctx->argv[i + 1]);
+                ctx->out_mode = O_APPEND;
+                free(ctx->argv[i]);
+                free(ctx->argv[i + 1]);
+                i++;
+            } else {
+                free(ctx->argv[i]); // Dangling operator with no file
+            }
+        } else if (strcmp(ctx->argv[i], "2>") == 0) {
+            if (i + 1 < count) {
+                ctx->redirect_err = true;
+                free(ctx->error_file);
+                ctx->error_file = strdup(ctx->argv[i + 1]);
+                ctx->err_mode = O_TRUNC;
+                free(ctx->argv[i]);
+                free(ctx->argv[i + 1]);
+                i++;
+            } else {
+                free(ctx->argv[i]); // Dangling operator with no file
+            }
+        } else if (strcmp(ctx->argv[i], "2>>") == 0) {
+            if (i + 1 < count) {
+                ctx->redirect_err = true;
+                free(ctx->error_file);
+                ctx->error_file = strdup(ctx->argv[i + 1]);
+                ctx->err_mode = O_APPEND;
+                free(ctx->argv[i]);
+                free(ctx->argv[i + 1]);
+                i++;
+            } else {
+                free(ctx->argv[i]); // Dangling operator with no file
+            }
+        } else {
+            ctx->argv[final_argc++] = ctx->argv[i];
+        }
+    }
+    
+    // Set command info
+    if (final_argc > 0) {
+        ctx->command_name = ctx->argv[0];
+        ctx->argc = final_argc;
+        ctx->argv[final_argc] = NULL;
+    } else {
+        ctx->command_name = NULL;
+        ctx->argc = 0;
+        ctx->argv[0] = NULL;
+    }
+}
+
+// Moves each `>| FILE` out of ctx->argv into the fanout lists, noting the
+// stage it follows. Returns how many words are left
+static int take_fanouts(struct command_context *ctx, bool *quoted, int count) {
+    int kept = 0;
+    int stage = 0;
+    for (int i = 0; i < count; i++) {
+        if (!quoted[i] && strcmp(ctx->argv[i], "|") == 0) {
+            stage++;
+        } else if (!quoted[i] && strcmp(ctx->argv[i], ">|") == 0) {
+            free(ctx->argv[i]);
+            if (i + 1 < count && (quoted[i + 1] || strcmp(ctx->argv[i + 1], "|") != 0)) {
+                ctx->fanout_files = realloc(ctx->fanout_files, (ctx->num_fanouts + 1) * sizeof(char *));
+                ctx->fanout_stages = realloc(ctx->fanout_stages, (ctx->num_fanouts + 1) * sizeof(int));
+                ctx->fanout_files[ctx->num_fanouts] = ctx->argv[i + 1];
+                ctx->fanout_stages[ctx->num_fanouts] = stage;
+                ctx->num_fanouts++;
+                i++;
+            }
+            continue;   // A dangling operator is dropped like the others
+        }
+        ctx->argv[kept] = ctx->argv[i];
+        quoted[kept] = quoted[i];
+        kept++;
+    }
+    ctx->argv[kept] = NULL;
+    return kept;
+}
+
+static struct command_node *new_node(enum node_type type) {
+    struct command_node *node = calloc(1, sizeof(struct command_node));
+    node->type = type;
+    node->refs = 1;
+    node->command.out_mode = O_TRUNC;
+    node->command.err_mode = O_TRUNC;
+    return node;
+}
+
+static void append_child(struct command_node *parent, struct command_node *child) {
+    parent->children = realloc(parent->children, (parent->num_children + 1) * sizeof(struct command_node *));
+    parent->children[parent->num_children++] = child;
+}
+
+/* GRAMMAR HELPERS */
+static bool at_end(struct parse_state *ps) {
+    return ps->pos >= ps->tokens->count;
+}
+
+static bool at_operator(struct parse_state *ps, const char *op) {
+    return !at_end(ps) && is_operator(ps->tokens, ps->pos, op);
+}
+
+// Reserved words are only recognized unquoted; same check as operators
+static bool at_word(struct parse_state *ps, const char *word) {
+    return at_operator(ps, word);
+}
+
+static bool at_separator(struct parse_state *ps) {
+    return at_operator(ps, ";") || at_operator(ps, "\n");
+}
+
+// Tokens that end a simple command
+static bool at_list_end(struct parse_state *ps) {
+    return at_end(ps) || at_separator(ps) || at_operator(ps, "&&") || at_operator(ps, "||") || 
+           at_operator(ps, "&") || at_operator(ps, ";;") || at_operator(ps, "(") || 
+           at_operator(ps, ")");
+}
+
+static bool at_redirect(struct parse_state *ps) {
+    return at_operator(ps, ">") || at_operator(ps, "1>") || at_operator(ps, ">>") || 
+           at_operator(ps, "1>>") || at_operator(ps, "2>") || at_operator(ps, "2>>");
+}
+
+// ">&N", "1>&N" or "2>&N" (one word) as the path of descriptor N. Opening
+// it in append mode shares the descriptor's pipe, or keeps writes to the
+// same file from overwriting each other. NULL for any other word
+static char *duplication_target(const char *word, bool *is_stderr) {
+    *is_stderr = word[0] == '2';
+    if (word[0] == '1' || word[0] == '2') {
+        word++;
+    }
+    if (word[0] != '>' || word[1] != '&' || word[2] == '\0' || strcmp(word + 2, "-") == 0) {
+        return NULL;
+    }
+    
+    size_t length = strlen(word + 2);
+    char *target = malloc(sizeof("/dev/fd/") + length);
+    memcpy(target, "/dev/fd/", sizeof("/dev/fd/") - 1);
+    memcpy(target + sizeof("/dev/fd/") - 1, word + 2, length + 1);
+    return target;
+}
+
+static void skip_newlines(struct parse_state *ps) {
+    while (at_operator(ps, "\n")) {
+        ps->pos++;
+    }
+}
+
+// Running out of input inside a construct means "keep reading", not an error
+static void syntax_error(struct parse_state *ps) {
+    if (ps->status != PARSE_OK) {
+        return;
+    }
+    if (at_end(ps)) {
+        ps->status = PARSE_INCOMPLETE;
+        return;
+    }
+    
+    const char *word = ps->tokens->words[ps->pos];
+    fprintf(stderr, "syntax error near unexpected token `%s'\n", 
+            strcmp(word, "\n") == 0 ? "newline" : word);
+    ps->status = PARSE_ERROR;
+}
+
+static bool expect_word(struct parse_state *ps, const char *word) {
+    if (!at_word(ps, word)) {
+        syntax_error(ps);
+        return false;
+    }
+    ps->pos++;
+    return true;
+}
+
+// Moves the current word out of the token list
+static char *take_word(struct parse_state *ps) {
+    char *word = ps->tokens->words[ps->pos];
+    ps->tokens->words[ps->pos] = NULL;
+    ps->pos++;
+    return word;
+}
+
+// Variable names: letters, digits and '_', not starting with a digit
+static bool is_name(const char *name) {
+    if (name[0] == '\0' || (name[0] >= '0' && name[0] <= '9')) {
+        return false;
+    }
+    for (const char *c = name; *c; c++) {
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || 
+              (*c >= '0' && *c <= '9') || *c == '_')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Function names may also use '-' after the first character, as in bash
+static bool is_function_name(const char *name) {
+    if (name[0] == '\0' || name[0] == '-' || (name[0] >= '0' && name[0] <= '9')) {
+        return false;
+    }
+    for (const char *c = name; *c; c++) {
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || 
+              (*c >= '0' && *c <= '9') || *c == '_' || *c == '-')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* GRAMMAR */
+
+// Words that close a construct; in command position they end the current list
+static const char *const closing_words[] = {
+    "then", "elif", "else", "fi", "do", "done", "esac", "}", ";;", ")", NULL,
+};
+
+// list := and_or ((';' | '\n' | '&') and_or)* ['&']
+// Stops at one of `terminators` in command position, which the caller
+// consumes. Any other closing word there is a syntax error
+static struct command_node *parse_list(struct parse_state *ps, const char *const *terminators) {
+    struct command_node *list = new_node(NODE_LIST);
+    
+    while (ps->status == PARSE_OK) {
+        while (at_separator(ps)) {
+            ps->pos++;
+        }
+        if (at_end(ps)) {
+            if (terminators) {
+                ps->status = PARSE_INCOMPLETE;
+            }
+            break;
+        }
+        
+        bool closing = false;
+        for (int i = 0; closing_words[i]; i++) {
+            if (at_word(ps, closing_words[i])) {
+                closing = true;
+                break;
+            }
+        }
+        if (closing) {
+            bool expected = false;
+            for (int i = 0; terminators && terminators[i]; i++) {
+                if (at_word(ps, terminators[i])) {
+                    expected = true;
+                    break;
+                }
+            }
+            if (!expected) {
+                syntax_error(ps);
+            }
+            break;
+        }
+        
+        struct command_node *item = parse_and_or(ps);
+        if (item && at_operator(ps, "&")) {
+            // '&' runs the item in the background and also ends it
+            struct command_node *background = new_node(NODE_BACKGROUND);
+            append_child(background, item);
+            item = background;
+            ps->pos++;
+        }
+        if (item) {
+            append_child(list, item);
+        }
+        
+        // An and_or must be followed by a separator or the end of the list
+        if (ps->status == PARSE_OK && !at_end(ps) && !at_separator(ps) && 
+            !(item && item->type == NODE_BACKGROUND)) {
+            bool closing_next = false;
+            for (int i = 0; closing_words[i]; i++) {
+                if (at_word(ps, closing_words[i])) {
+                    closing_next = true;
+                    break;
+                }
+            }
+            if (!closing_next) {
+                syntax_error(ps);
+            }
+        }
+    }
+    
+    return list;
+}
+
+// and_or := pipeline (('&&' | '||') linebreak pipeline)*
+static struct command_node *parse_and_or(struct parse_state *ps) {
+    struct command_node *left = parse_pipeline(ps);
+    
+    while (left && ps->status == PARSE_OK && (at_operator(ps, "&&") || at_operator(ps, "||"))) {
+        enum node_type type = at_operator(ps, "&&") ? NODE_AND : NODE_OR;
+        ps->pos++;
+        skip_newlines(ps);
+        
+        struct command_node *right = parse_pipeline(ps);
+        if (right == NULL) {
+            free_command_node(left);
+            return NULL;
+        }
+        
+        struct command_node *node = new_node(type);
+        append_child(node, left);
+        append_child(node, right);
+        left = node;
+    }
+    
+    return left;
+}
+
+// pipeline := ['!'] command ('|' linebreak command)*
+// Pipelines of plain commands become one NODE_COMMAND (the executor's fast
+// path); pipelines with a compound stage become NODE_PIPELINE
+static struct command_node *parse_pipeline(struct parse_state *ps) {
+    bool negate = false;
+    if (at_word(ps, "!")) {
+        negate = true;
+        ps->pos++;
+    }
+    
+    struct command_node *pipeline = new_node(NODE_PIPELINE);
+    
+    do {
+        if (pipeline->num_children > 0) {
+            ps->pos++; // '|'
+            skip_newlines(ps);
+        }
+        
+        struct command_node *stage = parse_command(ps);
+        if (stage == NULL) {
+            if (ps->status == PARSE_OK) {
+                syntax_error(ps);
+            }
+            free_command_node(pipeline);
+            return NULL;
+        }
+        append_child(pipeline, stage);
+    } while (ps->status == PARSE_OK && at_operator(ps, "|"));
+    
+    struct command_node *result = pipeline;
+    if (pipeline->num_children == 1) {
+        result = pipeline->children[0];
+        pipeline->num_children = 0;
+        free_command_node(pipeline);
+    }
+    
+    if (negate) {
+        struct command_node *node = new_node(NODE_NOT);
+        append_child(node, result);
+        result = node;
+    }
+    return result;
+}
+
+// command := compound redirects* | NAME '(' ')' linebreak '{' list '}' | simple_command
+static struct command_node *parse_command(struct parse_state *ps) {
+    if (at_list_end(ps) || at_operator(ps, "|")) {
+        syntax_error(ps);
+        return NULL;
+    }
+    
+    struct command_node *node = NULL;
+    if (at_word(ps, "{")) {
+        node = parse_group(ps);
+    } else if (at_word(ps, "if")) {
+        node = parse_if(ps);
+    } else if (at_word(ps, "while")) {
+        node = parse_loop(ps, NODE_WHILE);
+    } else if (at_word(ps, "until")) {
+        node = parse_loop(ps, NODE_UNTIL);
+    } else if (at_word(ps, "for")) {
+        node = parse_for(ps);
+    } else if (at_word(ps, "case")) {
+        node = parse_case(ps);
+    } else if (ps->pos + 1 < ps->tokens->count && is_operator(ps->tokens, ps->pos + 1, "(") && 
+               !ps->tokens->quoted[ps->pos] && is_function_name(ps->tokens->words[ps->pos])) {
+        return parse_function(ps);
+    } else {
+        return parse_simple_command(ps, true);
+    }
+    
+    if (node && ps->status == PARSE_OK) {
+        parse_redirects(ps, node);
+    }
+    if (ps->status != PARSE_OK) {
+        free_command_node(node);
+        return NULL;
+    }
+    return node;
+}
+
+// The words up to the next operator. With `allow_pipes`, a run of plain
+// stages joined by '|' is taken as a whole and split by build_context
+static struct command_node *parse_simple_command(struct parse_state *ps, bool allow_pipes) {
+    int start = ps->pos;
+    int end = start;
+    
+    while (end < ps->tokens->count) {
+        struct parse_state probe = { ps->tokens, end, PARSE_OK };
+        if (at_list_end(&probe)) {
+            break;
+        }
+        if (is_operator(ps->tokens, end, "|")) {
+            // Only keep going if the next stage is a plain command too
+            probe.pos = end + 1;
+            skip_newlines(&probe);
+            if (!allow_pipes || at_end(&probe) || at_list_end(&probe) || 
+                at_word(&probe, "{") || at_word(&probe, "if") || at_word(&probe, "while") || 
+                at_word(&probe, "until") || at_word(&probe, "for") || at_word(&probe, "case") || 
+                at_word(&probe, "!") || probe.pos != end + 1) {
+                break;
+            }
+        }
+        end++;
+    }
+    
+    if (end == start) {
+        syntax_error(ps);
+        return NULL;
+    }
+    
+    struct command_node *command = new_node(NODE_COMMAND);
+    build_context(ps->tokens, start, end, &command->command);
+    ps->pos = end;
+    
+    if (command->command.argc == 0 && command->command.num_commands == 0) {
+        // Only redirects, e.g. "> file": create the file like other shells
+        if (!command->command.redirect && !command->command.redirect_err && command->command.num_fanouts == 0) {
+            free_command_node(command);
+            syntax_error(ps);
+            return NULL;
+        }
+    }
+    return command;
+}
+
+static struct command_node *parse_function(struct parse_state *ps) {
+    char *name = take_word(ps);
+    ps->pos++; // '('
+    if (!expect_word(ps, ")")) {
+        free(name);
+        return NULL;
+    }
+    
+    // The body may start on the next line
+    skip_newlines(ps);
+    if (!at_word(ps, "{")) {
+        syntax_error(ps);
+        free(name);
+        return NULL;
+    }
+    
+    struct command_node *body = parse_group(ps);
+    if (body == NULL) {
+        free(name);
+        return NULL;
+    }
+    
+    struct command_node *function = new_node(NODE_FUNCTION);
+    function->name = name;
+    append_child(function, body);
+    return function;
+}
+
+// group := '{' list '}'
+static struct command_node *parse_group(struct parse_state *ps) {
+    static const char *const terminators[] = { "}", NULL };
+    
+    ps->pos++; // '{'
+    struct command_node *body = parse_list(ps, terminators);
+    if (ps->status != PARSE_OK || !expect_word(ps, "}")) {
+        free_command_node(body);
+        return NULL;
+    }
+    return body;
+}
+
+// if := 'if' list 'then' list ('elif' list 'then' list)* ['else' list] 'fi'
+// elif chains nest as the else branch of the previous if
+static struct command_node *parse_if(struct parse_state *ps) {
+    static const char *const condition_end[] = { "then", NULL };
+    static const char *const branch_end[] = { "elif", "else", "fi", NULL };
+    static const char *const else_end[] = { "fi", NULL };
+    
+    ps->pos++; // 'if' or 'elif'
+    struct command_node *node = new_node(NODE_IF);
+    
+    append_child(node, parse_list(ps, condition_end));
+    if (ps->status != PARSE_OK || !expect_word(ps, "then")) {
+        free_command_node(node);
+        return NULL;
+    }
+    
+    append_child(node, parse_list(ps, branch_end));
+    if (ps->status != PARSE_OK) {
+        free_command_node(node);
+        return NULL;
+    }
+    
+    if (at_word(ps, "elif")) {
+        struct command_node *elif = parse_if(ps);
+        if (elif == NULL) {
+            free_command_node(node);
+            return NULL;
+        }
+        append_child(node, elif);
+        return node; // The nested if consumed the 'fi'
+    }
+    
+    if (at_word(ps, "else")) {
+        ps->pos++;
+        append_child(node, parse_list(ps, else_end));
+        if (ps->status != PARSE_OK) {
+            free_command_node(node);
+            return NULL;
+        }
+    }
+    
+    if (!expect_word(ps, "fi")) {
+        free_command_node(node);
+        return NULL;
+    }
+    return node;
+}
+
+// while/until := ('while' | 'until') list 'do' list 'done'
+static struct command_node *parse_loop(struct parse_state *ps, enum node_type type) {
+    static const char *const condition_end[] = { "do", NULL };
+    static const char *const body_end[] = { "done", NULL };
+    
+    ps->pos++; // 'while' or 'until'
+    struct command_node *node = new_node(type);
+    
+    append_child(node, parse_list(ps, condition_end));
+    if (ps->status != PARSE_OK || !expect_word(ps, "do")) {
+        free_command_node(node);
+        return NULL;
+    }
+    
+    append_child(node, parse_list(ps, body_end));
+    if (ps->status != PARSE_OK || !expect_word(ps, "done")) {
+        free_command_node(node);
+        return NULL;
+    }
+    return node;
+}
+
+// for := 'for' NAME [linebreak 'in' word*] (';' | '\n') linebreak 'do' list 'done'
+// Without 'in' the loop runs over "$@"
+static struct command_node *parse_for(struct parse_state *ps) {
+    static const char *const body_end[] = { "done", NULL };
+    
+    ps->pos++; // 'for'
+    if (at_end(ps) || ps->tokens->quoted[ps->pos] || !is_name(ps->tokens->words[ps->pos])) {
+        syntax_error(ps);
+        return NULL;
+    }
+    
+    struct command_node *node = new_node(NODE_FOR);
+    node->name = take_word(ps);
+    
+    skip_newlines(ps);
+    if (at_word(ps, "in")) {
+        ps->pos++;
+        while (!at_end(ps) && !at_list_end(ps)) {
+            node->words = realloc(node->words, (node->num_words + 1) * sizeof(char *));
+            node->words[node->num_words++] = take_word(ps);
+        }
+        if (!at_separator(ps)) {
+            syntax_error(ps);
+            free_command_node(node);
+            return NULL;
+        }
+    } else {
+        char all_args[] = { EXPAND_MARK_QUOTED, '$', '@', '\0' };
+        node->words = malloc(sizeof(char *));
+        node->words[node->num_words++] = strdup(all_args);
+    }
+    
+    while (at_separator(ps)) {
+        ps->pos++;
+    }
+    if (!expect_word(ps, "do")) {
+        free_command_node(node);
+        return NULL;
+    }
+    
+    append_child(node, parse_list(ps, body_end));
+    if (ps->status != PARSE_OK || !expect_word(ps, "done")) {
+        free_command_node(node);
+        return NULL;
+    }
+    return node;
+}
+
+// case := 'case' WORD linebreak 'in' linebreak
+//         (['('] pattern ('|' pattern)* ')' list [';;'] linebreak)* 'esac'
+// Each arm is a NODE_CASE_ARM whose words are its patterns
+static struct command_node *parse_case(struct parse_state *ps) {
+    static const char *const arm_end[] = { ";;", "esac", NULL };
+    
+    ps->pos++; // 'case'
+    if (at_end(ps) || at_list_end(ps)) {
+        syntax_error(ps);
+        return NULL;
+    }
+    
+    struct command_node *node = new_node(NODE_CASE);
+    node->name = take_word(ps);
+    
+    skip_newlines(ps);
+    if (!expect_word(ps, "in")) {
+        free_command_node(node);
+        return NULL;
+    }
+    
+    while (ps->status == PARSE_OK) {
+        while (at_separator(ps)) {
+            ps->pos++;
+        }
+        if (at_word(ps, "esac")) {
+            ps->pos++;
+            return node;
+        }
+        if (at_end(ps)) {
+            ps->status = PARSE_INCOMPLETE;
+            break;
+        }
+        
+        struct command_node *arm = new_node(NODE_CASE_ARM);
+        append_child(node, arm);
+        
+        if (at_operator(ps, "(")) {
+            ps->pos++;
+        }
+        while (true) {
+            if (at_end(ps) || at_list_end(ps) || at_operator(ps, "|")) {
+                syntax_error(ps);
+                break;
+            }
+            arm->words = realloc(arm->words, (arm->num_words + 1) * sizeof(char *));
+            arm->words[arm->num_words++] = take_word(ps);
+            
+            if (at_operator(ps, "|")) {
+                ps->pos++;
+                continue;
+            }
+            if (!expect_word(ps, ")")) {
+                break;
+            }
+            break;
+        }
+        if (ps->status != PARSE_OK) {
+            break;
+        }
+        
+        append_child(arm, parse_list(ps, arm_end));
+        if (at_operator(ps, ";;")) {
+            ps->pos++;
+        }
+    }
+    
+    free_command_node(node);
+    return NULL;
+}
+
+// Redirects after a compound command apply to the whole construct
+static void parse_redirects(struct parse_state *ps, struct command_node *node) {
+    while (ps->status == PARSE_OK && !at_end(ps) && !ps->tokens->quoted[ps->pos]) {
+        struct command_context *ctx = &node->command;
+        bool is_stderr;
+        char *target = duplication_target(ps->tokens->words[ps->pos], &is_stderr);
+        if (target) {
+            if (ps->tokens->expands[ps->pos]) {
+                ctx->needs_expansion = true;
+            }
+            ps->pos++;
+            char **file = is_stderr ? &ctx->error_file : &ctx->out_file;
+            free(*file);
+            *file = target;
+            if (is_stderr) {
+                ctx->redirect_err = true;
+                ctx->err_mode = O_APPEND;
+            } else {
+                ctx->redirect = true;
+                ctx->out_mode = O_APPEND;
+            }
+            continue;
+        }
+        if (!at_redirect(ps)) {
+            break;
+        }
+        
+        const char *op = ps->tokens->words[ps->pos];
+        ps->pos++;
+        if (at_end(ps) || at_list_end(ps) || at_operator(ps, "|")) {
+            syntax_error(ps);
+            return;
+        }
+        
+        if (op[0] == '2') {
+            free(ctx->error_file);
+            ctx->redirect_err = true;
+            ctx->error_file = take_word(ps);
+            ctx->err_mode = strstr(op, ">>") ? O_APPEND : O_TRUNC;
+        } else {
+            free(ctx->out_file);
+            ctx->redirect = true;
+            ctx->out_file = take_word(ps);
+            ctx->out_mode = strstr(op, ">>") ? O_APPEND : O_TRUNC;
+        }
+        if (ps->tokens->expands[ps->pos - 1]) {
+            ctx->needs_expansion = true;
+        }
+    }
+}
+
+// Returns the first byte in [p, end) that belongs to `set`, or `end`
+static inline const char *scan_to_special(const char *p, const char *end, const struct scan_class *set) {
+    // Most tokens are short: probe a few bytes with the table before paying
+    // for vector setup, which only wins on long plain runs
+    const char *probe_end = (end - p > SCAN_SCALAR_PROBE) ? p + SCAN_SCALAR_PROBE : end;
+    while (p < probe_end) {
+        if (set->table[(unsigned char)*p]) {
+            return p;
+        }
+        p++;
+    }
+    if (p == end) {
+        return end;
+    }
+    
+    if (scan_impl == NULL) {
+#ifdef PARSER_HAVE_X86_SIMD
+        __builtin_cpu_init();
+        scan_impl = __builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+#else
+        scan_impl = scan_scalar;
+#endif
+    }
+    
+    return scan_impl(p, end, set);
+}
+
+static const char *scan_scalar(const char *p, const char *end, const struct scan_class *set) {
+    while (p < end && !set->table[(unsigned char)*p]) {
+        p++;
+    }
+    return p;
+}
+
+#ifdef PARSER_HAVE_X86_SIMD
+static const char *scan_sse2(const char *p, const char *end, const struct scan_class *set) {
+    __m128i needles[SCAN_CLASS_MAX];
+    for (int i = 0; i < set->count; i++) {
+        needles[i] = _mm_set1_epi8(set->chars[i]);
+    }
+    
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)p);
+        __m128i hits = _mm_cmpeq_epi8(block, needles[0]);
+        for (int i = 1; i < set->count; i++) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[i]));
+        }
+        
+        unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    
+    return scan_scalar(p, end, set);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, const char *end, const struct scan_class *set) {
+    __m256i needles[SCAN_CLASS_MAX];
+    for (int i = 0; i < set->count; i++) {
+        needles[i] = _mm256_set1_epi8(set->chars[i]);
+    }
+    
+    while (end - p >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hits = _mm256_cmpeq_epi8(block, needles[0]);
+        for (int i = 1; i < set->count; i++) {
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, needles[i]));
+        }
+        
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    
+    // Finish the last < 32 bytes with the table; calling the SSE2 version
+    // from here would mix VEX and legacy encodings
+    return scan_scalar(p, end, set);
+}
+#endif
+
+void free_command_context(struct command_context *ctx) {
+    if (ctx->num_commands > 0) {
+        // Pipeline
+        for (int i = 0; i < ctx->num_commands; i++) {
+            for (int j = 0; j < ctx->all_argc[i]; j++) {
+                free(ctx->all_commands[i][j]);
+            }
+            free(ctx->all_commands[i]);
+        }
+        free(ctx->all_commands);
+        free(ctx->all_argc);
+        free(ctx->all_command_names);
+    } else if (ctx->argv) {
+        // Single command
+        for (int i = 0; i < ctx->argc; i++) {
+            if (ctx->argv[i]) free(ctx->argv[i]);
+        }
+    }
+    free(ctx->argv);
+
+    if (ctx->out_file) {
+        free(ctx->out_file);
+    }
+
+    if (ctx->error_file) {
+        free(ctx->error_file);
+    }
+    
+    for (int i = 0; i < ctx->num_fanouts; i++) {
+        free(ctx->fanout_files[i]);
+    }
+    free(ctx->fanout_files);
+    free(ctx->fanout_stages);
+}
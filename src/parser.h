@@ -0,0 +1,108 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+/* INCLUDE LIBRARIES */
+#include <stdbool.h>
+
+/* DEFINE CONSTANTS */
+#define ARGV_MAX_CAPACITY 1024
+
+// Written by the tokenizer in front of a '$' that should be expanded at
+// run time (unquoted, or inside double quotes). A literal '$' carries no mark
+#define EXPAND_MARK '\x01'
+#define EXPAND_MARK_QUOTED '\x02'
+
+// First byte of a word that is an unquoted <(cmd) or >(cmd). The rest is
+// the source text, kept verbatim; the command is parsed when it runs
+#define PROCSUB_MARK '\x03'
+
+// Written in front of each unquoted '{', ',' and '}' of a brace expression,
+// so quoted or escaped ones stay literal. Words keep the marks only if some
+// expression in them expands; see brace.h
+#define BRACE_MARK '\x04'
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+struct command_context {
+	bool redirect;
+	char *out_file;
+    int out_mode;
+    bool redirect_err;
+    char *error_file;
+    int err_mode;
+	char *command_name;
+    int argc;
+    char **argv;
+    int num_commands;
+    char ***all_commands;
+    int *all_argc;
+    char **all_command_names;
+    bool needs_expansion;   // Some word holds an EXPAND_MARK
+    char **fanout_files;    // `>| FILE` targets, which get a copy of stdout
+    int *fanout_stages;     // The pipeline stage each one copies (0 if none)
+    int num_fanouts;
+};
+
+enum parse_status {
+    PARSE_OK,
+    PARSE_INCOMPLETE,   // Input ended inside a construct; more lines may finish it
+    PARSE_ERROR,
+};
+
+enum node_type {
+    NODE_COMMAND,       // A simple command or pipeline of simple commands
+    NODE_LIST,          // Commands separated by ';' or newlines
+    NODE_FUNCTION,      // name() { body }; children[0] is the body
+    NODE_AND,           // children[0] && children[1]
+    NODE_OR,            // children[0] || children[1]
+    NODE_NOT,           // ! children[0]
+    NODE_PIPELINE,      // Stages joined by '|' where at least one is compound
+    NODE_IF,            // children: condition, then-list, optional else branch
+    NODE_WHILE,         // children: condition, body
+    NODE_UNTIL,         // children: condition, body
+    NODE_FOR,           // for name in words; children[0] is the body
+    NODE_CASE,          // case name in ...; children are NODE_CASE_ARMs
+    NODE_CASE_ARM,      // words are the patterns; children[0] is the list
+    NODE_BACKGROUND,    // children[0] &
+};
+
+// Parsed form of a script or line. Nodes are reference counted so function
+// and alias tables can keep a body alive after the line that defined it
+struct command_node {
+    enum node_type type;
+    int refs;
+    bool has_expansions;    // Root only: line uses '$' or '`' outside single quotes
+    
+    // NODE_COMMAND; redirects of a compound command
+    struct command_context command;
+    
+    struct command_node **children;
+    int num_children;
+    
+    // NODE_FUNCTION, NODE_FOR, NODE_CASE
+    char *name;
+    
+    // NODE_FOR, NODE_CASE_ARM
+    char **words;
+    int num_words;
+};
+
+/* FUNCTION HEADERS */
+
+// Tokenizes `line` (quotes, escapes, redirects, pipes) into `ctx`.
+// Every string and array stored in `ctx` is owned by it afterwards.
+void parse_command_line(char *line, struct command_context *ctx);
+
+// Releases everything parse_command_line allocated into `ctx`
+void free_command_context(struct command_context *ctx);
+
+// Parses a whole line or script (lists, and/or, if, loops, case, function
+// definitions) into a tree.
+// Returns NULL unless `*status` is PARSE_OK
+struct command_node *parse_script(const char *text, enum parse_status *status);
+
+struct command_node *retain_command_node(struct command_node *node);
+
+// Drops one reference; the tree is released when the last one goes
+void free_command_node(struct command_node *node);
+
+#endif
@@ -0,0 +1,173 @@
+/* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include "pipestats.h"
+
+/* DEFINE CONSTANTS */
+#define NS_PER_SEC 1000000000ULL
+
+/* FUNCTION HEADERS */
+static void *relay_main(void *arg);
+static uint64_t wait_for(int fd, short events);
+static uint64_t now_ns(void);
+static uint64_t timeval_ns(const struct timeval *tv);
+static void format_bytes(uint64_t bytes, char *buf, size_t size);
+static void format_seconds(uint64_t ns, char *buf, size_t size);
+
+/* FUNCTION FUNCTIONS */
+bool pipe_relay_start(struct pipe_relay *relay, int in_fd, int out_fd) {
+    *relay = (struct pipe_relay) {
+        .in_fd = in_fd,
+        .out_fd = out_fd,
+    };
+    
+    // SIGPIPE goes to the thread that wrote, and only a relay should get it
+    sigset_t block, saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &block, &saved);
+    int error = pthread_create(&relay->thread, NULL, relay_main, relay);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    
+    if (error != 0) {
+        fprintf(stderr, "pipestats: can't start relay: %s\n", strerror(error));
+        close(in_fd);
+        close(out_fd);
+        return false;
+    }
+    relay->running = true;
+    return true;
+}
+
+void pipe_relay_join(struct pipe_relay *relay) {
+    if (relay->running) {
+        pthread_join(relay->thread, NULL);
+        relay->running = false;
+    }
+}
+
+void pipestats_report(FILE *output, const struct job *job, char *const *names,
+                      const struct pipe_relay *relays) {
+    int n = job->num_procs;
+    uint64_t wall = (uint64_t)(job->finished.tv_sec - job->started.tv_sec) * NS_PER_SEC +
+                    (uint64_t)(job->finished.tv_nsec - job->started.tv_nsec);
+    
+    // The stage that spent the least time waiting on its neighbours is the
+    // one the others were waiting for
+    int bottleneck = 0;
+    uint64_t least_waiting = UINT64_MAX;
+    for (int i = 0; i < n; i++) {
+        uint64_t waiting = (i > 0 ? relays[i - 1].starved_ns : 0) + (i < n - 1 ? relays[i].blocked_ns : 0);
+        if (waiting < least_waiting) {
+            least_waiting = waiting;
+            bottleneck = i;
+        }
+    }
+    
+    char total[16];
+    format_seconds(wall, total, sizeof(total));
+    fprintf(output, "pipestats: %d stages in %s\n", n, total);
+    fprintf(output, "  %-3s %-16s %9s %9s %9s %8s %8s %8s\n",
+            "#", "command", "in", "out", "MB/s", "cpu", "starved", "blocked");
+    
+    for (int i = 0; i < n; i++) {
+        char in[16] = "-";
+        char out[16] = "-";
+        char rate[16] = "-";
+        char cpu[16];
+        char starved[16] = "-";
+        char blocked[16] = "-";
+        
+        if (i > 0) {
+            format_bytes(relays[i - 1].bytes, in, sizeof(in));
+            format_seconds(relays[i - 1].starved_ns, starved, sizeof(starved));
+        }
+        if (i < n - 1) {
+            format_bytes(relays[i].bytes, out, sizeof(out));
+            format_seconds(relays[i].blocked_ns, blocked, sizeof(blocked));
+        }
+        
+        // What went through the stage: its output, or for the last one its input
+        uint64_t moved = (i < n - 1) ? relays[i].bytes : relays[i - 1].bytes;
+        if (wall > 0) {
+            snprintf(rate, sizeof(rate), "%.1f", moved / 1e6 / ((double)wall / NS_PER_SEC));
+        }
+        format_seconds(timeval_ns(&job->procs[i].usage.ru_utime) + timeval_ns(&job->procs[i].usage.ru_stime),
+                       cpu, sizeof(cpu));
+        
+        fprintf(output, "  %-3d %-16.16s %9s %9s %9s %8s %8s %8s%s\n", i + 1, names[i],
+                in, out, rate, cpu, starved, blocked, (i == bottleneck) ? "  <- bottleneck" : "");
+    }
+}
+
+static void *relay_main(void *arg) {
+    struct pipe_relay *relay = arg;
+    
+    while (true) {
+        relay->starved_ns += wait_for(relay->in_fd, POLLIN);
+        
+        ssize_t moved = splice(relay->in_fd, NULL, relay->out_fd, NULL, PIPE_RELAY_CHUNK,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0) {
+            relay->bytes += moved;
+        } else if (moved == 0) {
+            break;      // Upstream closed its end
+        } else if (errno == EAGAIN) {
+            // Input was ready, so the downstream pipe is full
+            relay->blocked_ns += wait_for(relay->out_fd, POLLOUT);
+        } else if (errno != EINTR) {
+            break;      // EPIPE: downstream exited; upstream gets SIGPIPE next
+        }
+    }
+    
+    close(relay->in_fd);
+    close(relay->out_fd);
+    return NULL;
+}
+
+// Nanoseconds spent in poll() until `fd` is ready (or hung up)
+static uint64_t wait_for(int fd, short events) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    uint64_t start = now_ns();
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+    }
+    return now_ns() - start;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t timeval_ns(const struct timeval *tv) {
+    return (uint64_t)tv->tv_sec * NS_PER_SEC + (uint64_t)tv->tv_usec * 1000;
+}
+
+static void format_bytes(uint64_t bytes, char *buf, size_t size) {
+    const char *units = "BKMGT";
+    double value = (double)bytes;
+    int unit = 0;
+    while (value >= 1024 && units[unit + 1] != '\0') {
+        value /= 1024;
+        unit++;
+    }
+    if (unit == 0) {
+        snprintf(buf, size, "%lluB", (unsigned long long)bytes);
+    } else {
+        snprintf(buf, size, "%.1f%c", value, units[unit]);
+    }
+}
+
+static void format_seconds(uint64_t ns, char *buf, size_t size) {
+    snprintf(buf, size, "%.2fs", (double)ns / NS_PER_SEC);
+}
@@ -0,0 +1,44 @@
+#ifndef PIPESTATS_H
+#define PIPESTATS_H
+
+/* INCLUDE LIBRARIES */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "jobs.h"
+
+/* DEFINE CONSTANTS */
+#define PIPE_RELAY_CHUNK (64 * 1024)
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// Copies one pipeline link from `in_fd` to `out_fd` with splice(), so the
+// data never enters user space, and times what it waits for
+struct pipe_relay {
+    int in_fd;              // Read end of the upstream stage's pipe
+    int out_fd;             // Write end of the downstream stage's pipe
+    pthread_t thread;
+    bool running;
+    uint64_t bytes;
+    uint64_t starved_ns;    // Waiting for the upstream stage to write
+    uint64_t blocked_ns;    // Waiting for the downstream stage to read
+};
+
+/* FUNCTION HEADERS */
+
+// Starts relaying on its own thread; the relay owns both descriptors and
+// closes them at EOF, or when the downstream stage stops reading. On
+// failure both are closed right away
+bool pipe_relay_start(struct pipe_relay *relay, int in_fd, int out_fd);
+
+// Waits for the relay to finish
+void pipe_relay_join(struct pipe_relay *relay);
+
+// Table of bytes, throughput, CPU and waiting per stage of a finished
+// job. `relays[i]` sits between stage i and i + 1
+void pipestats_report(FILE *output, const struct job *job, char *const *names,
+                      const struct pipe_relay *relays);
+
+#endif
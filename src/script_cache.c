@@ -0,0 +1,465 @@
+/* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "script_cache.h"
+
+/* DEFINE CONSTANTS */
+#define SCRIPT_CACHE_MAX_DEPTH 4096
+#define SCRIPT_CACHE_NULL_STRING UINT32_MAX
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// Start of a cache file. The script's path follows, then the serialized tree
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t path_length;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t inode;
+    uint64_t payload_length;
+    uint64_t checksum;      // FNV-1a of the payload
+};
+
+struct out_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+// Reads past the end, or impossible counts, set `failed` and yield zeros,
+// so a damaged file still decodes into a well-formed (if useless) tree
+struct in_buffer {
+    const char *data;
+    size_t length;
+    size_t pos;
+    bool failed;
+};
+
+/* FUNCTION HEADERS */
+static bool cache_file_path(const char *script_path, char *buf, size_t size, bool create_dir);
+static bool make_dirs(char *path);
+static uint64_t hash_bytes(const void *data, size_t length);
+static void put_bytes(struct out_buffer *out, const void *data, size_t length);
+static void put_u8(struct out_buffer *out, uint8_t value);
+static void put_u32(struct out_buffer *out, uint32_t value);
+static void put_string(struct out_buffer *out, const char *text);
+static void put_words(struct out_buffer *out, char **words, int count);
+static void put_context(struct out_buffer *out, const struct command_context *ctx);
+static void put_node(struct out_buffer *out, const struct command_node *node);
+static bool get_bytes(struct in_buffer *in, void *data, size_t length);
+static uint8_t get_u8(struct in_buffer *in);
+static uint32_t get_u32(struct in_buffer *in);
+static uint32_t get_count(struct in_buffer *in);
+static char *get_string(struct in_buffer *in);
+static void get_context(struct in_buffer *in, struct command_context *ctx);
+static struct command_node *get_node(struct in_buffer *in, int depth);
+
+/* CACHE STATE */
+static struct script_cache_stats stats = { 0 };
+
+/* FUNCTION FUNCTIONS */
+struct command_node *script_cache_load(const char *path, const struct stat *st) {
+    char cache_path[PATH_MAX];
+    if (!cache_file_path(path, cache_path, sizeof(cache_path), false)) {
+        return NULL;
+    }
+    
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        stats.misses++;
+        return NULL;
+    }
+    
+    struct stat cache_st;
+    if (fstat(fd, &cache_st) < 0 || (size_t)cache_st.st_size < sizeof(struct cache_header)) {
+        close(fd);
+        stats.rejected++;
+        return NULL;
+    }
+    
+    size_t length = (size_t)cache_st.st_size;
+    char *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        stats.misses++;
+        return NULL;
+    }
+    
+    struct cache_header header;
+    memcpy(&header, data, sizeof(header));
+    size_t path_length = strlen(path);
+    const char *payload = data + sizeof(header) + header.path_length;
+    
+    bool valid = memcmp(header.magic, SCRIPT_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == SCRIPT_CACHE_VERSION &&
+                 header.path_length == path_length &&
+                 sizeof(header) + path_length + header.payload_length == length &&
+                 memcmp(data + sizeof(header), path, path_length) == 0 &&
+                 header.size == (uint64_t)st->st_size &&
+                 header.mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+                 header.mtime_nsec == (int64_t)st->st_mtim.tv_nsec &&
+                 header.inode == (uint64_t)st->st_ino &&
+                 hash_bytes(payload, header.payload_length) == header.checksum;
+    
+    struct command_node *root = NULL;
+    if (valid) {
+        struct in_buffer in = {
+            .data = payload,
+            .length = header.payload_length,
+        };
+        root = get_node(&in, 0);
+        if (in.failed || in.pos != in.length) {
+            free_command_node(root);
+            root = NULL;
+        }
+    }
+    munmap(data, length);
+    
+    if (root == NULL) {
+        stats.rejected++;
+        return NULL;
+    }
+    stats.hits++;
+    return root;
+}
+
+void script_cache_store(const char *path, const struct stat *st, const struct command_node *root) {
+    char cache_path[PATH_MAX];
+    if (!cache_file_path(path, cache_path, sizeof(cache_path), true)) {
+        return;
+    }
+    
+    struct out_buffer out = { 0 };
+    struct cache_header header = { 0 };
+    put_bytes(&out, &header, sizeof(header));
+    put_bytes(&out, path, strlen(path));
+    size_t payload_start = out.length;
+    put_node(&out, root);
+    
+    memcpy(header.magic, SCRIPT_CACHE_MAGIC, sizeof(header.magic));
+    header.version = SCRIPT_CACHE_VERSION;
+    header.path_length = (uint32_t)strlen(path);
+    header.size = (uint64_t)st->st_size;
+    header.mtime_sec = (int64_t)st->st_mtim.tv_sec;
+    header.mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+    header.inode = (uint64_t)st->st_ino;
+    header.payload_length = out.length - payload_start;
+    header.checksum = hash_bytes(out.data + payload_start, header.payload_length);
+    memcpy(out.data, &header, sizeof(header));
+    
+    char temp_path[PATH_MAX + 32];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", cache_path, (int)getpid());
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        bool ok = write(fd, out.data, out.length) == (ssize_t)out.length;
+        close(fd);
+        if (ok && rename(temp_path, cache_path) == 0) {
+            stats.stores++;
+        } else {
+            unlink(temp_path);
+        }
+    }
+    free(out.data);
+}
+
+void script_cache_get_stats(struct script_cache_stats *out) {
+    *out = stats;
+}
+
+// <cache dir>/<hash of the script path>.ast
+static bool cache_file_path(const char *script_path, char *buf, size_t size, bool create_dir) {
+    char dir[PATH_MAX];
+    const char *configured = getenv(SCRIPT_CACHE_ENV_VAR);
+    if (configured) {
+        if (configured[0] == '\0') {
+            return false;
+        }
+        snprintf(dir, sizeof(dir), "%s", configured);
+    } else if (getenv("XDG_CACHE_HOME") && getenv("XDG_CACHE_HOME")[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/%s", getenv("XDG_CACHE_HOME"), SCRIPT_CACHE_DIR_NAME);
+    } else if (getenv("HOME")) {
+        snprintf(dir, sizeof(dir), "%s/.cache/%s", getenv("HOME"), SCRIPT_CACHE_DIR_NAME);
+    } else {
+        return false;
+    }
+    
+    if (create_dir && !make_dirs(dir)) {
+        return false;
+    }
+    
+    uint64_t hash = hash_bytes(script_path, strlen(script_path));
+    return (size_t)snprintf(buf, size, "%s/%016llx.ast", dir, (unsigned long long)hash) < size;
+}
+
+// mkdir -p
+static bool make_dirs(char *path) {
+    for (char *p = path + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            bool ok = mkdir(path, 0700) == 0 || errno == EEXIST;
+            *p = '/';
+            if (!ok) {
+                return false;
+            }
+        }
+    }
+    return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+static uint64_t hash_bytes(const void *data, size_t length) {
+    // FNV-1a, 64-bit
+    const unsigned char *bytes = data;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void put_bytes(struct out_buffer *out, const void *data, size_t length) {
+    if (out->length + length > out->capacity) {
+        size_t capacity = out->capacity ? out->capacity : 4096;
+        while (out->length + length > capacity) {
+            capacity *= 2;
+        }
+        out->data = realloc(out->data, capacity);
+        out->capacity = capacity;
+    }
+    memcpy(out->data + out->length, data, length);
+    out->length += length;
+}
+
+static void put_u8(struct out_buffer *out, uint8_t value) {
+    put_bytes(out, &value, sizeof(value));
+}
+
+static void put_u32(struct out_buffer *out, uint32_t value) {
+    put_bytes(out, &value, sizeof(value));
+}
+
+static void put_string(struct out_buffer *out, const char *text) {
+    if (text == NULL) {
+        put_u32(out, SCRIPT_CACHE_NULL_STRING);
+        return;
+    }
+    size_t length = strlen(text);
+    put_u32(out, (uint32_t)length);
+    put_bytes(out, text, length);
+}
+
+static void put_words(struct out_buffer *out, char **words, int count) {
+    put_u32(out, (uint32_t)count);
+    for (int i = 0; i < count; i++) {
+        put_string(out, words[i]);
+    }
+}
+
+// Pipelines are stored stage by stage; argv is rebuilt around them on load
+static void put_context(struct out_buffer *out, const struct command_context *ctx) {
+    put_u8(out, ctx->redirect);
+    put_string(out, ctx->out_file);
+    put_u32(out, (uint32_t)ctx->out_mode);
+    put_u8(out, ctx->redirect_err);
+    put_string(out, ctx->error_file);
+    put_u32(out, (uint32_t)ctx->err_mode);
+    put_u8(out, ctx->needs_expansion);
+    put_words(out, ctx->fanout_files, ctx->num_fanouts);
+    for (int i = 0; i < ctx->num_fanouts; i++) {
+        put_u32(out, (uint32_t)ctx->fanout_stages[i]);
+    }
+    
+    put_u32(out, (uint32_t)ctx->num_commands);
+    if (ctx->num_commands > 0) {
+        for (int i = 0; i < ctx->num_commands; i++) {
+            put_words(out, ctx->all_commands[i], ctx->all_argc[i]);
+        }
+    } else {
+        put_u8(out, ctx->argv != NULL);
+        if (ctx->argv) {
+            put_words(out, ctx->argv, ctx->argc);
+        }
+    }
+}
+
+static void put_node(struct out_buffer *out, const struct command_node *node) {
+    put_u8(out, (uint8_t)node->type);
+    put_u8(out, node->has_expansions);
+    put_context(out, &node->command);
+    
+    put_u32(out, (uint32_t)node->num_children);
+    for (int i = 0; i < node->num_children; i++) {
+        put_node(out, node->children[i]);
+    }
+    
+    put_string(out, node->name);
+    put_words(out, node->words, node->num_words);
+}
+
+static bool get_bytes(struct in_buffer *in, void *data, size_t length) {
+    if (in->failed || length > in->length - in->pos) {
+        in->failed = true;
+        memset(data, 0, length);
+        return false;
+    }
+    memcpy(data, in->data + in->pos, length);
+    in->pos += length;
+    return true;
+}
+
+static uint8_t get_u8(struct in_buffer *in) {
+    uint8_t value;
+    get_bytes(in, &value, sizeof(value));
+    return value;
+}
+
+static uint32_t get_u32(struct in_buffer *in) {
+    uint32_t value;
+    get_bytes(in, &value, sizeof(value));
+    return value;
+}
+
+// Every counted item takes at least one byte, which bounds what a damaged
+// count can make us allocate
+static uint32_t get_count(struct in_buffer *in) {
+    uint32_t count = get_u32(in);
+    if (in->failed || count > in->length - in->pos || count > INT_MAX / 2) {
+        in->failed = true;
+        return 0;
+    }
+    return count;
+}
+
+static char *get_string(struct in_buffer *in) {
+    uint32_t length = get_u32(in);
+    if (in->failed || length == SCRIPT_CACHE_NULL_STRING) {
+        return NULL;
+    }
+    if (length > in->length - in->pos) {
+        in->failed = true;
+        return NULL;
+    }
+    
+    char *text = malloc(length + 1);
+    memcpy(text, in->data + in->pos, length);
+    text[length] = '\0';
+    in->pos += length;
+    return text;
+}
+
+// Mirrors the ownership build_context sets up: pipeline words belong to
+// all_commands, and argv only borrows them
+static void get_context(struct in_buffer *in, struct command_context *ctx) {
+    ctx->redirect = get_u8(in);
+    ctx->out_file = get_string(in);
+    ctx->out_mode = (int)get_u32(in);
+    ctx->redirect_err = get_u8(in);
+    ctx->error_file = get_string(in);
+    ctx->err_mode = (int)get_u32(in);
+    ctx->needs_expansion = get_u8(in);
+    int num_fanouts = (int)get_count(in);
+    if (num_fanouts > 0) {
+        ctx->fanout_files = malloc(num_fanouts * sizeof(char *));
+        ctx->fanout_stages = malloc(num_fanouts * sizeof(int));
+        for (int i = 0; i < num_fanouts; i++) {
+            ctx->fanout_files[i] = get_string(in);
+        }
+        for (int i = 0; i < num_fanouts; i++) {
+            ctx->fanout_stages[i] = (int)get_u32(in);
+        }
+        ctx->num_fanouts = num_fanouts;
+    }
+    
+    int num_commands = (int)get_count(in);
+    if (num_commands > 0) {
+        ctx->all_commands = malloc(num_commands * sizeof(char **));
+        ctx->all_argc = malloc(num_commands * sizeof(int));
+        ctx->all_command_names = malloc(num_commands * sizeof(char *));
+    
+        int total = 0;
+        for (int i = 0; i < num_commands; i++) {
+            int argc = (int)get_count(in);
+            ctx->all_commands[i] = malloc((argc + 1) * sizeof(char *));
+            for (int j = 0; j < argc; j++) {
+                ctx->all_commands[i][j] = get_string(in);
+            }
+            ctx->all_commands[i][argc] = NULL;
+            ctx->all_argc[i] = argc;
+            ctx->all_command_names[i] = ctx->all_commands[i][0];
+            total += argc + 1;
+        }
+        ctx->num_commands = num_commands;
+    
+        // Stages back to back, with NULL where the '|' words were
+        ctx->argv = malloc((total + 1) * sizeof(char *));
+        int pos = 0;
+        for (int i = 0; i < num_commands; i++) {
+            for (int j = 0; j <= ctx->all_argc[i]; j++) {
+                ctx->argv[pos++] = ctx->all_commands[i][j];
+            }
+        }
+        ctx->argv[pos] = NULL;
+        ctx->argc = ctx->all_argc[0];
+        ctx->command_name = ctx->all_command_names[0];
+        return;
+    }
+    
+    if (!get_u8(in)) {
+        return;
+    }
+    int argc = (int)get_count(in);
+    ctx->argv = malloc((argc + 1) * sizeof(char *));
+    for (int i = 0; i < argc; i++) {
+        ctx->argv[i] = get_string(in);
+    }
+    ctx->argv[argc] = NULL;
+    ctx->argc = argc;
+    ctx->command_name = (argc > 0) ? ctx->argv[0] : NULL;
+}
+
+static struct command_node *get_node(struct in_buffer *in, int depth) {
+    struct command_node *node = calloc(1, sizeof(struct command_node));
+    node->refs = 1;
+    if (depth > SCRIPT_CACHE_MAX_DEPTH) {
+        in->failed = true;
+        return node;
+    }
+    
+    uint8_t type = get_u8(in);
+    if (type > NODE_BACKGROUND) {
+        in->failed = true;
+        return node;
+    }
+    node->type = (enum node_type)type;
+    node->has_expansions = get_u8(in);
+    get_context(in, &node->command);
+    
+    int num_children = (int)get_count(in);
+    if (num_children > 0) {
+        node->children = malloc(num_children * sizeof(struct command_node *));
+        for (int i = 0; i < num_children; i++) {
+            node->children[node->num_children++] = get_node(in, depth + 1);
+        }
+    }
+    
+    node->name = get_string(in);
+    int num_words = (int)get_count(in);
+    if (num_words > 0) {
+        node->words = malloc(num_words * sizeof(char *));
+        for (int i = 0; i < num_words; i++) {
+            node->words[node->num_words++] = get_string(in);
+        }
+    }
+    return node;
+}
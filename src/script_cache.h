@@ -0,0 +1,36 @@
+#ifndef SCRIPT_CACHE_H
+#define SCRIPT_CACHE_H
+
+/* INCLUDE LIBRARIES */
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "parser.h"
+
+/* DEFINE CONSTANTS */
+#define SCRIPT_CACHE_ENV_VAR "SHELL_SCRIPT_CACHE"     // Directory; empty disables
+#define SCRIPT_CACHE_DIR_NAME "codecrafters-shell"    // Under $XDG_CACHE_HOME or ~/.cache
+#define SCRIPT_CACHE_MAGIC "SHAST\0\0\0"
+#define SCRIPT_CACHE_VERSION 3                        // Bump when the node layout changes
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+struct script_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stores;
+    unsigned long rejected;     // Stale or damaged cache files
+};
+
+/* FUNCTION HEADERS */
+
+// The parsed tree cached for the script at `path` (absolute), as long as
+// the script's size and mtime still match `st`. NULL otherwise
+struct command_node *script_cache_load(const char *path, const struct stat *st);
+
+// Saves `root` as the parse of `path`. Written to a temporary file and
+// renamed, so concurrent shells never read half a cache file
+void script_cache_store(const char *path, const struct stat *st, const struct command_node *root);
+
+void script_cache_get_stats(struct script_cache_stats *stats);
+
+#endif
@@ -0,0 +1,244 @@
+/* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// Start of a request message; the working directory and the command text
+// follow, without terminators. Descriptors travel as SCM_RIGHTS
+struct request_header {
+    uint32_t version;
+    uint32_t kind;          // enum request_kind
+    uint32_t cwd_length;
+    uint32_t text_length;
+};
+
+/* FUNCTION HEADERS */
+static bool socket_address(const char *path, struct sockaddr_un *addr);
+
+/* FUNCTION FUNCTIONS */
+int server_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) {
+        fprintf(stderr, "shell: %s: socket path too long\n", path);
+        return -1;
+    }
+    
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "shell: socket: %s\n", strerror(errno));
+        return -1;
+    }
+    
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (bound < 0 && errno == EADDRINUSE) {
+        // Only take the path over if nobody answers on it
+        int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        bool alive = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) {
+            close(probe);
+        }
+        if (alive) {
+            fprintf(stderr, "shell: %s: a server is already running\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+        bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    
+    if (bound < 0 || listen(fd, SERVER_BACKLOG) < 0) {
+        fprintf(stderr, "shell: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int server_accept(int listen_fd) {
+    int fd;
+    do {
+        fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    } while (fd < 0 && errno == EINTR);
+    return fd;
+}
+
+bool server_receive(int conn_fd, struct server_request *request) {
+    *request = (struct server_request) { .fds = { -1, -1, -1 } };
+    
+    char *buf = malloc(SERVER_MAX_REQUEST);
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(SERVER_NUM_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = { buf, SERVER_MAX_REQUEST };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.space,
+        .msg_controllen = sizeof(control.space),
+    };
+    
+    ssize_t got;
+    do {
+        got = recvmsg(conn_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (got < 0 && errno == EINTR);
+    
+    // Take whatever descriptors came along, so they are closed on any error
+    int num_fds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (num_fds < SERVER_NUM_FDS) {
+                    request->fds[num_fds++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+    
+    struct request_header header;
+    bool valid = got >= (ssize_t)sizeof(header) && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) &&
+                 num_fds == SERVER_NUM_FDS;
+    if (valid) {
+        memcpy(&header, buf, sizeof(header));
+        valid = header.version == SERVER_PROTOCOL_VERSION && header.kind <= REQUEST_WORDS &&
+                sizeof(header) + (size_t)header.cwd_length + header.text_length == (size_t)got;
+    }
+    
+    // Words end in their terminator; there has to be at least one
+    const char *text = buf + sizeof(header) + (valid ? header.cwd_length : 0);
+    if (valid && header.kind == REQUEST_WORDS) {
+        valid = header.text_length > 0 && text[header.text_length - 1] == '\0';
+    }
+    if (valid) {
+        request->cwd = strndup(buf + sizeof(header), header.cwd_length);
+        request->kind = header.kind;
+        request->text = malloc((size_t)header.text_length + 1);
+        memcpy(request->text, text, header.text_length);
+        request->text[header.text_length] = '\0';
+        request->text_length = header.text_length;
+    }
+    
+    free(buf);
+    if (!valid) {
+        server_free_request(request);
+    }
+    return valid;
+}
+
+void server_reply(int conn_fd, int status) {
+    int32_t value = status;
+    send(conn_fd, &value, sizeof(value), MSG_NOSIGNAL);
+}
+
+void server_free_request(struct server_request *request) {
+    for (int i = 0; i < SERVER_NUM_FDS; i++) {
+        if (request->fds[i] >= 0) {
+            close(request->fds[i]);
+            request->fds[i] = -1;
+        }
+    }
+    free(request->cwd);
+    free(request->text);
+    request->cwd = NULL;
+    request->text = NULL;
+}
+
+int client_run(const char *path, enum request_kind kind, const char *text, size_t length) {
+    struct sockaddr_un addr;
+    char cwd[PATH_MAX];
+    if (!socket_address(path, &addr)) {
+        fprintf(stderr, "shell: %s: socket path too long\n", path);
+        return 1;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        cwd[0] = '\0';
+    }
+    
+    struct request_header header = {
+        .version = SERVER_PROTOCOL_VERSION,
+        .kind = kind,
+        .cwd_length = (uint32_t)strlen(cwd),
+        .text_length = (uint32_t)length,
+    };
+    if (length > SERVER_MAX_REQUEST || sizeof(header) + header.cwd_length + length > SERVER_MAX_REQUEST) {
+        fprintf(stderr, "shell: command too long for the server\n");
+        return 1;
+    }
+    
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "shell: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    
+    int fds[SERVER_NUM_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov[3] = {
+        { &header, sizeof(header) },
+        { cwd, header.cwd_length },
+        { (void *)text, header.text_length },
+    };
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 3,
+        .msg_control = control.space,
+        .msg_controllen = sizeof(control.space),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+        fprintf(stderr, "shell: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    
+    int32_t status;
+    ssize_t got;
+    do {
+        got = recv(fd, &status, sizeof(status), 0);
+    } while (got < 0 && errno == EINTR);
+    close(fd);
+    
+    if (got != sizeof(status)) {
+        fprintf(stderr, "shell: %s: server went away\n", path);
+        return 1;
+    }
+    return status;
+}
+
+static bool socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
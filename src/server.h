@@ -0,0 +1,54 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/* INCLUDE LIBRARIES */
+#include <stdbool.h>
+
+/* DEFINE CONSTANTS */
+#define SERVER_PROTOCOL_VERSION 2
+#define SERVER_MAX_REQUEST 65536    // Header, working directory and command text
+#define SERVER_BACKLOG 64
+#define SERVER_NUM_FDS 3            // The client's stdin, stdout and stderr
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// What the text of a request holds
+enum request_kind {
+    REQUEST_LINE,           // A command line for the server to parse
+    REQUEST_WORDS,          // One command's words, each NUL-terminated
+};
+
+// One command sent by `shell --client`
+struct server_request {
+    char *cwd;
+    enum request_kind kind;
+    char *text;             // NUL-terminated after `text_length` as well
+    size_t text_length;
+    int fds[SERVER_NUM_FDS];
+};
+
+/* FUNCTION HEADERS */
+
+// Binds a SOCK_SEQPACKET socket at `path`, replacing a stale one left by a
+// server that died. Returns the listening fd, or -1 after printing why
+int server_listen(const char *path);
+
+// Next pending connection (close-on-exec), or -1
+int server_accept(int listen_fd);
+
+// Reads the one request a connection carries, with the client's
+// descriptors (received close-on-exec). False if it is malformed
+bool server_receive(int conn_fd, struct server_request *request);
+
+// Sends the command's exit status back
+void server_reply(int conn_fd, int status);
+
+// Closes the received descriptors and frees the strings
+void server_free_request(struct server_request *request);
+
+// Client side: sends `length` bytes of `text` with this process's
+// stdin/stdout/stderr and working directory to the server at `path`, and
+// waits for the status
+int client_run(const char *path, enum request_kind kind, const char *text, size_t length);
+
+#endif
@@ -0,0 +1,168 @@
+/* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+#include "shellstats.h"
+
+/* DEFINE CONSTANTS */
+#define FD_DIRECTORY "/proc/self/fd"
+
+/* FUNCTION HEADERS */
+
+// glibc's own allocator, which the wrappers below hand every call to.
+// Defining malloc and friends here replaces them for libc and readline too
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static void *note_allocation(void *ptr);
+static void add_bytes(size_t bytes);
+
+/* SHELLSTATS STATE */
+static unsigned long local_counters[NUM_SHELL_COUNTERS] = { 0 };
+static unsigned long *counters = local_counters;
+static struct alloc_stats alloc = { 0 };
+
+/* FUNCTION FUNCTIONS */
+void shellstats_init(void) {
+    if (counters != local_counters) {
+        return;
+    }
+    
+    void *page = mmap(NULL, sizeof(local_counters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED) {
+        return;     // Only this process's own forks get counted
+    }
+    memcpy(page, local_counters, sizeof(local_counters));
+    counters = page;
+}
+
+void shellstats_count(enum shell_counter counter) {
+    __atomic_fetch_add(&counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+unsigned long shellstats_counter(enum shell_counter counter) {
+    return __atomic_load_n(&counters[counter], __ATOMIC_RELAXED);
+}
+
+void shellstats_get_alloc_stats(struct alloc_stats *stats) {
+    stats->allocations = __atomic_load_n(&alloc.allocations, __ATOMIC_RELAXED);
+    stats->reallocations = __atomic_load_n(&alloc.reallocations, __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&alloc.frees, __ATOMIC_RELAXED);
+    stats->live_blocks = __atomic_load_n(&alloc.live_blocks, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&alloc.bytes, __ATOMIC_RELAXED);
+    stats->peak_bytes = __atomic_load_n(&alloc.peak_bytes, __ATOMIC_RELAXED);
+}
+
+int shellstats_open_fds(void) {
+    DIR *dir = opendir(FD_DIRECTORY);
+    if (dir == NULL) {
+        return -1;
+    }
+    
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count - 1;   // The listing's own descriptor
+}
+
+void *malloc(size_t size) {
+    return note_allocation(__libc_malloc(size));
+}
+
+void *calloc(size_t count, size_t size) {
+    return note_allocation(__libc_calloc(count, size));
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    
+    size_t old_bytes = malloc_usable_size(ptr);
+    void *moved = __libc_realloc(ptr, size);
+    if (moved == NULL && size > 0) {
+        return NULL;    // Failed; the old block is untouched
+    }
+    
+    __atomic_fetch_sub(&alloc.bytes, old_bytes, __ATOMIC_RELAXED);
+    if (moved == NULL) {
+        // realloc(ptr, 0) frees
+        __atomic_fetch_add(&alloc.frees, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&alloc.live_blocks, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    __atomic_fetch_add(&alloc.reallocations, 1, __ATOMIC_RELAXED);
+    add_bytes(malloc_usable_size(moved));
+    return moved;
+}
+
+void free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    __atomic_fetch_add(&alloc.frees, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&alloc.live_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&alloc.bytes, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    __libc_free(ptr);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return note_allocation(__libc_memalign(alignment, size));
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *ptr = memalign(alignment, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+static void *note_allocation(void *ptr) {
+    if (ptr != NULL) {
+        __atomic_fetch_add(&alloc.allocations, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&alloc.live_blocks, 1, __ATOMIC_RELAXED);
+        add_bytes(malloc_usable_size(ptr));
+    }
+    return ptr;
+}
+
+// The peak may miss a few bytes when threads race; it's a gauge, not a limit
+static void add_bytes(size_t bytes) {
+    size_t now = __atomic_add_fetch(&alloc.bytes, bytes, __ATOMIC_RELAXED);
+    if (now > __atomic_load_n(&alloc.peak_bytes, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&alloc.peak_bytes, now, __ATOMIC_RELAXED);
+    }
+}
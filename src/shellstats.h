@@ -0,0 +1,42 @@
+#ifndef SHELLSTATS_H
+#define SHELLSTATS_H
+
+/* INCLUDE LIBRARIES */
+#include <stddef.h>
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// Process counters live in a shared page, so forks and execs done by
+// subshells and by children just before they exec are counted too
+enum shell_counter {
+    COUNTER_FORKS,
+    COUNTER_EXECS,
+    NUM_SHELL_COUNTERS,
+};
+
+// Heap use of this process, seen through its malloc and free. Blocks are
+// measured by their usable size, which is what they really hold on to
+struct alloc_stats {
+    unsigned long allocations;      // malloc, calloc, aligned allocations
+    unsigned long reallocations;
+    unsigned long frees;
+    size_t live_blocks;
+    size_t bytes;
+    size_t peak_bytes;
+};
+
+/* FUNCTION HEADERS */
+
+// Maps the shared counter page; call once before the first fork
+void shellstats_init(void);
+
+void shellstats_count(enum shell_counter counter);
+
+unsigned long shellstats_counter(enum shell_counter counter);
+
+void shellstats_get_alloc_stats(struct alloc_stats *stats);
+
+// Descriptors open in this process right now, or -1 if /proc can't tell
+int shellstats_open_fds(void);
+
+#endif
@@ -0,0 +1,564 @@
+/* INCLUDE LIBRARIES */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "parser.h"
+#include "brace.h"
+#include "variables.h"
+
+/* DEFINE CONSTANTS */
+#define NUMBER_BUFFER_SIZE 32
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+struct variable {
+    char *name;
+    char *value;        // NULL for `export NAME` before NAME is set
+    bool exported;
+    struct variable *next;
+};
+
+// Fields produced while expanding one or more words
+struct field_builder {
+    bool split;         // Split unquoted results into separate fields
+    char **fields;
+    int count;
+    int capacity;
+    char *buffer;       // The field being built
+    size_t length;
+    size_t buffer_capacity;
+    bool open;          // The current field exists, even if it is empty
+    
+    // Set when fields are handed out one at a time instead of collected
+    field_visitor visit;
+    void *visit_data;
+    bool stopped;       // `visit` asked for no more
+};
+
+/* FUNCTION HEADERS */
+static unsigned long hash_name(const char *name);
+static struct variable *find_variable(const char *name);
+static int compare_variables(const void *a, const void *b);
+static bool is_separator(char c);
+static void append_bytes(struct field_builder *fb, const char *text, size_t length);
+static void append_split(struct field_builder *fb, const char *value);
+static void end_field(struct field_builder *fb);
+static void append_value(struct field_builder *fb, const char *value, bool quoted);
+static void append_positional(struct field_builder *fb, bool quoted, bool separate);
+static const char *special_value(const char *name, size_t length, char *number);
+static const char *expand_parameter(struct field_builder *fb, const char *p, bool quoted);
+static bool is_element_name(const char *name, size_t length);
+static void expand_into(struct field_builder *fb, const char *word);
+static void expand_field_words(struct field_builder *fb, char *const *words, int count,
+                               struct brace_expansion **braces);
+static void expand_one(struct field_builder *fb, const char *word, bool generated);
+
+/* VARIABLE STATE */
+static struct variable *variables[VARIABLE_BUCKETS];
+static int last_status = 0;
+static pid_t last_background = 0;
+static struct positional_params positional = { 0, NULL };
+
+/* FUNCTION FUNCTIONS */
+const char *var_get(const char *name) {
+    struct variable *var = find_variable(name);
+    if (var) {
+        return var->value;
+    }
+    return getenv(name);
+}
+
+void var_set(const char *name, const char *value) {
+    struct variable *var = find_variable(name);
+    if (var == NULL) {
+        unsigned long bucket = hash_name(name) % VARIABLE_BUCKETS;
+        var = calloc(1, sizeof(struct variable));
+        var->name = strdup(name);
+        var->exported = getenv(name) != NULL;
+        var->next = variables[bucket];
+        variables[bucket] = var;
+    }
+    
+    free(var->value);
+    var->value = strdup(value);
+    if (var->exported) {
+        setenv(name, value, 1);
+    }
+}
+
+void var_export(const char *name) {
+    struct variable *var = find_variable(name);
+    if (var == NULL) {
+        if (getenv(name)) {
+            return; // Inherited, so already exported
+        }
+        unsigned long bucket = hash_name(name) % VARIABLE_BUCKETS;
+        var = calloc(1, sizeof(struct variable));
+        var->name = strdup(name);
+        var->next = variables[bucket];
+        variables[bucket] = var;
+    }
+    
+    var->exported = true;
+    if (var->value) {
+        setenv(name, var->value, 1);
+    }
+}
+
+void var_unset(const char *name) {
+    struct variable **link = &variables[hash_name(name) % VARIABLE_BUCKETS];
+    while (*link && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    
+    if (*link) {
+        struct variable *var = *link;
+        *link = var->next;
+        free(var->name);
+        free(var->value);
+        free(var);
+    }
+    unsetenv(name);
+}
+
+void var_print(FILE *output) {
+    int count = 0;
+    for (int b = 0; b < VARIABLE_BUCKETS; b++) {
+        for (struct variable *var = variables[b]; var; var = var->next) {
+            count++;
+        }
+    }
+    
+    // Sorted by name, like other shells
+    struct variable **sorted = malloc((count + 1) * sizeof(struct variable *));
+    int n = 0;
+    for (int b = 0; b < VARIABLE_BUCKETS; b++) {
+        for (struct variable *var = variables[b]; var; var = var->next) {
+            sorted[n++] = var;
+        }
+    }
+    qsort(sorted, n, sizeof(struct variable *), compare_variables);
+    
+    for (int i = 0; i < n; i++) {
+        if (sorted[i]->value) {
+            fprintf(output, "%s='%s'\n", sorted[i]->name, sorted[i]->value);
+        }
+    }
+    free(sorted);
+}
+
+void var_each_name(void (*visit)(const char *name, void *data), void *data) {
+    for (int b = 0; b < VARIABLE_BUCKETS; b++) {
+        for (struct variable *var = variables[b]; var; var = var->next) {
+            visit(var->name, data);
+        }
+    }
+}
+
+bool var_is_name(const char *name, size_t length) {
+    if (length == 0 || (name[0] >= '0' && name[0] <= '9')) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int var_status(void) {
+    return last_status;
+}
+
+void var_set_status(int status) {
+    last_status = status;
+}
+
+void var_set_last_background(pid_t pid) {
+    last_background = pid;
+}
+
+void var_set_positional(int count, char *const *values, struct positional_params *saved) {
+    if (saved) {
+        *saved = positional;
+    } else {
+        for (int i = 0; i < positional.count; i++) {
+            free(positional.values[i]);
+        }
+        free(positional.values);
+    }
+    
+    positional.count = count;
+    positional.values = malloc((count + 1) * sizeof(char *));
+    for (int i = 0; i < count; i++) {
+        positional.values[i] = strdup(values[i]);
+    }
+    positional.values[count] = NULL;
+}
+
+void var_restore_positional(struct positional_params *saved) {
+    for (int i = 0; i < positional.count; i++) {
+        free(positional.values[i]);
+    }
+    free(positional.values);
+    positional = *saved;
+}
+
+int expand_words(char *const *words, int count, char ***out) {
+    struct field_builder fb = {
+        .split = true,
+        .capacity = count + 1,
+    };
+    
+    // Brace expressions know how many words they make, so the array is
+    // sized once instead of doubling its way up to {1..1000000}
+    struct brace_expansion **braces = NULL;
+    size_t capacity = (size_t)count + 1;
+    for (int i = 0; i < count; i++) {
+        if (strchr(words[i], BRACE_MARK) == NULL) {
+            continue;
+        }
+        if (braces == NULL) {
+            braces = calloc(count, sizeof(struct brace_expansion *));
+        }
+        braces[i] = brace_parse(words[i]);
+        size_t generated = braces[i] ? brace_count(braces[i]) : 1;
+        if (generated > BRACE_MAX_WORDS || capacity + generated - 1 > (size_t)count + 1 + BRACE_MAX_WORDS) {
+            // Left as written, like a brace that doesn't expand
+            fprintf(stderr, "shell: brace expansion: too many words\n");
+            brace_free(braces[i]);
+            braces[i] = NULL;
+            generated = 1;
+        }
+        capacity += generated - 1;
+    }
+    fb.capacity = (int)capacity;
+    fb.fields = malloc(fb.capacity * sizeof(char *));
+    
+    expand_field_words(&fb, words, count, braces);
+    
+    fb.fields[fb.count] = NULL;
+    free(fb.buffer);
+    free(braces);
+    *out = fb.fields;
+    return fb.count;
+}
+
+void expand_words_each(char *const *words, int count, field_visitor visit, void *data) {
+    struct field_builder fb = {
+        .split = true,
+        .visit = visit,
+        .visit_data = data,
+    };
+    
+    struct brace_expansion **braces = calloc(count, sizeof(struct brace_expansion *));
+    for (int i = 0; i < count; i++) {
+        if (strchr(words[i], BRACE_MARK)) {
+            braces[i] = brace_parse(words[i]);
+        }
+    }
+    
+    expand_field_words(&fb, words, count, braces);
+    
+    // Stopping early leaves generators unfinished
+    for (int i = 0; i < count; i++) {
+        brace_free(braces[i]);
+    }
+    free(braces);
+    free(fb.buffer);
+}
+
+char *expand_word(const char *word) {
+    struct field_builder fb = { .split = false };
+    expand_into(&fb, word);
+    
+    if (fb.buffer == NULL) {
+        return strdup("");
+    }
+    fb.buffer[fb.length] = '\0';
+    return fb.buffer;
+}
+
+static unsigned long hash_name(const char *name) {
+    // FNV-1a
+    unsigned long hash = 14695981039346656037UL;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static struct variable *find_variable(const char *name) {
+    struct variable *var = variables[hash_name(name) % VARIABLE_BUCKETS];
+    while (var && strcmp(var->name, name) != 0) {
+        var = var->next;
+    }
+    return var;
+}
+
+static int compare_variables(const void *a, const void *b) {
+    const struct variable *left = *(const struct variable *const *)a;
+    const struct variable *right = *(const struct variable *const *)b;
+    return strcmp(left->name, right->name);
+}
+
+// Unquoted expansions are split on blanks and newlines
+static bool is_separator(char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+static void append_bytes(struct field_builder *fb, const char *text, size_t length) {
+    if (fb->length + length + 1 > fb->buffer_capacity) {
+        fb->buffer_capacity = (fb->length + length + 1) * 2;
+        fb->buffer = realloc(fb->buffer, fb->buffer_capacity);
+    }
+    memcpy(fb->buffer + fb->length, text, length);
+    fb->length += length;
+    fb->open = true;
+}
+
+static void append_split(struct field_builder *fb, const char *value) {
+    while (*value) {
+        if (is_separator(*value)) {
+            end_field(fb);
+            while (is_separator(*value)) {
+                value++;
+            }
+            continue;
+        }
+    
+        size_t run = 0;
+        while (value[run] && !is_separator(value[run])) {
+            run++;
+        }
+        append_bytes(fb, value, run);
+        value += run;
+    }
+}
+
+static void end_field(struct field_builder *fb) {
+    if (!fb->open || !fb->split) {
+        return;
+    }
+    
+    if (fb->visit) {
+        append_bytes(fb, "", 0);
+        fb->buffer[fb->length] = '\0';
+        if (!fb->stopped && !fb->visit(fb->buffer, fb->visit_data)) {
+            fb->stopped = true;
+        }
+        fb->length = 0;
+        fb->open = false;
+        return;
+    }
+    
+    if (fb->count + 1 >= fb->capacity) {
+        fb->capacity *= 2;
+        fb->fields = realloc(fb->fields, fb->capacity * sizeof(char *));
+    }
+    
+    char *field = malloc(fb->length + 1);
+    memcpy(field, fb->buffer, fb->length);
+    field[fb->length] = '\0';
+    fb->fields[fb->count++] = field;
+    
+    fb->length = 0;
+    fb->open = false;
+}
+
+static void append_value(struct field_builder *fb, const char *value, bool quoted) {
+    if (value == NULL) {
+        value = "";
+    }
+    if (quoted || !fb->split) {
+        append_bytes(fb, value, strlen(value));
+    } else {
+        append_split(fb, value);
+    }
+}
+
+// $@ and $*. With `separate`, each parameter is its own field ("$@");
+// otherwise they are joined with spaces ("$*")
+static void append_positional(struct field_builder *fb, bool quoted, bool separate) {
+    for (int i = 0; i < positional.count; i++) {
+        if (i > 0) {
+            if (separate || (!quoted && fb->split)) {
+                end_field(fb);
+            } else {
+                append_bytes(fb, " ", 1);
+            }
+        }
+        append_value(fb, positional.values[i], quoted);
+    }
+}
+
+// Value of a special or positional parameter, or NULL if `name` isn't one.
+// `number` is scratch space for numeric values
+static const char *special_value(const char *name, size_t length, char *number) {
+    if (length == 1 && name[0] == '?') {
+        snprintf(number, NUMBER_BUFFER_SIZE, "%d", last_status);
+        return number;
+    }
+    if (length == 1 && name[0] == '#') {
+        snprintf(number, NUMBER_BUFFER_SIZE, "%d", positional.count);
+        return number;
+    }
+    if (length == 1 && name[0] == '$') {
+        snprintf(number, NUMBER_BUFFER_SIZE, "%d", (int)getpid());
+        return number;
+    }
+    if (length == 1 && name[0] == '!') {
+        if (last_background == 0) {
+            return "";
+        }
+        snprintf(number, NUMBER_BUFFER_SIZE, "%d", (int)last_background);
+        return number;
+    }
+    if (length == 1 && name[0] == '0') {
+        return program_invocation_name;
+    }
+    
+    if (length == 0) {
+        return NULL;
+    }
+    int index = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (name[i] < '0' || name[i] > '9') {
+            return NULL;
+        }
+        index = index * 10 + (name[i] - '0');
+    }
+    return (index >= 1 && index <= positional.count) ? positional.values[index - 1] : "";
+}
+
+// `p` is just past the '$'. Returns the first byte after the parameter
+static const char *expand_parameter(struct field_builder *fb, const char *p, bool quoted) {
+    const char *name = p;
+    size_t length = 0;
+    const char *next;
+    
+    if (*p == '{') {
+        const char *close = strchr(p, '}');
+        if (close == NULL) {
+            append_bytes(fb, "$", 1);
+            return p;
+        }
+        name = p + 1;
+        length = close - name;
+        next = close + 1;
+    } else if (*p == '?' || *p == '#' || *p == '$' || *p == '!' || *p == '@' || *p == '*' || 
+               (*p >= '0' && *p <= '9')) {
+        length = 1;
+        next = p + 1;
+    } else {
+        while (var_is_name(p, length + 1)) {
+            length++;
+        }
+        next = p + length;
+    }
+    
+    if (length == 1 && (name[0] == '@' || name[0] == '*')) {
+        append_positional(fb, quoted, name[0] == '@');
+        return next;
+    }
+    
+    char number[NUMBER_BUFFER_SIZE];
+    const char *value = special_value(name, length, number);
+    if (value == NULL && (var_is_name(name, length) || (*p == '{' && is_element_name(name, length)))) {
+        char *key = strndup(name, length);
+        value = var_get(key);
+        free(key);
+        if (value == NULL) {
+            value = "";
+        }
+    }
+    
+    if (value == NULL) {
+        // Not a parameter ("$", "$(", "${-}"): keep the text as written
+        append_bytes(fb, "$", 1);
+        return p;
+    }
+    
+    append_value(fb, value, quoted);
+    return next;
+}
+
+// ${NAME[N]}. There are no arrays; elements are plain variables whose name
+// includes the subscript, as `coproc` sets them
+static bool is_element_name(const char *name, size_t length) {
+    const char *open = memchr(name, '[', length);
+    if (open == NULL || open == name || length < 3 || name[length - 1] != ']' || open + 2 > name + length - 1) {
+        return false;
+    }
+    for (const char *c = open + 1; c < name + length - 1; c++) {
+        if (*c < '0' || *c > '9') {
+            return false;
+        }
+    }
+    return var_is_name(name, open - name);
+}
+
+static void expand_into(struct field_builder *fb, const char *word) {
+    const char *p = word;
+    while (*p) {
+        if ((*p == EXPAND_MARK || *p == EXPAND_MARK_QUOTED) && *(p + 1) == '$') {
+            p = expand_parameter(fb, p + 2, *p == EXPAND_MARK_QUOTED);
+            continue;
+        }
+    
+        // Copy the literal run up to the next marker. Brace marks left in a
+        // word that wasn't brace expanded (a redirect target, a case
+        // pattern) are dropped like stray ones
+        size_t run = 0;
+        while (p[run] && p[run] != BRACE_MARK &&
+               !((p[run] == EXPAND_MARK || p[run] == EXPAND_MARK_QUOTED) && p[run + 1] == '$')) {
+            run++;
+        }
+        if (run == 0) {
+            p++; // Stray marker byte
+            continue;
+        }
+        append_bytes(fb, p, run);
+        p += run;
+    }
+}
+
+// Expands each word into `fb`; words with a generator in `braces` (which may
+// be NULL) contribute one field per generated word, produced as they are used
+static void expand_field_words(struct field_builder *fb, char *const *words, int count,
+                               struct brace_expansion **braces) {
+    for (int i = 0; i < count && !fb->stopped; i++) {
+        if (braces == NULL || braces[i] == NULL) {
+            expand_one(fb, words[i], false);
+            continue;
+        }
+        const char *word;
+        while (!fb->stopped && (word = brace_next(braces[i]))) {
+            expand_one(fb, word, true);
+        }
+        brace_free(braces[i]);
+        braces[i] = NULL;
+    }
+}
+
+// Generated words that come out empty, like the first of {,y}, are dropped
+static void expand_one(struct field_builder *fb, const char *word, bool generated) {
+    if (generated && word[0] == '\0') {
+        return;
+    }
+    
+    // Most words have nothing to expand
+    if (strchr(word, EXPAND_MARK) == NULL && strchr(word, EXPAND_MARK_QUOTED) == NULL &&
+        strchr(word, BRACE_MARK) == NULL) {
+        append_bytes(fb, word, strlen(word));
+    } else {
+        expand_into(fb, word);
+    }
+    end_field(fb);
+}
@@ -0,0 +1,72 @@
+#ifndef VARIABLES_H
+#define VARIABLES_H
+
+/* INCLUDE LIBRARIES */
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* DEFINE CONSTANTS */
+#define VARIABLE_BUCKETS 256
+
+/* DEFINE STRUCTS AND TYPEDEFS */
+
+// $1, $2, ... as saved around a function call
+struct positional_params {
+    int count;
+    char **values;
+};
+
+// Receives fields from expand_words_each; returning false stops it
+typedef bool (*field_visitor)(const char *field, void *data);
+
+/* FUNCTION HEADERS */
+
+// Shell variable `name`, falling back to the environment. NULL if unset
+const char *var_get(const char *name);
+
+// Sets a shell variable. Names already in the environment stay exported
+void var_set(const char *name, const char *value);
+
+// Marks `name` for export to child processes
+void var_export(const char *name);
+
+void var_unset(const char *name);
+
+// Prints every shell variable as name='value'
+void var_print(FILE *output);
+
+// Calls `visit` with the name of every shell variable, in no particular order
+void var_each_name(void (*visit)(const char *name, void *data), void *data);
+
+// True when the first `length` bytes of `name` form a valid variable name
+bool var_is_name(const char *name, size_t length);
+
+// $? of the last command, pipeline or compound command
+int var_status(void);
+void var_set_status(int status);
+
+// $! after a background command starts
+void var_set_last_background(pid_t pid);
+
+// Replaces $1... with copies of `values`; the old ones go to `saved` if given
+void var_set_positional(int count, char *const *values, struct positional_params *saved);
+
+// Puts back what var_set_positional saved, releasing the current ones
+void var_restore_positional(struct positional_params *saved);
+
+// Expands brace expressions, then $NAME, ${NAME}, $?, $#, $$, $!, $0-$9, $@
+// and $* in words written by the tokenizer. Unquoted results are split on whitespace; "$@" keeps one
+// field per parameter. Returns the number of fields; `*out` is a new
+// NULL-terminated array of new strings
+int expand_words(char *const *words, int count, char ***out);
+
+// Like expand_words, but each field goes to `visit` as soon as it exists.
+// Brace expressions are generated one word at a time, so {1..1000000}
+// never exists as a list
+void expand_words_each(char *const *words, int count, field_visitor visit, void *data);
+
+// Like expand_words for a single word, without field splitting
+char *expand_word(const char *word);
+
+#endif